@@ -0,0 +1,280 @@
+// cc -O3 -pthread -o bench_regex bench_regex.c && ./bench_regex ; rm -f ./bench_regex
+//
+// Throughput benchmark for the `match`, `matcha`, and `fmatcha` entry
+// points over generated corpora, with a baseline comparison mode that
+// can gate performance regressions:
+//
+//   ./bench_regex [-s <megabytes>] [-r <repeats>] [-o <baseline>]
+//                 [-c <baseline>] [-t <tolerance percent>]
+//
+//   -s  size of each generated corpus (default 4)
+//   -r  number of timed runs of each case, the fastest is kept (default 3)
+//   -o  write the results to a baseline file
+//   -c  compare the results to a baseline file, exit with status 1 if
+//       any case is slower by more than the tolerance (default 10%) or
+//       finds a different number of matches
+//
+// The `match` case searches every line of a corpus on its own (the
+// way short strings are searched), `matcha` searches the whole corpus
+// in memory, and `fmatcha` searches it as a file.
+
+#define BENCHMARK
+
+// Include the source code for regex here in the benchmark.
+#include "regex.c"
+
+#include <time.h> // clock_gettime
+
+
+#define BENCH_MAX_CASES 256
+//      ^^ maximum number of cases in a baseline file
+#define BENCH_NAME_SIZE 64
+//      ^^ maximum length of the name of a case
+
+// A corpus of generated text (or bytes) to search.
+struct bench_corpus {
+  const char * name;
+  char * contents;
+  int length;
+};
+
+// One regular expression to time, with the kind of work it stresses.
+struct bench_pattern {
+  const char * kind;
+  const char * regex;
+};
+
+// The patterns timed over every corpus.
+static const struct bench_pattern BENCH_PATTERNS[] = {
+  {"literal",     ".*request"},
+  {"literal",     ".*return 0;"},
+  {"class",       ".*[0123456789][0123456789]:[0123456789][0123456789]"},
+  {"class",       ".*[ABCDEFGHIJKLMNOPQRSTUVWXYZ][abcdefghijklmnopqrstuvwxyz]*[ \t]"},
+  {"alternation", ".*((INFO)|(WARN)|(ERROR))"},
+  {"alternation", ".*((int)|(char)|(while)|(return)|(struct))"},
+  {"negation",    ".*\"{\"}*\""},
+  {"negation",    ".*={[ \n]}*;"},
+};
+#define BENCH_N_PATTERNS ((int) (sizeof(BENCH_PATTERNS) / sizeof(BENCH_PATTERNS[0])))
+
+// A timed case and its results.
+struct bench_result {
+  char name[BENCH_NAME_SIZE]; // "corpus/kind/index/entry"
+  double seconds; // fastest time over all runs
+  double mbps;    // megabytes per second
+  int n;          // number of matches (or matching lines)
+};
+
+
+// A deterministic pseudo-random number generator (xorshift).
+static unsigned int _bench_random(unsigned long long * state) {
+  (*state) ^= (*state) << 13;
+  (*state) ^= (*state) >> 7;
+  (*state) ^= (*state) << 17;
+  return (unsigned int) ((*state) >> 16);
+}
+
+
+// Generate a corpus of "length" bytes. "log" is lines of a service
+// log, "source" is lines of C code, "binary" is mostly random bytes
+// with a few words of text.
+static void _bench_generate(struct bench_corpus * corpus, const int length) {
+  static const char * levels[] = {"INFO", "INFO", "INFO", "WARN", "ERROR"};
+  static const char * paths[] = {"/api/items", "/api/users", "/static/app.js", "/health"};
+  static const char * lines[] = {
+    "int main(int argc, char * argv[]) {\n",
+    "  for (int i = 0; i < n; i++) total += values[i];\n",
+    "  while ((k < length) && (set[k] == other[k])) k++;\n",
+    "  struct found_matches found = {0, 0, NULL, NULL, NULL, NULL};\n",
+    "  printf(\"ERROR: could not open '%s'.\\n\", path);\n",
+    "  // Release the memory held by the program.\n",
+    "  if (program == NULL) return NULL;\n",
+    "  char * Name = \"Value\";\n",
+    "  return 0;\n",
+    "}\n",
+  };
+  unsigned long long state = 88172645463325252ull;
+  char * contents = malloc(length + 1);
+  int i = 0;
+  while (i < length) {
+    char line[256];
+    int n;
+    if (strcmp(corpus->name, "log") == 0) {
+      const unsigned int r = _bench_random(&state);
+      n = snprintf(line, sizeof(line), "2021-%02d-%02d %02d:%02d:%02d %s worker-%d request %s?id=%u took %ums\n",
+                   1 + r % 12, 1 + (r >> 4) % 28, (r >> 8) % 24, (r >> 12) % 60, (r >> 16) % 60,
+                   levels[(r >> 20) % 5], (r >> 23) % 32, paths[(r >> 28) % 4],
+                   _bench_random(&state) % 100000, _bench_random(&state) % 500);
+    } else if (strcmp(corpus->name, "source") == 0) {
+      n = snprintf(line, sizeof(line), "%s", lines[_bench_random(&state) % 10]);
+    } else {
+      n = 64 + _bench_random(&state) % 64;
+      for (int k = 0; k < n; k++) line[k] = (char) _bench_random(&state);
+      if (_bench_random(&state) % 4 == 0) memcpy(line + n - 16, " return \"INFO\";\n", 16);
+    }
+    if (n > length - i) n = length - i;
+    memcpy(contents + i, line, n);
+    i += n;
+  }
+  contents[length] = '\0';
+  corpus->contents = contents;
+  corpus->length = length;
+}
+
+
+// The current (monotonic) time in seconds.
+static double _bench_now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+// Time one entry point ("match", "matcha", or "fmatcha") of a program
+// over a corpus (saved at "path" for `fmatcha`), keeping the fastest
+// of "repeats" runs.
+static void _bench_time(struct compiled_regex * program, const struct bench_corpus * corpus,
+                        const char * path, const char * entry, const int repeats,
+                        struct found_matches * results, struct bench_result * result) {
+  result->seconds = -1.0;
+  for (int r = 0; r < repeats; r++) {
+    int n = 0;
+    const double start = _bench_now();
+    if (strcmp(entry, "match") == 0) {
+      // Search each line on its own, count the lines that match.
+      const char * line = corpus->contents;
+      const char * end = corpus->contents + corpus->length;
+      while (line < end) {
+        const char * newline = memchr(line, '\n', end - line);
+        const char * next = (newline == NULL) ? end : newline + 1;
+        int s, e;
+        match_compiledn(program, line, next - line, &s, &e);
+        if (s >= 0) n++;
+        line = next;
+      }
+    } else if (strcmp(entry, "matcha") == 0) {
+      n = matcha_into(program, corpus->contents, corpus->length, results);
+    } else {
+      n = fmatcha_into(program, path, 0.0, results);
+    }
+    const double seconds = _bench_now() - start;
+    if ((result->seconds < 0) || (seconds < result->seconds)) result->seconds = seconds;
+    result->n = n;
+  }
+  result->mbps = corpus->length / result->seconds / 1e6;
+}
+
+
+// Read the results in a baseline file, returns the number read (or -1).
+static int _bench_read(const char * path, struct bench_result * baseline) {
+  FILE * file = fopen(path, "r");
+  if (file == NULL) return -1;
+  int n = 0;
+  while ((n < BENCH_MAX_CASES) &&
+         (fscanf(file, "%63s %lf %d", baseline[n].name, &(baseline[n].mbps), &(baseline[n].n)) == 3)) n++;
+  fclose(file);
+  return n;
+}
+
+
+int main(int argc, char * argv[]) {
+  // Read the optional flags.
+  int megabytes = 4;
+  int repeats = 3;
+  double tolerance = 10.0;
+  const char * output = NULL;
+  const char * compare = NULL;
+  for (int i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "-s") == 0) && (i+1 < argc)) megabytes = atoi(argv[++i]);
+    else if ((strcmp(argv[i], "-r") == 0) && (i+1 < argc)) repeats = atoi(argv[++i]);
+    else if ((strcmp(argv[i], "-t") == 0) && (i+1 < argc)) tolerance = atof(argv[++i]);
+    else if ((strcmp(argv[i], "-o") == 0) && (i+1 < argc)) output = argv[++i];
+    else if ((strcmp(argv[i], "-c") == 0) && (i+1 < argc)) compare = argv[++i];
+    else {
+      fprintf(stderr, "usage: %s [-s <megabytes>] [-r <repeats>] [-o <baseline>]"
+              " [-c <baseline>] [-t <tolerance percent>]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (megabytes < 1) megabytes = 1;
+  if (repeats < 1) repeats = 1;
+  struct bench_result baseline[BENCH_MAX_CASES];
+  int n_baseline = 0;
+  if (compare != NULL) {
+    n_baseline = _bench_read(compare, baseline);
+    if (n_baseline < 0) {
+      fprintf(stderr, "ERROR: could not read the baseline '%s'.\n", compare);
+      return 2;
+    }
+  }
+  // Generate the corpora (saving each as a file for `fmatcha`).
+  struct bench_corpus corpora[3] = {{"log", NULL, 0}, {"source", NULL, 0}, {"binary", NULL, 0}};
+  char paths[3][32];
+  for (int c = 0; c < 3; c++) {
+    _bench_generate(corpora + c, megabytes * 1048576);
+    snprintf(paths[c], sizeof(paths[c]), "/tmp/bench_regex_XXXXXX");
+    const int fd = mkstemp(paths[c]);
+    if ((fd < 0) || (write(fd, corpora[c].contents, corpora[c].length) != corpora[c].length)) {
+      fprintf(stderr, "ERROR: could not write a corpus to '%s'.\n", paths[c]);
+      return 2;
+    }
+    close(fd);
+  }
+  // Time every pattern over every corpus with every entry point.
+  static const char * entries[3] = {"match", "matcha", "fmatcha"};
+  struct bench_result results[BENCH_MAX_CASES];
+  int n_results = 0;
+  int failed = 0;
+  struct found_matches arena = {0};
+  printf("%-36s %10s %12s %10s  %s\n", "case", "MB/s", "ns/match", "matches", "");
+  for (int c = 0; c < 3; c++) {
+    for (int p = 0; p < BENCH_N_PATTERNS; p++) {
+      struct compiled_regex * program = compile(BENCH_PATTERNS[p].regex);
+      for (int e = 0; e < 3; e++) {
+        struct bench_result * result = results + n_results;
+        snprintf(result->name, BENCH_NAME_SIZE, "%s/%s/%d/%s", corpora[c].name,
+                 BENCH_PATTERNS[p].kind, p, entries[e]);
+        _bench_time(program, corpora + c, paths[c], entries[e], repeats, &arena, result);
+        n_results++;
+        // Compare with the baseline (when one was given).
+        char note[64] = "";
+        for (int b = 0; b < n_baseline; b++) {
+          if (strcmp(baseline[b].name, result->name) != 0) continue;
+          const double change = 100.0 * (result->mbps - baseline[b].mbps) / baseline[b].mbps;
+          if (baseline[b].n != result->n) {
+            snprintf(note, sizeof(note), "CHANGED (%d matches in baseline)", baseline[b].n);
+            failed = 1;
+          } else if (change < -tolerance) {
+            snprintf(note, sizeof(note), "SLOWER %+.1f%%", change);
+            failed = 1;
+          } else {
+            snprintf(note, sizeof(note), "%+.1f%%", change);
+          }
+        }
+        char ns[32] = "-"; // nanoseconds per match
+        if (result->n > 0) snprintf(ns, sizeof(ns), "%.1f", result->seconds * 1e9 / result->n);
+        printf("%-36s %10.1f %12s %10d  %s\n", result->name, result->mbps, ns, result->n, note);
+        fflush(stdout);
+      }
+      free_compiled(program);
+    }
+  }
+  free_results(&arena);
+  for (int c = 0; c < 3; c++) {
+    unlink(paths[c]);
+    free(corpora[c].contents);
+  }
+  // Save the results as a baseline.
+  if (output != NULL) {
+    FILE * file = fopen(output, "w");
+    if (file == NULL) {
+      fprintf(stderr, "ERROR: could not write the baseline '%s'.\n", output);
+      return 2;
+    }
+    for (int r = 0; r < n_results; r++)
+      fprintf(file, "%s %.3f %d\n", results[r].name, results[r].mbps, results[r].n);
+    fclose(file);
+  }
+  if (failed) printf("\n Benchmark REGRESSED against '%s'.\n", compare);
+  return failed;
+}
@@ -26,8 +26,205 @@
 //                      If there is no match this value is -1.
 //     (int *) end -- The (pass by reference) end (noninclusive) of the
 //                    first match. If *start is -1, contains error code.
-// 
-// 
+//
+//  A regular expression that is used repeatedly can be compiled once:
+//
+//   struct compiled_regex * compile(regex)
+//     (const char *) regex -- A null-terminated simple regular expression.
+//     Returns a program with "n_tokens" and "n_groups" set, where
+//     "n_tokens <= 0" holds the same error values as "*start" above.
+//
+//   struct compiled_regex * compile_flags(regex, flags)
+//     Same as `compile`, with (int) "flags" COMPILE_IGNORE_CASE to
+//     match letters in either case, COMPILE_REVERSE_START to find the
+//     start of each match by scanning backwards from its end (only for
+//     regexes that start with ".*", faster for ones like ".*a.*b", each
+//     end is given once), COMPILE_EXTENDED for the extended syntax
+//     below (with COMPILE_MULTILINE its anchors are for lines), any of
+//     them together (or 0).
+//
+//  Without a match mode every end of a match is found (with the latest
+//  start that reaches it), so matches can overlap. A mode in "flags"
+//  picks matches that do not overlap instead, in the same single pass
+//  (it turns off COMPILE_REVERSE_START and splitting into chunks):
+//
+//     COMPILE_FIRST_END  each match is the first to end at or after the
+//                        end of the last one (with its latest start)
+//     COMPILE_LONGEST    each match is the leftmost-longest one at or
+//                        after the end of the last one (as for POSIX),
+//                        a later start that shares all of its tokens
+//                        with an older one can be missed
+//
+//  With COMPILE_CAPTURE the same pass also finds where each "()" group
+//  of every match is (a program with it has "n_captures" groups per
+//  match, the most of any one regex, and finds starts forwards):
+//
+//   void match_captures(program, string, start, end, captures)
+//     Same as `match_compiled`, setting (int *) "captures" to the start
+//     and end of each group of the first match (2*n_captures values,
+//     -1 for a group that is not part of it, and a group in a loop is
+//     its last repetition). (`match_capturesn` takes a "length".)
+//
+//  With COMPILE_LINES each line (without its newline) is searched as
+//  its own string, like grep: no match holds a newline, and a regex
+//  without a leading ".*" (or with '^') matches at the start of every
+//  line. When the regex has a literal prefix, the lines before each
+//  occurrence of it are passed over in one scan. (Streams search the
+//  same as without it.)
+//
+//  The extended syntax (COMPILE_EXTENDED) adds, outside of token sets
+//  (write "[+]", "[^]", "[$]" for the characters themselves):
+//
+//     +      1 or more repetitions of the preceding token (group)
+//     {n}    exactly n repetitions of the preceding token (group), a
+//     {n,}   "{}" of only digits (and one comma) after a token (group)
+//     {n,m}  is a count (write "{[0]}" for the NOT of a digit)
+//     ^      the start of the string (or of a line, with a preceding
+//              newline, for COMPILE_MULTILINE), matches no character
+//     $      the end of the string (or of a line, with a following
+//              newline, for COMPILE_MULTILINE), matches no character
+//
+//   void match_compiled(program, string, start, end)
+//     Same as `match`, given the compiled program instead of "regex".
+//     (`matcha_compiled` and `fmatcha_compiled` follow the same pattern.)
+//
+//   void free_compiled(program)
+//     Release all memory held by a compiled program.
+//
+//   struct compiled_regex * copy_compiled(program)
+//     A copy of a compiled program (released with `free_compiled`). A
+//     program builds its DFA while it searches, so threads that search
+//     at the same time each need their own.
+//
+//  The working memory of a search is on the stack for regexes of up to
+//  SMALL_TOKENS tokens, and otherwise kept by each thread between its
+//  searches. Results can also be kept in a caller owned arena that is
+//  reused by every search (so repeated searches do not allocate):
+//
+//   struct found_matches results = {0};
+//   int matcha_into(program, buffer, length, results)
+//     Replace "results" with all matches in "buffer" (fields "n",
+//     "starts", "ends", and "patterns", and with COMPILE_CAPTURE the
+//     "n_captures" groups of each match in "captures"), returns "n" or
+//     a negative error (-1 invalid program, -2 empty buffer, -3 buffer
+//     of INT_MAX bytes or more).
+//     (`fmatcha_into(program, path, min_ascii_ratio, results)` also
+//      sets "lines", the line of the last character of each match, and
+//      "line_starts" and "line_ends", the range of the lines that hold
+//      it, and matches `fmatcha` errors.)
+//
+//   int matcha_limit(program, buffer, length, max_matches, results)
+//     Same as `matcha_into`, but the search stops as soon as it has
+//     found the first (int) "max_matches" matches (all when 0), so 1
+//     only checks for any match. (`fmatcha_limit(program, path,
+//     min_ascii_ratio, max_matches, results)` also stops reading.)
+//
+//   void free_results(results)
+//     Release the arrays held by "results" (it can be used again).
+//
+//  Every function that searches a null-terminated "string" has a
+//  variant ending in "n" that searches the (size_t) "length" bytes of
+//  a "buffer" instead, where the null character is an ordinary byte:
+//
+//   void matchn(regex, buffer, length, start, end)
+//     (`matchan`, `match_compiledn`, `matcha_compiledn`, `match_setn`,
+//      and `matcha_setn` follow the same pattern.)
+//
+//  Match locations are (int) indices, so a buffer of INT_MAX bytes or
+//  more is not searched: "start" is -1 and "end" STRING_TOO_LONG_ERROR
+//  (-7), or "n" is -3 for the functions that find all matches.
+//
+//  Many regular expressions can be searched for in one pass:
+//
+//   struct compiled_regex * compile_set(regexes, n_regexes)
+//     (const char **) regexes -- An array of simple regular expressions.
+//     (int) n_regexes -- The number of regular expressions.
+//     Returns one program for all of them, with errors signaled the
+//     same way as `compile` and "n_patterns" set to the invalid index.
+//     (`compile_set_flags(regexes, n_regexes, flags)` takes flags.)
+//
+//   void match_set(program, string, pattern, start, end)
+//     Same as `match_compiled`, also setting the (pass by reference)
+//     index of the regular expression that matched in "pattern".
+//     (`matcha_set` and `fmatcha_set` return an array "patterns".)
+//
+//  Many strings (rows) can be searched for the first match of each:
+//
+//   void match_batch(program, strings, lengths, n, starts, ends)
+//     (const char **) strings -- The "n" rows to search.
+//     (const size_t *) lengths -- The bytes in each row (or NULL when
+//                                 every row is null-terminated).
+//     (int *) starts, ends -- Set for each row the same way as
+//                             `match_compiledn` sets "start" and "end".
+//     (`match_batch_threads(program, strings, lengths, n, n_threads,
+//      patterns, starts, ends)` spreads the rows over (int) "n_threads"
+//      threads, one per processor when 0, and sets "patterns" as
+//      `match_set` does unless it is NULL.)
+//
+//  Input that arrives in pieces can be searched as one stream:
+//
+//   struct regex_stream * stream_init(program)
+//     Start a stream for a compiled program (that outlives it).
+//     Returns NULL if the program is invalid.
+//
+//   void stream_feed(stream, buffer, length, callback, data)
+//     (const char *) buffer -- The next "length" bytes of the stream.
+//     (stream_callback) callback -- Called as
+//       "callback(data, pattern, start, end)" for each match as soon as
+//       it ends, with (long long) offsets from the start of the stream.
+//
+//   void stream_finish(stream, callback, data)
+//     Give matches that end with the stream and release its memory.
+//
+//  The files below a directory are listed the way `frex` walks them:
+//
+//   int walk_files(root, flags, max_bytes, paths, n_bytes)
+//     (const char *) root -- The directory to list the files of.
+//     (int) flags -- WALK_RECURSIVE to list subdirectories too, and
+//                    WALK_IGNORE to pass over ".git" and the paths
+//                    matched by ".gitignore" and ".ignore" files.
+//     (long long) max_bytes -- Larger files are passed over (not when 0).
+//     Sets (char **) "paths" to the null-terminated path of every file
+//     (release with `free_paths`) and (long long *) "n_bytes" to their
+//     total length, returns the number of files (-1 out of memory).
+//
+//  The files of a tree can be indexed by their trigrams, so that each
+//  later search only reads the files that can hold a match (see the
+//  "Trigram index" section for the layout of the index file):
+//
+//   int index_build(index_path, root, n_files, paths, stamps, reuse)
+//     (const char **) paths -- The "n_files" files to index (read at
+//                              "root" joined with each when relative).
+//     (const long long *) stamps -- The modification time and size of
+//                                   each file, kept for the caller.
+//     (const int *) reuse -- For each file, its number in the index
+//                            already at "index_path" to keep its
+//                            trigrams (unchanged), or -1 to read it.
+//     Writes the index to "index_path", returns the number of files
+//     read, or a negative error (-1 memory, -2 invalid old index, -3
+//     the index could not be written).
+//
+//   int index_search(program, index_path, keep)
+//     Sets (char *) "keep[f]" to 1 for each file of the index that
+//     holds every trigram of the literal factors (the literal runs
+//     every match passes) of one of the patterns of "program", and
+//     for each file that was not indexed, 0 for the rest. Returns the
+//     number kept, or a negative error (-1 invalid program, -2 invalid
+//     index, -3 memory).
+//
+//   int read_stats(stats, reset)
+//     (struct regex_stats *) stats -- Filled with counts of the work
+//       done by all searches (bytes scanned, simulation steps and
+//       pushes, peak active tokens, time compiling, files skipped by
+//       the ASCII ratio check) since they were last reset.
+//     (int) reset -- Nonzero to reset the counts to zero.
+//     Returns 1, or 0 (and zeros) when not compiled with -DREGEX_STATS.
+//
+//  Files over 16MB are split at newlines and searched with one thread
+//  per processor when every regular expression starts with ".*", the
+//  results are the same as for one pass over the file.
+//
+//
 // ERROR CODES
 //  These codes are returned in "end" when "start<0".
 //   0  Successful execution, no match found.
@@ -43,11 +240,27 @@
 //
 // COMPILATION
 //  Compile shared object (importable by Python) with:
-//    cc -O3 -fPIC -shared -o regex.so regex.c
+//    cc -O3 -pthread -fPIC -shared -o regex.so regex.c
+//  (and the Python extension with 'regex_ext.c', see that file).
+// 
+//  Compile the (multithreaded, grep-like) command line program with:
+//    cc -O3 -pthread -o frex regex.c
 // 
 //  Compile and run test (including debugging print statements) with:
 //    cc -o test_regex regex.c && ./test_regex
 // 
+//  Compile and run the throughput benchmark (see its flags for saving
+//  a baseline and comparing against one) with:
+//    cc -O3 -pthread -o bench_regex bench_regex.c && ./bench_regex
+// 
+//  Generate a linkable object with a matcher specialized for each of
+//  a few fixed patterns (see that file for the generated functions):
+//    cc -O3 -pthread -o regex_gen regex_gen.c
+//    ./regex_gen <name> "<regex>" [...] > patterns.c && cc -O3 -c patterns.c
+// 
+//  Add -DREGEX_STATS to any of these to keep the counts read by
+//  `read_stats` (they cost a little time, otherwise they are removed).
+// 
 //
 // EXAMPLES:
 //  Match any text contained within square brackets.
@@ -72,25 +285,39 @@
 //  collections. These substitutions can easily be placed in regular
 //  expression pre-processing code. Some substitution examples:
 // 
-//    +     replace with one explicit copy of preceding token (group),
-//            followed by a copy with '*'
 //    ^     this is implicitly at the beginning of all regex'es,
 //            disable by including ".*" at the beginning of the regex
-//    $     include "{.}" at the end of the regex
 //    [~ab] replace with {[ab]}
 //    \d    replace with "[0123456789]"
 //    \D    replace with "{[0123456789]}"
 //    \s    replace with "[ \t\n\r]"
-//    {n}   replace with n occurrences of the preceding group
-//    {n,}  replace with n occurrences of the preceding group,
-//            followed by a copy with '*'
-//    {n,m} replace with n occurrences of the preceding group, then
-//            m-n repetitions of the group all with '?'
+// 
+//  Repetitions ('+' and counts) and anchors ('^' and '$') are part of
+//  the extended syntax (see COMPILE_EXTENDED). A '+' on a token adds
+//  one token that loops back over it, a '+' on a group is written out
+//  as the group and a copy of it with '*'. A count is written out as
+//  that many copies of its group (the automata hold no counters), the
+//  ones past "n" with '?', so "{n,m}" costs as many tokens as "m"
+//  copies would. Writing out adds at most the length of the regex and
+//  MAX_EXPANDED (4096) more characters to it, so programs grow with
+//  the regex and not with its counts. A count past that is an error
+//  (REGEX_TOO_LARGE_ERROR at its position).
 // 
 // ___________________________________________________________________
 
 #include <stdio.h>  // printf, EOF
 #include <stdlib.h> // malloc, free
+#include <string.h> // memchr, memcmp, strchr, strncmp, strerror
+#include <limits.h> // INT_MAX
+#include <fcntl.h>  // open
+#include <unistd.h> // read, close
+#include <sys/mman.h> // mmap, madvise, munmap
+#include <sys/stat.h> // fstat, lstat, stat
+#include <ctype.h>  // isalpha, isdigit, islower, tolower, toupper
+#include <dirent.h> // opendir, readdir, closedir
+#include <pthread.h> // pthread_create, pthread_join, pthread_mutex_*, pthread_cond_*
+#include <errno.h>  // errno
+#include <sys/resource.h> // getrlimit
 
 #define EXIT_TOKEN -1
 #define REGEX_NO_TOKENS_ERROR -1
@@ -98,19 +325,140 @@
 #define REGEX_SYNTAX_ERROR -3
 #define REGEX_EMPTY_GROUP_ERROR -4
 #define STRING_EMPTY_ERROR -5
+#define REGEX_TOO_LARGE_ERROR -6
+#define STRING_TOO_LONG_ERROR -7
 #define DEFAULT_GROUP_MOD ' '
 #define MIN_SAMPLE_SIZE 100
 //      ^^ minimum number of bytes read before checking ASCII ratio
-#define FILE_BUFFER_SIZE 33554432
-//      ^^ 2^25 = 32MB = 33554432 bytes
+#define ASCII_SAMPLE_SIZE 4096
+//      ^^ number of bytes at the start of a file used for the ASCII ratio
+#define READ_BUFFER_SIZE 65536
+//      ^^ 2^16 = 64KB, initial buffer size for files that cannot be mapped
 #define INITIAL_FOUND_SIZE 4
 //      ^^ default size of the arrays that store all regex matches
+#define PARALLEL_CHUNK_SIZE 8388608
+//      ^^ 2^23 = 8MB, minimum bytes of one file searched by each thread
+#define BATCH_THREAD_ROWS 1024
+//      ^^ fewest rows searched by each thread of `match_batch_threads`
+#define SMALL_TOKENS 64
+//      ^^ most tokens (and groups) of a regex that is compiled and searched with stack memory
+#define SET_BYTES 32
+//      ^^ bytes in the (256 bit) membership of one token set
+#define IN_SET(set, c) ((set)[(c) >> 3] & (1 << ((c) & 7)))
+//      ^^ nonzero if the byte "c" is a member of "set"
+#define COMPILE_IGNORE_CASE 1
+//      ^^ flag for `compile_flags`, letters match in either case
+#define COMPILE_REVERSE_START 2
+//      ^^ flag for `compile_flags`, find match starts backwards from each end
+#define COMPILE_EXTENDED 4
+//      ^^ flag for `compile_flags`, accept '+', counts, and anchors
+#define COMPILE_MULTILINE 8
+//      ^^ flag for `compile_flags`, anchors are for the start and end of lines
+#define COMPILE_FIRST_END 16
+//      ^^ flag for `compile_flags`, each match is the first to end after the last one
+#define COMPILE_LONGEST 32
+//      ^^ flag for `compile_flags`, leftmost-longest matches that do not overlap
+#define COMPILE_CAPTURE 64
+//      ^^ flag for `compile_flags`, find where each "()" group of every match is
+#define COMPILE_LINES 128
+//      ^^ flag for `compile_flags`, search each line on its own (no match holds a newline)
+#define MAX_EXPANDED 4096
+//      ^^ most characters that writing out a regex adds beyond its own length
+#define ADD_TO_SET(set, c) ((set)[(c) >> 3] |= (1 << ((c) & 7)))
+//      ^^ make the byte (or token) "c" a member of "set"
+#define REMOVE_FROM_SET(set, c) ((set)[(c) >> 3] &= ~(1 << ((c) & 7)))
+//      ^^ remove the byte (or token) "c" from "set"
+#define TOKEN_SPLIT 0
+//      ^^ packed token operation, go to both jumps without a character ('*')
+#define TOKEN_ANY 1
+//      ^^ packed token operation, match any character ('.')
+#define TOKEN_BYTE 2
+//      ^^ packed token operation, match one byte (a literal)
+#define TOKEN_SET 3
+//      ^^ packed token operation, match any byte in a token set
+#define TOKEN_ANCHOR 4
+//      ^^ packed token operation, go to one jump without a character ('^', '$')
+#define JUMPI_ANCHOR 3
+//      ^^ the "jumpi" of an anchor token (it is not in a token set)
+#define ANCHOR_START '^'
+//      ^^ anchor (its token character), the start of the string
+#define ANCHOR_END '$'
+//      ^^ anchor, the end of the string
+#define ANCHOR_LINE_START '<'
+//      ^^ anchor, the start of the string or the character after a newline
+#define ANCHOR_LINE_END '>'
+//      ^^ anchor, the end of the string or a newline
+
+// Counters of the work done by all searches (in every thread) since
+// they were last reset, used to find pathological patterns. They are
+// only kept when compiled with -DREGEX_STATS, otherwise every update
+// compiles to nothing and `read_stats` gives zeros.
+struct regex_stats {
+  long long searches;    // searches of strings, buffers, and file contents
+  long long files;       // files read for searching
+  long long ascii_skips; // files skipped by the ASCII ratio check
+  long long bytes;       // bytes passed over by the DFA (or skipped to a prefix)
+  long long steps;       // characters processed by the token simulation
+  long long pushes;      // tokens pushed onto the stacks of the simulation
+  long long peak_active; // most tokens active for one character
+  long long compile_ns;  // nanoseconds spent in `_set_jump` (compiling)
+};
+
+#ifdef REGEX_STATS
+#include <time.h> // clock_gettime
+static struct regex_stats _stats; // shared by all threads (updated atomically)
+#define STATS(...) __VA_ARGS__
+//      ^^ statements that only keep statistics
+
+// Add "value" to a counter shared by all threads.
+static inline void _stats_add(long long * counter, const long long value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+// Raise a counter shared by all threads to "value" (if that is larger).
+static inline void _stats_max(long long * counter, const long long value) {
+  long long old = __atomic_load_n(counter, __ATOMIC_RELAXED);
+  while ((value > old) &&
+         (! __atomic_compare_exchange_n(counter, &old, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))) ;
+}
+
+// The time of a monotonic clock in nanoseconds.
+static long long _stats_now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+#else
+#define STATS(...)
+#endif
+
+
+// Copy the counters into "stats", and reset them to zero if "reset"
+// is nonzero. Returns 1 if the counters are kept (compiled with
+// -DREGEX_STATS), otherwise 0 with all of "stats" set to zero.
+int read_stats(struct regex_stats * stats, const int reset) {
+  #ifdef REGEX_STATS
+  long long * from = (long long *) &_stats;
+  long long * to = (long long *) stats;
+  for (int k = 0; k < (int) (sizeof(struct regex_stats) / sizeof(long long)); k++) {
+    if (reset) to[k] = __atomic_exchange_n(from + k, 0, __ATOMIC_RELAXED);
+    else to[k] = __atomic_load_n(from + k, __ATOMIC_RELAXED);
+  }
+  return 1;
+  #else
+  (void) reset;
+  memset(stats, 0, sizeof(struct regex_stats));
+  return 0;
+  #endif
+}
+
 
 //  Name:
 //    frex  -- fast regular expressions (frexi for case insensitive)
 
-// Count the number of tokens and groups in a regular expression.
-void _count(const char * regex, int * tokens, int * groups) {
+// Count the number of tokens and groups in a regular expression,
+// with COMPILE_EXTENDED in "flags" a '+' is a modifier (like '*').
+void _count_flags(const char * regex, const int flags, int * tokens, int * groups) {
   // Initialize the number of tokens and groups to 0.
   (*tokens) = 0;
   (*groups) = 0;
@@ -118,6 +466,7 @@ void _count(const char * regex, int * tokens, int * groups) {
   char token = regex[i]; // current character in regex
   int gc = 0;            // groups closed
   char pt = '\0';        // previous token
+  const char plus = (flags & COMPILE_EXTENDED) ? '+' : '*'; // (the same as '*' otherwise)
   // Count tokens and groups.
   while (token != '\0') {
     // Count a character set as a single character.
@@ -161,10 +510,10 @@ void _count(const char * regex, int * tokens, int * groups) {
     } else if (
       // starts with a special character
       ((i == 0) && ((token == ')') || (token == ']') || (token == '}') || 
-                    (token == '*') || (token == '?') || (token == '|'))) ||
-      // illegally placed * or ?
-      ((i > 0) && ((token == '*') || (token == '?')) &&
-       ((pt == '*') || (pt == '?') || (pt == '(') || (pt == '{') || (pt == '|'))) ||
+                    (token == '*') || (token == plus) || (token == '?') || (token == '|'))) ||
+      // illegally placed *, +, or ?
+      ((i > 0) && ((token == '*') || (token == plus) || (token == '?')) &&
+       ((pt == '*') || (pt == plus) || (pt == '?') || (pt == '(') || (pt == '{') || (pt == '|'))) ||
       // illegally placed ), ], or } after a |
       ((i > 0) && (pt == '|') && ((token == ')') || (token == ']') || (token == '}'))) ||
       // | at the end of the regex
@@ -217,19 +566,39 @@ void _count(const char * regex, int * tokens, int * groups) {
 }
 
 
+// Count the number of tokens and groups (with no flags, see `_count_flags`).
+void _count(const char * regex, int * tokens, int * groups) {
+  _count_flags(regex, 0, tokens, groups);
+}
+
+
 // Read through the regular expression with the (already counted)
-// number of tokens + groups and set the jump conditions.
-void _set_jump(const char * regex, const int n_tokens, int n_groups,
-             char * tokens, int * jumps, int * jumpf, char * jumpi) {
+// number of tokens + groups and set the jump conditions. With
+// COMPILE_EXTENDED in "flags", a '+' is a modifier that is set up the
+// same way as '*' (its tokens loop back to it), then every jump into
+// it from outside of its group skips it (at least one repetition).
+// The anchors '^' and '$' are tokens with JUMPI_ANCHOR in "jumpi".
+// When "groups" is not NULL (2*n_groups integers), it is set to the
+// first token inside of each group (in the order they open) and the
+// token after it, where the modifier of a group is outside of it (so
+// a loop leaves and enters it again), or -1 and -1 for token sets and
+// negated groups.
+void _set_jump_groups(const char * regex, const int flags, const int n_tokens, int n_groups,
+                      char * tokens, int * jumps, int * jumpf, char * jumpi, int * groups) {
 
-  // Initialize storage for the first and first proceding token of groups.
-  int * group_starts = malloc((4*n_groups+n_tokens+2)*sizeof(int) + 2*n_groups*sizeof(char));
+  // Initialize storage for the first and first proceding token of groups
+  // (on the stack for a small regex, 2*n_groups characters fit in n_groups ints).
+  int local[7*SMALL_TOKENS+2];
+  int * group_starts = ((n_tokens <= SMALL_TOKENS) && (n_groups <= SMALL_TOKENS)) ? local :
+    malloc((4*n_groups+2*n_tokens+2)*sizeof(int) + 2*n_groups*sizeof(char));
   int * group_nexts = group_starts + n_groups;
   int * gi_stack = group_nexts + n_groups; // active group stack
   int * gc_stack = gi_stack + n_groups; // closed group stack
   int * redirect = 1 + gc_stack + n_groups; // jump redirection (might access -1 or n_tokens)
-  char * s_stack = (char*) (redirect + n_tokens + 1); // active group start character stack
+  int * plus_ends = redirect + n_tokens + 1; // token after the group of each '+' (-1 otherwise)
+  char * s_stack = (char*) (plus_ends + n_tokens); // active group start character stack
   char * g_mods = s_stack + n_groups; // track the modifiers on each group
+  const char plus = (flags & COMPILE_EXTENDED) ? '+' : '*'; // (the same as '*' otherwise)
 
   // Initialize all the group pointers to a known value.
   for (int j = 0; j < n_groups; j++) {
@@ -243,6 +612,7 @@ void _set_jump(const char * regex, const int n_tokens, int n_groups,
   }
   // declare the rest of redirect.
   for (int j = n_groups; j <= n_tokens; j++) redirect[j] = j;
+  for (int j = 0; j < n_tokens; j++) plus_ends[j] = EXIT_TOKEN;
   // (declare the -1 to point to -1)
   redirect[EXIT_TOKEN] = EXIT_TOKEN;
 
@@ -272,6 +642,7 @@ void _set_jump(const char * regex, const int n_tokens, int n_groups,
       gi_stack[iga] = gi;   // push group index to stack
       s_stack[iga] = token; // push group start character to stack
       group_starts[gi] = nt; // set the start token for this group
+      if (groups != NULL) groups[2*gi] = (token == '(') ? 0 : EXIT_TOKEN; // (see the end)
     // Set the end of a group.
     } else if ((iga >= 0) &&
               (((cgs == '(') && (token == ')')) ||
@@ -282,7 +653,7 @@ void _set_jump(const char * regex, const int n_tokens, int n_groups,
       gc_stack[igc] = gi;
       // Check to see if the next character is a modifier.
       token = regex[i+1]; // (can reuse this, it will be overwritten after later i++)
-      if ((token == '*') || (token == '?') || (token == '|')) {
+      if ((token == '*') || (token == plus) || (token == '?') || (token == '|')) {
         g_mods[gi] = token;
       }
       // Pop previous group index and start character from stack.
@@ -297,7 +668,7 @@ void _set_jump(const char * regex, const int n_tokens, int n_groups,
     // Handle normal tokens.
     } else {
       // if (not special)
-      if ((cgs == '[') || ((token != '*') && (token != '?') && (token != '|'))) {
+      if ((cgs == '[') || ((token != '*') && (token != plus) && (token != '?') && (token != '|'))) {
         // Set the "next" token for the recently closed groups.
         for (int j = 0; j <= igc; j++) {
           group_nexts[gc_stack[j]] = nt;
@@ -412,14 +783,14 @@ void _set_jump(const char * regex, const int n_tokens, int n_groups,
       // if in token set
       if (cgs == '[') { // do nothing
       // Not in token set, handle special looping modifiers on single tokens
-      } else if ((nx_token == '*') || (nx_token == '?') || (nx_token == '|')) {
+      } else if ((nx_token == '*') || (nx_token == plus) || (nx_token == '?') || (nx_token == '|')) {
         tokens[nt] = nx_token; // store this modifier at the front
         nt++; // increment the token counter.
         i++; // increment the regex index counter
         tokens[nt+1] = token; // move the original token back one
       }
       // store the token, skip specials that were already stored earlier
-      if ((cgs == '[') || ((token != '*') && (token != '?') && (token != '|'))) {
+      if ((cgs == '[') || ((token != '*') && (token != plus) && (token != '?') && (token != '|'))) {
         tokens[nt] = token; // store this token.
         nt++; // increment the token counter.
       }
@@ -502,8 +873,9 @@ void _set_jump(const char * regex, const int n_tokens, int n_groups,
         redirect[nt] = nt; // reset redirect to completed token
         nt++; // increment the token counter
         // assign 'redirect' based on the modifier.
-        if (g_mods[gi] == '*') {
+        if ((g_mods[gi] == '*') || (g_mods[gi] == plus)) {
           redirect[group_nexts[gi]] = nt-1; // -1 because of nt++ above
+          if (g_mods[gi] == '+') plus_ends[nt-1] = group_nexts[gi];
         } else if (g_mods[gi] == '|') {
           // search for a group that starts at the first token after this
           int j = gi+1;
@@ -557,14 +929,15 @@ void _set_jump(const char * regex, const int n_tokens, int n_groups,
           }
         }
       // Not in token set, handle special looping modifiers on single tokens
-      } else if ((nx_token == '*') || (nx_token == '?') || (nx_token == '|')) {
+      } else if ((nx_token == '*') || (nx_token == plus) || (nx_token == '?') || (nx_token == '|')) {
         SET_JUMP(nt, nt+(neg?2:1), nt+(neg?1:2)); // set jump conditions for special token
         redirect[nt] = nt; // reset redirect to completed token
         nt++; // increment the token counter.
         i++; // increment the regex index counter
-        // make tokens followed by * loop back to *
-        if (nx_token == '*') {
+        // make tokens followed by * (or +) loop back to it
+        if ((nx_token == '*') || (nx_token == plus)) {
           SET_JUMP(nt, nt-1, EXIT_TOKEN);
+          if (nx_token == '+') plus_ends[nt-1] = nt+1;
         // make tokens followed by | correctly jump
         } else if (nx_token == '|'){  
           const char nxnx_token = regex[i+1]; // guaranteed to exist
@@ -581,9 +954,12 @@ void _set_jump(const char * regex, const int n_tokens, int n_groups,
       } else {
         SET_JUMP(nt, nt+1, EXIT_TOKEN);
       }
+      // (an anchor is never checked against a character)
+      if ((flags & COMPILE_EXTENDED) && (cgs != '[') && ((token == '^') || (token == '$')))
+        jumpi[nt] = JUMPI_ANCHOR;
       redirect[nt] = nt; // reset redirect to completed token
       // store the token, skip specials that were already stored earlier
-      if ((cgs == '[') || ((token != '*') && (token != '?') && (token != '|'))) {
+      if ((cgs == '[') || ((token != '*') && (token != plus) && (token != '?') && (token != '|'))) {
         nt++; // increment the token counter.
       }
     }
@@ -593,6 +969,18 @@ void _set_jump(const char * regex, const int n_tokens, int n_groups,
     token = regex[i];
   }
 
+  // Make every jump into a '+' from outside of its group go to the
+  // first token of the group instead (outer groups first, so a jump
+  // that lands on an inner '+' is moved again).
+  for (int m = 0; m < n_tokens; m++) {
+    if (plus_ends[m] < 0) continue;
+    for (int j = 0; j < n_tokens; j++) {
+      if ((j > m) && (j < plus_ends[m])) continue;
+      if (jumps[j] == m) jumps[j] = m+1;
+      if (jumpf[j] == m) jumpf[j] = m+1;
+    }
+  }
+
   // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // DEBUG: Print out the group starts and ends.
   #ifdef DEBUG
@@ -606,668 +994,4594 @@ void _set_jump(const char * regex, const int n_tokens, int n_groups,
   #endif
   // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
+  // Give the tokens inside of each "()" group (after its modifier).
+  if (groups != NULL) {
+    for (int j = 0; j < n_groups; j++) {
+      if (groups[2*j] < 0) {
+        groups[2*j+1] = EXIT_TOKEN;
+        continue;
+      }
+      groups[2*j] = group_starts[j] + (g_mods[j] != DEFAULT_GROUP_MOD);
+      groups[2*j+1] = group_nexts[j];
+    }
+  }
+
   // Free memory used for tracking the start and ends of groups.
-  free(group_starts);
+  if (group_starts != local) free(group_starts);
   return;
 }
 
 
-// Do a simple regular experession match.
-void match(const char * regex, const char * string, int * start, int * end) {
+// Set the jump conditions (without the groups, see `_set_jump_groups`).
+void _set_jump_flags(const char * regex, const int flags, const int n_tokens, int n_groups,
+                     char * tokens, int * jumps, int * jumpf, char * jumpi) {
+  _set_jump_groups(regex, flags, n_tokens, n_groups, tokens, jumps, jumpf, jumpi, NULL);
+}
 
-  // Check for an empty string.
-  if (string[0] == '\0') {
-    (*start) = EXIT_TOKEN;
-    (*end) = STRING_EMPTY_ERROR;
-    return;
-  }
 
-  // Count the number of tokens and groups in this regular expression.
-  int n_tokens, n_groups;
-  _count(regex, &n_tokens, &n_groups);
-  // Error mode, fewer than one token (no possible match).
-  if (n_tokens <= 0) {
-    // Set the error flag and return.
-    if (n_tokens == 0) {
-      (*start) = EXIT_TOKEN;
-      (*end) = REGEX_NO_TOKENS_ERROR;
-    } else {
-      (*start) = n_tokens;
-      (*end) = n_groups;
+// Set the jump conditions (with no flags, see `_set_jump_flags`).
+void _set_jump(const char * regex, const int n_tokens, int n_groups,
+             char * tokens, int * jumps, int * jumpf, char * jumpi) {
+  _set_jump_flags(regex, 0, n_tokens, n_groups, tokens, jumps, jumpf, jumpi);
+}
+
+
+// One token of a compiled program, packed into a single record that
+// holds everything a search reads for it (12 bytes, several tokens
+// per cache line). Built from the token and jump tables by `_link`.
+struct regex_token {
+  int jumps;  // jump-to location after success (same as the table)
+  int jumpf;  // jump-to location after failure (same as the table)
+  unsigned char op;   // one of TOKEN_SPLIT, TOKEN_ANY, TOKEN_BYTE, TOKEN_SET, TOKEN_ANCHOR
+  unsigned char byte; // the literal byte of TOKEN_BYTE (the character of TOKEN_ANCHOR)
+  char is_entry;      // nonzero for tokens that are in "entries"
+  char any_start;     // 1 for the entry split of a leading ".*" (any start), 2 for its '.'
+};
+
+
+// A compiled regular expression. This holds the token and jump
+// tables computed by `_count` and `_set_jump`, so that repeated
+// searches with the same regular expression only pay for them once.
+// Create with `compile` and release with `free_compiled`.
+struct compiled_regex {
+  int n_tokens; // number of tokens (error position when <= 0, see `_count`)
+  int n_groups; // number of groups (error code when n_tokens < 0)
+  int n_patterns; // number of regexes combined (index of the bad one after errors)
+  int * jumps;  // jump-to location after success ("n_tokens + p" ends pattern p)
+  int * jumpf;  // jump-to location after failure
+  int * entries; // first token of each pattern
+  char * tokens; // regex index of each token (character)
+  char * jumpi;  // nonzero for token sets (checked with "sets")
+  char * is_entry; // nonzero for tokens that are in "entries"
+  unsigned char * sets; // members of each token set (SET_BYTES per token)
+  int n_prefix;  // length of the literal that starts every match (0 if none)
+  const char * prefix; // the literal itself (within "tokens", not terminated)
+  struct regex_dfa * dfa; // lazily built DFA (NULL until first search)
+  struct regex_token * code; // packed tokens read by the searches (see `_link`)
+  int reverse; // nonzero to find match starts backwards (see `_reverse_start`)
+  int mode; // COMPILE_FIRST_END or COMPILE_LONGEST (0 gives every end, see `_simulate_select`)
+  int lines; // nonzero to search each line on its own (COMPILE_LINES, see `_search_lines`)
+  int n_captures; // most "()" groups in one pattern (0 without COMPILE_CAPTURE)
+  int n_spans; // ranges of tokens in "spans"
+  int * spans; // for each "()" group (copy), its capture then its first and after last token
+};
+static void _dfa_free(struct regex_dfa * dfa); // (defined with the DFA)
+
+
+// Allocate a program header and all of its tables in one block.
+static struct compiled_regex * _alloc_program(const int n_tokens, const int n_groups,
+                                              const int n_patterns) {
+  const int n = (n_tokens > 0) ? n_tokens : 0;
+  const int g = ((n_tokens > 0) && (n_groups > 0)) ? n_groups : 0;
+  const int mem_bytes = (sizeof(struct compiled_regex) +
+                         n*sizeof(struct regex_token) +
+                         (2*n + n_patterns + 3*g)*sizeof(int) + (3*n+2)*sizeof(char) +
+                         SET_BYTES*n);
+  struct compiled_regex * program = malloc(mem_bytes);
+  if (program == NULL) return NULL;
+  program->n_tokens = n_tokens;
+  program->n_groups = n_groups;
+  program->n_patterns = n_patterns;
+  program->n_prefix = 0;
+  program->dfa = NULL;
+  program->reverse = 0;
+  program->mode = 0;
+  program->lines = 0;
+  program->n_captures = 0;
+  program->n_spans = 0;
+  program->code = (struct regex_token*) (program + 1);
+  program->jumps = (int*) (program->code + n);
+  program->jumpf = program->jumps + n;
+  program->entries = program->jumpf + n;
+  program->spans = program->entries + n_patterns;
+  program->tokens = (char*) (program->spans + 3*g);
+  program->jumpi = program->tokens + n + 1;
+  program->is_entry = program->jumpi + n + 1;
+  program->sets = (unsigned char*) (program->is_entry + n);
+  program->prefix = program->tokens;
+  // Terminate the two character arrays with the null character.
+  program->tokens[n] = '\0';
+  program->jumpi[n] = '\0';
+  for (int j = 0; j < n; j++) program->is_entry[j] = 0;
+  memset(program->sets, 0, SET_BYTES*n);
+  return program;
+}
+
+
+// Check whether the pattern at "entry" starts with ".*" (any start,
+// as the first token that resets match starts, not inside of a '+'),
+// then every character leads back to the entry token and the state
+// with only the entry tokens active is reached again and again.
+static int _any_start(const struct compiled_regex * program, const int entry) {
+  const int * jumps = program->jumps;
+  const int * jumpf = program->jumpf;
+  const char * tokens = program->tokens;
+  const char * jumpi = program->jumpi;
+  const int e = entry;
+  return ((e+2 < program->n_tokens) && (tokens[e] == '*') && (! jumpi[e]) && (program->is_entry[e]) &&
+          (jumps[e] == e+1) && (jumpf[e] == e+2) && (tokens[e+1] == '.') &&
+          (! jumpi[e+1]) && (jumps[e+1] == e) && (jumpf[e+1] == EXIT_TOKEN));
+}
+
+
+// Get the length of the literal that must start every match of the
+// pattern at "entry", when it starts with ".*" (any start) followed
+// by plain characters. Every token of the literal can only succeed
+// into the next one (or the end of the pattern).
+static int _prefix_length(const struct compiled_regex * program, const int entry) {
+  const int n_tokens = program->n_tokens;
+  const int * jumps = program->jumps;
+  const int * jumpf = program->jumpf;
+  const char * tokens = program->tokens;
+  const char * jumpi = program->jumpi;
+  int length = 0;
+  if (_any_start(program, entry)) {
+    for (int j = entry+2; j < n_tokens; j++) {
+      if ((jumpi[j]) || (tokens[j] == '*') || (tokens[j] == '.') ||
+          (jumpf[j] != EXIT_TOKEN)) break;
+      length++;
+      if (jumps[j] != j+1) break; // (the end of the pattern)
     }
-    return;
   }
+  return length;
+}
 
-  // Initialize storage for tracking the current active tokens and
-  // where to jump based on the string being parsed.
-  const int mem_bytes = ((5*n_tokens+1)*sizeof(int) + (4*n_tokens+2)*sizeof(char));
-  int * jumps = malloc(mem_bytes); // jump-to location after success
-  int * jumpf = jumps + n_tokens; // jump-to location after failure
-  int * active = jumpf + n_tokens; // presently active tokens in regex
-  int * cstack = active + n_tokens+1; // current stack of active tokens
-  int * nstack = cstack + n_tokens; // next stack of active tokens
-  char * tokens = (char*) (nstack + n_tokens); // regex index of each token (character)
-  char * jumpi = tokens + n_tokens+1; // immediately check next on failure
-  char * incs = jumpi + n_tokens+1; // token flags for "in current stack"
-  char * inns = incs + n_tokens; // token flags for "in next stack"
-  // Terminate the two character arrays with the null character.
-  tokens[n_tokens] = '\0';
-  jumpi[n_tokens] = '\0';
 
-  // Determine the jump-to tokens upon successful match and failed
-  // match at each token in the regular expression.
-  _set_jump(regex, n_tokens, n_groups, tokens, jumps, jumpf, jumpi);
-  // Set all tokens to be inactive, convert ? to * for simplicity.
-  active[n_tokens] = EXIT_TOKEN;
-  for (int j = 0; j < n_tokens; j++) {
-    // convert all "special tokens" to * for speed, exclude all
-    // tokens with jumpi = 1 because those are inside token sets
-    if ((! jumpi[j]) && ((tokens[j] == '?') || (tokens[j] == '|')))
-      tokens[j] = '*';
-    active[j] = EXIT_TOKEN; // token is inactive
-    incs[j] = 0; // token is not in current stack
-    inns[j] = 0; // token is not in next stack
+// Pack the token and jump tables of a program into its "code", the
+// records that are read by the searches.
+static void _link(struct compiled_regex * program) {
+  const int * jumps = program->jumps;
+  const char * tokens = program->tokens;
+  const char * jumpi = program->jumpi;
+  for (int j = 0; j < program->n_tokens; j++) {
+    struct regex_token * token = program->code + j;
+    const char ct = program->tokens[j];
+    token->jumps = program->jumps[j];
+    token->jumpf = program->jumpf[j];
+    if (program->jumpi[j] == JUMPI_ANCHOR) token->op = TOKEN_ANCHOR;
+    else if (program->jumpi[j]) token->op = TOKEN_SET;
+    else if (ct == '*') token->op = TOKEN_SPLIT;
+    else if (ct == '.') token->op = TOKEN_ANY;
+    else token->op = TOKEN_BYTE;
+    token->byte = (unsigned char) ct;
+    token->is_entry = program->is_entry[j];
+    token->any_start = (program->is_entry[j] && (ct == '*') && (! jumpi[j]) &&
+                        (j+1 < program->n_tokens) && (jumps[j] == j+1) && (tokens[j+1] == '.') &&
+                        (! jumpi[j+1]) && (jumps[j+1] == j) && (program->jumpf[j+1] == EXIT_TOKEN));
+    if ((j > 0) && (program->code[j-1].any_start == 1)) token->any_start = 2;
   }
-  
-  // Set the current index in the string.
-  int i = 0; // current index in string
-  char c = string[i]; // current character in string
-  int ics = 0; // index in current stack
-  int ins = -1; // index in next stack
-  int dest; // index of next token (for jump)
-  void * temp; // temporary pointer (used for transferring nstack to cstack)
-  cstack[ics] = 0; // set the first element in stack to '0'
-  active[0] = 0; // set the start index of the first token
-  incs[0] = 1; // the first token is in the current stack
+}
 
-  // Initialize to "no match".
-  (*start) = EXIT_TOKEN;
-  (*end) = 0;
 
-  // Define an in-line substitution that will be used repeatedly in
-  // a following while loop.
-  // 
-  // If the destination is valid, and the current start index (val)
-  // is newer than the one to be overwritten, then stack the
-  // new destination, assign active, and mark as set.
-  // 
-  // If the destination is the "done" token, then:
-  //   free all memory that was allocated,
-  //   set the start and end of the match
-  //   return
-  #define MATCH_STACK_NEXT_TOKEN(stack, si, in_stack)\
-    if ((dest >= 0) && (val >= active[dest])) {\
-      if (in_stack[dest] == 0) {\
-        si++;\
-        stack[si] = dest;\
-      }\
-      if (dest == n_tokens) {\
-        free(jumps);\
-        (*start) = val;\
-        (*end) = i;\
-        if ((jumpi[j]) || (ct != '*')) (*end)++;\
-        return;\
-      } else {\
-        in_stack[dest] = 1;\
-        if (active[dest] == EXIT_TOKEN) active[dest] = val;\
-      }\
+// Make a program from the tables set by `_set_jump` in "raw", where
+// each token set is a chain of tokens that check one character each
+// (a failure moves along the chain). Every chain becomes one token
+// that checks the membership of the character in its set, and with
+// COMPILE_IGNORE_CASE in "flags" every letter becomes a token set of
+// both of its cases. Returns NULL if memory could not be allocated.
+static struct compiled_regex * _collapse_sets(const struct compiled_regex * raw,
+                                              const int flags) {
+  const int n_raw = raw->n_tokens;
+  // Get the new index of every raw token (all members of a token set
+  // get the index of the first), and of the end of the pattern.
+  int local[SMALL_TOKENS+1];
+  int * index = (n_raw <= SMALL_TOKENS) ? local : malloc((n_raw+1) * sizeof(int));
+  if (index == NULL) return NULL;
+  int n_tokens = 0;
+  for (int j = 0; j < n_raw; j++) {
+    if ((j == 0) || (raw->jumpi[j-1] != 1)) n_tokens++;
+    index[j] = n_tokens-1;
+  }
+  index[n_raw] = n_tokens;
+  struct compiled_regex * program = _alloc_program(n_tokens, raw->n_groups, 1);
+  if (program == NULL) {
+    if (index != local) free(index);
+    return NULL;
+  }
+  // Copy every token, a token set gets the jumps of its last member
+  // (every member succeeds to the same token).
+  for (int j = 0; j < n_raw; j++) {
+    const int t = index[j];
+    unsigned char * set = program->sets + SET_BYTES*t;
+    int k = j; // last raw token of this token
+    program->jumpi[t] = 0;
+    if (raw->jumpi[j] == JUMPI_ANCHOR) {
+      program->jumpi[t] = JUMPI_ANCHOR;
+    } else if (raw->jumpi[j]) {
+      while (raw->jumpi[k] == 1) k++;
+      for (int m = j; m <= k; m++) ADD_TO_SET(set, (unsigned char) raw->tokens[m]);
+      program->jumpi[t] = 1;
+    } else if ((flags & COMPILE_IGNORE_CASE) && isalpha((unsigned char) raw->tokens[j])) {
+      ADD_TO_SET(set, (unsigned char) raw->tokens[j]);
+      program->jumpi[t] = 1;
+    }
+    // Add the other case of every letter in the set.
+    if ((flags & COMPILE_IGNORE_CASE) && (program->jumpi[t] == 1)) {
+      for (int b = 0; b < 256; b++) {
+        if (isalpha(b) && IN_SET(set, b)) {
+          const int o = islower(b) ? toupper(b) : tolower(b);
+          ADD_TO_SET(set, o);
+        }
+      }
     }
+    const int s = raw->jumps[k];
+    const int f = raw->jumpf[k];
+    program->jumps[t] = (s < 0) ? s : index[s];
+    program->jumpf[t] = (f < 0) ? f : index[f];
+    program->tokens[t] = raw->tokens[j];
+    j = k;
+  }
+  if (index != local) free(index);
+  return program;
+}
 
-  // Start searching for a regular expression match. (the character
-  // 'c' is checked for null value at the end of the loop.
-  do {
-    // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    #ifdef DEBUG
-    if (DO_PRINT) {
-    printf("--------------------------------------------------\n");
-    printf("i = %d   c = '%s'\n\n", i, SAFE_CHAR(c));
-    printf("stack:\n");
-    for (int j = ics;  j >= 0; j--) {
-      printf(" '%s' (at %2d) %d\n", SAFE_CHAR(tokens[cstack[j]]), cstack[j], active[cstack[j]]);
+
+// Get the length of the count "{n}", "{n,}", or "{n,m}" at the start
+// of "regex" (with -1 in "most" for "{n,}"), or 0 if it is not one.
+static int _count_length(const char * regex, int * least, int * most) {
+  int k = 1;
+  (*least) = 0;
+  while (isdigit((unsigned char) regex[k])) {
+    if ((*least) <= MAX_EXPANDED) (*least) = 10*(*least) + (regex[k] - '0');
+    k++;
+  }
+  if (k == 1) return 0;
+  (*most) = (*least);
+  if (regex[k] == ',') {
+    k++;
+    (*most) = (regex[k] == '}') ? -1 : 0;
+    while (isdigit((unsigned char) regex[k])) {
+      if ((*most) <= MAX_EXPANDED) (*most) = 10*(*most) + (regex[k] - '0');
+      k++;
     }
-    printf("\n");
-    printf("active: (search token / index of match start)\n");
-    for (int j = 0; j <= n_tokens; j++) {
-      printf("  %-3s", SAFE_CHAR(tokens[j]));
+  }
+  return (regex[k] == '}') ? k+1 : 0;
+}
+
+
+// Write out the counts in a regex of the extended syntax (see
+// COMPILE_EXTENDED), each one becomes a group of copies of the token
+// (group) before it: "x{n}" is n copies, "x{n,}" is n copies and
+// "x*", "x{n,m}" is n copies and m-n copies of "x?". A '+' on a group
+// is written out as "{1,}". Returns the new null-terminated regex with
+// the index in "regex" of each of its characters in "source" (release
+// both with `free`), or NULL with the (negative) error position of an
+// invalid count in "error" (0 when memory could not be allocated) and
+// its error value in "code" (REGEX_SYNTAX_ERROR, or
+// REGEX_TOO_LARGE_ERROR when the written out regex would be longer
+// than twice "regex" and MAX_EXPANDED more characters).
+static char * _expand_counts(const char * regex, int ** source, int * error, int * code) {
+  const int n = strlen(regex);
+  int size = n + 1; // capacity of "expanded" and "source"
+  char * expanded = malloc(size);
+  int * at = malloc(size * sizeof(int)); // index in "regex" of each character
+  int * opened = malloc((n+1) * sizeof(int)); // start of each open group in "expanded"
+  int failed = (expanded == NULL) || (at == NULL) || (opened == NULL);
+  int e = 0; // characters in "expanded"
+  int n_opened = 0; // groups open
+  int item = EXIT_TOKEN; // start of the last token (group) in "expanded"
+  (*error) = 0;
+  for (int i = 0; (i < n) && (! failed); i++) {
+    const char token = regex[i];
+    int least, most;
+    int length = ((token == '{') && (item >= 0)) ? _count_length(regex+i, &least, &most) : 0;
+    // A '+' on a group is written out as "{1,}" (its loop token only
+    // fits a single token, see `_set_jump_groups`).
+    if ((token == '+') && (item >= 0) && ((expanded[item] == '(') || (expanded[item] == '{'))) {
+      length = 1;
+      least = 1;
+      most = -1;
     }
-    printf("\n");
-    for (int j = 0; j <= n_tokens; j++) {
-      printf("  %-3d", active[j]);
+    const int copies = (length == 0) ? 0 : (most < 0) ? least + (least > 0) : most;
+    if ((length > 0) && ((most == 0) || ((most > 0) && (most < least)))) {
+      (*error) = -i-1;
+      (*code) = REGEX_SYNTAX_ERROR;
+      break;
     }
-    printf("\n\n");
+    // (the written out length: the item in a group, its copies, and their modifiers)
+    const int modifiers = (length == 0) ? 0 : (most < 0) ? 1 : most - least;
+    if ((length > 0) && ((long long) item + 2 + (long long) (e - item) * copies + modifiers +
+                         (n - i - length) > 2 * (long long) n + MAX_EXPANDED)) {
+      (*error) = -i-1;
+      (*code) = REGEX_TOO_LARGE_ERROR;
+      break;
     }
-    #endif
-    // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-
-    // Continue popping active elements from the current stack and
-    // checking them for a match and jump conditions, add next tokens
-    // to the next stack.
-    while (ics >= 0) {
-      // Pop next token to check from the stack, skip if already done.
-      const int j = cstack[ics];
-      ics--;
-      incs[j] = 0;
-      // Get the token and the "start index" for the match that led here.
-      const char ct = tokens[j];
-      int val = active[j];
-      // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      #ifdef DEBUG
-      if (DO_PRINT) {
-        printf("    j = %d   ct = '%s'  %2d %2d  (%d)\n", j, SAFE_CHAR(ct), jumps[j], jumpf[j], val);
-      }
-      #endif
-      // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      // If this is a special character, add its tokens immediately to
-      // the current stack (to be checked before next charactrer).
-      if ((ct == '*') && (! jumpi[j])) {
-        if (j == 0) val = i; // ignore leading tokens where possible
-        dest = jumps[j];
-        MATCH_STACK_NEXT_TOKEN(cstack, ics, incs);
-        dest = jumpf[j];
-        MATCH_STACK_NEXT_TOKEN(cstack, ics, incs);
-      // Check to see if this token matches the current character.
-      } else if ((c == ct) || ((ct == '.') && (! jumpi[j]) && (c != '\0'))) {
-        dest = jumps[j];
-        MATCH_STACK_NEXT_TOKEN(nstack, ins, inns);
-      // This token did not match, trigger a jump fail.
-      } else {
-        dest = jumpf[j];
-        // jump immediately on fail if this is not the last token in a token set
-        if (jumpi[j] == 1) { 
-          MATCH_STACK_NEXT_TOKEN(cstack, ics, incs);
-        // otherwise, put into the "next" stack
-        } else { 
-          MATCH_STACK_NEXT_TOKEN(nstack, ins, inns);
+    // Make room for this character (or token set), or the copies.
+    const int needed = e + ((length > 0) ? (e - item + 1) * copies + 2 : n - i) + 1;
+    if (needed > size) {
+      while (needed > size) size *= 2;
+      char * grown = realloc(expanded, size);
+      if (grown != NULL) expanded = grown;
+      int * grown_at = realloc(at, size * sizeof(int));
+      if (grown_at != NULL) at = grown_at;
+      failed = (grown == NULL) || (grown_at == NULL);
+      if (failed) break;
+    }
+    if (length > 0) {
+      // Put the item in a group, followed by the rest of its copies.
+      const int item_length = e - item;
+      memmove(expanded + item + 1, expanded + item, item_length);
+      memmove(at + item + 1, at + item, item_length * sizeof(int));
+      expanded[item] = '(';
+      at[item] = i;
+      e = item + 1;
+      for (int c = 0; c < copies; c++) {
+        if (c > 0) {
+          memcpy(expanded + e, expanded + item + 1, item_length);
+          memcpy(at + e, at + item + 1, item_length * sizeof(int));
+        }
+        e += item_length;
+        char modifier = '\0';
+        if ((most < 0) && (c == copies-1)) modifier = '*';
+        else if (c >= least) modifier = '?';
+        if (modifier != '\0') {
+          expanded[e] = modifier;
+          at[e++] = i;
         }
       }
+      expanded[e] = ')';
+      at[e++] = i;
+      i += length - 1;
+      continue;
     }
-    // Switch out the current stack with the next stack.
-    //   switch stack of token indices
-    temp = (void*) cstack; // store "current stack"
-    cstack = nstack; // set "current stack"
-    ics = ins; // set "index in current stack"
-    nstack = (int*) temp; // set "next stack"
-    //   switch flag arrays of "token in stack"
-    temp = (void*) incs; // store "in current stack"
-    incs = inns; // set "in current stack"
-    inns = (char*) temp; // set "in next stack"
-    ins = -1; // reset the count of elements in "next stack"
-
-    // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    #ifdef DEBUG
-    if (DO_PRINT) {
-      printf("\n");
-    }
-    #endif
-    // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-
-    // If the just-parsed character was the end of the string, then break.
-    if (c == '\0') {
-      break;
-    // Get the next character in the string (assuming it's null terminated).
+    // Copy token sets whole, and track where groups start.
+    if (token == '[') {
+      item = e;
+      do {
+        expanded[e] = regex[i];
+        at[e++] = i;
+      } while ((regex[i] != ']') && (++i < n));
+      continue;
+    } else if ((token == '(') || (token == '{')) {
+      opened[n_opened++] = e;
+      item = EXIT_TOKEN;
+    } else if ((token == ')') || (token == '}')) {
+      item = (n_opened > 0) ? opened[--n_opened] : EXIT_TOKEN;
+    } else if ((token == '*') || (token == '+') || (token == '?') || (token == '|')) {
+      item = EXIT_TOKEN;
     } else {
-      i++;
-      c = string[i];
+      item = e;
     }
-  } while (ics >= 0) ; // loop until the active stack is empty
-  free(jumps); // free all memory that was allocated
-  return;
-} 
+    expanded[e] = token;
+    at[e++] = i;
+  }
+  free(opened);
+  if (failed || ((*error) < 0)) {
+    free(expanded);
+    free(at);
+    return NULL;
+  }
+  expanded[e] = '\0';
+  (*source) = at;
+  return expanded;
+}
 
-// Find all nonoverlapping matches of a regular expression in a string.
-// Return arrays of the starts and ends of matches.
-void matcha(const char * regex, const char * string,
-            int * n, int ** starts, int ** ends) {
 
-  // Check for an empty string.
-  if (string[0] == '\0') {
-    (*n) = -2;
-    return;
+// Number the groups of "regex" in the order they open (token sets and
+// negated groups included, as for `_set_jump_groups`), where every
+// "()" group gets its index among the "()" groups of "original" and
+// the others get -1. "source" holds the index in "original" of each
+// character of "regex" (NULL when they are the same), so the copies
+// of a group written out for a count share its number. Returns the
+// number of "()" groups in "original" (-1 if memory ran out).
+static int _number_groups(const char * regex, const char * original,
+                          const int * source, int * numbers) {
+  const int n = strlen(original);
+  int * rank = malloc((n+1) * sizeof(int)); // number of the "()" group opened at each index
+  if (rank == NULL) return EXIT_TOKEN;
+  int n_captures = 0;
+  int in_set = 0; // whether the character is inside of a token set
+  for (int i = 0; i < n; i++) {
+    rank[i] = EXIT_TOKEN;
+    if (in_set) in_set = (original[i] != ']');
+    else if (original[i] == '[') in_set = 1;
+    else if (original[i] == '(') rank[i] = n_captures++;
+  }
+  int g = 0; // groups opened in "regex"
+  in_set = 0;
+  for (int i = 0; regex[i] != '\0'; i++) {
+    if (in_set) in_set = (regex[i] != ']');
+    else if ((regex[i] == '(') || (regex[i] == '[') || (regex[i] == '{')) {
+      in_set = (regex[i] == '[');
+      numbers[g++] = (regex[i] == '(') ? rank[(source != NULL) ? source[i] : i] : EXIT_TOKEN;
+    }
   }
+  free(rank);
+  return n_captures;
+}
+
 
+// Compile a regular expression into a reusable program (see
+// `compile_flags`), where counts are already written out. For
+// COMPILE_CAPTURE, the "()" groups are numbered by those of
+// "original" (see `_number_groups`).
+static struct compiled_regex * _compile(const char * regex, const int flags,
+                                        const char * original, const int * source) {
   // Count the number of tokens and groups in this regular expression.
-  (*n) = -1;
   int n_tokens, n_groups;
-  _count(regex, &n_tokens, &n_groups);
-  // Error mode, fewer than one token (no possible match).
-  if (n_tokens <= 0) {
-    (*starts) = malloc(2 * sizeof(int));
-    (*ends) = (*starts) + 1;
-    // Set the error flag and return.
-    if (n_tokens == 0) {
-      (*starts)[0] = EXIT_TOKEN;
-      (*ends)[0] = REGEX_NO_TOKENS_ERROR;
-    } else {
-      (*starts)[0] = n_tokens;
-      (*ends)[0] = n_groups;
+  _count_flags(regex, flags, &n_tokens, &n_groups);
+  struct compiled_regex * raw = _alloc_program(n_tokens, n_groups, 1);
+  if (raw == NULL) return NULL;
+  raw->n_patterns = 0; // (the index of the bad regex)
+  // Error mode, fewer than one token (no tables to set).
+  if (n_tokens <= 0) return raw;
+  // The tokens inside of each group and its number (for COMPILE_CAPTURE).
+  int * groups = NULL;
+  int n_captures = 0;
+  if ((flags & COMPILE_CAPTURE) && (n_groups > 0)) {
+    groups = malloc((3*n_groups + n_tokens+1) * sizeof(int));
+    n_captures = (groups == NULL) ? EXIT_TOKEN :
+      _number_groups(regex, original, source, groups + 2*n_groups);
+    if (n_captures < 0) {
+      free(groups);
+      free(raw);
+      return NULL;
     }
-    // WARNING: returning pointers to allocated memory for two integers!
-    return;
   }
-
-  // Set there to be 0 matches, initially.
-  (*n) = 0;
-  // Initialize storage for tracking the current active tokens and
-  // where to jump based on the string being parsed.
-  const int mem_bytes = ((5*n_tokens+1)*sizeof(int) + (4*n_tokens+2)*sizeof(char));
-  int * jumps = malloc(mem_bytes); // jump-to location after success
-  int * jumpf = jumps + n_tokens; // jump-to location after failure
-  int * active = jumpf + n_tokens; // presently active tokens in regex
-  int * cstack = active + n_tokens + 1; // current stack of active tokens
-  int * nstack = cstack + n_tokens; // next stack of active tokens
-  char * tokens = (char*) (nstack + n_tokens); // regex index of each token (character)
-  char * jumpi = tokens + n_tokens + 1; // immediately check next on failure
-  char * incs = jumpi + n_tokens; // token flags for "in current stack"
-  char * inns = incs + n_tokens; // token flags for "in next stack"
-  // Terminate the two character arrays with the null character.
-  tokens[n_tokens] = '\0';
-  jumpi[n_tokens] = '\0';
-
   // Determine the jump-to tokens upon successful match and failed
   // match at each token in the regular expression.
-  _set_jump(regex, n_tokens, n_groups, tokens, jumps, jumpf, jumpi);
-  // Set all tokens to be inactive, convert ? to * for simplicity.
-  active[n_tokens] = EXIT_TOKEN;
+  STATS(const long long compile_start = _stats_now();)
+  _set_jump_groups(regex, flags, n_tokens, n_groups, raw->tokens,
+                   raw->jumps, raw->jumpf, raw->jumpi, groups);
+  STATS(_stats_add(&_stats.compile_ns, _stats_now() - compile_start);)
+  // Make every token set a single token.
+  struct compiled_regex * program = _collapse_sets(raw, flags);
+  // Keep the (collapsed) tokens inside of every "()" group.
+  if ((program != NULL) && (groups != NULL)) {
+    // (The new index of a raw token, the same as in `_collapse_sets`.)
+    int * index = groups + 3*n_groups;
+    for (int j = 0, t = 0; j < n_tokens; j++) {
+      if ((j == 0) || (raw->jumpi[j-1] != 1)) t++;
+      index[j] = t-1;
+    }
+    index[n_tokens] = program->n_tokens;
+    program->n_captures = n_captures;
+    for (int g = 0; g < n_groups; g++) {
+      const int capture = groups[2*n_groups + g];
+      if ((capture < 0) || (groups[2*g] < 0)) continue;
+      int * span = program->spans + 3*program->n_spans;
+      span[0] = capture;
+      span[1] = index[groups[2*g]];
+      span[2] = index[groups[2*g+1]];
+      program->n_spans++;
+    }
+  }
+  free(groups);
+  free(raw);
+  if (program == NULL) return NULL;
+  n_tokens = program->n_tokens;
+  // The pattern starts after any leading '+' (it can not be skipped),
+  // a split there is looped back to, so it does not reset match starts
+  // the way a first token does (see `_simulate_step`).
+  int entry = 0;
+  while ((flags & COMPILE_EXTENDED) && (! program->jumpi[entry]) &&
+         (program->tokens[entry] == '+')) entry = program->jumps[entry];
+  program->entries[0] = entry;
+  program->is_entry[entry] = (entry == 0) || (program->jumpi[entry]) ||
+    (strchr("*?|+", program->tokens[entry]) == NULL);
+  // Convert ? to * for simplicity, exclude all token sets (where those
+  // characters are literals).
   for (int j = 0; j < n_tokens; j++) {
-    // convert both "special tokens" to * for speed, exclude all
-    // tokens with jumpi = 1 because those are inside token sets
-    if ((! jumpi[j]) && ((tokens[j] == '?') || (tokens[j] == '|')))
-      tokens[j] = '*';
-    active[j] = EXIT_TOKEN; // token is inactive
-    incs[j] = 0; // token is not in current stack
-    inns[j] = 0; // token is not in next stack
-  }
-
-  // Set the current index in the file.
-  int i = 0; // current index in file
-  int c = string[i]; // get current character in file
-  int ics = 0; // index in current stack
-  int ins = -1; // index in next stack
-  int dest; // index of next token (for jump)
-  void * temp; // temporary pointer (used for transferring nstack to cstack)
-  cstack[ics] = 0; // set the first element in stack to '0'
-  active[0] = 0; // set the start index of the first token
-  incs[0] = 1; // the first token is in the current stack
+    if ((! program->jumpi[j]) &&
+        ((program->tokens[j] == '?') || (program->tokens[j] == '|') ||
+         ((flags & COMPILE_EXTENDED) && (program->tokens[j] == '+'))))
+      program->tokens[j] = '*';
+    if ((flags & COMPILE_MULTILINE) && (program->jumpi[j] == JUMPI_ANCHOR))
+      program->tokens[j] = (program->tokens[j] == '^') ? ANCHOR_LINE_START : ANCHOR_LINE_END;
+  }
+  // Find the literal that every match must start with.
+  program->n_prefix = _prefix_length(program, entry);
+  program->prefix = program->tokens + entry + 2;
+  program->mode = (flags & COMPILE_LONGEST) ? COMPILE_LONGEST : (flags & COMPILE_FIRST_END);
+  program->lines = ((flags & COMPILE_LINES) != 0);
+  program->reverse = (flags & COMPILE_REVERSE_START) && (! program->mode) &&
+    (! program->n_captures) && _any_start(program, entry);
+  _link(program);
+  return program;
+}
 
-  // Initialize to "no match".
-  (*starts) = NULL;
-  (*ends) = NULL;
-  int n_found = 0; // number found
-  int s_found = 0; // size of "found" arrays
 
-  // Define an in-line substitution that will be used repeatedly in
-  // a following while loop.
-  #define MATCHA_STACK_NEXT_TOKEN(stack, si, in_stack) \
-    if ((dest >= 0) && (val >= active[dest])) { \
-      if (dest == n_tokens) { \
-        (*n)++; \
-        if (n_found >= s_found) { \
-          if (s_found == 0) s_found = INITIAL_FOUND_SIZE; \
-          else s_found = 2*s_found; \
-          int * new_starts = malloc(3 * s_found * sizeof(int)); \
-          int * new_ends = new_starts + s_found; \
-          for (int index = 0; index < n_found; index++)      { \
-            new_starts[index] = (*starts)[index]; \
-            new_ends[index] = (*ends)[index]; \
-          } \
-          if ((*starts) != NULL) free(*starts); \
-          (*starts) = new_starts; \
-          (*ends) = new_ends; \
-        } \
-        (*starts)[n_found] = val; \
-        (*ends)[n_found] = (((jumpi[j]) || (ct != '*')) ? i+1 : i); \
-        n_found++; \
-      } else { \
-        if (in_stack[dest] == 0) { \
-          si++; \
-          stack[si] = dest; \
-          in_stack[dest] = 1; \
-        } \
-        active[dest] = val; \
-      } \
-    }                                
+// Compile a regular expression into a reusable program. The tokens
+// '?' and '|' are converted into '*' (outside of token sets) for
+// speed, the same way the single-use matchers used to on every call.
+// The returned pointer is never NULL unless memory is exhausted, an
+// invalid regular expression is signaled through "n_tokens" <= 0.
+// The "flags" are any of COMPILE_IGNORE_CASE, COMPILE_REVERSE_START,
+// COMPILE_EXTENDED, COMPILE_MULTILINE, and one match mode of
+// COMPILE_FIRST_END or COMPILE_LONGEST (or 0), the second only
+// applies when the regex starts with ".*" and there is no match mode
+// (COMPILE_LONGEST wins when both modes are given). Error positions are
+// indices in "regex" (before its counts are written out).
+struct compiled_regex * compile_flags(const char * regex, const int flags) {
+  if (! (flags & COMPILE_EXTENDED)) return _compile(regex, flags, regex, NULL);
+  int * source;
+  int error, code;
+  char * expanded = _expand_counts(regex, &source, &error, &code);
+  struct compiled_regex * program;
+  if (expanded == NULL) {
+    if (error == 0) return NULL;
+    program = _alloc_program(error, code, 1);
+    if (program != NULL) program->n_patterns = 0;
+    return program;
+  }
+  program = _compile(expanded, flags, regex, source);
+  if ((program != NULL) && (program->n_tokens < 0)) {
+    const int at = -program->n_tokens-1;
+    program->n_tokens = -((expanded[at] == '\0') ? (int) strlen(regex) : source[at])-1;
+  }
+  free(expanded);
+  free(source);
+  return program;
+}
 
-  // Start searching for a regular expression match. (the character
-  // 'c' is checked for null value at the end of the loop.
-  do {
-    // Continue popping active elements from the current stack and
-    // checking them for a match and jump conditions, add next tokens
-    // to the next stack.
-    while (ics >= 0) {
-      // Pop next token to check from the stack.
-      const int j = cstack[ics];
-      ics--;
-      incs[j] = 0;
-      // Get the token and the "match start index" for the match that led here.
-      const char ct = tokens[j];
-      int val = active[j];
-      // If this is a special character, add its tokens immediately to
-      // the current stack (to be checked before next charactrer).
-      if ((ct == '*') && (! jumpi[j])) {
-        if (j == 0) val = i; // ignore leading tokens where possible
-      dest = jumps[j];
-      MATCHA_STACK_NEXT_TOKEN(cstack, ics, incs);
-      dest = jumpf[j];
-      MATCHA_STACK_NEXT_TOKEN(cstack, ics, incs);
-      // Check to see if this token matches the current character.
-      } else if ((c == ct) || ((ct == '.') && (! jumpi[j]) && (c != '\0'))) {
-      dest = jumps[j];
-      MATCHA_STACK_NEXT_TOKEN(nstack, ins, inns);
-      // This token did not match, trigger a jump fail.
-      } else {
-      dest = jumpf[j];
-      // jump immediately on fail if this is not the last token in a token set
-      if (jumpi[j] == 1) { 
-        MATCHA_STACK_NEXT_TOKEN(cstack, ics, incs);
-      // otherwise, put into the "next" stack
-      } else { 
-        MATCHA_STACK_NEXT_TOKEN(nstack, ins, inns);
-      }
-      }
-    }
-    // Switch out the current stack with the next stack.
-    //   switch stack of token indices
-    temp = (void*) cstack; // store "current stack"
-    cstack = nstack; // set "current stack"
-    ics = ins; // set "index in current stack"
-    nstack = (int*) temp; // set "next stack"
-    //   switch flag arrays of "token in stack"
-    temp = (void*) incs; // store "in current stack"
-    incs = inns; // set "in current stack"
-    inns = (char*) temp; // set "in next stack"
-    ins = -1; // reset the count of elements in "next stack"
 
-    // If the just-parsed character was the end of the string, then break.
-    if (c == '\0') {
-      break;
-    // Get the next character in the string (assuming it's null terminated).
-    } else {
-      i++;
-      c = string[i];
-    }
-  } while (ics >= 0) ; // loop until the active stack is empty
-  free(jumps); // free all memory that was allocated
-  // Check for errors, deallocate 'ends', 'starts', and 'lines' if there are errors.
-  if ((*n) < 0) {
-    if ((*starts) != NULL) free(*starts);
-  // Re-allocate the output arrays to be the exact size of the number of matches.
+// Compile a regular expression (with no flags, see `compile_flags`).
+struct compiled_regex * compile(const char * regex) {
+  return compile_flags(regex, 0);
+}
+
+
+// Release a program created by `compile` (or `compile_set`).
+void free_compiled(struct compiled_regex * program) {
+  if (program == NULL) return;
+  _dfa_free(program->dfa);
+  free(program);
+}
+
+
+// Compile many regular expressions into one program, with the tokens
+// of each placed one after the other (and their ends distinguished),
+// so that all of them are searched for in a single pass. Invalid
+// regular expressions are signaled through "n_tokens" <= 0 the same
+// way as `compile`, with "n_patterns" set to the index of the first
+// invalid regular expression. The "flags" apply to every regular
+// expression (see `compile_flags`).
+struct compiled_regex * compile_set_flags(const char ** regexes, const int n_regexes,
+                                          const int flags) {
+  // Compile every regular expression on its own first.
+  struct compiled_regex ** programs = malloc(n_regexes * sizeof(struct compiled_regex *));
+  if (programs == NULL) return NULL;
+  int n_tokens = 0; // total number of tokens
+  int n_groups = 0; // total number of groups
+  int bad = -1; // index of the first invalid regular expression
+  for (int p = 0; p < n_regexes; p++) {
+    programs[p] = compile_flags(regexes[p], flags);
+    if (programs[p] == NULL) {
+      for (int q = 0; q < p; q++) free_compiled(programs[q]);
+      free(programs);
+      return NULL;
+    }
+    if ((bad < 0) && (programs[p]->n_tokens <= 0)) bad = p;
+    n_tokens += programs[p]->n_tokens;
+    n_groups += programs[p]->n_groups;
+  }
+  // Error mode, copy the error of the first invalid regex (or no regexes).
+  struct compiled_regex * program;
+  if ((bad >= 0) || (n_regexes <= 0)) {
+    if (bad >= 0) program = _alloc_program(programs[bad]->n_tokens, programs[bad]->n_groups, 1);
+    else program = _alloc_program(0, 0, 1);
+    if (program != NULL) program->n_patterns = (bad >= 0) ? bad : 0;
   } else {
-    if (n_found < s_found) {
-      s_found = n_found;
-      int * new_starts = malloc(3 * s_found * sizeof(int));
-      int * new_ends = new_starts + s_found;
-      for (int index = 0; index < n_found; index++) {
-        new_starts[index] = (*starts)[index];
-        new_ends[index] = (*ends)[index];
+    program = _alloc_program(n_tokens, n_groups, n_regexes);
+  }
+  // Copy the tables of each regex, offsetting all of its jumps.
+  if ((program != NULL) && (bad < 0) && (n_regexes > 0)) {
+    int offset = 0;
+    for (int p = 0; p < n_regexes; p++) {
+      const struct compiled_regex * part = programs[p];
+      for (int j = 0; j < part->n_tokens; j++) {
+        const int s = part->jumps[j];
+        const int f = part->jumpf[j];
+        program->jumps[offset+j] = (s == part->n_tokens) ? n_tokens+p : ((s < 0) ? s : s+offset);
+        program->jumpf[offset+j] = (f == part->n_tokens) ? n_tokens+p : ((f < 0) ? f : f+offset);
+        program->tokens[offset+j] = part->tokens[j];
+        program->jumpi[offset+j] = part->jumpi[j];
+        memcpy(program->sets + SET_BYTES*(offset+j), part->sets + SET_BYTES*j, SET_BYTES);
       }
-      if ((*starts) != NULL) free(*starts);
-      (*starts) = new_starts;
-      (*ends) = new_ends;
+      program->entries[p] = offset + part->entries[0];
+      program->is_entry[offset + part->entries[0]] = part->is_entry[part->entries[0]];
+      // (The captures of each regex are numbered on their own.)
+      for (int k = 0; k < part->n_spans; k++) {
+        int * span = program->spans + 3*program->n_spans;
+        span[0] = part->spans[3*k];
+        span[1] = part->spans[3*k+1] + offset;
+        span[2] = part->spans[3*k+2] + offset;
+        program->n_spans++;
+      }
+      if (part->n_captures > program->n_captures) program->n_captures = part->n_captures;
+      offset += part->n_tokens;
+    }
+    // Every match starts with the prefix that all patterns share.
+    program->n_prefix = _prefix_length(program, program->entries[0]);
+    program->prefix = program->tokens + program->entries[0] + 2;
+    for (int p = 1; p < n_regexes; p++) {
+      const int e = program->entries[p];
+      const int length = _prefix_length(program, e);
+      int k = 0;
+      while ((k < length) && (k < program->n_prefix) &&
+             (program->tokens[e+2+k] == program->prefix[k])) k++;
+      program->n_prefix = k;
     }
+    program->mode = (flags & COMPILE_LONGEST) ? COMPILE_LONGEST : (flags & COMPILE_FIRST_END);
+    program->lines = ((flags & COMPILE_LINES) != 0);
+    program->reverse = (flags & COMPILE_REVERSE_START) && (! program->mode) &&
+      (! program->n_captures);
+    for (int p = 0; p < n_regexes; p++)
+      if (! _any_start(program, program->entries[p])) program->reverse = 0;
+    _link(program);
   }
-  return;
+  for (int p = 0; p < n_regexes; p++) free_compiled(programs[p]);
+  free(programs);
+  return program;
 }
 
 
+// Compile many regular expressions (with no flags, see `compile_set_flags`).
+struct compiled_regex * compile_set(const char ** regexes, const int n_regexes) {
+  return compile_set_flags(regexes, n_regexes, 0);
+}
 
-// Find all nonoverlapping matches of a regular expression in a file
-// at a given path. Return arrays of the starts and ends of matches.
-void fmatcha(const char * regex, const char * path,
-            int * n, int ** starts, int ** ends, int ** lines,
-                float min_ascii_ratio) {
 
-  // Open the file and handle any errors.
-  FILE * file = fopen(path, "r");
-  if (file == NULL) {
-    (*n) = -2;
-    return;
+// Matches found by a search, also used as a reusable (caller owned)
+// arena of results by `matcha_into` and `fmatcha_into`. The starts,
+// ends, lines, patterns, line ranges, and captures share one
+// allocation (in that order) that only grows, owned by "starts" (the
+// array the matchers hand back to their callers).
+struct found_matches {
+  int n;        // number of matches found
+  int size;     // capacity of each of the arrays (matches)
+  int * starts; // start (inclusive) of each match
+  int * ends;   // end (noninclusive) of each match
+  int * lines;  // line number of each match (only set by `fmatcha`,
+                // until then the index of the character that found it)
+  int * patterns; // index of the pattern of each match (see `compile_set`)
+  int n_captures; // "()" groups of each match in "captures" (COMPILE_CAPTURE)
+  int * captures; // start and end of each group of each match (-1 and -1
+                  // for a group that is not part of the match)
+  int * line_starts; // start of the first line that holds each match (only
+  int * line_ends;   // set by `fmatcha`), and the end of its last line (the
+                     // index of its newline, or the end of the file)
+};
+
+
+// Move the arrays in "found" into a new allocation of "size" matches.
+static void _found_resize(struct found_matches * found, const int size) {
+  const int width = 2 * found->n_captures; // integers of captures per match
+  found->size = size;
+  int * new_starts = malloc((6 + width) * found->size * sizeof(int));
+  int * new_ends = new_starts + found->size;
+  int * new_lines = new_ends + found->size;
+  int * new_patterns = new_lines + found->size;
+  int * new_line_starts = new_patterns + found->size;
+  int * new_line_ends = new_line_starts + found->size;
+  int * new_captures = new_line_ends + found->size;
+  if (found->n > 0) {
+    memcpy(new_starts, found->starts, found->n * sizeof(int));
+    memcpy(new_ends, found->ends, found->n * sizeof(int));
+    memcpy(new_lines, found->lines, found->n * sizeof(int));
+    memcpy(new_patterns, found->patterns, found->n * sizeof(int));
+    memcpy(new_line_starts, found->line_starts, found->n * sizeof(int));
+    memcpy(new_line_ends, found->line_ends, found->n * sizeof(int));
   }
+  for (int c = 0; c < found->n * width; c++)
+    new_captures[c] = (found->captures != NULL) ? found->captures[c] : EXIT_TOKEN;
+  if (found->starts != NULL) free(found->starts);
+  found->starts = new_starts;
+  found->ends = new_ends;
+  found->lines = new_lines;
+  found->patterns = new_patterns;
+  found->line_starts = new_line_starts;
+  found->line_ends = new_line_ends;
+  found->captures = (width > 0) ? new_captures : NULL;
+}
 
-  // Count the number of tokens and groups in this regular expression.
-  (*n) = -1;
-  int n_tokens, n_groups;
-  _count(regex, &n_tokens, &n_groups);
-  // Error mode, fewer than one token (no possible match).
-  if (n_tokens <= 0) {
-    (*starts) = malloc(2 * sizeof(int));
-    (*ends) = (*starts) + 1;
-    // Set the error flag and return.
-    if (n_tokens == 0) {
-      (*starts)[0] = EXIT_TOKEN;
-      (*ends)[0] = REGEX_NO_TOKENS_ERROR;
-    } else {
-      (*starts)[0] = n_tokens;
-      (*ends)[0] = n_groups;
-    }
-    return;
+
+// Make "found" hold the captures of "n_captures" groups for each
+// match (the matches it already holds get none when that changes).
+static void _found_captures(struct found_matches * found, const int n_captures) {
+  if (found->n_captures == n_captures) return;
+  found->n_captures = n_captures;
+  found->captures = NULL;
+  if (found->size > 0) _found_resize(found, found->size);
+}
+
+
+// Add a match to "found", doubling the size of the arrays when full,
+// with its captures copied from "captures" (none are set when NULL).
+static void _found_append_captures(struct found_matches * found, int pattern,
+                                   int start, int end, int line, const int * captures) {
+  if (found->n >= found->size)
+    _found_resize(found, (found->size == 0) ? INITIAL_FOUND_SIZE : 2*found->size);
+  found->starts[found->n] = start;
+  found->ends[found->n] = end;
+  found->lines[found->n] = line;
+  found->patterns[found->n] = pattern;
+  const int width = 2 * found->n_captures;
+  for (int c = 0; c < width; c++)
+    found->captures[found->n * width + c] = (captures != NULL) ? captures[c] : EXIT_TOKEN;
+  found->n++;
+}
+
+
+// Add a match (without captures) to "found", see `_found_append_captures`.
+static void _found_append(struct found_matches * found, int pattern,
+                          int start, int end, int line) {
+  _found_append_captures(found, pattern, start, end, line, NULL);
+}
+
+
+// Copy the match at index "from" of "found" (with its captures) over
+// the one at index "to".
+static inline void _found_move(struct found_matches * found, const int to, const int from) {
+  found->starts[to] = found->starts[from];
+  found->ends[to] = found->ends[from];
+  found->lines[to] = found->lines[from];
+  found->patterns[to] = found->patterns[from];
+  const int width = 2 * found->n_captures;
+  for (int c = 0; c < width; c++)
+    found->captures[to * width + c] = found->captures[from * width + c];
+}
+
+
+// Swap the matches at indices "a" and "b" of "found" (with their captures).
+static inline void _found_swap(struct found_matches * found, const int a, const int b) {
+  int swap;
+  #define FOUND_SWAP(x, y) swap = (x); (x) = (y); (y) = swap;
+  FOUND_SWAP(found->starts[a], found->starts[b]);
+  FOUND_SWAP(found->ends[a], found->ends[b]);
+  FOUND_SWAP(found->lines[a], found->lines[b]);
+  FOUND_SWAP(found->patterns[a], found->patterns[b]);
+  const int width = 2 * found->n_captures;
+  for (int c = 0; c < width; c++) {
+    FOUND_SWAP(found->captures[a * width + c], found->captures[b * width + c]);
   }
+  #undef FOUND_SWAP
+}
 
-  // Set there to be 0 matches, initially.
-  (*n) = 0;
-  // Initialize storage for tracking the current active tokens and
-  // where to jump based on the string being parsed.
-  const int mem_bytes = ((5*n_tokens+1)*sizeof(int) + (4*n_tokens+2)*sizeof(char));
-  int * jumps = malloc(mem_bytes); // jump-to location after success
-  int * jumpf = jumps + n_tokens; // jump-to location after failure
-  int * active = jumpf + n_tokens; // presently active tokens in regex
-  int * cstack = active + n_tokens + 1; // current stack of active tokens
-  int * nstack = cstack + n_tokens; // next stack of active tokens
-  char * tokens = (char*) (nstack + n_tokens); // regex index of each token (character)
-  char * jumpi = tokens + n_tokens + 1; // immediately check next on failure
-  char * incs = jumpi + n_tokens; // token flags for "in current stack"
-  char * inns = incs + n_tokens; // token flags for "in next stack"
-  // Terminate the two character arrays with the null character.
-  tokens[n_tokens] = '\0';
-  jumpi[n_tokens] = '\0';
-
-  // Create a character buffer for reading data from the file.
-  size_t buffer_size = FILE_BUFFER_SIZE;
-  fseek(file, 0, SEEK_END); // go to the end of the file
-  size_t file_size = ftell(file); // size of file in bytes
-  rewind(file); // go back to the beginning of the file
-  if (file_size < buffer_size)
-    buffer_size = file_size+1; // set the buffer size smaller if appropriate
-  char * file_buff = malloc(sizeof(char)*buffer_size); // storage for the file contents
-  int bytes_buffered = fread(file_buff, sizeof(char), buffer_size, file);
-  int ib = 0; // index in buffer.
-  if (bytes_buffered < buffer_size) file_buff[bytes_buffered] = EOF;
 
-  // Determine the jump-to tokens upon successful match and failed
-  // match at each token in the regular expression.
-  _set_jump(regex, n_tokens, n_groups, tokens, jumps, jumpf, jumpi);
-  // Set all tokens to be inactive, convert ? to * for simplicity.
-  active[n_tokens] = EXIT_TOKEN;
+// The number of bytes of working memory needed by `_simulate`.
+#define SIMULATE_BYTES(n_tokens) \
+  ((6*(n_tokens)+2)*sizeof(int) + 2*(n_tokens)*sizeof(char))
+
+// The character at index "i" of a string with "length" bytes, or of
+// a null-terminated string when "length" is negative. The end of the
+// string is EOF, every other character is its (unsigned) byte value.
+static inline int _char_at(const char * string, const int length, const int i) {
+  if (length < 0) return (string[i] == '\0') ? EOF : (unsigned char) string[i];
+  return (i < length) ? (unsigned char) string[i] : EOF;
+}
+
+
+// Check whether an anchor (the "byte" of a TOKEN_ANCHOR) holds between
+// the character "prev" (EOF at the start of the string) and "c".
+static inline int _anchor_holds(const int anchor, const int prev, const int c) {
+  switch (anchor) {
+  case ANCHOR_START: return (prev == EOF);
+  case ANCHOR_END: return (c == EOF);
+  case ANCHOR_LINE_START: return (prev == EOF) || (prev == '\n');
+  default: return (c == EOF) || (c == '\n');
+  }
+}
+
+
+// The last check of one token by the simulation (see `_simulate_step`).
+struct token_check {
+  int step; // index in string when token was last checked
+  int val;  // start index of the last check of token
+};
+
+// The state of the token simulation between two characters.
+struct simulation {
+  int * active; // presently active tokens in regex (with their match start)
+  int * nactive; // tokens active for next character
+  int * cstack; // current stack of active tokens
+  int * nstack; // next stack of active tokens
+  struct token_check * checked; // last check of each token
+  char * incs; // token flags for "in current stack"
+  char * inns; // token flags for "in next stack"
+  int ics; // index in current stack (-1 when no tokens are active)
+  int mode; // match mode of the program (see `_simulate_select`)
+  int kept; // matches of "found" selected by the mode (the rest are pending)
+  int floor; // earliest start of a match that can be kept (-1 for every start)
+  int last; // end of the last kept match (-1 when none is kept yet)
+  int cut_start; // starts strictly between these two can not be kept
+  int cut_end;   // (COMPILE_LONGEST, -1 and -1 when no match is pending)
+  int width; // integers of captures for each token (0 when they are not kept)
+  int * tags; // captures of each active token (see `_simulate_tag`, or NULL)
+  int * ntags; // captures of each token active for next character
+  int * row; // captures of the token being checked
+  int * done; // captures of a match that ends
+  #ifdef REGEX_STATS
+  long long steps; // characters processed (not yet added to the statistics)
+  long long pushes; // tokens pushed onto the stacks (not yet added)
+  int peak; // most tokens active for one character (not yet added)
+  #endif
+};
+
+
+// Initialize the state of the token simulation in "memory" (which
+// must hold SIMULATE_BYTES(n_tokens) bytes) with only the first token
+// (of each pattern) active, starting matches at index "from".
+static void _simulate_init(const struct compiled_regex * program, void * memory,
+                           const int from, struct simulation * state) {
+  const int n_tokens = program->n_tokens;
+  // Initialize storage for tracking the current active tokens. The
+  // match start index has one array for each of the two stacks, so
+  // that a token waiting in the next stack does not have its start
+  // overwritten by an entry in the current stack.
+  state->active = (int*) memory;
+  state->nactive = state->active + n_tokens+1;
+  state->cstack = state->nactive + n_tokens+1;
+  state->nstack = state->cstack + n_tokens;
+  state->checked = (struct token_check*) (state->nstack + n_tokens);
+  state->incs = (char*) (state->checked + n_tokens);
+  state->inns = state->incs + n_tokens;
+  // Set all tokens to be inactive (and in neither stack).
+  state->active[n_tokens] = EXIT_TOKEN;
+  state->nactive[n_tokens] = EXIT_TOKEN;
   for (int j = 0; j < n_tokens; j++) {
-    // convert both "special tokens" to * for speed, exclude all
-    // tokens with jumpi = 1 because those are inside token sets
-    if ((! jumpi[j]) && ((tokens[j] == '?') || (tokens[j] == '|')))
-      tokens[j] = '*';
-    active[j] = EXIT_TOKEN; // token is inactive
-    incs[j] = 0; // token is not in current stack
-    inns[j] = 0; // token is not in next stack
-  }
-
-  // Set the current index in the file.
-  int i = 0; // current index in file
-  int c = file_buff[ib]; // get current character in file
-  int ics = 0; // index in current stack
+    state->active[j] = EXIT_TOKEN; // token is inactive
+    state->nactive[j] = EXIT_TOKEN; // token is inactive
+    state->checked[j].step = EXIT_TOKEN; // token has not been checked
+  }
+  memset(state->incs, 0, 2*n_tokens);
+  // Put the first token of each pattern in the current stack.
+  state->ics = -1;
+  state->mode = program->mode;
+  state->kept = 0;
+  state->floor = program->mode ? from : EXIT_TOKEN;
+  state->last = EXIT_TOKEN;
+  state->cut_start = EXIT_TOKEN;
+  state->cut_end = EXIT_TOKEN;
+  state->width = 0;
+  state->tags = NULL;
+  state->ntags = NULL;
+  for (int p = program->n_patterns-1; p >= 0; p--) {
+    const int e = program->entries[p];
+    state->ics++;
+    state->cstack[state->ics] = e; // set the next element in stack
+    state->active[e] = from; // set the start index of the first token
+    state->incs[e] = 1; // the first token is in the current stack
+  }
+  STATS(state->steps = 0; state->pushes = 0; state->peak = 0;)
+}
+
+
+#ifdef REGEX_STATS
+// Add the counts of a simulation to the statistics (and reset them).
+static void _stats_flush(struct simulation * state) {
+  _stats_add(&_stats.steps, state->steps);
+  _stats_add(&_stats.pushes, state->pushes);
+  _stats_max(&_stats.peak_active, state->peak);
+  state->steps = 0;
+  state->pushes = 0;
+  state->peak = 0;
+}
+#endif
+
+
+// Check whether only the first tokens are active (nothing is in progress).
+static inline int _simulate_idle(const struct compiled_regex * program,
+                                 const struct simulation * state) {
+  if (state->ics != program->n_patterns-1) return 0;
+  int k = 0;
+  while ((k <= state->ics) && (program->is_entry[state->cstack[k]])) k++;
+  return (k > state->ics);
+}
+
+
+// Set the captures "to" of the step from token "j" to token "dest"
+// (a "done" token when "dest" >= n_tokens) at the index "at" of the
+// string, from the captures "from" of token "j" (COMPILE_CAPTURE).
+// A group starts at "at" when the step enters its tokens, and ends at
+// "at" when the step leaves them, so a group (copy) in a loop holds
+// its last repetition.
+static inline void _simulate_tag(const struct compiled_regex * program,
+                                 const int * from, int * to, const int width,
+                                 const int j, const int dest, const int at) {
+  memcpy(to, from, width * sizeof(int));
+  for (int k = 0; k < program->n_spans; k++) {
+    const int * span = program->spans + 3*k;
+    const int was_in = (j >= span[1]) && (j < span[2]);
+    const int is_in = (dest >= span[1]) && (dest < span[2]);
+    if (is_in && (! was_in)) to[2*span[0]] = at;
+    else if (was_in && (! is_in)) to[2*span[0]+1] = at;
+  }
+}
+
+
+// Set the captures "to" of a match that starts at token "j" at the
+// index "at" of the string (the groups that hold "j" start there).
+static inline void _simulate_tag_start(const struct compiled_regex * program,
+                                       int * to, const int width, const int j, const int at) {
+  for (int c = 0; c < width; c++) to[c] = EXIT_TOKEN;
+  for (int k = 0; k < program->n_spans; k++) {
+    const int * span = program->spans + 3*k;
+    if ((j >= span[1]) && (j < span[2])) to[2*span[0]] = at;
+  }
+}
+
+
+// Select the matches of the match mode from the ones added to "found"
+// by the steps of a simulation (up to the step at index "i"). The
+// matches before "state->kept" are kept, the ones after are pending.
+// Without a mode every match is kept. With COMPILE_FIRST_END the
+// match that ends first (with the newest start) is kept, then the one
+// that ends first of those that start at or after its end, and so on.
+// With COMPILE_LONGEST the match with the oldest start (and then the
+// latest end) is kept once no active token holds a start that old,
+// then the same from its end. An empty match at the end of the last
+// kept one is never kept. When "final" is nonzero, nothing is in
+// progress and every pending match is decided. Each match is looked
+// at once per step while it is pending, the input is never rescanned.
+static void _simulate_select(const struct compiled_regex * program,
+                             struct simulation * state, struct found_matches * found,
+                             const int i, const int final) {
+  if (! state->mode) {
+    state->kept = found->n;
+    return;
+  }
+  const int longest = (state->mode == COMPILE_LONGEST);
+  while (1) {
+    // Drop the pending matches that can not be kept, and find the
+    // best of the rest (the next one to keep).
+    int n = state->kept;
+    int best = -1;
+    for (int k = state->kept; k < found->n; k++) {
+      const int start = found->starts[k];
+      const int end = found->ends[k];
+      if ((start < state->floor) || ((start == end) && (end == state->last))) continue;
+      if (n < k) _found_move(found, n, k);
+      if ((best < 0) || (longest ?
+          ((start < found->starts[best]) || ((start == found->starts[best]) && (end > found->ends[best]))) :
+          ((end < found->ends[best]) || ((end == found->ends[best]) && (start > found->starts[best])))))
+        best = n;
+      n++;
+    }
+    found->n = n;
+    state->cut_start = EXIT_TOKEN;
+    state->cut_end = EXIT_TOKEN;
+    if (best < 0) return;
+    // Wait while a later step could still give a better match.
+    if ((! final) && longest) {
+      int waiting = 0;
+      for (int k = 0; (! waiting) && (k <= state->ics); k++) {
+        const int j = state->cstack[k];
+        const struct regex_token token = program->code[j];
+        const int start = token.any_start ? i+1 : state->active[j];
+        waiting = ((start >= state->floor) && (start <= found->starts[best]));
+      }
+      // (Starts inside of the pending match can only be given up.)
+      if (waiting) {
+        state->cut_start = found->starts[best];
+        state->cut_end = found->ends[best];
+        return;
+      }
+    } else if ((! final) && (found->ends[best] > i)) return;
+    // Keep the best match, move it to the end of the kept ones.
+    const int end = found->ends[best];
+    if (best != state->kept) _found_swap(found, best, state->kept);
+    state->kept++;
+    state->floor = end;
+    state->last = end;
+  }
+}
+
+
+// Advance the token simulation over the character "c" (or EOF) at
+// index "i", after the character "prev" (EOF when "i" is the start of
+// the string, for anchors), adding matches that end to "found".
+// Returns 1 once "found" holds "max_matches" matches (when it is
+// nonzero, the state is then incomplete), otherwise 0 once the stacks
+// are ready for the next character.
+static inline int _simulate_step(const struct compiled_regex * program,
+                                 struct simulation * state, const int prev, const int c,
+                                 const int i, const int max_matches,
+                                 struct found_matches * found) {
+  const int n_tokens = program->n_tokens;
+  // Get the (read only) packed tokens of the compiled program.
+  const struct regex_token * code = program->code; // jumps and operation of each token
+  const unsigned char * sets = program->sets; // members of each token set
+  // Get the state of the simulation.
+  int * active = state->active;
+  int * nactive = state->nactive;
+  int * cstack = state->cstack;
+  int * nstack = state->nstack;
+  struct token_check * checked = state->checked;
+  char * incs = state->incs;
+  char * inns = state->inns;
+  int ics = state->ics; // index in current stack
   int ins = -1; // index in next stack
   int dest; // index of next token (for jump)
-  void * temp; // temporary pointer (used for transferring nstack to cstack)
-  cstack[ics] = 0; // set the first element in stack to '0'
-  active[0] = 0; // set the start index of the first token
-  incs[0] = 1; // the first token is in the current stack
-
-  // Initialize to "no match".
-  (*starts) = NULL;
-  (*ends) = NULL;
-  (*lines) = NULL;
-  int n_found = 0; // number found
-  int s_found = 0; // size of "found" arrays
-  int lines_read = 1;
-  // Track some file statistics for early exit conditions.
-  float ascii_count = 0.0;
-  float bytes_read = 0.0;
+  // Get the captures of the active tokens (NULL when they are not kept).
+  int * tags = state->tags;
+  int * ntags = state->ntags;
+  int * row = state->row;
+  const int width = state->width;
+  // With COMPILE_LONGEST the oldest match start is kept for each token
+  // (and only a leading ".*" resets starts), otherwise the newest.
+  const int oldest = (state->mode == COMPILE_LONGEST);
+  // A match start that can no longer be kept by the match mode.
+  #define SIMULATE_DROPPED(start) (((start) < state->floor) ||\
+    (((start) > state->cut_start) && ((start) < state->cut_end)))
 
   // Define an in-line substitution that will be used repeatedly in
   // a following while loop.
-  #define FMATCHA_STACK_NEXT_TOKEN(stack, si, in_stack) \
-    if ((dest >= 0) && (val >= active[dest])) { \
-      if (dest == n_tokens) { \
-        (*n)++; \
-        if (n_found >= s_found) { \
-          if (s_found == 0) s_found = INITIAL_FOUND_SIZE; \
-          else s_found = 2*s_found; \
-          int * new_starts = malloc(3 * s_found * sizeof(int)); \
-          int * new_ends = new_starts + s_found; \
-          int * new_lines = new_ends + s_found;  \
-          for (int index = 0; index < n_found; index++)      { \
-            new_starts[index] = (*starts)[index]; \
-            new_ends[index] = (*ends)[index]; \
-            new_lines[index] = (*lines)[index]; \
-          } \
-          if ((*starts) != NULL) free(*starts); \
-          (*starts) = new_starts; \
-          (*ends) = new_ends; \
-          (*lines) = new_lines; \
-        } \
-        (*starts)[n_found] = val; \
-        (*ends)[n_found] = (((jumpi[j]) || (ct != '*')) ? i+1 : i); \
-        (*lines)[n_found] = lines_read; \
-        n_found++; \
-      } else { \
-        if (in_stack[dest] == 0) { \
-          si++; \
-          stack[si] = dest; \
-          in_stack[dest] = 1; \
-        } \
-        active[dest] = val; \
-      } \
-    }                                
+  //
+  // If the destination is valid, and the current start index (val)
+  // is newer (older for COMPILE_LONGEST, or the one to be overwritten
+  // was dropped) than the one to be overwritten, then stack the new
+  // destination, assign active, and mark as set.
+  //
+  // If the destination is a "done" token (one per pattern), then
+  // record the match and return if no more matches are wanted.
+  //
+  // With captures, the destination also gets the captures of this
+  // token, updated for the groups that the step enters or leaves.
+  #define SIMULATE_STACK_NEXT_TOKEN(stack, si, in_stack, in_active, in_tags)\
+    if (dest >= n_tokens) {\
+      if (tags != NULL) _simulate_tag(program, row, state->done, width, j, dest, at);\
+      _found_append_captures(found, dest-n_tokens, val, at, i, (tags != NULL) ? state->done : NULL);\
+      if (max_matches && (found->n >= max_matches)) return 1;\
+    } else if ((dest >= 0) && (oldest ? ((in_active[dest] < 0) || (val < in_active[dest]) ||\
+                                         SIMULATE_DROPPED(in_active[dest]))\
+                                      : (val >= in_active[dest]))) {\
+      if (in_stack[dest] == 0) {\
+        si++;\
+        stack[si] = dest;\
+        in_stack[dest] = 1;\
+        STATS(state->pushes++;)\
+      }\
+      in_active[dest] = val;\
+      if (tags != NULL) _simulate_tag(program, row, in_tags + width*dest, width, j, dest, at);\
+    }
+
+  // Continue popping active elements from the current stack and
+  // checking them for a match and jump conditions, add next tokens
+  // to the next stack. With COMPILE_LONGEST the entry splits (that
+  // start matches at "i") are checked after every other token, once
+  // the matches that end at "i" are selected, so a token is never
+  // given an older start that those matches then drop.
+  int deferred = 0; // whether the entry splits were set aside (COMPILE_LONGEST)
+  while (1) {
+  while (ics >= 0) {
+    // Pop next token to check from the stack, skip if already done.
+    const int j = cstack[ics];
+    ics--;
+    incs[j] = 0;
+    // Get the token and the "start index" for the match that led here.
+    const struct regex_token token = code[j];
+    if (oldest && (token.any_start == 1) && (! deferred)) {
+      incs[j] = 2; // (set aside, see below)
+      continue;
+    }
+    int val = active[j];
+    active[j] = EXIT_TOKEN;
+    const int reset = (token.is_entry) && (token.op == TOKEN_SPLIT) && ((! oldest) || token.any_start);
+    if (reset) val = i; // ignore leading tokens where possible
+    // Drop matches that can no longer be kept by the match mode (the
+    // loop of a leading ".*" always goes on, it starts later matches).
+    if ((! token.any_start) && SIMULATE_DROPPED(val)) continue;
+    // Skip tokens that were already checked for this character with
+    // a match start that is at least as new (as old, and not dropped
+    // since), stops epsilon loops.
+    if ((checked[j].step == i) && (oldest ? ((val >= checked[j].val) && (! SIMULATE_DROPPED(checked[j].val)))
+                                          : (val <= checked[j].val))) continue;
+    checked[j].step = i;
+    checked[j].val = val;
+    // The index in the string after this token, and its captures.
+    const int at = ((token.op == TOKEN_SPLIT) || (token.op == TOKEN_ANCHOR)) ? i : i+1;
+    if ((tags != NULL) && reset) _simulate_tag_start(program, row, width, j, i);
+    else if (tags != NULL) memcpy(row, tags + width*j, width * sizeof(int));
+    // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    #ifdef DEBUG
+    if (DO_PRINT) {
+      const char ct = program->tokens[j];
+      printf("    j = %d   ct = '%s'  %2d %2d  (%d)\n", j, SAFE_CHAR(ct), token.jumps, token.jumpf, val);
+    }
+    #endif
+    // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // If this is a special character, add its tokens immediately to
+    // the current stack (to be checked before next charactrer).
+    if (token.op == TOKEN_SPLIT) {
+      dest = token.jumps;
+      SIMULATE_STACK_NEXT_TOKEN(cstack, ics, incs, active, tags);
+      dest = token.jumpf;
+      SIMULATE_STACK_NEXT_TOKEN(cstack, ics, incs, active, tags);
+    // An anchor also goes on without a character, to one of its jumps.
+    } else if (token.op == TOKEN_ANCHOR) {
+      dest = _anchor_holds(token.byte, prev, c) ? token.jumps : token.jumpf;
+      SIMULATE_STACK_NEXT_TOKEN(cstack, ics, incs, active, tags);
+    // Check to see if this token matches the current character.
+    } else if ((token.op == TOKEN_BYTE) ? (c == token.byte) : ((c != EOF) &&
+               ((token.op == TOKEN_ANY) || IN_SET(sets + SET_BYTES*j, c)))) {
+      dest = token.jumps;
+      SIMULATE_STACK_NEXT_TOKEN(nstack, ins, inns, nactive, ntags);
+    // This token did not match, trigger a jump fail (into the "next" stack).
+    } else {
+      dest = token.jumpf;
+      SIMULATE_STACK_NEXT_TOKEN(nstack, ins, inns, nactive, ntags);
+    }
+  }
+  if (deferred || (! oldest)) break;
+  deferred = 1;
+  state->cstack = nstack;
+  state->ics = ins;
+  state->active = nactive;
+  _simulate_select(program, state, found, i, 0);
+  for (int p = 0; p < program->n_patterns; p++) {
+    const int e = program->entries[p];
+    if (incs[e] != 2) continue;
+    ics++;
+    cstack[ics] = e;
+    incs[e] = 1;
+  }
+  }
+  #undef SIMULATE_STACK_NEXT_TOKEN
+  #undef SIMULATE_DROPPED
+  STATS(state->steps++; if (ins+1 > state->peak) state->peak = ins+1;)
+  // Switch out the current stack with the next stack (and the flag
+  // arrays of "token in stack", and the match starts of active tokens).
+  state->cstack = nstack;
+  state->nstack = cstack;
+  state->ics = ins;
+  state->incs = inns;
+  state->inns = incs;
+  state->active = nactive;
+  state->nactive = active;
+  state->tags = ntags;
+  state->ntags = tags;
+  return 0;
+}
+
 
+// Run the token simulation of a compiled program over "string" (with
+// "length" bytes, see `_char_at`), starting at index "from" with only
+// the first token (of each pattern) active. Matches are added to
+// "found" (as selected by the match mode, see `_simulate_select`),
+// stopping once it holds "max_matches" matches (when that is nonzero).
+// If "sync" is nonzero, the simulation also stops as soon as only the
+// first tokens are active again (nothing is left in progress), and
+// the index of the next character to process is returned. Otherwise
+// -1 is returned once no tokens are active or the string ends.
+// "memory" must hold SIMULATE_BYTES(n_tokens) bytes.
+static int _simulate(const struct compiled_regex * program,
+                     const char * string, const int length,
+                     int from, int max_matches, int sync,
+                     struct found_matches * found, void * memory) {
+  struct simulation state;
+  _simulate_init(program, memory, from, &state);
+  // Keep the captures of every active token (COMPILE_CAPTURE), in
+  // memory of their own (no capture is set for the first tokens).
+  _found_captures(found, program->n_captures);
+  if (program->n_captures > 0) {
+    const int width = 2 * program->n_captures;
+    const int rows = program->n_tokens + 1;
+    state.tags = malloc((2*rows + 2) * width * sizeof(int));
+    if (state.tags != NULL) {
+      state.width = width;
+      state.ntags = state.tags + rows * width;
+      state.row = state.ntags + rows * width;
+      state.done = state.row + width;
+      for (int c = 0; c < 2*rows*width; c++) state.tags[c] = EXIT_TOKEN;
+      for (int p = 0; p < program->n_patterns; p++) {
+        const int e = program->entries[p];
+        _simulate_tag_start(program, state.tags + width*e, width, e, from);
+      }
+    }
+  }
+  // (A search resumed at the end of the last match can not keep an
+  // empty match there.)
+  state.kept = found->n;
+  if (program->mode && (found->n > 0)) state.last = found->ends[found->n-1];
+  // (With a match mode, the steps add pending matches without a limit.)
+  const int step_max = program->mode ? 0 : max_matches;
+  int result = -1; // index where the simulation stopped (see above)
+  // Set the current index in the string.
+  int i = from; // current index in string
+  int c = _char_at(string, length, i); // current character in string
+  int prev = (i > 0) ? _char_at(string, length, i-1) : EOF; // character before it
   // Start searching for a regular expression match. (the character
   // 'c' is checked for null value at the end of the loop.
   do {
-    // Continue popping active elements from the current stack and
-    // checking them for a match and jump conditions, add next tokens
-    // to the next stack.
-    while (ics >= 0) {
-      // Record the ASCII fraction, exit if file is too non-ASCII.
-      if ((c < 128) && (c != '\0')) {
-        ascii_count++;
-      } else if ((i >= MIN_SAMPLE_SIZE) &&
-                 ((ascii_count / i) < min_ascii_ratio)) {
-        (*n) = -3;
-        break;
-      }
-      // Pop next token to check from the stack.
-      const int j = cstack[ics];
-      ics--;
-      incs[j] = 0;
-      // Get the token and the "match start index" for the match that led here.
-      const char ct = tokens[j];
-      int val = active[j];
-      // If this is a special character, add its tokens immediately to
-      // the current stack (to be checked before next charactrer).
-      if ((ct == '*') && (! jumpi[j])) {
-        if (j == 0) val = i; // ignore leading tokens where possible
-      dest = jumps[j];
-      FMATCHA_STACK_NEXT_TOKEN(cstack, ics, incs);
-      dest = jumpf[j];
-      FMATCHA_STACK_NEXT_TOKEN(cstack, ics, incs);
-      // Check to see if this token matches the current character.
-      } else if ((c == ct) || ((ct == '.') && (! jumpi[j]) && (c != EOF))) {
-      dest = jumps[j];
-      FMATCHA_STACK_NEXT_TOKEN(nstack, ins, inns);
-      // This token did not match, trigger a jump fail.
-      } else {
-      dest = jumpf[j];
-      // jump immediately on fail if this is not the last token in a token set
-      if (jumpi[j] == 1) { 
-        FMATCHA_STACK_NEXT_TOKEN(cstack, ics, incs);
-      // otherwise, put into the "next" stack
-      } else { 
-        FMATCHA_STACK_NEXT_TOKEN(nstack, ins, inns);
-      }
-      }
+    // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    #ifdef DEBUG
+    if (DO_PRINT) {
+    const int n_tokens = program->n_tokens;
+    const char * tokens = program->tokens;
+    printf("--------------------------------------------------\n");
+    printf("i = %d   c = '%s'\n\n", i, SAFE_CHAR(c));
+    printf("stack:\n");
+    for (int j = state.ics;  j >= 0; j--) {
+      printf(" '%s' (at %2d) %d\n", SAFE_CHAR(tokens[state.cstack[j]]), state.cstack[j], state.active[state.cstack[j]]);
     }
-    // Switch out the current stack with the next stack.
-    //   switch stack of token indices
-    temp = (void*) cstack; // store "current stack"
-    cstack = nstack; // set "current stack"
-    ics = ins; // set "index in current stack"
-    nstack = (int*) temp; // set "next stack"
-    //   switch flag arrays of "token in stack"
-    temp = (void*) incs; // store "in current stack"
-    incs = inns; // set "in current stack"
-    inns = (char*) temp; // set "in next stack"
-    ins = -1; // reset the count of elements in "next stack"
-
+    printf("\n");
+    printf("active: (search token / index of match start)\n");
+    for (int j = 0; j <= n_tokens; j++) {
+      printf("  %-3s", SAFE_CHAR(tokens[j]));
+    }
+    printf("\n");
+    for (int j = 0; j <= n_tokens; j++) {
+      printf("  %-3d", state.active[j]);
+    }
+    printf("\n\n");
+    }
+    #endif
+    // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Check all active tokens against this character.
+    if (_simulate_step(program, &state, prev, c, i, step_max, found)) break;
+    _simulate_select(program, &state, found, i, 0);
+    if (max_matches && (state.kept >= max_matches)) break;
+    // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    #ifdef DEBUG
+    if (DO_PRINT) {
+      printf("\n");
+    }
+    #endif
+    // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
     // If the just-parsed character was the end of the string, then break.
     if (c == EOF) {
       break;
-    // Get the next character in the string (assuming it's null terminated).
+    // Get the next character in the string.
     } else {
       i++;
-      ib++;
-      // Read another chunk of the file.
-      if (ib >= buffer_size) {
-        // Reset the index in the buffer and read next character set.
-        ib = 0;
-        bytes_buffered = fread(file_buff, sizeof(char), buffer_size, file);
-        if (bytes_buffered < buffer_size) file_buff[bytes_buffered] = EOF;
+      prev = c;
+      c = _char_at(string, length, i);
+    }
+    // Stop when nothing is in progress (only the first tokens are
+    // active, and no match is pending).
+    if (sync && (state.kept == found->n) && _simulate_idle(program, &state)) {
+      result = i;
+      break;
+    }
+  } while (state.ics >= 0) ; // loop until the active stack is empty
+  // Decide the pending matches, nothing more is in progress.
+  _simulate_select(program, &state, found, i, 1);
+  if (max_matches && (found->n > max_matches)) found->n = max_matches;
+  STATS(_stats_flush(&state);)
+  // (The captures swap with the stacks, free the one that was allocated.)
+  if (state.tags != NULL) free((state.tags < state.ntags) ? state.tags : state.ntags);
+  return result;
+}
+
+
+// ___________________________________________________________________
+//                             Lazy DFA
+//
+//  The set of tokens in the current stack at the start of each
+//  character does not depend on the match start indices, only on the
+//  previous set and the character. Each distinct set is made a state
+//  of a deterministic automaton the first time it is seen, and each
+//  transition is computed the first time it is needed, so that most
+//  characters cost one table lookup instead of a pass over the stack.
+//  A transition also records whether any match ends during it, only
+//  then is the token simulation run (to recover the match start).
+//
+//  Programs compiled with COMPILE_REVERSE_START (where every pattern
+//  starts with ".*") do not hand the search to the simulation (unless
+//  the DFA is full, or see REVERSE_WORK_LIMIT). When a match ends, its
+//  start is found by walking the token graph backwards from the end
+//  of the pattern, one character at a time, until the entry token is
+//  reached. That is the newest start that leads to the end, the one
+//  the simulation keeps, so only the characters of the match itself
+//  are passed over a second time. Each end is reported once (the
+//  simulation may report an end once for each path that reaches it).
+//
+//  Anchors at the start of a string (or line) depend on the character
+//  before the state, so for programs that have them the token set of
+//  a state after a newline (or at the start) also holds "n_tokens"
+//  (or "n_tokens+1"), and a newline is a class of its own.
+//
+
+#define DFA_MEMORY_LIMIT 1048576
+//      ^^ 2^20 = 1MB, maximum bytes held by the DFA of one regex
+#define DFA_START 0
+//      ^^ state with only the first tokens active (its transitions start at 0)
+#define DFA_DEAD 1
+//      ^^ state with no active tokens
+#define DFA_ENDED 1
+//      ^^ transition flag, a match ends on this character
+#define DFA_STOP 2
+//      ^^ transition flag, nothing can match after this character
+#define DFA_UNKNOWN -1
+//      ^^ transition that has not been computed yet
+#define DFA_FULL -2
+//      ^^ transition that could not be computed within the memory limit
+#define REVERSE_WORK_LIMIT 4
+//      ^^ characters walked backwards per character searched (past the
+//         first DFA_MEMORY_LIMIT) before the simulation takes over
+
+// The lazily built DFA for one compiled regular expression.
+struct regex_dfa {
+  int n_classes; // number of byte classes (the last is end of string)
+  int n_states;  // number of states built
+  int s_states;  // capacity of "trans" and "set_at" (in states)
+  int n_sets;    // number of integers used in "sets"
+  int s_sets;    // capacity of "sets"
+  int s_table;   // size of "table" (power of two)
+  int bytes;     // total bytes currently allocated
+  int * trans;   // transitions ("trans" index of next state << 2 | flags), per state and class
+  int * set_at;  // start of the token set of each state within "sets"
+  int * sets;    // all sorted token sets, concatenated in state order
+  int * table;   // hash table of state indices (-1 is empty)
+  int * work;    // working stacks for computing transitions (2*n_tokens)
+  unsigned char * seen; // working bits for computing transitions (2*n_tokens)
+  int * rev_at;  // start of the tokens that jump to each token (or pattern end) in "rev"
+  int * rev;     // tokens that jump to each token, for `_reverse_start` (NULL if unused)
+  int * rwork;   // working stacks for `_reverse_start` (2*n_tokens)
+  unsigned char * rseen; // working bits for `_reverse_start` (2*n_tokens), and end flags
+  int marks;     // nonzero if token sets note the character before them (see above)
+  int line_row;  // start of the transitions of the first state after a newline
+  int input_row; // start of the transitions of the first state at the start of the string
+  unsigned char classes[256];      // class of each byte ('\0' ends the string)
+  unsigned char byte_classes[256]; // class of each byte ('\0' is a byte)
+  char class_bytes[256];           // a representative byte for each class
+};
+
+
+// Release all memory held by a DFA.
+static void _dfa_free(struct regex_dfa * dfa) {
+  if (dfa == NULL) return;
+  free(dfa->trans);
+  free(dfa->set_at);
+  free(dfa->sets);
+  free(dfa->table);
+  free(dfa->work);
+  free(dfa->rev_at);
+  free(dfa);
+}
+
+
+// Compute the hash of a sorted token set.
+static unsigned int _dfa_hash(const int * set, const int length) {
+  unsigned int hash = 2166136261u;
+  for (int k = 0; k < length; k++) hash = (hash ^ (unsigned int) set[k]) * 16777619u;
+  return hash;
+}
+
+
+// Get the state with the given (sorted) token set, adding it if it
+// does not exist. Returns DFA_FULL if there is not enough memory.
+static int _dfa_state(struct regex_dfa * dfa, const int * set, const int length) {
+  // Look for the set in the hash table.
+  unsigned int mask = dfa->s_table - 1;
+  unsigned int h = _dfa_hash(set, length) & mask;
+  while (dfa->table[h] >= 0) {
+    const int s = dfa->table[h];
+    const int * other = dfa->sets + dfa->set_at[s];
+    if (dfa->set_at[s+1] - dfa->set_at[s] == length) {
+      int k = 0;
+      while ((k < length) && (other[k] == set[k])) k++;
+      if (k == length) return s;
+    }
+    h = (h + 1) & mask;
+  }
+  // Grow the storage for states (and rehash the table) when needed.
+  if (dfa->n_states+1 >= dfa->s_states) {
+    const int s_states = 2*dfa->s_states;
+    const int added = (s_states - dfa->s_states) * (dfa->n_classes+1) * sizeof(int)
+      + s_states * sizeof(int); // doubling the table
+    if (dfa->bytes + added > DFA_MEMORY_LIMIT) return DFA_FULL;
+    int * trans = realloc(dfa->trans, s_states * dfa->n_classes * sizeof(int));
+    if (trans == NULL) return DFA_FULL;
+    dfa->trans = trans;
+    int * set_at = realloc(dfa->set_at, (s_states+1) * sizeof(int));
+    if (set_at == NULL) return DFA_FULL;
+    dfa->set_at = set_at;
+    int * table = malloc(2 * s_states * sizeof(int));
+    if (table == NULL) return DFA_FULL;
+    free(dfa->table);
+    dfa->table = table;
+    dfa->s_table = 2 * s_states;
+    dfa->s_states = s_states;
+    dfa->bytes += added;
+    mask = dfa->s_table - 1;
+    for (int k = 0; k < dfa->s_table; k++) dfa->table[k] = -1;
+    for (int s = 0; s < dfa->n_states; s++) {
+      unsigned int g = _dfa_hash(dfa->sets + dfa->set_at[s],
+                                 dfa->set_at[s+1] - dfa->set_at[s]) & mask;
+      while (dfa->table[g] >= 0) g = (g + 1) & mask;
+      dfa->table[g] = s;
+    }
+    h = _dfa_hash(set, length) & mask;
+    while (dfa->table[h] >= 0) h = (h + 1) & mask;
+  }
+  // Grow the storage for token sets when needed.
+  if (dfa->n_sets + length > dfa->s_sets) {
+    int s_sets = 2*dfa->s_sets;
+    while (dfa->n_sets + length > s_sets) s_sets *= 2;
+    const int added = (s_sets - dfa->s_sets) * sizeof(int);
+    if (dfa->bytes + added > DFA_MEMORY_LIMIT) return DFA_FULL;
+    int * sets = realloc(dfa->sets, s_sets * sizeof(int));
+    if (sets == NULL) return DFA_FULL;
+    dfa->sets = sets;
+    dfa->s_sets = s_sets;
+    dfa->bytes += added;
+  }
+  // Add the new state.
+  const int s = dfa->n_states;
+  for (int k = 0; k < length; k++) dfa->sets[dfa->n_sets+k] = set[k];
+  dfa->set_at[s] = dfa->n_sets;
+  dfa->n_sets += length;
+  dfa->set_at[s+1] = dfa->n_sets;
+  for (int k = 0; k < dfa->n_classes; k++) dfa->trans[s*dfa->n_classes + k] = DFA_UNKNOWN;
+  dfa->table[h] = s;
+  dfa->n_states++;
+  return s;
+}
+
+
+// Create the DFA for a compiled program (with only the start and
+// dead states built), or return NULL if memory could not be allocated.
+static struct regex_dfa * _dfa_init(const struct compiled_regex * program) {
+  const int n_tokens = program->n_tokens;
+  struct regex_dfa * dfa = calloc(1, sizeof(struct regex_dfa));
+  if (dfa == NULL) return NULL;
+  // Bytes that every token treats the same way share a class. Start
+  // with one class and split each class by the members of every token
+  // (its literal byte or its token set), keeping the classes numbered
+  // in order of their smallest byte (so the null character is in 0).
+  int part[256] = {0}; // class of each byte
+  int n_parts = 1;
+  for (int j = 0; j < n_tokens; j++) {
+    const char ct = program->tokens[j];
+    const unsigned char * set = program->sets + SET_BYTES*j;
+    if ((! program->jumpi[j]) && ((ct == '*') || (ct == '.'))) continue;
+    // (anchors only tell a newline apart from other bytes)
+    const int anchor = (program->jumpi[j] == JUMPI_ANCHOR);
+    int split[2*256]; // new class of the members of each class
+    for (int p = 0; p < n_parts; p++) split[p] = -1;
+    int n_split = n_parts;
+    for (int b = 0; b < 256; b++) {
+      if (anchor ? (b == '\n') : (program->jumpi[j]) ? IN_SET(set, b) : (b == (unsigned char) ct)) {
+        if (split[part[b]] < 0) split[part[b]] = n_split++;
+        part[b] = split[part[b]];
       }
-      c = file_buff[ib];
-      // Increment the number of lines read.
-      if (c == '\n') lines_read++;
-
-    }
-  } while (ics >= 0) ; // loop until the active stack is empty
-  free(file_buff); // free the file buffer
-  free(jumps); // free all memory that was allocated
-  if (ferror(file)) (*n) = -2; // check for error while reading file
-  fclose(file); // close the file
-  // Check for errors, deallocate 'ends', 'starts', and 'lines' if there are errors.
-  if ((*n) < 0) {
-    if ((*starts) != NULL) free(*starts);
-  } else {
-    // Re-allocate the output arrays to be the exact size of the number of matches.
-    if (n_found < s_found) {
-      s_found = n_found;
-      int * new_starts = malloc(3 * s_found * sizeof(int));
-      int * new_ends = new_starts + s_found;
-      int * new_lines = new_ends + s_found;
-      for (int index = 0; index < n_found; index++) {
-        new_starts[index] = (*starts)[index];
-        new_ends[index] = (*ends)[index];
-        new_lines[index] = (*lines)[index];
+    }
+    int order[2*256]; // renumbered classes
+    for (int p = 0; p < n_split; p++) order[p] = -1;
+    n_parts = 0;
+    for (int b = 0; b < 256; b++) {
+      if (order[part[b]] < 0) order[part[b]] = n_parts++;
+      part[b] = order[part[b]];
+    }
+  }
+  const int n_classes = n_parts;
+  // Pick a representative byte for each class, other than the null
+  // character when the class has any other byte.
+  dfa->class_bytes[0] = '\0';
+  for (int b = 255; b >= 1; b--) dfa->class_bytes[part[b]] = (char) b;
+  for (int b = 0; b < 256; b++) {
+    dfa->classes[b] = part[b];
+    dfa->byte_classes[b] = part[b];
+  }
+  // The end of the string is the last class. The null character ends
+  // null-terminated strings, otherwise it is like any other byte.
+  dfa->classes[0] = n_classes;
+  dfa->byte_classes[0] = 0;
+  dfa->class_bytes[n_classes] = '\0';
+  dfa->n_classes = n_classes + 1;
+  // Allocate the initial storage.
+  dfa->s_states = 8;
+  dfa->s_sets = 8 + n_tokens;
+  dfa->s_table = 2 * dfa->s_states;
+  dfa->trans = malloc(dfa->s_states * dfa->n_classes * sizeof(int));
+  dfa->set_at = malloc((dfa->s_states+1) * sizeof(int));
+  dfa->sets = malloc(dfa->s_sets * sizeof(int));
+  dfa->table = malloc(dfa->s_table * sizeof(int));
+  dfa->work = malloc((2*n_tokens+2)*sizeof(int) + 2*((n_tokens+7)/8));
+  if ((dfa->trans == NULL) || (dfa->set_at == NULL) || (dfa->sets == NULL) ||
+      (dfa->table == NULL) || (dfa->work == NULL)) {
+    _dfa_free(dfa);
+    return NULL;
+  }
+  dfa->seen = (unsigned char*) (dfa->work + 2*n_tokens+2);
+  memset(dfa->seen, 0, 2*((n_tokens+7)/8));
+  for (int k = 0; k < dfa->s_table; k++) dfa->table[k] = -1;
+  dfa->bytes = sizeof(struct regex_dfa)
+    + dfa->s_states * (dfa->n_classes+1) * sizeof(int)
+    + (dfa->s_sets + dfa->s_table) * sizeof(int)
+    + (2*n_tokens+2)*sizeof(int) + 2*((n_tokens+7)/8);
+  // List the tokens that jump to each token (and each pattern end) for
+  // finding match starts backwards, with the working memory after it.
+  if (program->reverse) {
+    const int n_nodes = n_tokens + program->n_patterns;
+    const int n_bits = (n_tokens+7)/8;
+    const int bytes = (n_nodes + 1 + 2*n_tokens + 2*n_tokens) * sizeof(int)
+      + 2*n_bits + 2*program->n_patterns;
+    dfa->rev_at = calloc(bytes, 1);
+    if (dfa->rev_at == NULL) {
+      _dfa_free(dfa);
+      return NULL;
+    }
+    dfa->rev = dfa->rev_at + n_nodes + 1;
+    dfa->rwork = dfa->rev + 2*n_tokens;
+    dfa->rseen = (unsigned char*) (dfa->rwork + 2*n_tokens);
+    dfa->bytes += bytes;
+    // (count the tokens that jump to each node, then fill in from the end)
+    const int * jumps[2] = {program->jumps, program->jumpf};
+    for (int k = 0; k < 2; k++)
+      for (int j = 0; j < n_tokens; j++)
+        if (jumps[k][j] >= 0) dfa->rev_at[jumps[k][j]]++;
+    for (int v = 1; v < n_nodes; v++) dfa->rev_at[v] += dfa->rev_at[v-1];
+    dfa->rev_at[n_nodes] = dfa->rev_at[n_nodes-1];
+    for (int k = 0; k < 2; k++)
+      for (int j = 0; j < n_tokens; j++)
+        if (jumps[k][j] >= 0) dfa->rev[--dfa->rev_at[jumps[k][j]]] = j;
+  }
+  // Create the start state (only the first tokens) and the dead state.
+  _dfa_state(dfa, program->entries, program->n_patterns);
+  _dfa_state(dfa, NULL, 0);
+  // With anchors at the start of a string (or line), also create the
+  // start state after a newline and at the start of the string.
+  dfa->line_row = DFA_START;
+  dfa->input_row = DFA_START;
+  for (int j = 0; j < n_tokens; j++)
+    if ((program->code[j].op == TOKEN_ANCHOR) && ((program->code[j].byte == ANCHOR_START) ||
+                                                  (program->code[j].byte == ANCHOR_LINE_START)))
+      dfa->marks = 1;
+  if (dfa->marks) {
+    int * set = dfa->work; // (the first tokens are sorted, they are in order)
+    const int n = program->n_patterns;
+    memcpy(set, program->entries, n * sizeof(int));
+    set[n] = n_tokens;
+    dfa->line_row = _dfa_state(dfa, set, n+1) * dfa->n_classes;
+    set[n] = n_tokens+1;
+    dfa->input_row = _dfa_state(dfa, set, n+1) * dfa->n_classes;
+  }
+  return dfa;
+}
+
+
+// Compute the transition out of "state" for the byte class "cls"
+// by doing one step of the token simulation without start indices.
+static int _dfa_transition(const struct compiled_regex * program,
+                           struct regex_dfa * dfa, const int state, const int cls) {
+  const int n_tokens = program->n_tokens;
+  const struct regex_token * code = program->code;
+  const unsigned char * sets = program->sets;
+  const int c = (cls == dfa->n_classes-1) ? EOF : (unsigned char) dfa->class_bytes[cls];
+  int * cstack = dfa->work; // tokens to check for this character
+  int * nstack = cstack + n_tokens; // tokens to check for the next character
+  unsigned char * incs = dfa->seen; // tokens already stacked for this character (bits)
+  unsigned char * inns = incs + (n_tokens+7)/8; // token already stacked for the next character
+  int ics = -1;
+  int ins = -1;
+  int ended = 0; // whether or not a match ends during this transition
+  int prev = 0; // the character before, when this state notes it (see above)
+  // Stack all the tokens in the token set of this state.
+  for (int k = dfa->set_at[state]; k < dfa->set_at[state+1]; k++) {
+    if (dfa->sets[k] >= n_tokens) {
+      prev = (dfa->sets[k] == n_tokens) ? '\n' : EOF;
+      continue;
+    }
+    ics++;
+    cstack[ics] = dfa->sets[k];
+    ADD_TO_SET(incs, cstack[ics]);
+  }
+  // Stack a destination token (once), or note the end of a match.
+  #define DFA_STACK_NEXT_TOKEN(stack, si, in_stack) \
+    if (dest >= n_tokens) { \
+      ended = 1; \
+    } else if ((dest >= 0) && (! IN_SET(in_stack, dest))) { \
+      si++; \
+      stack[si] = dest; \
+      ADD_TO_SET(in_stack, dest); \
+    }
+  // Process the tokens the same way that `_simulate` does.
+  int dest;
+  while (ics >= 0) {
+    const int j = cstack[ics];
+    ics--;
+    const struct regex_token token = code[j];
+    if (token.op == TOKEN_SPLIT) {
+      dest = token.jumps;
+      DFA_STACK_NEXT_TOKEN(cstack, ics, incs);
+      dest = token.jumpf;
+      DFA_STACK_NEXT_TOKEN(cstack, ics, incs);
+    } else if (token.op == TOKEN_ANCHOR) {
+      dest = _anchor_holds(token.byte, prev, c) ? token.jumps : token.jumpf;
+      DFA_STACK_NEXT_TOKEN(cstack, ics, incs);
+    } else if ((token.op == TOKEN_BYTE) ? (c == token.byte) : ((c != EOF) &&
+               ((token.op == TOKEN_ANY) || IN_SET(sets + SET_BYTES*j, c)))) {
+      dest = token.jumps;
+      DFA_STACK_NEXT_TOKEN(nstack, ins, inns);
+    } else {
+      dest = token.jumpf;
+      DFA_STACK_NEXT_TOKEN(nstack, ins, inns);
+    }
+  }
+  // Reset the flags, and sort the next token set (insertion sort,
+  // these sets are small).
+  memset(incs, 0, (n_tokens+7)/8);
+  for (int k = 0; k <= ins; k++) {
+    const int token = nstack[k];
+    REMOVE_FROM_SET(inns, token);
+    int l = k - 1;
+    while ((l >= 0) && (nstack[l] > token)) {
+      nstack[l+1] = nstack[l];
+      l--;
+    }
+    nstack[l+1] = token;
+  }
+  // Note a newline (after the tokens, the set stays sorted).
+  if (dfa->marks && (ins >= 0) && (c == '\n')) nstack[++ins] = n_tokens;
+  // Find (or make) the next state and store the transition.
+  const int next = _dfa_state(dfa, nstack, ins+1);
+  if (next == DFA_FULL) return DFA_FULL;
+  int transition = ((next * dfa->n_classes) << 2);
+  if (ended) transition |= DFA_ENDED;
+  if ((next == DFA_DEAD) || (c == EOF)) transition |= DFA_STOP;
+  dfa->trans[state*dfa->n_classes + cls] = transition;
+  return transition;
+}
+
+
+// Find the first index at or after "i" in "string" (with "length"
+// bytes, see `_char_at`) where the literal prefix of a program occurs,
+// return -1 if there is none. The scan for its first character uses
+// the (vectorized) C library, the rest is compared at each hit.
+static int _find_prefix(const struct compiled_regex * program,
+                        const char * string, const int length, int i) {
+  const char * prefix = program->prefix;
+  const int n_prefix = program->n_prefix;
+  while (1) {
+    const char * hit;
+    if (length < 0) hit = strchr(string + i, prefix[0]);
+    else hit = memchr(string + i, prefix[0], length - i);
+    if (hit == NULL) return -1;
+    i = hit - string;
+    if (length < 0) {
+      if (strncmp(hit, prefix, n_prefix) == 0) return i;
+    } else if ((length - i >= n_prefix) && (memcmp(hit, prefix, n_prefix) == 0)) {
+      return i;
+    }
+    i++;
+  }
+}
+
+
+// Check whether a token that is not a split matches the character "c".
+static inline int _token_match(const struct compiled_regex * program,
+                               const int j, const int c) {
+  const struct regex_token token = program->code[j];
+  return (token.op == TOKEN_BYTE) ? (c == token.byte) : ((c != EOF) &&
+         ((token.op == TOKEN_ANY) || IN_SET(program->sets + SET_BYTES*j, c)));
+}
+
+
+// Flag the ends of the matches that end during the transition out of
+// "state" for the character "c" at some index i, in "ends" (two flags
+// per pattern, the first for matches that end at i, the second for
+// matches that end at i+1, the same ends that `_simulate_step` gives).
+static void _dfa_ends(const struct compiled_regex * program, struct regex_dfa * dfa,
+                      const int state, const int c, unsigned char * ends) {
+  const int n_tokens = program->n_tokens;
+  const struct regex_token * code = program->code;
+  int * list = dfa->work; // tokens reached for this character
+  unsigned char * in_list = dfa->seen;
+  int n = 0;
+  int prev = 0; // the character before (see `_dfa_transition`)
+  for (int k = dfa->set_at[state]; k < dfa->set_at[state+1]; k++) {
+    if (dfa->sets[k] >= n_tokens) {
+      prev = (dfa->sets[k] == n_tokens) ? '\n' : EOF;
+      continue;
+    }
+    list[n++] = dfa->sets[k];
+    ADD_TO_SET(in_list, dfa->sets[k]);
+  }
+  for (int k = 0; k < n; k++) {
+    const int j = list[k];
+    if ((code[j].op == TOKEN_SPLIT) || (code[j].op == TOKEN_ANCHOR)) {
+      // (an anchor only goes one way, it does not consume "c" either)
+      int dests[2] = {code[j].jumps, code[j].jumpf};
+      if (code[j].op == TOKEN_ANCHOR) {
+        if (! _anchor_holds(code[j].byte, prev, c)) dests[0] = dests[1];
+        dests[1] = -1;
+      }
+      for (int d = 0; d < 2; d++) {
+        if (dests[d] >= n_tokens) {
+          ends[2*(dests[d]-n_tokens)] = 1;
+        } else if ((dests[d] >= 0) && (! IN_SET(in_list, dests[d]))) {
+          list[n++] = dests[d];
+          ADD_TO_SET(in_list, dests[d]);
+        }
       }
-      if ((*starts) != NULL) free(*starts);
-      (*starts) = new_starts;
-      (*ends) = new_ends;
-      (*lines) = new_lines;
+    } else {
+      const int dest = _token_match(program, j, c) ? code[j].jumps : code[j].jumpf;
+      if (dest >= n_tokens) ends[2*(dest-n_tokens)+1] = 1;
     }
   }
-  return;
+  for (int k = 0; k < n; k++) REMOVE_FROM_SET(in_list, list[k]);
 }
 
 
-// If DEBUG is not define, make the main of this program be a command line interface.
-#ifndef DEBUG
-int main(int argc, char * argv[]) {
-  printf("\n");
-  printf("The main program has not been implemented yet.\n");
-  printf("It should behave somewhat like `grep` once done.\n");
-  printf("\n");
-  printf("argc = %d\n", argc);
-  for (int i = 0; i < argc; i++) {
-    printf("argv[%d] = \"%s\"\n", i, argv[i]);
+// Find the start of the match of pattern "p" found at index "i" that
+// ends at "end" (i or i+1, see `_dfa_ends`), for a program compiled
+// with COMPILE_REVERSE_START. The tokens that can reach the end of
+// the pattern are followed backwards one character at a time (from
+// the tokens checked at "i") until the first token of the pattern is
+// among them, that index is the newest start (the one the simulation
+// would give). Returns "bound" if the walk gets there first.
+static int _reverse_start(const struct compiled_regex * program, struct regex_dfa * dfa,
+                          const char * string, const int length, const int bound,
+                          const int i, const int p, const int end) {
+  const int n_tokens = program->n_tokens;
+  const struct regex_token * code = program->code;
+  const int * rev_at = dfa->rev_at;
+  const int * rev = dfa->rev;
+  const int entry = program->entries[p];
+  int * list = dfa->rwork; // tokens that reach the end from index k
+  int * prev = list + n_tokens; // tokens that reach the end from index k-1
+  unsigned char * in_list = dfa->rseen;
+  unsigned char * in_prev = in_list + (n_tokens+7)/8;
+  int n = 0;
+  int k = i;
+  int c = _char_at(string, length, k);
+  int pc = (k > 0) ? _char_at(string, length, k-1) : EOF; // the character before
+  // Add a token "u" to a list (once).
+  #define REVERSE_ADD(l, nl, in_l, u) \
+    if (! IN_SET(in_l, u)) { \
+      l[nl++] = u; \
+      ADD_TO_SET(in_l, u); \
+    }
+  // The tokens that end the pattern during the check of index "i".
+  const int done = n_tokens + p;
+  for (int r = rev_at[done]; r < rev_at[done+1]; r++) {
+    const int u = rev[r];
+    if ((code[u].op == TOKEN_SPLIT) ? (end == i) : (code[u].op == TOKEN_ANCHOR) ?
+        ((end == i) && ((_anchor_holds(code[u].byte, pc, c) ? code[u].jumps : code[u].jumpf) == done)) :
+        ((end == i+1) && ((_token_match(program, u, c) ? code[u].jumps : code[u].jumpf) == done))) {
+      REVERSE_ADD(list, n, in_list, u);
+    }
   }
-  printf("\n");
+  int start = bound;
+  while (1) {
+    // Add the splits (and anchors that hold) that lead to any listed
+    // token (checked at "k" too).
+    int found = 0;
+    for (int a = 0; a < n; a++) {
+      const int t = list[a];
+      if (t == entry) {
+        found = 1;
+        break;
+      }
+      for (int r = rev_at[t]; r < rev_at[t+1]; r++) {
+        const int u = rev[r];
+        if ((code[u].op == TOKEN_SPLIT) || ((code[u].op == TOKEN_ANCHOR) &&
+            ((_anchor_holds(code[u].byte, pc, c) ? code[u].jumps : code[u].jumpf) == t))) {
+          REVERSE_ADD(list, n, in_list, u);
+        }
+      }
+    }
+    if (found) {
+      start = k;
+      break;
+    }
+    if ((k <= bound) || (n == 0)) break;
+    // List the tokens that jump to a listed token on the previous character.
+    k--;
+    c = pc;
+    pc = (k > 0) ? _char_at(string, length, k-1) : EOF;
+    int n_prev = 0;
+    for (int a = 0; a < n; a++) {
+      const int t = list[a];
+      for (int r = rev_at[t]; r < rev_at[t+1]; r++) {
+        const int u = rev[r];
+        if ((code[u].op != TOKEN_SPLIT) && (code[u].op != TOKEN_ANCHOR) &&
+            ((_token_match(program, u, c) ? code[u].jumps : code[u].jumpf) == t)) {
+          REVERSE_ADD(prev, n_prev, in_prev, u);
+        }
+      }
+    }
+    for (int a = 0; a < n; a++) REMOVE_FROM_SET(in_list, list[a]);
+    int * swap = list;
+    list = prev;
+    prev = swap;
+    unsigned char * swap_in = in_list;
+    in_list = in_prev;
+    in_prev = swap_in;
+    n = n_prev;
+  }
+  #undef REVERSE_ADD
+  for (int a = 0; a < n; a++) REMOVE_FROM_SET(in_list, list[a]);
+  return start;
 }
-#endif
 
 
+// Run the simulation from index "from" up to the point where only
+// the first tokens are active again (see `_simulate`), keeping only
+// the matches found at or after index "step" (the ones before were
+// already found by `_reverse_start`). Returns the same as `_simulate`.
+static int _simulate_after(const struct compiled_regex * program,
+                           const char * string, const int length,
+                           const int from, const int step, const int max_matches,
+                           struct found_matches * found, void * memory) {
+  const int n_found = found->n;
+  const int result = _simulate(program, string, length, from, 0, 1, found, memory);
+  int n = n_found;
+  for (int k = n_found; k < found->n; k++) {
+    if (found->lines[k] < step) continue;
+    _found_move(found, n, k);
+    n++;
+  }
+  found->n = (max_matches && (n > max_matches)) ? max_matches : n;
+  return result;
+}
+
+
+// Get the start of the transitions of the state with only the first
+// tokens active at index "i" of "string" (see `_dfa_init`).
+static inline int _dfa_idle(const struct regex_dfa * dfa, const char * string,
+                            const int i) {
+  if (! dfa->marks) return DFA_START;
+  if (i == 0) return dfa->input_row;
+  return (string[i-1] == '\n') ? dfa->line_row : DFA_START;
+}
+
+
+// Search "string" (with "length" bytes, see `_char_at`) for matches
+// of a compiled program starting at index "start", adding them to
+// "found" (stopping once it holds "max_matches" matches, when that is
+// nonzero). The DFA is used to pass over characters until a match
+// ends, then the token simulation is run from the last point where
+// only the first tokens were active to recover the match start (or
+// with COMPILE_REVERSE_START, `_reverse_start` walks back to it). At
+// those points, nothing is in progress, so the search skips ahead to
+// the next occurrence of the literal prefix (if any). If the DFA runs out of memory, the
+// simulation is used for the rest of the string. The search stops at
+// the first of those points at or after index "stop" and returns its
+// index, otherwise INT_MAX is returned when the search is finished.
+static int _search_from(struct compiled_regex * program,
+                        const char * string, const int length,
+                        const int start, const int stop, int max_matches,
+                        struct found_matches * found, void * memory) {
+  STATS(_stats_add(&_stats.searches, 1);)
+  // Build the DFA lazily, use only the simulation if that fails.
+  if (program->dfa == NULL) program->dfa = _dfa_init(program);
+  struct regex_dfa * dfa = program->dfa;
+  if (dfa == NULL) {
+    _simulate(program, string, length, start, max_matches, 0, found, memory);
+    return INT_MAX;
+  }
+  // A null-terminated string ends at the null character (its class),
+  // a string with a length ends at the index "length".
+  const unsigned char * classes = (length < 0) ? dfa->classes : dfa->byte_classes;
+  const int limit = (length < 0) ? INT_MAX : length;
+  const int end_class = dfa->n_classes - 1;
+  // The simulation can only be restarted from the middle of the string
+  // when a leading '*' resets match starts (in every pattern, only a
+  // leading ".*" does for COMPILE_LONGEST), otherwise it always
+  // restarts from the beginning of the string.
+  int can_sync = 1;
+  for (int p = 0; p < program->n_patterns; p++) {
+    const int e = program->entries[p];
+    if ((program->tokens[e] != '*') || (program->jumpi[e]) || (! program->is_entry[e])) can_sync = 0;
+    if ((program->mode == COMPILE_LONGEST) && (! program->code[e].any_start)) can_sync = 0;
+  }
+  const int sync_row = can_sync ? DFA_START : EXIT_TOKEN;
+  const int line_row = can_sync ? dfa->line_row : EXIT_TOKEN; // (the same when unmarked)
+  const int input_row = can_sync ? dfa->input_row : EXIT_TOKEN;
+  // Find match starts backwards (until that does too much work).
+  int reverse = program->reverse;
+  unsigned char * ends = reverse ? dfa->rseen + 2*((program->n_tokens+7)/8) : NULL;
+  long long walked = 0; // characters passed over backwards
+  int i = start; // current index in string
+  int from = start; // index where the simulation would start
+  int row = _dfa_idle(dfa, string, i); // start of the transitions of the current state
+  int result = INT_MAX; // index where the search stopped (see above)
+  STATS(long long bytes = 0;) // bytes passed over (for the statistics)
+  while (1) {
+    if ((row == sync_row) || (row == line_row) || (row == input_row)) {
+      if (i >= stop) {
+        result = i;
+        break;
+      }
+      // No match can start before the next occurrence of the prefix.
+      if (program->n_prefix > 0) {
+        STATS(const int skip_start = i;)
+        i = _find_prefix(program, string, length, i);
+        STATS(bytes += ((i >= 0) ? i : ((length < 0) ? skip_start + (int) strlen(string + skip_start) : length)) - skip_start;)
+        if (i < 0) break;
+        row = _dfa_idle(dfa, string, i);
+      }
+      from = i;
+    }
+    // Look up (or compute) the transition for this character.
+    STATS(bytes++;)
+    const int cls = (i < limit) ? classes[(unsigned char) string[i]] : end_class;
+    int next = dfa->trans[row + cls];
+    if (next == DFA_UNKNOWN) {
+      next = _dfa_transition(program, dfa, row / dfa->n_classes, cls);
+      // Out of memory for the DFA, simulate the rest of the string.
+      if ((next == DFA_FULL) && (! reverse)) {
+        _simulate(program, string, length, from, max_matches, 0, found, memory);
+        break;
+      }
+    }
+    // Hand the search to the simulation when the DFA is out of memory
+    // or the backward walks pass over too many characters again and
+    // again (an end far from its start that matches repeatedly).
+    if (reverse && ((next == DFA_FULL) || ((next & DFA_ENDED) &&
+        (walked > REVERSE_WORK_LIMIT * ((long long) (i - start) + DFA_MEMORY_LIMIT))))) {
+      reverse = 0;
+      i = _simulate_after(program, string, length, from, i, max_matches, found, memory);
+      if ((i < 0) || (max_matches && (found->n >= max_matches))) break;
+      row = _dfa_idle(dfa, string, i);
+      continue;
+    }
+    // Go to the next state and next character (the usual case).
+    if (! (next & (DFA_ENDED | DFA_STOP))) {
+      row = next >> 2;
+      i++;
+    // Matches end here, walk back to where each started and continue.
+    } else if (reverse && (next & DFA_ENDED)) {
+      _dfa_ends(program, dfa, row / dfa->n_classes, _char_at(string, length, i), ends);
+      for (int e = 0; e < 2; e++) {
+        for (int p = 0; p < program->n_patterns; p++) {
+          if (! ends[2*p+e]) continue;
+          ends[2*p+e] = 0;
+          if (max_matches && (found->n >= max_matches)) continue;
+          const int match_start = _reverse_start(program, dfa, string, length, start, i, p, i+e);
+          walked += i - match_start;
+          _found_append(found, p, match_start, i+e, i);
+        }
+      }
+      if ((next & DFA_STOP) || (max_matches && (found->n >= max_matches))) break;
+      row = next >> 2;
+      i++;
+    // A match ends here, simulate to find where it started.
+    } else if (next & DFA_ENDED) {
+      i = _simulate(program, string, length, from, max_matches, can_sync, found, memory);
+      if ((i < 0) || (max_matches && (found->n >= max_matches))) break;
+      row = _dfa_idle(dfa, string, i);
+    // The string ended or no tokens are active.
+    } else {
+      break;
+    }
+  }
+  STATS(_stats_add(&_stats.bytes, bytes);)
+  return result;
+}
+
+
+// Search the lines of "string" (with "length" bytes, see `_char_at`)
+// that start before index "stop", from the line that starts at
+// "start", for the matches of a program compiled with COMPILE_LINES.
+// Each line (without its newline) is searched as its own string, so
+// no match holds a newline and every search starts with nothing in
+// progress. The matches are added to "found" with indices in "string"
+// (see `_search_from`). A program with a literal prefix passes over
+// every line before the next occurrence of it with one scan. Returns
+// "stop" when the search stopped there, otherwise INT_MAX.
+static int _search_lines(struct compiled_regex * program,
+                         const char * string, int length,
+                         const int start, const int stop, int max_matches,
+                         struct found_matches * found, void * memory) {
+  if (length < 0) length = (int) strlen(string);
+  const int width = 2 * found->n_captures;
+  int i = start; // index of the first character of the current line
+  while ((i < length) && (i < stop)) {
+    // Skip to the line that holds the next occurrence of the prefix.
+    if (program->n_prefix > 0) {
+      int at = _find_prefix(program, string, length, i);
+      if (at < 0) break;
+      while ((at > i) && (string[at-1] != '\n')) at--;
+      i = at;
+      if (i >= stop) return stop;
+    }
+    const char * newline = memchr(string + i, '\n', length - i);
+    const int end = (newline != NULL) ? (int) (newline - string) : length;
+    const int n_before = found->n;
+    _search_from(program, string + i, end - i, 0, INT_MAX, max_matches, found, memory);
+    for (int k = n_before; k < found->n; k++) {
+      found->starts[k] += i;
+      found->ends[k] += i;
+      found->lines[k] += i;
+      for (int c = k*width; c < (k+1)*width; c++)
+        if (found->captures[c] >= 0) found->captures[c] += i;
+    }
+    if (max_matches && (found->n >= max_matches)) break;
+    i = end + 1;
+  }
+  return ((i < length) && (i >= stop)) ? stop : INT_MAX;
+}
+
+
+// Search all of "string" for matches (see `_search_from`, and
+// `_search_lines` for COMPILE_LINES).
+static void _search(struct compiled_regex * program,
+                    const char * string, const int length,
+                    int max_matches, struct found_matches * found, void * memory) {
+  if (program->lines) _search_lines(program, string, length, 0, INT_MAX, max_matches, found, memory);
+  else _search_from(program, string, length, 0, INT_MAX, max_matches, found, memory);
+}
+
+
+// Set the error flags of a program compiled from an invalid set of
+// regular expressions, in arrays allocated for the start, end, and
+// pattern (the index of the invalid regex) of one match.
+static void _set_error(const struct compiled_regex * program,
+                       int ** patterns, int ** starts, int ** ends) {
+  (*starts) = malloc(3 * sizeof(int));
+  (*ends) = (*starts) + 1;
+  (*patterns) = (*starts) + 2;
+  (*patterns)[0] = program->n_patterns;
+  if (program->n_tokens == 0) {
+    (*starts)[0] = EXIT_TOKEN;
+    (*ends)[0] = REGEX_NO_TOKENS_ERROR;
+  } else {
+    (*starts)[0] = program->n_tokens;
+    (*ends)[0] = program->n_groups;
+  }
+}
+
+
+// Get the number of bytes of a buffer as the length of a search, or
+// INT_MAX when match locations (integers) can not index all of them
+// (which `_match` and `_matcha` report as an error).
+static int _buffer_length(const size_t length) {
+  return (length >= INT_MAX) ? INT_MAX : (int) length;
+}
+
+
+// The working memory of each thread for searches that are not given
+// any (see `_scratch`), released when the thread exits.
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static void _scratch_key(void) { pthread_key_create(&scratch_key, free); }
+
+
+// Get "bytes" of working memory for a search in this thread, kept
+// (and only grown) between searches, so repeated searches with one
+// program do not allocate. Only one search of a thread can hold it at
+// a time. Returns NULL if memory could not be allocated.
+static void * _scratch(const size_t bytes) {
+  pthread_once(&scratch_once, _scratch_key);
+  size_t * block = pthread_getspecific(scratch_key); // (its size, then the memory)
+  if ((block == NULL) || (block[0] < bytes)) {
+    free(block);
+    block = malloc(sizeof(size_t) + bytes);
+    if (block != NULL) block[0] = bytes;
+    pthread_setspecific(scratch_key, block);
+    if (block == NULL) return NULL;
+  }
+  return block + 1;
+}
+
+
+// Find the first match of a compiled regex in "string" (with "length"
+// bytes, see `_char_at`). When "pattern" is not NULL, it is set to the
+// index of the regex that matched (or "n_patterns" otherwise). The
+// working memory is "batch_memory" (SIMULATE_BYTES(n_tokens) bytes)
+// when it is not NULL, otherwise it is on the stack (SMALL_TOKENS or
+// fewer) or the scratch memory of this thread.
+// When "captures" is not NULL, it is set to the captures of the match
+// (2*n_captures integers, all -1 when there is none, see COMPILE_CAPTURE).
+static void _match(struct compiled_regex * program, const char * string,
+                   const int length, int * pattern, int * start, int * end,
+                   void * batch_memory, int * captures) {
+  if (pattern != NULL) (*pattern) = program->n_patterns;
+  if (captures != NULL)
+    for (int c = 0; c < 2*program->n_captures; c++) captures[c] = EXIT_TOKEN;
+
+  // Check for an empty string.
+  if ((length < 0) ? (string[0] == '\0') : (length == 0)) {
+    (*start) = EXIT_TOKEN;
+    (*end) = STRING_EMPTY_ERROR;
+    return;
+  } else if (length == INT_MAX) {
+    (*start) = EXIT_TOKEN;
+    (*end) = STRING_TOO_LONG_ERROR;
+    return;
+  }
+
+  // Error mode, fewer than one token (no possible match).
+  const int n_tokens = program->n_tokens;
+  if (n_tokens <= 0) {
+    // Set the error flag and return.
+    if (n_tokens == 0) {
+      (*start) = EXIT_TOKEN;
+      (*end) = REGEX_NO_TOKENS_ERROR;
+    } else {
+      (*start) = n_tokens;
+      (*end) = program->n_groups;
+    }
+    return;
+  }
+
+  // Search for the first match. Only one match is ever added, so it
+  // fits in local storage and "found" never needs to grow (unless a
+  // match mode holds more matches pending or there are captures, then
+  // it is allocated).
+  int location[4];
+  struct found_matches found = {0, 1, location, location+1, location+2, location+3, 0, NULL, NULL, NULL};
+  const int allocated = (program->mode || program->n_captures);
+  if (allocated) found = (struct found_matches) {0};
+  int local[SIMULATE_BYTES(SMALL_TOKENS) / sizeof(int) + 1];
+  void * memory = batch_memory;
+  if (memory == NULL) memory = (n_tokens <= SMALL_TOKENS) ? local : _scratch(SIMULATE_BYTES(n_tokens));
+  _search(program, string, length, 1, &found, memory);
+
+  // Set the start and end of the match (or "no match").
+  if (found.n > 0) {
+    (*start) = found.starts[0];
+    (*end) = found.ends[0];
+    if (pattern != NULL) (*pattern) = found.patterns[0];
+    if ((captures != NULL) && (found.n_captures > 0))
+      memcpy(captures, found.captures, 2 * found.n_captures * sizeof(int));
+  } else {
+    (*start) = EXIT_TOKEN;
+    (*end) = 0;
+  }
+  if (allocated) free(found.starts);
+  return;
+}
+
+
+// Do a simple regular experession match with a compiled regex.
+void match_compiled(struct compiled_regex * program,
+                    const char * string, int * start, int * end) {
+  _match(program, string, -1, NULL, start, end, NULL, NULL);
+}
+
+
+// Same as `match_compiled`, for the "length" bytes in "buffer" (where
+// the null character is an ordinary byte).
+void match_compiledn(struct compiled_regex * program, const char * buffer,
+                     const size_t length, int * start, int * end) {
+  _match(program, buffer, _buffer_length(length), NULL, start, end, NULL, NULL);
+}
+
+
+// Same as `match_compiled` for a program compiled with COMPILE_CAPTURE,
+// also setting the start and end of each "()" group of the match in
+// "captures" (2*n_captures integers, -1 and -1 for a group that is
+// not part of the match, all -1 when there is no match).
+void match_captures(struct compiled_regex * program, const char * string,
+                    int * start, int * end, int * captures) {
+  _match(program, string, -1, NULL, start, end, NULL, captures);
+}
+
+
+// Same as `match_captures`, for the "length" bytes in "buffer".
+void match_capturesn(struct compiled_regex * program, const char * buffer,
+                     const size_t length, int * start, int * end, int * captures) {
+  _match(program, buffer, _buffer_length(length), NULL, start, end, NULL, captures);
+}
+
+
+// Do a simple regular experession match.
+void match(const char * regex, const char * string, int * start, int * end) {
+  // Check for an empty string (before compiling, it takes precedence).
+  if (string[0] == '\0') {
+    (*start) = EXIT_TOKEN;
+    (*end) = STRING_EMPTY_ERROR;
+    return;
+  }
+  struct compiled_regex * program = compile(regex);
+  match_compiled(program, string, start, end);
+  free_compiled(program);
+}
+
+
+// Same as `match`, for the "length" bytes in "buffer".
+void matchn(const char * regex, const char * buffer, const size_t length,
+            int * start, int * end) {
+  // Check for an empty string (before compiling, it takes precedence).
+  if (length == 0) {
+    (*start) = EXIT_TOKEN;
+    (*end) = STRING_EMPTY_ERROR;
+    return;
+  }
+  struct compiled_regex * program = compile(regex);
+  match_compiledn(program, buffer, length, start, end);
+  free_compiled(program);
+}
+
+
+// Find all nonoverlapping matches of a compiled regex in "string"
+// (with "length" bytes, see `_char_at`). When "patterns" is not NULL,
+// it is set to the index of the regex of each match.
+static void _matcha(struct compiled_regex * program, const char * string,
+                    const int length, int * n, int ** patterns,
+                    int ** starts, int ** ends) {
+
+  // Check for an empty string.
+  if ((length < 0) ? (string[0] == '\0') : (length == 0)) {
+    (*n) = -2;
+    return;
+  } else if (length == INT_MAX) {
+    (*n) = -3;
+    return;
+  }
+
+  // Error mode, fewer than one token (no possible match).
+  (*n) = -1;
+  const int n_tokens = program->n_tokens;
+  if ((n_tokens <= 0) && (patterns != NULL)) {
+    _set_error(program, patterns, starts, ends);
+    return;
+  } else if (n_tokens <= 0) {
+    (*starts) = malloc(2 * sizeof(int));
+    (*ends) = (*starts) + 1;
+    // Set the error flag and return.
+    if (n_tokens == 0) {
+      (*starts)[0] = EXIT_TOKEN;
+      (*ends)[0] = REGEX_NO_TOKENS_ERROR;
+    } else {
+      (*starts)[0] = n_tokens;
+      (*ends)[0] = program->n_groups;
+    }
+    // WARNING: returning pointers to allocated memory for two integers!
+    return;
+  }
+
+  // Search for all matches.
+  struct found_matches found = {0};
+  void * memory = malloc(SIMULATE_BYTES(n_tokens));
+  _search(program, string, length, 0, &found, memory);
+  free(memory); // free all memory that was allocated
+
+  // Give the output arrays (they may have room for more matches).
+  (*n) = found.n;
+  (*starts) = found.starts;
+  (*ends) = found.ends;
+  if (patterns != NULL) (*patterns) = found.patterns;
+  return;
+}
+
+
+// Find all nonoverlapping matches of a compiled regular expression in
+// a string. Return arrays of the starts and ends of matches.
+void matcha_compiled(struct compiled_regex * program, const char * string,
+                     int * n, int ** starts, int ** ends) {
+  _matcha(program, string, -1, n, NULL, starts, ends);
+}
+
+
+// Same as `matcha_compiled`, for the "length" bytes in "buffer".
+void matcha_compiledn(struct compiled_regex * program, const char * buffer,
+                      const size_t length, int * n, int ** starts, int ** ends) {
+  _matcha(program, buffer, _buffer_length(length), n, NULL, starts, ends);
+}
+
+
+// Find all nonoverlapping matches of a regular expression in a string.
+// Return arrays of the starts and ends of matches.
+void matcha(const char * regex, const char * string,
+            int * n, int ** starts, int ** ends) {
+  // Check for an empty string (before compiling, it takes precedence).
+  if (string[0] == '\0') {
+    (*n) = -2;
+    return;
+  }
+  struct compiled_regex * program = compile(regex);
+  matcha_compiled(program, string, n, starts, ends);
+  free_compiled(program);
+}
+
+
+// Same as `matcha`, for the "length" bytes in "buffer".
+void matchan(const char * regex, const char * buffer, const size_t length,
+             int * n, int ** starts, int ** ends) {
+  // Check for an empty string (before compiling, it takes precedence).
+  if (length == 0) {
+    (*n) = -2;
+    return;
+  }
+  struct compiled_regex * program = compile(regex);
+  matcha_compiledn(program, buffer, length, n, starts, ends);
+  free_compiled(program);
+}
+
+
+// Read the entire contents of an open file (that could not be
+// mapped) into memory, growing the buffer as needed. "size" is the
+// expected number of bytes (0 when unknown). Returns NULL on failure,
+// otherwise the buffer and its number of bytes in "length".
+static char * _read_all(int fd, size_t size, size_t * length) {
+  size_t buffer_size = (size > 0) ? size+1 : READ_BUFFER_SIZE;
+  char * buffer = malloc(buffer_size);
+  (*length) = 0;
+  while (buffer != NULL) {
+    // Grow the buffer when it is full.
+    if ((*length) == buffer_size) {
+      buffer_size = 2*buffer_size;
+      char * larger = realloc(buffer, buffer_size);
+      if (larger == NULL) break;
+      buffer = larger;
+    }
+    const ssize_t bytes_read = read(fd, buffer + (*length), buffer_size - (*length));
+    if (bytes_read == 0) return buffer;
+    if (bytes_read < 0) break;
+    (*length) += bytes_read;
+  }
+  free(buffer);
+  return NULL;
+}
+
+
+// Get the contents of the open file "fd" (and close it). Regular
+// files are mapped into memory, all other files (pipes, devices) are
+// read into a buffer. Returns NULL if the file could not be read,
+// otherwise sets its number of bytes in "length" and whether it was
+// "mapped" (all of it; callers only search contents shorter than
+// INT_MAX bytes). Release the contents with `_free_contents`.
+static char empty_file[1] = {'\0'};
+static char * _file_contents(const int fd, size_t * length, int * mapped) {
+  struct stat info;
+  char * contents = NULL;
+  (*length) = 0;
+  (*mapped) = 0;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return NULL;
+  }
+  if (S_ISREG(info.st_mode)) {
+    (*length) = info.st_size;
+    if ((*length) == 0) {
+      contents = empty_file;
+    } else {
+      contents = mmap(NULL, (*length), PROT_READ, MAP_PRIVATE, fd, 0);
+      if (contents == MAP_FAILED) {
+        contents = NULL;
+      } else {
+        madvise(contents, (*length), MADV_SEQUENTIAL);
+        (*mapped) = 1;
+      }
+    }
+  }
+  if (contents == NULL) {
+    contents = _read_all(fd, (S_ISREG(info.st_mode)) ? info.st_size : 0, length);
+  }
+  close(fd); // (a mapping stays valid after the file is closed)
+  STATS(_stats_add(&_stats.files, 1);)
+  return contents;
+}
+
+
+// Release the contents of a file from `_file_contents`.
+static void _free_contents(char * contents, const size_t length, const int mapped) {
+  if (mapped) munmap(contents, length);
+  else if (contents != empty_file) free(contents);
+}
+
+
+// Copy a compiled program (without its DFA), so that another thread
+// can search with it. Returns NULL if memory could not be allocated.
+static struct compiled_regex * _copy_program(const struct compiled_regex * program) {
+  struct compiled_regex * copy = _alloc_program(program->n_tokens, program->n_groups,
+                                                program->n_patterns);
+  if (copy == NULL) return NULL;
+  const int n = (program->n_tokens > 0) ? program->n_tokens : 0;
+  const int g = ((program->n_tokens > 0) && (program->n_groups > 0)) ? program->n_groups : 0;
+  memcpy(copy+1, program+1, n*sizeof(struct regex_token) +
+         (2*n + program->n_patterns + 3*g)*sizeof(int) +
+         (3*n+2)*sizeof(char) + SET_BYTES*n);
+  copy->n_prefix = program->n_prefix;
+  copy->prefix = copy->tokens + (program->prefix - program->tokens);
+  copy->reverse = program->reverse;
+  copy->mode = program->mode;
+  copy->lines = program->lines;
+  copy->n_captures = program->n_captures;
+  copy->n_spans = program->n_spans;
+  return copy;
+}
+
+
+// Copy a program created by `compile` (or `compile_set`) for another
+// thread, see `_copy_program`.
+struct compiled_regex * copy_compiled(const struct compiled_regex * program) {
+  if (program == NULL) return NULL;
+  return _copy_program(program);
+}
+
+
+// One part of a file that is searched by its own thread.
+struct search_chunk {
+  struct compiled_regex * program; // program used by this thread
+  const char * contents; // the whole file
+  int length; // number of bytes in the file
+  int start; // index of the first character of the chunk (after a newline)
+  int stop; // index of the first character of the next chunk
+  int end; // index where the search stopped (nothing in progress)
+  int newlines; // number of newlines within [start, stop)
+  int max_matches; // most matches wanted (0 for all of them)
+  int * steps; // index of the character that found each match
+  struct found_matches found; // matches, lines counted from "start"
+};
+
+
+// Count the newlines in the first "n" bytes of "bytes", eight at a
+// time: a byte is a newline when its XOR with '\n' is zero, and it is
+// not zero when adding 0x7F to its low seven bits (or its own high
+// bit) sets the high bit.
+static int _newline_count(const char * bytes, const int n) {
+  const unsigned long long low = 0x7F7F7F7F7F7F7F7FULL;
+  const unsigned long long newlines = 0x0A0A0A0A0A0A0A0AULL;
+  int count = 0;
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    unsigned long long word;
+    memcpy(&word, bytes + i, 8);
+    word ^= newlines;
+    count += __builtin_popcountll(~(((word & low) + low) | word) & ~low);
+  }
+  for (; i < n; i++) count += (bytes[i] == '\n');
+  return count;
+}
+
+
+// Set the line of each match in "found" from index "first" on, the
+// line that holds its last character, counted from "line" at index
+// "at" of "contents" (matches are found in nearly sorted order).
+static void _found_lines(struct found_matches * found, const int first,
+                         const char * contents, int line, int at) {
+  for (int k = first; k < found->n; k++) {
+    int last = found->ends[k] - 1;
+    if (last < found->starts[k]) last = found->starts[k];
+    if (at < last) line += _newline_count(contents + at, last - at);
+    else           line -= _newline_count(contents + last, at - last);
+    at = last;
+    found->lines[k] = line;
+  }
+}
+
+
+// Set the range of lines that holds each match in "found" from index
+// "first" on, from the start of the line of its first character to the
+// end of the line of its last (see `_found_lines`), in "contents" with
+// "length" bytes. The last line that was found is checked first, so
+// many matches on one long line only look for its ends once.
+static void _found_line_ranges(struct found_matches * found, const int first,
+                               const char * contents, const int length) {
+  int line_start = 0; // the last line that was found (none before)
+  int line_end = -1;  // (the index of its newline, or "length")
+  for (int k = first; k < found->n; k++) {
+    // The first and last character of the match (an empty one is in
+    // the line of its start).
+    int last = (found->ends[k] > found->starts[k]) ? found->ends[k]-1 : found->starts[k];
+    if (last >= length) last = length-1;
+    if (last < 0) last = 0;
+    const int start = (found->starts[k] < last) ? found->starts[k] : last;
+    for (int e = 0; e < 2; e++) {
+      const int at = e ? last : start;
+      if ((at < line_start) || (at > line_end)) {
+        line_start = at;
+        while ((line_start > 0) && (contents[line_start-1] != '\n')) line_start--;
+        const char * newline = memchr(contents + at, '\n', length - at);
+        line_end = (newline != NULL) ? (int) (newline - contents) : length;
+      }
+      if (e) found->line_ends[k] = line_end;
+      else   found->line_starts[k] = line_start;
+    }
+  }
+}
+
+
+// Search one chunk, starting with nothing in progress at its start
+// and continuing past its stop until nothing is in progress again
+// (see `_search_from`, a program with COMPILE_LINES only searches the
+// lines of the chunk). Then set the line of each match relative to
+// the chunk start and count the newlines in the chunk.
+static void * _search_chunk(void * argument) {
+  struct search_chunk * chunk = (struct search_chunk *) argument;
+  const char * contents = chunk->contents;
+  struct found_matches * found = &(chunk->found);
+  void * memory = malloc(SIMULATE_BYTES(chunk->program->n_tokens));
+  // (The last chunk is searched to the end, including its end.)
+  const int stop = (chunk->stop < chunk->length) ? chunk->stop : INT_MAX;
+  chunk->end = (chunk->program->lines ? _search_lines : _search_from)
+    (chunk->program, contents, chunk->length, chunk->start, stop, chunk->max_matches, found, memory);
+  free(memory);
+  chunk->steps = malloc((found->n + 1) * sizeof(int));
+  if (found->n > 0) memcpy(chunk->steps, found->lines, found->n * sizeof(int));
+  _found_lines(found, 0, contents, 0, chunk->start);
+  chunk->newlines = _newline_count(contents + chunk->start, chunk->stop - chunk->start);
+  return NULL;
+}
+
+
+// Search "contents" (with "length" bytes) for all matches of a
+// compiled program with up to "n_chunks" threads, adding them (with
+// their line numbers) to "found" in the same order as one search of
+// the whole file. The file is split after newlines into chunks that
+// are searched independently from nothing in progress. When the search
+// of one chunk reaches the next chunk, it continues until nothing is
+// in progress (so matches that cross a boundary are found), then
+// every later match of the next chunk is the same as in one search.
+// Only programs where every pattern starts with ".*" reach that point
+// regardless of what came before, others (and those with a match
+// mode, where each match depends on the last) are searched in one
+// chunk, unless they search each line on its own (COMPILE_LINES).
+// With "max_matches" (nonzero), each chunk stops once it has that
+// many matches and only the first "max_matches" are kept. Returns 0,
+// or 1 if a chunk stopped before enough of its matches were kept
+// (some were also found by the chunk before it), then "found" is
+// incomplete and the contents must be searched in one pass.
+static int _search_chunks(struct compiled_regex * program, const char * contents,
+                          const int length, int n_chunks, const int max_matches,
+                          struct found_matches * found) {
+  for (int p = 0; (p < program->n_patterns) && (! program->lines); p++)
+    if (! _any_start(program, program->entries[p])) n_chunks = 1;
+  if (program->mode && (! program->lines)) n_chunks = 1;
+  if (n_chunks > length) n_chunks = length;
+  if (n_chunks < 1) n_chunks = 1;
+  struct search_chunk * chunks = calloc(n_chunks, sizeof(struct search_chunk));
+  pthread_t * threads = malloc(n_chunks * sizeof(pthread_t));
+  char * threaded = calloc(n_chunks, sizeof(char));
+  // Split the file after newlines, copy the program for each chunk
+  // (the first one uses the given program).
+  for (int c = 0; c < n_chunks; c++) {
+    struct search_chunk * chunk = chunks + c;
+    chunk->contents = contents;
+    chunk->length = length;
+    chunk->max_matches = max_matches;
+    chunk->start = (c == 0) ? 0 : chunks[c-1].stop;
+    chunk->stop = length;
+    if ((c+1 < n_chunks) && (chunk->start < length)) {
+      int middle = (int) (((long long) length * (c+1)) / n_chunks);
+      if (middle < chunk->start) middle = chunk->start;
+      const char * newline = memchr(contents + middle, '\n', length - middle);
+      if (newline != NULL) chunk->stop = (int) (newline - contents) + 1;
+    }
+    chunk->program = (c == 0) ? program : _copy_program(program);
+    // Make the previous chunk the last one when memory runs out.
+    if (chunk->program == NULL) {
+      chunks[c-1].stop = length;
+      n_chunks = c;
+    }
+  }
+  // Search every chunk after the first with its own thread (or with
+  // this thread if one cannot be started), then search the first.
+  for (int c = 1; c < n_chunks; c++) {
+    threaded[c] = (pthread_create(threads + c, NULL, _search_chunk, chunks + c) == 0);
+    if (! threaded[c]) _search_chunk(chunks + c);
+  }
+  _search_chunk(chunks);
+  for (int c = 1; c < n_chunks; c++) if (threaded[c]) pthread_join(threads[c], NULL);
+  // Keep the matches of each chunk that were found after the search
+  // of earlier chunks stopped, offset lines by the newlines before it.
+  int at = 0; // index in the file up to which matches have been kept
+  int line = 1; // line number at the start of the chunk
+  int incomplete = 0; // whether a chunk stopped before its matches were kept
+  const int n_kept = found->n + max_matches; // matches held by "found" when done
+  for (int c = 0; c < n_chunks; c++) {
+    struct search_chunk * chunk = chunks + c;
+    for (int k = 0; k < chunk->found.n; k++) {
+      if (max_matches && (found->n >= n_kept)) break;
+      if ((chunk->steps[k] >= at) && (chunk->steps[k] < chunk->end))
+        _found_append_captures(found, chunk->found.patterns[k], chunk->found.starts[k],
+                               chunk->found.ends[k], chunk->found.lines[k] + line,
+                               ((found->n_captures > 0) &&
+                                (chunk->found.n_captures == found->n_captures)) ?
+                               chunk->found.captures + 2*found->n_captures*k : NULL);
+    }
+    if (max_matches && (chunk->found.n >= max_matches)) incomplete = 1;
+    if (chunk->end > at) at = chunk->end;
+    line += chunk->newlines;
+    if (c > 0) free_compiled(chunk->program);
+    free(chunk->found.starts);
+    free(chunk->steps);
+  }
+  free(threaded);
+  free(threads);
+  free(chunks);
+  return incomplete && (found->n < n_kept);
+}
+
+
+// Count the ASCII characters (other than the null character) in the
+// first "n" bytes of "bytes", eight at a time: a byte is ASCII when
+// its high bit is clear, and it is not null when adding 0x7F to its
+// low seven bits sets the high bit.
+static int _ascii_count(const char * bytes, const int n) {
+  const unsigned long long low = 0x7F7F7F7F7F7F7F7FULL;
+  int count = 0;
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    unsigned long long word;
+    memcpy(&word, bytes + i, 8);
+    count += __builtin_popcountll(((word & low) + low) & ~word & ~low);
+  }
+  for (; i < n; i++) count += ((unsigned char) (bytes[i] - 1) < 127);
+  return count;
+}
+
+
+// Check whether the contents of a file look like binary, when too few
+// of the bytes at its start are ASCII characters (with a ratio of 0,
+// nothing is binary). Short files are never binary.
+static int _is_binary(const char * contents, const int length, float min_ascii_ratio) {
+  if ((length < MIN_SAMPLE_SIZE) || (min_ascii_ratio <= 0)) return 0;
+  const int sample = (length < ASCII_SAMPLE_SIZE) ? length : ASCII_SAMPLE_SIZE;
+  return (_ascii_count(contents, sample) < min_ascii_ratio * sample);
+}
+
+
+// Search the contents of a file for all matches of a compiled
+// program (only the first "max_matches" when that is nonzero), adding
+// them (with their line numbers) to "found". Large files are split
+// between up to "n_threads" threads. Returns 0 on success or -3 if
+// there are too few ASCII characters at the start of the file (then
+// nothing is searched).
+static int _search_contents(struct compiled_regex * program, const char * contents,
+                            const int length, float min_ascii_ratio, const int n_threads,
+                            const int max_matches, struct found_matches * found) {
+  // Exit early if the start of the file has too few ASCII characters.
+  if (_is_binary(contents, length, min_ascii_ratio)) {
+    STATS(_stats_add(&_stats.ascii_skips, 1);)
+    return -3;
+  }
+  // Search for all matches, give each thread at least one chunk size.
+  int n_chunks = length / PARALLEL_CHUNK_SIZE;
+  if (n_chunks > n_threads) n_chunks = n_threads;
+  const int n_before = found->n; // matches in "found" before this search
+  int searched = 0; // whether the chunks found every match
+  if (n_chunks > 1) {
+    searched = ! _search_chunks(program, contents, length, n_chunks, max_matches, found);
+    if (! searched) found->n = n_before; // (too few matches were kept, search in one pass)
+  }
+  if (! searched) {
+    _search(program, contents, length, max_matches ? n_before + max_matches : 0, found,
+            _scratch(SIMULATE_BYTES(program->n_tokens)));
+    _found_lines(found, n_before, contents, 1, 0);
+  }
+  _found_line_ranges(found, n_before, contents, length);
+  return 0;
+}
+
+
+// Get the number of threads used to search one large file (one per
+// processor that is online).
+static int _search_threads(void) {
+  const long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 1) ? (int) n : 1;
+}
+
+
+// Search the open file "fd" for all matches of a compiled program
+// (only the first "max_matches" when that is nonzero), adding them
+// (with their line numbers) to "found", using up to "n_threads"
+// threads for large files. Returns 0 on success, -2 if the
+// file could not be read, -3 if there are too few ASCII characters
+// at the start of the file, or -4 if it is too large to search (match
+// locations are integers, so INT_MAX bytes or more). The file is closed.
+static int _search_file(struct compiled_regex * program, const int fd,
+                        float min_ascii_ratio, const int n_threads,
+                        const int max_matches, struct found_matches * found) {
+  size_t length;
+  int mapped;
+  char * contents = _file_contents(fd, &length, &mapped);
+  if (contents == NULL) return -2;
+  if (length >= INT_MAX) {
+    _free_contents(contents, length, mapped);
+    return -4;
+  }
+  const int status = _search_contents(program, contents, (int) length, min_ascii_ratio,
+                                      n_threads, max_matches, found);
+  _free_contents(contents, length, mapped);
+  return status;
+}
+
+
+// Find all nonoverlapping matches of a compiled regular expression in
+// a file at a given path. Return arrays of the starts and ends of matches.
+void fmatcha_compiled(struct compiled_regex * program, const char * path,
+                      int * n, int ** starts, int ** ends, int ** lines,
+                      float min_ascii_ratio) {
+
+  // Open the file and handle any errors.
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    (*n) = -2;
+    return;
+  }
+
+  // Error mode, fewer than one token (no possible match).
+  (*n) = -1;
+  const int n_tokens = program->n_tokens;
+  if (n_tokens <= 0) {
+    close(fd);
+    (*starts) = malloc(2 * sizeof(int));
+    (*ends) = (*starts) + 1;
+    // Set the error flag and return.
+    if (n_tokens == 0) {
+      (*starts)[0] = EXIT_TOKEN;
+      (*ends)[0] = REGEX_NO_TOKENS_ERROR;
+    } else {
+      (*starts)[0] = n_tokens;
+      (*ends)[0] = program->n_groups;
+    }
+    return;
+  }
+
+  // Search the file for all matches.
+  struct found_matches found = {0};
+  (*n) = _search_file(program, fd, min_ascii_ratio, _search_threads(), 0, &found);
+
+  // Give the output arrays (they may have room for more matches).
+  if ((*n) == 0) {
+    (*n) = found.n;
+    (*starts) = found.starts;
+    (*ends) = found.ends;
+    (*lines) = found.lines;
+  } else {
+    free(found.starts);
+  }
+  return;
+}
+
+
+// Find all nonoverlapping matches of a regular expression in a file
+// at a given path. Return arrays of the starts and ends of matches.
+void fmatcha(const char * regex, const char * path,
+            int * n, int ** starts, int ** ends, int ** lines,
+                float min_ascii_ratio) {
+  struct compiled_regex * program = compile(regex);
+  fmatcha_compiled(program, path, n, starts, ends, lines, min_ascii_ratio);
+  free_compiled(program);
+}
+
+
+// Find the first match of any of the regular expressions in a program
+// made by `compile_set`. Same as `match_compiled`, and also gives the
+// index of the regular expression that matched in "pattern" (or of
+// the invalid regular expression when there is an error).
+void match_set(struct compiled_regex * program, const char * string,
+               int * pattern, int * start, int * end) {
+  _match(program, string, -1, pattern, start, end, NULL, NULL);
+}
+
+
+// Same as `match_set`, for the "length" bytes in "buffer".
+void match_setn(struct compiled_regex * program, const char * buffer,
+                const size_t length, int * pattern, int * start, int * end) {
+  _match(program, buffer, _buffer_length(length), pattern, start, end, NULL, NULL);
+}
+
+
+// Find all nonoverlapping matches of any of the regular expressions
+// in a program made by `compile_set`. Same as `matcha_compiled`, and
+// also gives the index of the regular expression of each match.
+void matcha_set(struct compiled_regex * program, const char * string,
+                int * n, int ** patterns, int ** starts, int ** ends) {
+  _matcha(program, string, -1, n, patterns, starts, ends);
+}
+
+
+// Same as `matcha_set`, for the "length" bytes in "buffer".
+void matcha_setn(struct compiled_regex * program, const char * buffer,
+                 const size_t length, int * n, int ** patterns,
+                 int ** starts, int ** ends) {
+  _matcha(program, buffer, _buffer_length(length), n, patterns, starts, ends);
+}
+
+
+// Find all nonoverlapping matches of any of the regular expressions
+// in a program made by `compile_set` in a file at a given path. Same
+// as `fmatcha_compiled`, and also gives the index of the regular
+// expression of each match. The file is only read once.
+void fmatcha_set(struct compiled_regex * program, const char * path,
+                 int * n, int ** patterns, int ** starts, int ** ends,
+                 int ** lines, float min_ascii_ratio) {
+  // Open the file and handle any errors.
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    (*n) = -2;
+    return;
+  }
+  // Error mode, fewer than one token (no possible match).
+  if (program->n_tokens <= 0) {
+    close(fd);
+    (*n) = -1;
+    _set_error(program, patterns, starts, ends);
+    return;
+  }
+  // Search the file for all matches.
+  struct found_matches found = {0};
+  (*n) = _search_file(program, fd, min_ascii_ratio, _search_threads(), 0, &found);
+  if ((*n) == 0) {
+    (*n) = found.n;
+    (*patterns) = found.patterns;
+    (*starts) = found.starts;
+    (*ends) = found.ends;
+    (*lines) = found.lines;
+  } else {
+    free(found.starts);
+  }
+}
+
+
+// Find the nonoverlapping matches of a compiled program (from
+// `compile` or `compile_set`) in the "length" bytes of "buffer",
+// replacing the contents of the caller owned arena "results" (its
+// arrays are reused, and only grow when there are more matches than
+// ever before). The search stops as soon as it has found (the first)
+// "max_matches" matches when that is nonzero, so a limit of 1 only
+// checks whether there is any match. Returns the number of matches,
+// -1 if the program is invalid, -2 if the buffer is empty, or -3 if
+// it has INT_MAX bytes or more (match locations are integers).
+int matcha_limit(struct compiled_regex * program, const char * buffer,
+                 const size_t length, const int max_matches,
+                 struct found_matches * results) {
+  results->n = 0;
+  _found_captures(results, (program->n_tokens > 0) ? program->n_captures : 0);
+  if (length == 0) return -2;
+  if (length >= INT_MAX) return -3;
+  if (program->n_tokens <= 0) return -1;
+  _search(program, buffer, _buffer_length(length), max_matches, results,
+          _scratch(SIMULATE_BYTES(program->n_tokens)));
+  return results->n;
+}
+
+
+// Find all nonoverlapping matches in a buffer (see `matcha_limit`).
+int matcha_into(struct compiled_regex * program, const char * buffer,
+                const size_t length, struct found_matches * results) {
+  return matcha_limit(program, buffer, length, 0, results);
+}
+
+
+// Same as `matcha_limit` for the file at "path", also setting the
+// line of each match (the rest of the file is not read once the limit
+// is reached). Returns the number of matches, -1 if the program is
+// invalid, -2 if the file could not be read, -3 if there are too
+// few ASCII characters at the start of the file, or -4 if the file is
+// too large (INT_MAX bytes or more).
+int fmatcha_limit(struct compiled_regex * program, const char * path,
+                  float min_ascii_ratio, const int max_matches,
+                  struct found_matches * results) {
+  results->n = 0;
+  _found_captures(results, (program->n_tokens > 0) ? program->n_captures : 0);
+  if (program->n_tokens <= 0) return -1;
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return -2;
+  const int status = _search_file(program, fd, min_ascii_ratio, _search_threads(),
+                                  max_matches, results);
+  if (status < 0) results->n = 0;
+  return (status < 0) ? status : results->n;
+}
+
+
+// Find all nonoverlapping matches in a file (see `fmatcha_limit`).
+int fmatcha_into(struct compiled_regex * program, const char * path,
+                 float min_ascii_ratio, struct found_matches * results) {
+  return fmatcha_limit(program, path, min_ascii_ratio, 0, results);
+}
+
+
+// Release the arrays held by a results arena, leaving it empty (and
+// ready to be used again).
+void free_results(struct found_matches * results) {
+  free(results->starts);
+  (*results) = (struct found_matches) {0};
+}
+
+
+// The rows of one thread of `match_batch_threads`.
+struct batch_rows {
+  struct compiled_regex * program; // program used by this thread
+  const char ** strings; // all rows
+  const size_t * lengths; // bytes in each row (NULL if null-terminated)
+  int first; // index of the first row of this thread
+  int last; // index after the last row of this thread
+  int * patterns; // index of the regex that matched each row (or NULL)
+  int * starts; // start of the first match in each row
+  int * ends; // end of the first match in each row
+};
+
+
+// Search the rows of one thread (see `match_batch_threads`).
+static void * _batch_match(void * argument) {
+  struct batch_rows * rows = (struct batch_rows *) argument;
+  void * memory = malloc(SIMULATE_BYTES((rows->program->n_tokens > 0) ? rows->program->n_tokens : 0));
+  for (int k = rows->first; k < rows->last; k++) {
+    const int length = (rows->lengths == NULL) ? -1 : _buffer_length(rows->lengths[k]);
+    _match(rows->program, rows->strings[k], length,
+           (rows->patterns == NULL) ? NULL : rows->patterns + k,
+           rows->starts + k, rows->ends + k, memory, NULL);
+  }
+  free(memory);
+  return NULL;
+}
+
+
+// Find the first match of a compiled program in each of "n" rows,
+// "strings[k]" with "lengths[k]" bytes (or null-terminated when
+// "lengths" is NULL), setting "starts[k]" and "ends[k]" the same way
+// as `match_compiledn` does (and "patterns[k]" as `match_setn` does,
+// unless "patterns" is NULL). The rows are split between "n_threads"
+// threads (one per processor when 0), each with its own copy of the
+// program, when there are at least BATCH_THREAD_ROWS per thread.
+void match_batch_threads(struct compiled_regex * program, const char ** strings,
+                         const size_t * lengths, const int n, int n_threads,
+                         int * patterns, int * starts, int * ends) {
+  if (n_threads <= 0) n_threads = _search_threads();
+  if (n_threads > n / BATCH_THREAD_ROWS) n_threads = n / BATCH_THREAD_ROWS;
+  if (n_threads < 1) n_threads = 1;
+  struct batch_rows * rows = malloc(n_threads * sizeof(struct batch_rows));
+  pthread_t * threads = malloc(n_threads * sizeof(pthread_t));
+  int * started = malloc(n_threads * sizeof(int));
+  for (int t = 0; t < n_threads; t++) {
+    rows[t] = (struct batch_rows) {program, strings, lengths, (int) ((long long) n * t / n_threads),
+                                    (int) ((long long) n * (t+1) / n_threads), patterns, starts, ends};
+    // The first thread is this one, the others use copies (or this
+    // thread too, when a copy or a thread could not be made).
+    started[t] = 0;
+    if (t == 0) continue;
+    rows[t].program = _copy_program(program);
+    if (rows[t].program == NULL) rows[t].program = program;
+    else started[t] = (pthread_create(threads + t, NULL, _batch_match, rows + t) == 0);
+  }
+  _batch_match(rows);
+  for (int t = 1; t < n_threads; t++) {
+    if (started[t]) pthread_join(threads[t], NULL);
+    else _batch_match(rows + t);
+    if (rows[t].program != program) free_compiled(rows[t].program);
+  }
+  free(started);
+  free(threads);
+  free(rows);
+}
+
+
+// Find the first match in each of "n" rows with one thread (see
+// `match_batch_threads`).
+void match_batch(struct compiled_regex * program, const char ** strings,
+                 const size_t * lengths, const int n, int * starts, int * ends) {
+  match_batch_threads(program, strings, lengths, n, 1, NULL, starts, ends);
+}
+
+
+// ___________________________________________________________________
+//                             Streaming
+//
+//  A stream searches input that arrives in pieces (from a pipe or a
+//  socket) with the token simulation, keeping the active tokens and
+//  their match starts between pieces, so memory does not grow with
+//  the input. Matches are given to a callback as soon as they end,
+//  with offsets counted from the start of the stream. They are the
+//  same matches `matcha` finds in all of the input at once (except
+//  that a null character is an ordinary byte in a stream).
+
+#define STREAM_REBASE 1073741824
+//      ^^ 2^30, index at which stream indices are shifted back to zero
+
+// Function given every match found in a stream, with the "data"
+// pointer given to `stream_feed` or `stream_finish`.
+typedef void (*stream_callback)(void * data, int pattern, long long start, long long end);
+
+struct regex_stream {
+  const struct compiled_regex * program; // the searched program (not owned)
+  struct simulation state; // active tokens after the last character
+  struct found_matches found; // matches not yet given to the callback
+  long long base; // stream offset of index 0 in the simulation
+  long long * far; // stream offsets of the indices below "n_far" (see `_stream_rebase`)
+  int n_far; // number of indices that stand for a (far back) offset in "far"
+  int i; // index of the next character in the simulation
+  int prev; // the last character fed (EOF before the first, for anchors)
+  int skip; // nonzero if characters before the prefix can be skipped when idle
+  int done; // nonzero once no tokens are active (nothing more can match)
+};
+
+
+// Get the stream offset of index "i" of the simulation of a stream.
+static inline long long _stream_offset(const struct regex_stream * stream, const int i) {
+  return (i < stream->n_far) ? stream->far[i] : stream->base + i;
+}
+
+
+// Compare two indices (for sorting).
+static int _stream_compare(const void * a, const void * b) {
+  return (*(const int *) a > *(const int *) b) - (*(const int *) a < *(const int *) b);
+}
+
+
+// Get the index "value" moves to when a stream is shifted back by
+// "shift", where the sorted "n_below" indices of "below" become the
+// first ones (and the others follow them).
+static inline int _stream_move(const int value, const int shift,
+                               const int * below, const int n_below) {
+  if (value < 0) return value;
+  if (value >= shift) return value - shift + n_below;
+  int low = 0, high = n_below - 1;
+  while (low < high) {
+    const int middle = (low + high) / 2;
+    if (below[middle] < value) low = middle + 1;
+    else high = middle;
+  }
+  return low;
+}
+
+
+// Shift all indices held by the simulation of a stream back toward
+// zero, so that they fit in an int. Indices of matches in progress
+// (or pending, see `_simulate_select`) for more than "keep"
+// characters (STREAM_REBASE/2 when feeding) are given the first few indices (in the same order, so
+// the simulation compares them the same) and their stream offsets are
+// kept in "far". Only if that memory can not be allocated are their
+// starts clamped to the oldest index that is kept.
+static void _stream_rebase(struct regex_stream * stream, const int keep) {
+  const int n_tokens = stream->program->n_tokens;
+  struct simulation * state = &(stream->state);
+  struct found_matches * found = &(stream->found);
+  int shift = stream->i;
+  for (int j = 0; j < n_tokens; j++)
+    if ((state->active[j] >= 0) && (state->active[j] < shift)) shift = state->active[j];
+  for (int k = 0; k < found->n; k++) if (found->starts[k] < shift) shift = found->starts[k];
+  if ((state->floor >= 0) && (state->floor < shift)) shift = state->floor;
+  if (stream->i - shift > keep) shift = stream->i - keep;
+  int * marks[4] = {&(state->floor), &(state->last), &(state->cut_start), &(state->cut_end)};
+  // Gather the distinct indices below "shift" (in ascending order).
+  int * below = malloc((3*n_tokens + 2*found->n + 4) * sizeof(int));
+  int n_below = 0;
+  if (below != NULL) {
+    for (int j = 0; j < n_tokens; j++) {
+      const int values[3] = {state->active[j], state->nactive[j], state->checked[j].val};
+      for (int v = 0; v < 3; v++)
+        if ((values[v] >= 0) && (values[v] < shift)) below[n_below++] = values[v];
+    }
+    for (int k = 0; k < found->n; k++) {
+      if (found->starts[k] < shift) below[n_below++] = found->starts[k];
+      if (found->ends[k] < shift) below[n_below++] = found->ends[k];
+    }
+    for (int m = 0; m < 4; m++)
+      if ((*(marks[m]) >= 0) && (*(marks[m]) < shift)) below[n_below++] = *(marks[m]);
+    qsort(below, n_below, sizeof(int), _stream_compare);
+    int n = 0;
+    for (int b = 0; b < n_below; b++) if ((n == 0) || (below[b] != below[n-1])) below[n++] = below[b];
+    n_below = n;
+  }
+  long long * far = (n_below > 0) ? malloc(n_below * sizeof(long long)) : NULL;
+  if (far == NULL) n_below = 0;
+  for (int b = 0; b < n_below; b++) far[b] = _stream_offset(stream, below[b]);
+  // Move every index (those below "shift" to the first few).
+  for (int j = 0; j < n_tokens; j++) {
+    state->active[j] = _stream_move(state->active[j], shift, below, n_below);
+    state->nactive[j] = _stream_move(state->nactive[j], shift, below, n_below);
+    struct token_check * check = state->checked + j;
+    check->val = _stream_move(check->val, shift, below, n_below);
+    if (check->step >= 0) check->step = (check->step >= shift) ? check->step - shift + n_below : EXIT_TOKEN;
+  }
+  for (int k = 0; k < found->n; k++) {
+    found->starts[k] = _stream_move(found->starts[k], shift, below, n_below);
+    found->ends[k] = _stream_move(found->ends[k], shift, below, n_below);
+  }
+  for (int m = 0; m < 4; m++) *(marks[m]) = _stream_move(*(marks[m]), shift, below, n_below);
+  free(below);
+  free(stream->far);
+  stream->far = far;
+  stream->n_far = n_below;
+  stream->base += shift - n_below;
+  stream->i -= shift - n_below;
+}
+
+
+// Give all matches kept so far in a stream to the callback (the
+// pending ones stay, see `_simulate_select`).
+static void _stream_report(struct regex_stream * stream,
+                           stream_callback callback, void * data) {
+  struct found_matches * found = &(stream->found);
+  const int kept = stream->state.kept;
+  if (callback != NULL) {
+    for (int k = 0; k < kept; k++)
+      callback(data, found->patterns[k], _stream_offset(stream, found->starts[k]),
+               _stream_offset(stream, found->ends[k]));
+  }
+  for (int k = kept; k < found->n; k++) {
+    found->starts[k-kept] = found->starts[k];
+    found->ends[k-kept] = found->ends[k];
+    found->lines[k-kept] = found->lines[k];
+    found->patterns[k-kept] = found->patterns[k];
+  }
+  found->n -= kept;
+  stream->state.kept = 0;
+}
+
+
+// Start a stream that searches for the matches of a compiled program
+// (from `compile` or `compile_set`), the program must outlive the
+// stream. Returns NULL if the program is invalid or out of memory.
+struct regex_stream * stream_init(const struct compiled_regex * program) {
+  if ((program == NULL) || (program->n_tokens <= 0)) return NULL;
+  struct regex_stream * stream = malloc(sizeof(struct regex_stream) +
+                                        SIMULATE_BYTES(program->n_tokens));
+  if (stream == NULL) return NULL;
+  stream->program = program;
+  _simulate_init(program, stream+1, 0, &(stream->state));
+  stream->found = (struct found_matches) {0};
+  stream->base = 0;
+  stream->far = NULL;
+  stream->n_far = 0;
+  stream->i = 0;
+  stream->prev = EOF;
+  stream->done = 0;
+  // While nothing is in progress, characters other than the first of
+  // the literal prefix leave only the first tokens active.
+  stream->skip = (program->n_prefix > 0);
+  for (int p = 0; p < program->n_patterns; p++)
+    if (! _any_start(program, program->entries[p])) stream->skip = 0;
+  return stream;
+}
+
+
+// Search the next "length" bytes of a stream in "buffer", giving
+// each match that ends within them to "callback" (with "data").
+void stream_feed(struct regex_stream * stream, const char * buffer, int length,
+                 stream_callback callback, void * data) {
+  const struct compiled_regex * program = stream->program;
+  int k = 0; // index in buffer
+  while ((k < length) && (! stream->done)) {
+    if (stream->i >= STREAM_REBASE) _stream_rebase(stream, STREAM_REBASE/2);
+    // Skip to the next character that could start a match.
+    if (stream->skip && _simulate_idle(program, &(stream->state))) {
+      const int limit = ((length - k) < STREAM_REBASE/2) ? (length - k) : STREAM_REBASE/2;
+      const char * next = memchr(buffer + k, program->prefix[0], limit);
+      const int skipped = (next == NULL) ? limit : (int) (next - (buffer + k));
+      stream->i += skipped;
+      k += skipped;
+      if (skipped > 0) stream->prev = (unsigned char) buffer[k-1];
+      if (next == NULL) continue;
+    }
+    _simulate_step(program, &(stream->state), stream->prev, (unsigned char) buffer[k],
+                   stream->i, 0, &(stream->found));
+    stream->done = (stream->state.ics < 0);
+    _simulate_select(program, &(stream->state), &(stream->found), stream->i, stream->done);
+    stream->prev = (unsigned char) buffer[k];
+    stream->i++;
+    k++;
+    if (stream->state.kept > 0) _stream_report(stream, callback, data);
+  }
+  STATS(_stats_flush(&(stream->state));)
+}
+
+
+// End a stream, giving the matches that end with the stream to
+// "callback" (with "data"), and release its memory.
+void stream_finish(struct regex_stream * stream, stream_callback callback, void * data) {
+  if (stream == NULL) return;
+  if (! stream->done) {
+    _simulate_step(stream->program, &(stream->state), stream->prev, EOF,
+                   stream->i, 0, &(stream->found));
+    _simulate_select(stream->program, &(stream->state), &(stream->found), stream->i, 1);
+    _stream_report(stream, callback, data);
+    STATS(_stats_flush(&(stream->state));)
+  }
+  free(stream->found.starts);
+  free(stream->far);
+  free(stream);
+}
+
+
+// ___________________________________________________________________
+//                           Directory walk
+//
+//  A walk lists the files below a directory the way the searches of
+//  `frex` see them: links to files are followed, links to directories
+//  are not. The type of each entry comes from the directory listing,
+//  only links and entries of an unknown type are checked with `lstat`
+//  (and files with `stat` when there is a size limit). With
+//  WALK_IGNORE, the ".gitignore" and ".ignore" files of each directory
+//  pass over the paths that their rules match (as git does, the last
+//  matching rule wins, the rules of deeper directories before those
+//  above them), and ignored directories and ".git" are never opened.
+
+#define WALK_RECURSIVE 1
+//      ^^ flag for `walk_files`, list the files of all subdirectories too
+#define WALK_IGNORE 2
+//      ^^ flag for `walk_files`, pass over ".git" and the paths matched by ignore files
+#define WALK_STACK_SIZE 64
+//      ^^ initial number of directories held by the stack of a walk
+#define IGNORE_NEGATE 1
+//      ^^ an ignore rule that starts with '!', it keeps the paths it matches
+#define IGNORE_DIRECTORY 2
+//      ^^ an ignore rule that ends with '/', it only matches directories
+#define IGNORE_PATH 4
+//      ^^ an ignore rule with a '/', it matches the path below its directory (not the name)
+
+// The rules of the ignore files of one directory, and of the ones above.
+struct ignore_rules {
+  const struct ignore_rules * parent; // rules of the directories above (NULL at the top)
+  struct ignore_rules * next; // rules read before these by the same walk (to release them)
+  size_t base; // length of the path of the directory that holds the ignore files
+  int n_rules;
+  char ** globs; // the pattern of each rule (null-terminated, within "text")
+  char * flags;  // IGNORE_NEGATE, IGNORE_DIRECTORY, and IGNORE_PATH of each rule
+  char * text;   // the contents of the ignore files
+};
+
+
+// Check whether the glob (ignore rule) "glob" matches all of "text".
+// A '*' matches any characters but '/', "**" matches any characters,
+// "**/" any directories (or none), a '?' any character but '/', and
+// "[...]" (or "[!...]", "[^...]" for NOT) any listed character (with
+// ranges like "a-z"). A '\' makes the next character a literal.
+static int _glob_match(const char * glob, const char * text) {
+  while (*glob != '\0') {
+    if ((glob[0] == '*') && (glob[1] == '*')) {
+      glob += 2;
+      if (*glob == '/') {
+        glob++;
+        for (const char * t = text; t != NULL; t = strchr(t, '/'), t = (t == NULL) ? NULL : t+1)
+          if (_glob_match(glob, t)) return 1;
+        return 0;
+      }
+      for (const char * t = text; ; t++) {
+        if (_glob_match(glob, t)) return 1;
+        if (*t == '\0') return 0;
+      }
+    }
+    if (*glob == '*') {
+      glob++;
+      for (const char * t = text; ; t++) {
+        if (_glob_match(glob, t)) return 1;
+        if ((*t == '\0') || (*t == '/')) return 0;
+      }
+    }
+    if (*text == '\0') return 0;
+    if (*glob == '?') {
+      if (*text == '/') return 0;
+    } else if ((*glob == '[') && (strchr(glob+1, ']') != NULL)) {
+      const unsigned char c = *text;
+      const char * g = glob + 1;
+      const int negate = ((*g == '!') || (*g == '^'));
+      if (negate) g++;
+      int in = 0;
+      do {
+        if ((*g == '\\') && (g[1] != '\0')) g++;
+        const unsigned char low = *g;
+        unsigned char high = low;
+        if ((g[1] == '-') && (g[2] != ']') && (g[2] != '\0')) {
+          g += 2;
+          if ((*g == '\\') && (g[1] != '\0')) g++;
+          high = *g;
+        }
+        in |= ((c >= low) && (c <= high));
+        g++;
+      } while ((*g != ']') && (*g != '\0'));
+      if ((*g == '\0') || (in == negate) || (c == '/')) return 0;
+      glob = g;
+    } else {
+      if ((*glob == '\\') && (glob[1] != '\0')) glob++;
+      if (*glob != *text) return 0;
+    }
+    glob++;
+    text++;
+  }
+  return (*text == '\0');
+}
+
+
+// Read the ignore files of the directory "path" (with "length"
+// bytes), for the rules over "parent". Returns NULL if there are no
+// rules (then the rules of "parent" hold for the directory), otherwise
+// rules to release with `_ignore_free`.
+static struct ignore_rules * _ignore_read(const char * path, const size_t length,
+                                          const struct ignore_rules * parent) {
+  const char * names[2] = {".gitignore", ".ignore"};
+  char * text = NULL;
+  size_t n_text = 0;
+  char * file_path = malloc(length + 12);
+  if (file_path == NULL) return NULL;
+  memcpy(file_path, path, length);
+  file_path[length] = '/';
+  for (int k = 0; k < 2; k++) {
+    strcpy(file_path + length + 1, names[k]);
+    const int fd = open(file_path, O_RDONLY);
+    if (fd < 0) continue;
+    size_t n;
+    char * contents = _read_all(fd, 0, &n);
+    close(fd);
+    if (contents == NULL) continue;
+    char * more = realloc(text, n_text + n + 2);
+    if (more != NULL) {
+      text = more;
+      memcpy(text + n_text, contents, n);
+      n_text += n;
+      text[n_text++] = '\n'; // (a file may not end with a newline)
+    }
+    free(contents);
+  }
+  free(file_path);
+  if (text == NULL) return NULL;
+  text[n_text] = '\0';
+  // Cut the text into one rule per line (at most one per newline).
+  int n_lines = 0;
+  for (size_t i = 0; i < n_text; i++) n_lines += (text[i] == '\n');
+  struct ignore_rules * rules = malloc(sizeof(struct ignore_rules) + n_lines*(sizeof(char *) + 1));
+  if (rules == NULL) {
+    free(text);
+    return NULL;
+  }
+  rules->parent = parent;
+  rules->next = NULL;
+  rules->base = length;
+  rules->n_rules = 0;
+  rules->globs = (char **) (rules + 1);
+  rules->flags = (char *) (rules->globs + n_lines);
+  rules->text = text;
+  for (char * line = text, * end; (end = strchr(line, '\n')) != NULL; line = end+1) {
+    (*end) = '\0';
+    // Drop trailing whitespace (unless it is escaped), comments, and empty lines.
+    char * last = end;
+    while ((last > line) && ((last[-1] == '\r') || ((last[-1] == ' ') &&
+                                                    ((last-1 == line) || (last[-2] != '\\'))))) last--;
+    (*last) = '\0';
+    if ((*line == '\0') || (*line == '#')) continue;
+    char flags = 0;
+    char * glob = line;
+    if (*glob == '!') {
+      flags |= IGNORE_NEGATE;
+      glob++;
+    } else if ((glob[0] == '\\') && ((glob[1] == '!') || (glob[1] == '#'))) glob++;
+    if ((last > glob) && (last[-1] == '/')) {
+      flags |= IGNORE_DIRECTORY;
+      (*--last) = '\0';
+    }
+    if (strchr(glob, '/') != NULL) {
+      flags |= IGNORE_PATH;
+      if (*glob == '/') glob++;
+    }
+    if (*glob == '\0') continue;
+    rules->globs[rules->n_rules] = glob;
+    rules->flags[rules->n_rules] = flags;
+    rules->n_rules++;
+  }
+  return rules;
+}
+
+
+// Release all rules in the list that starts at "rules" (see "next").
+static void _ignore_free(struct ignore_rules * rules) {
+  while (rules != NULL) {
+    struct ignore_rules * next = rules->next;
+    free(rules->text);
+    free(rules);
+    rules = next;
+  }
+}
+
+
+// Check whether the path "path" (at "name") below the directories of
+// "rules" is ignored by them.
+static int _ignore_match(const struct ignore_rules * rules, const char * path,
+                         const char * name, const int is_directory) {
+  for (; rules != NULL; rules = rules->parent) {
+    const char * relative = path + rules->base + 1;
+    for (int k = rules->n_rules-1; k >= 0; k--) {
+      const char flags = rules->flags[k];
+      if ((flags & IGNORE_DIRECTORY) && (! is_directory)) continue;
+      if (_glob_match(rules->globs[k], (flags & IGNORE_PATH) ? relative : name))
+        return ! (flags & IGNORE_NEGATE);
+    }
+  }
+  return 0;
+}
+
+
+// Get what a walk (with "flags", see `walk_files`) does with the
+// entry "entry" of a directory listing at "path", under the ignore
+// "rules" of its directory: 2 to walk it (a directory), 1 to list it
+// (a file), or 0 to pass over it. Files over "max_bytes" are passed
+// over unless it is 0.
+static int _walk_kind(const char * path, const struct dirent * entry, const int flags,
+                      const long long max_bytes, const struct ignore_rules * rules) {
+  const char * name = entry->d_name;
+  if ((name[0] == '.') && ((name[1] == '\0') || ((name[1] == '.') && (name[2] == '\0'))))
+    return 0;
+  struct stat info;
+  int is_directory = 0;
+  int is_file = 0;
+  int stated = 0;
+  #ifdef DT_UNKNOWN
+  is_directory = (entry->d_type == DT_DIR);
+  is_file = (entry->d_type == DT_REG);
+  #endif
+  if ((! is_directory) && (! is_file)) {
+    if (lstat(path, &info) != 0) return 0;
+    stated = 1;
+    if (S_ISDIR(info.st_mode)) is_directory = 1;
+    else if (S_ISREG(info.st_mode)) is_file = 1;
+    else if (S_ISLNK(info.st_mode) && (stat(path, &info) == 0)) is_file = S_ISREG(info.st_mode);
+  }
+  if (is_directory) {
+    if (! (flags & WALK_RECURSIVE)) return 0;
+    if ((flags & WALK_IGNORE) && ((strcmp(name, ".git") == 0) ||
+                                  _ignore_match(rules, path, name, 1))) return 0;
+    return 2;
+  }
+  if (! is_file) return 0;
+  if ((flags & WALK_IGNORE) && _ignore_match(rules, path, name, 0)) return 0;
+  if ((max_bytes > 0) && (((! stated) && (stat(path, &info) != 0)) || (info.st_size > max_bytes)))
+    return 0;
+  return 1;
+}
+
+
+// Join the directory "path" (with "length" bytes) and the "name" of
+// an entry in it as a new path (release with `free`).
+static char * _walk_join(const char * path, const size_t length, const char * name) {
+  const size_t name_length = strlen(name);
+  char * child = malloc(length + name_length + 2);
+  if (child == NULL) return NULL;
+  memcpy(child, path, length);
+  child[length] = '/';
+  memcpy(child + length + 1, name, name_length + 1);
+  return child;
+}
+
+
+// List every file below the directory "root" (see `_walk_kind`). Sets
+// "paths" to all of their paths (each null-terminated, starting with
+// "root" and a '/', release with `free_paths`) and "n_bytes" to their
+// total length. With WALK_RECURSIVE in "flags" all subdirectories are
+// listed too (depth first), and with WALK_IGNORE the paths matched by
+// ignore files are not (see the section above). Files over "max_bytes"
+// are not listed, unless it is 0. Returns the number of files, or -1
+// if memory could not be allocated.
+int walk_files(const char * root, const int flags, const long long max_bytes,
+               char ** paths, long long * n_bytes) {
+  struct walk_directory { char * path; const struct ignore_rules * rules; };
+  int n_stack = 1;
+  int s_stack = WALK_STACK_SIZE;
+  struct walk_directory * stack = malloc(s_stack * sizeof(struct walk_directory));
+  struct ignore_rules * made = NULL; // every ignore rules read (to release them)
+  size_t s_paths = READ_BUFFER_SIZE;
+  (*paths) = malloc(s_paths);
+  (*n_bytes) = 0;
+  int n_files = 0;
+  if ((stack == NULL) || ((*paths) == NULL)) n_files = -1;
+  else stack[0] = (struct walk_directory) {strdup(root), NULL};
+  while ((n_files >= 0) && (n_stack > 0)) {
+    struct walk_directory top = stack[--n_stack];
+    DIR * directory = (top.path == NULL) ? NULL : opendir(top.path);
+    const size_t length = (top.path == NULL) ? 0 : strlen(top.path);
+    const struct ignore_rules * rules = top.rules;
+    if ((directory != NULL) && (flags & WALK_IGNORE)) {
+      struct ignore_rules * read = _ignore_read(top.path, length, rules);
+      if (read != NULL) {
+        read->next = made;
+        made = read;
+        rules = read;
+      }
+    }
+    // List the files of this directory, then walk its subdirectories
+    // in the order they were listed.
+    const int first = n_stack;
+    struct dirent * entry;
+    while ((directory != NULL) && (n_files >= 0) && ((entry = readdir(directory)) != NULL)) {
+      char * child = _walk_join(top.path, length, entry->d_name);
+      int kind = (child == NULL) ? -1 : _walk_kind(child, entry, flags, max_bytes, rules);
+      if ((kind == 2) && (n_stack == s_stack)) {
+        struct walk_directory * more = realloc(stack, 2*s_stack*sizeof(struct walk_directory));
+        if (more == NULL) kind = -1;
+        else {
+          stack = more;
+          s_stack = 2*s_stack;
+        }
+      }
+      if (kind == 2) {
+        stack[n_stack++] = (struct walk_directory) {child, rules};
+        continue;
+      } else if (kind == 1) {
+        const size_t bytes = length + 1 + strlen(entry->d_name) + 1;
+        if ((*n_bytes) + bytes > s_paths) {
+          while ((*n_bytes) + bytes > s_paths) s_paths = 2*s_paths;
+          char * more = realloc(*paths, s_paths);
+          if (more == NULL) kind = -1;
+          else (*paths) = more;
+        }
+        if (kind == 1) {
+          memcpy((*paths) + (*n_bytes), child, bytes);
+          (*n_bytes) += bytes;
+          n_files++;
+        }
+      }
+      if (kind < 0) n_files = -1;
+      free(child);
+    }
+    for (int a = first, b = n_stack-1; a < b; a++, b--) {
+      const struct walk_directory swap = stack[a];
+      stack[a] = stack[b];
+      stack[b] = swap;
+    }
+    if (directory != NULL) closedir(directory);
+    free(top.path);
+  }
+  for (int k = 0; k < n_stack; k++) free(stack[k].path);
+  free(stack);
+  _ignore_free(made);
+  if (n_files < 0) {
+    free(*paths);
+    (*paths) = NULL;
+    (*n_bytes) = 0;
+  }
+  return n_files;
+}
+
+
+// Release the paths given by `walk_files`.
+void free_paths(char * paths) {
+  free(paths);
+}
+
+
+// ___________________________________________________________________
+//                           Trigram index
+//
+//  An index of the three byte sequences (trigrams, with ASCII letters
+//  in lower case) held by each file of a tree, so repeated searches
+//  of the same tree only read the files that can hold a match. Every
+//  match must contain the literal runs of tokens that all paths
+//  through a pattern pass (its literal factors), so a file that lacks
+//  one of their trigrams is passed over. The index is one file, laid
+//  out to be mapped into memory and read in place:
+//
+//     struct index_header header
+//     long long stamps[2*n_files]  -- modification time (ns) and size
+//     int counts[n_files]          -- trigrams of each file (-1 if it
+//                                     was not indexed, always searched)
+//     int trigrams[n_trigrams]     -- every trigram held, ascending
+//     int offsets[n_trigrams+1]    -- first posting of each trigram
+//     int postings[n_postings]     -- files holding each trigram, ascending
+//     char paths[n_path_bytes]     -- null-terminated path of each file
+//
+//  Files are numbered in the order they were given to `index_build`.
+
+#define INDEX_VERSION 1
+//      ^^ version of the index layout, an index of any other version is not read
+#define INDEX_MAX_BYTES 67108864
+//      ^^ 2^26, files larger than this are not indexed (they are always searched)
+#define INDEX_BINARY_BYTES 4096
+//      ^^ files with a null character in this many first bytes are not indexed
+#define INDEX_MAX_QUERY 256
+//      ^^ most trigrams looked up for one pattern (the rest are not checked)
+#define INDEX_TRIGRAMS 16777216
+//      ^^ 2^24, number of possible trigrams
+#define INDEX_TRIGRAM(a, b, c) ((tolower(a) << 16) | (tolower(b) << 8) | tolower(c))
+
+struct index_header {
+  char magic[4]; // "RXTI"
+  int version; // INDEX_VERSION
+  int n_files; // files in the index
+  int n_trigrams; // distinct trigrams held by all files
+  int n_postings; // total of all counts
+  int n_path_bytes; // bytes of all paths (with their terminators)
+};
+
+
+// Get the header of the "length" bytes of an index in "contents", or
+// NULL when they are not a valid index.
+static const struct index_header * _index_check(const char * contents, const size_t length) {
+  const struct index_header * header = (const struct index_header *) contents;
+  if ((contents == NULL) || (length < sizeof(struct index_header)) ||
+      (memcmp(header->magic, "RXTI", 4) != 0) || (header->version != INDEX_VERSION) ||
+      (header->n_files < 0) || (header->n_trigrams < 0) ||
+      (header->n_postings < 0) || (header->n_path_bytes < 0)) return NULL;
+  const size_t bytes = (sizeof(struct index_header) + 2*sizeof(long long)*(size_t)header->n_files +
+                        sizeof(int)*((size_t)header->n_files + 2*(size_t)header->n_trigrams + 1 +
+                                     (size_t)header->n_postings) + header->n_path_bytes);
+  return (bytes == length) ? header : NULL;
+}
+
+
+// Find the count, trigram, offset, and posting arrays of a checked index.
+static void _index_arrays(const struct index_header * header, const int ** counts,
+                          const int ** trigrams, const int ** offsets, const int ** postings) {
+  (*counts) = (const int *) (((const long long *) (header + 1)) + 2*header->n_files);
+  (*trigrams) = (*counts) + header->n_files;
+  (*offsets) = (*trigrams) + header->n_trigrams;
+  (*postings) = (*offsets) + header->n_trigrams + 1;
+}
+
+
+// Compare two trigrams (for sorting).
+static int _index_compare(const void * a, const void * b) {
+  return (*(const int *) a > *(const int *) b) - (*(const int *) a < *(const int *) b);
+}
+
+
+// Append the distinct trigrams of the file at "path" to "codes" (with
+// "n_codes" held and room for "size", grown as needed), in ascending
+// order. Each trigram is marked in "seen" (INDEX_TRIGRAMS bits, all
+// clear again on return). Returns the number of trigrams appended, or
+// -1 if the file is not indexed (unreadable, binary, or too large),
+// or -2 if memory could not be allocated.
+static int _index_scan(const char * path, int ** codes, long long * n_codes,
+                       long long * size, unsigned char * seen) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  size_t length;
+  int mapped;
+  char * contents = _file_contents(fd, &length, &mapped);
+  if (contents == NULL) return -1;
+  const unsigned char * bytes = (const unsigned char *) contents;
+  int count = -1;
+  if ((length <= INDEX_MAX_BYTES) &&
+      (memchr(contents, '\0', (length < INDEX_BINARY_BYTES) ? length : INDEX_BINARY_BYTES) == NULL)) {
+    // A file holds at most one trigram per byte.
+    if ((*n_codes) + (long long) length > (*size)) {
+      long long grown = 2*(*size) + length;
+      int * more = realloc(*codes, grown * sizeof(int));
+      if (more == NULL) {
+        _free_contents(contents, length, mapped);
+        return -2;
+      }
+      (*codes) = more;
+      (*size) = grown;
+    }
+    int * appended = (*codes) + (*n_codes);
+    count = 0;
+    for (size_t i = 2; i < length; i++) {
+      const int code = INDEX_TRIGRAM(bytes[i-2], bytes[i-1], bytes[i]);
+      if (seen[code >> 3] & (1 << (code & 7))) continue;
+      seen[code >> 3] |= (1 << (code & 7));
+      appended[count++] = code;
+    }
+    for (int k = 0; k < count; k++) seen[appended[k] >> 3] = 0;
+    qsort(appended, count, sizeof(int), _index_compare);
+    (*n_codes) += count;
+  }
+  _free_contents(contents, length, mapped);
+  return count;
+}
+
+
+// Write the index of "n_files" files to "index_path" (through a
+// temporary file that then replaces it). Each file is read at "root"
+// joined with its path in "paths" (the path that is kept), unless
+// "reuse[k]" is not negative, then it is the number of the same file
+// in the index already at "index_path", whose trigrams are kept.
+// "stamps" holds the modification time and size of each file (two
+// values each, kept in the index for the caller to check). Returns
+// the number of files that were read, -1 if memory could not be
+// allocated, -2 if a file is reused but the old index is not valid,
+// or -3 if the index could not be written.
+int index_build(const char * index_path, const char * root, const int n_files,
+                const char ** paths, const long long * stamps, const int * reuse) {
+  int status = 0;
+  // Map the old index when any of its files are reused.
+  char * old = NULL;
+  size_t old_length = 0;
+  int old_mapped = 0;
+  const struct index_header * header = NULL;
+  int needs_old = 0;
+  for (int k = 0; k < n_files; k++) needs_old |= (reuse[k] >= 0);
+  if (needs_old) {
+    const int fd = open(index_path, O_RDONLY);
+    if (fd >= 0) old = _file_contents(fd, &old_length, &old_mapped);
+    header = _index_check(old, old_length);
+    for (int k = 0; (header != NULL) && (k < n_files); k++)
+      if (reuse[k] >= header->n_files) header = NULL;
+    if (header == NULL) {
+      if (old != NULL) _free_contents(old, old_length, old_mapped);
+      return -2;
+    }
+  }
+  // The trigrams of each file, in order (from "first[k]", "counts[k]" of them).
+  int * counts = malloc((n_files + 1) * sizeof(int));
+  long long * first = malloc((n_files + 1) * sizeof(long long));
+  int * owner = (header != NULL) ? malloc((header->n_files + 1) * sizeof(int)) : NULL;
+  unsigned char * seen = calloc(INDEX_TRIGRAMS / 8, 1);
+  int * tally = calloc(INDEX_TRIGRAMS, sizeof(int));
+  long long n_codes = 0;
+  long long size = 0;
+  int * codes = NULL;
+  int * postings = NULL;
+  int * trigrams = NULL;
+  int * offsets = NULL;
+  if ((counts == NULL) || (first == NULL) || (seen == NULL) || (tally == NULL) ||
+      ((header != NULL) && (owner == NULL))) {
+    status = -1;
+    goto done;
+  }
+  // Read the files that are not reused, leave room for the others.
+  const int * old_counts = NULL, * old_trigrams = NULL, * old_offsets = NULL, * old_postings = NULL;
+  if (header != NULL) {
+    _index_arrays(header, &old_counts, &old_trigrams, &old_offsets, &old_postings);
+    for (int f = 0; f < header->n_files; f++) owner[f] = -1;
+  }
+  char full[PATH_MAX];
+  for (int k = 0; k < n_files; k++) {
+    first[k] = n_codes;
+    if (reuse[k] >= 0) {
+      counts[k] = old_counts[reuse[k]];
+      owner[reuse[k]] = k;
+      if (counts[k] <= 0) continue;
+      if (n_codes + counts[k] > size) {
+        long long grown = 2*size + counts[k];
+        int * more = realloc(codes, grown * sizeof(int));
+        if (more == NULL) {
+          status = -1;
+          goto done;
+        }
+        codes = more;
+        size = grown;
+      }
+      n_codes += counts[k];
+      continue;
+    }
+    const char * path = paths[k];
+    if ((root != NULL) && (root[0] != '\0') && (paths[k][0] != '/')) {
+      snprintf(full, PATH_MAX, "%s/%s", root, paths[k]);
+      path = full;
+    }
+    counts[k] = _index_scan(path, &codes, &n_codes, &size, seen);
+    if (counts[k] == -2) {
+      status = -1;
+      goto done;
+    }
+    status++;
+  }
+  // Every posting must be numbered by an int.
+  if (n_codes >= INT_MAX) {
+    status = -1;
+    goto done;
+  }
+  // The trigrams of reused files come from the old postings (in
+  // ascending order, one trigram at a time).
+  if (header != NULL) {
+    long long * filled = malloc((header->n_files + 1) * sizeof(long long));
+    if (filled == NULL) {
+      status = -1;
+      goto done;
+    }
+    for (int f = 0; f < header->n_files; f++) filled[f] = (owner[f] < 0) ? 0 : first[owner[f]];
+    for (int t = 0; t < header->n_trigrams; t++) {
+      for (int p = old_offsets[t]; p < old_offsets[t+1]; p++) {
+        const int f = old_postings[p];
+        if (owner[f] >= 0) codes[filled[f]++] = old_trigrams[t];
+      }
+    }
+    free(filled);
+  }
+  // Count the files holding each trigram, then number the trigrams
+  // and place the postings of each (files in ascending order).
+  for (long long c = 0; c < n_codes; c++) tally[codes[c]]++;
+  int n_trigrams = 0;
+  for (int code = 0; code < INDEX_TRIGRAMS; code++) n_trigrams += (tally[code] > 0);
+  postings = malloc((n_codes + 1) * sizeof(int));
+  trigrams = malloc((n_trigrams + 1) * sizeof(int));
+  offsets = malloc((n_trigrams + 1) * sizeof(int));
+  if ((postings == NULL) || (trigrams == NULL) || (offsets == NULL)) {
+    status = -1;
+    goto done;
+  }
+  int t = 0;
+  int at = 0;
+  for (int code = 0; code < INDEX_TRIGRAMS; code++) {
+    if (tally[code] == 0) continue;
+    trigrams[t] = code;
+    offsets[t] = at;
+    at += tally[code];
+    tally[code] = offsets[t]; // (the next posting of this trigram)
+    t++;
+  }
+  offsets[n_trigrams] = at;
+  for (int k = 0; k < n_files; k++)
+    for (int c = 0; c < counts[k]; c++) postings[tally[codes[first[k] + c]]++] = k;
+  // Write the index, then move it into place.
+  struct index_header written = {{'R','X','T','I'}, INDEX_VERSION, n_files, n_trigrams, (int) n_codes, 0};
+  for (int k = 0; k < n_files; k++) written.n_path_bytes += strlen(paths[k]) + 1;
+  snprintf(full, PATH_MAX, "%s.tmp", index_path);
+  FILE * file = fopen(full, "wb");
+  int written_all = (file != NULL);
+  if (written_all) {
+    written_all = ((fwrite(&written, sizeof(written), 1, file) == 1) &&
+                   (fwrite(stamps, sizeof(long long), 2*n_files, file) == (size_t) (2*n_files)) &&
+                   (fwrite(counts, sizeof(int), n_files, file) == (size_t) n_files) &&
+                   (fwrite(trigrams, sizeof(int), n_trigrams, file) == (size_t) n_trigrams) &&
+                   (fwrite(offsets, sizeof(int), n_trigrams+1, file) == (size_t) (n_trigrams+1)) &&
+                   (fwrite(postings, sizeof(int), n_codes, file) == (size_t) n_codes));
+    for (int k = 0; written_all && (k < n_files); k++)
+      written_all = (fwrite(paths[k], 1, strlen(paths[k]) + 1, file) == strlen(paths[k]) + 1);
+    written_all = (fclose(file) == 0) && written_all;
+  }
+  if ((! written_all) || (rename(full, index_path) != 0)) {
+    remove(full);
+    status = -3;
+  }
+ done:
+  if (old != NULL) _free_contents(old, old_length, old_mapped);
+  free(counts);
+  free(first);
+  free(owner);
+  free(seen);
+  free(tally);
+  free(codes);
+  free(postings);
+  free(trigrams);
+  free(offsets);
+  return status;
+}
+
+
+// Get the byte (in lower case) that token "j" of a program matches
+// in every match that passes it, when it is the only one (a token set
+// of one letter in both cases counts), otherwise -1. A token that
+// goes on after a failure (a NOT) has no byte.
+static int _index_byte(const struct compiled_regex * program, const int j) {
+  const struct regex_token token = program->code[j];
+  if (token.jumpf != EXIT_TOKEN) return -1;
+  if (token.op == TOKEN_BYTE) return tolower(token.byte);
+  if (token.op != TOKEN_SET) return -1;
+  int byte = -1;
+  for (int c = 0; c < 256; c++) {
+    if (! IN_SET(program->sets + SET_BYTES*j, c)) continue;
+    if (byte < 0) byte = tolower(c);
+    else if (tolower(c) != byte) return -1;
+  }
+  return byte;
+}
+
+
+// Check whether every match of the pattern at "entry" passes token
+// "j", that is, no path from "entry" to the end avoids it. Uses
+// "marks" (n_tokens, all zero, left that way) and "stack" (n_tokens).
+static int _index_required(const struct compiled_regex * program, const int entry,
+                           const int j, char * marks, int * stack) {
+  const int n_tokens = program->n_tokens;
+  int required = 1;
+  int depth = 0;
+  int n_marked = 0;
+  if (entry != j) {
+    stack[depth++] = entry;
+    marks[entry] = 1;
+  }
+  // (Marked tokens are kept on the stack below "depth" to be cleared.)
+  while (depth > n_marked) {
+    const int k = stack[n_marked++];
+    const int next[2] = {program->jumps[k], program->jumpf[k]};
+    for (int d = 0; d < 2; d++) {
+      if (next[d] >= n_tokens) required = 0;
+      if ((next[d] < 0) || (next[d] >= n_tokens) || (next[d] == j) || marks[next[d]]) continue;
+      marks[next[d]] = 1;
+      stack[depth++] = next[d];
+    }
+    if (! required) break;
+  }
+  for (int d = 0; d < depth; d++) marks[stack[d]] = 0;
+  return required;
+}
+
+
+// Set "codes" (room for INDEX_MAX_QUERY) to the distinct trigrams of
+// the literal factors of the pattern at "entry", the runs of tokens
+// that every match passes where each token has one byte and goes on
+// to the next. Returns the number of trigrams (0 when it has none,
+// then every file can match).
+static int _index_factors(const struct compiled_regex * program, const int entry,
+                          int * codes, char * marks, char * in_factor, int * stack) {
+  const int n_tokens = program->n_tokens;
+  int n_codes = 0;
+  for (int j = 0; j < n_tokens; j++) in_factor[j] = 0;
+  for (int j = 0; j < n_tokens; j++) {
+    if ((in_factor[j]) || (_index_byte(program, j) < 0) ||
+        (! _index_required(program, entry, j, marks, stack))) continue;
+    // Follow the factor from "j" while its tokens have one byte each.
+    int a = -1, b = -1;
+    for (int k = j, length = 0; (k >= 0) && (k < n_tokens) && (length < n_tokens); length++) {
+      const int c = _index_byte(program, k);
+      if (c < 0) break;
+      in_factor[k] = 1;
+      if ((a >= 0) && (n_codes < INDEX_MAX_QUERY)) {
+        const int code = (a << 16) | (b << 8) | c;
+        int known = 0;
+        for (int q = 0; (! known) && (q < n_codes); q++) known = (codes[q] == code);
+        if (! known) codes[n_codes++] = code;
+      }
+      a = b;
+      b = c;
+      k = program->jumps[k];
+    }
+  }
+  return n_codes;
+}
+
+
+// Find the postings of "code" in an index (their first and end).
+static int _index_postings(const struct index_header * header, const int * trigrams,
+                           const int * offsets, const int code, int * end) {
+  int low = 0, high = header->n_trigrams;
+  while (low < high) {
+    const int middle = low + (high - low) / 2;
+    if (trigrams[middle] < code) low = middle + 1;
+    else high = middle;
+  }
+  if ((low >= header->n_trigrams) || (trigrams[low] != code)) {
+    (*end) = 0;
+    return 0;
+  }
+  (*end) = offsets[low+1];
+  return offsets[low];
+}
+
+
+// Set "keep[f]" to 1 for each file "f" of the index at "index_path"
+// that could hold a match of the compiled program (each trigram of
+// the literal factors of one of its patterns is in the file, or the
+// file was not indexed), and to 0 for the rest. Returns the number of
+// files kept, -1 if the program is invalid, -2 if the index could not
+// be read (or is not valid), or -3 if memory could not be allocated.
+int index_search(const struct compiled_regex * program, const char * index_path, char * keep) {
+  if (program->n_tokens <= 0) return -1;
+  const int fd = open(index_path, O_RDONLY);
+  if (fd < 0) return -2;
+  size_t length;
+  int mapped;
+  char * contents = _file_contents(fd, &length, &mapped);
+  const struct index_header * header = _index_check(contents, length);
+  if (header == NULL) {
+    if (contents != NULL) _free_contents(contents, length, mapped);
+    return -2;
+  }
+  const int n_files = header->n_files;
+  const int n_tokens = program->n_tokens;
+  const int * counts, * trigrams, * offsets, * postings;
+  _index_arrays(header, &counts, &trigrams, &offsets, &postings);
+  int * codes = malloc((INDEX_MAX_QUERY + 2*n_tokens + n_files) * sizeof(int));
+  char * marks = calloc(2*n_tokens, 1);
+  if ((codes == NULL) || (marks == NULL)) {
+    free(codes);
+    free(marks);
+    _free_contents(contents, length, mapped);
+    return -3;
+  }
+  int * stack = codes + INDEX_MAX_QUERY;
+  int * files = stack + 2*n_tokens;
+  int kept = 0;
+  for (int f = 0; f < n_files; f++) {
+    keep[f] = (counts[f] < 0);
+    kept += keep[f];
+  }
+  for (int p = 0; (p < program->n_patterns) && (kept < n_files); p++) {
+    const int n_codes = _index_factors(program, program->entries[p], codes,
+                                       marks, marks + n_tokens, stack);
+    if (n_codes == 0) {
+      for (int f = 0; f < n_files; f++) keep[f] = 1;
+      kept = n_files;
+      break;
+    }
+    // Start from the trigram held by the fewest files, then only keep
+    // the files that also hold each of the others.
+    int shortest = 0, end, n = INT_MAX;
+    for (int q = 0; q < n_codes; q++) {
+      const int begin = _index_postings(header, trigrams, offsets, codes[q], &end);
+      if (end - begin < n) {
+        n = end - begin;
+        shortest = q;
+      }
+    }
+    int begin = _index_postings(header, trigrams, offsets, codes[shortest], &end);
+    memcpy(files, postings + begin, n * sizeof(int));
+    for (int q = 0; (q < n_codes) && (n > 0); q++) {
+      if (q == shortest) continue;
+      begin = _index_postings(header, trigrams, offsets, codes[q], &end);
+      int m = 0;
+      for (int k = 0; (k < n) && (begin < end); k++) {
+        while ((begin < end) && (postings[begin] < files[k])) begin++;
+        if ((begin < end) && (postings[begin] == files[k])) files[m++] = files[k];
+      }
+      n = m;
+    }
+    for (int k = 0; k < n; k++) {
+      kept += (! keep[files[k]]);
+      keep[files[k]] = 1;
+    }
+  }
+  free(codes);
+  free(marks);
+  _free_contents(contents, length, mapped);
+  return kept;
+}
+
+
+// ___________________________________________________________________
+//                        Command line (frex)
+//
+//  The main program searches every file below the current directory
+//  whose path matches one of the path patterns, the same way as
+//  `python3 -m regex`, but with the directory walk and the file
+//  searches all done here by a pool of threads. Each thread keeps a
+//  queue of directories and files to search, takes from the back of
+//  its own queue, and steals from the front of the others when
+//  empty. A thread also opens the next few files at the back of its
+//  own queue ahead of time and asks the system to start reading them,
+//  so the reads of cold files overlap the search of the current one
+//  (fewer when all threads would go over the limit of open files).
+//  Directories are walked as by `walk_files` (passing over ".git"
+//  and the paths of ignore files, unless "-u" is given). Matching
+//  lines are printed as each file is finished. The patterns use the
+//  extended syntax, with '^' and '$' anchored at the start and end of
+//  each line.
+//
+//   frex [-n] [-c] [-s] [-S] [-l] [-L] [-u] [-m <count>] [-M <bytes>] [-b <binary>] [-j <threads>] "<search-pattern>" ["<path-pattern-1>"] [...]
+//   frex [-n] [-c] [-s] [-S] [-l] [-L] [-u] [-m <count>] [-M <bytes>] [-b <binary>] [-j <threads>] -e "<search-pattern-1>" [-e ...] ["<path-pattern-1>"] [...]
+//
+//  "-n" do not recurse into subdirectories
+//  "-c" the search (and path) patterns are case sensitive
+//  "-s" search serially (with one thread)
+//  "-S" print the statistics of the search (when compiled with -DREGEX_STATS)
+//  "-l" only print the path of each file with a match (stop at its first match)
+//  "-m" the most matches to find in each file (the search of a file stops there)
+//  "-b" how to search binary files: "skip" (the default), "scan" them like
+//       other files, or "report" the path of each one with a match
+//  "-j" the number of threads to use (default is one per processor)
+//  "-e" precedes each search pattern when there are several
+//  "-L" search each line on its own (no match holds a newline)
+//  "-u" search every file, also the ones in ".git" and the ones matched
+//       by the rules of ".gitignore" and ".ignore" files (passed over by default)
+//  "-M" the largest file to search, in bytes (larger files are passed over)
+//
+
+// If DEBUG (tests), BENCHMARK, and REGEX_EXTENSION (the Python module)
+// are not defined, make the main of this program be a command line interface.
+#if !defined(DEBUG) && !defined(BENCHMARK) && !defined(REGEX_EXTENSION)
+
+#define FREX_ASCII_RATIO 0.7
+//      ^^ minimum fraction of ASCII characters at the start of a searched file
+#define FREX_PRINT_WIDTH 200
+//      ^^ maximum number of bytes printed for each matching line
+#define FREX_MAX_THREADS 256
+//      ^^ maximum number of threads used by one search
+#define FREX_QUEUE_SIZE 64
+//      ^^ initial number of items in the queue of each thread
+#define FREX_READAHEAD 8
+//      ^^ most files each thread has open (and being read) ahead of its search
+#define FREX_RESERVED_FILES 32
+//      ^^ open files left for everything but reading ahead (with 2 more per thread)
+#define FREX_BINARY_SKIP 0
+//      ^^ binary files (too few ASCII characters at the start) are not searched
+#define FREX_BINARY_SCAN 1
+//      ^^ binary files are searched and printed like all other files
+#define FREX_BINARY_REPORT 2
+//      ^^ binary files are searched for one match, only reported by path
+
+
+// Translate a regular expression in a Unix-like format into the
+// language of this library, the same way `translate_regex` does in
+// 'regex.py' (letters are matched in either case by compiling with
+// COMPILE_IGNORE_CASE instead). A ".*" is added to the front unless
+// the regex already starts with ".*", '^' and '$' are kept as line
+// anchors (compiled with COMPILE_MULTILINE). Returns a new
+// null-terminated string (release with `free`).
+static char * _translate(const char * regex) {
+  const int n = strlen(regex);
+  char * translated = malloc(n + 3);
+  int t = 0; // index in "translated"
+  if ((n > 0) && ((n < 2) || (regex[0] != '.') || (regex[1] != '*'))) {
+    translated[t++] = '.';
+    translated[t++] = '*';
+  }
+  for (int i = 0; i < n; i++) translated[t++] = regex[i];
+  translated[t] = '\0';
+  return translated;
+}
+
+
+// A directory or file waiting to be searched.
+struct frex_item {
+  char * path; // path to the directory or file (owned by the item)
+  int is_directory; // nonzero for directories
+  int fd; // the open file once it is read ahead (-1 before)
+  const struct ignore_rules * rules; // ignore rules of a directory (from the ones above)
+};
+
+// A double-ended queue of items. The thread that owns the queue adds
+// and takes items at the back (depth first), other threads steal
+// items from the front (the oldest, usually largest directories).
+struct frex_queue {
+  pthread_mutex_t lock;
+  struct frex_item * items;
+  int head; // index of the front item
+  int tail; // index after the back item
+  int size; // capacity of "items"
+};
+
+// The state shared by all threads of one search.
+struct frex_pool {
+  pthread_mutex_t lock; // guards "queued" and "pending"
+  pthread_cond_t wake;  // signaled when items are added or all are done
+  int queued;  // number of items in all queues
+  int pending; // number of items in all queues or being searched
+  int n_threads;
+  struct frex_queue * queues; // one queue per thread
+  int walk; // WALK_RECURSIVE and WALK_IGNORE flags of the directory walk
+  long long max_bytes; // files over this size are not searched (all are when 0)
+  struct ignore_rules * made; // every ignore rules read (guarded by "lock", see `_ignore_free`)
+  const char ** search; // translated search patterns
+  int n_search;
+  const char ** paths; // translated path patterns
+  int n_paths; // (all paths are searched when this is 0)
+  int max_matches; // most matches printed for each file (0 for all)
+  int files_with_matches; // whether to print only the paths of matching files
+  int binary; // how to search binary files (FREX_BINARY_SKIP, _SCAN, or _REPORT)
+  int readahead; // most files each thread reads ahead (FREX_READAHEAD, or fewer
+                 // to keep all threads within the limit of open files)
+};
+
+// The state of one thread. Every thread compiles its own programs,
+// because the DFA of a program is built while it is searching.
+struct frex_worker {
+  struct frex_pool * pool;
+  int id; // index of the queue of this thread
+  struct compiled_regex * search; // program for the search patterns
+  struct compiled_regex * paths;  // program for the path patterns
+  char * out; // buffered output for the current file
+  size_t n_out;
+  size_t s_out;
+  long matches; // number of matches found
+  long files;   // number of files searched
+};
+
+
+// Add a directory or file to the back of the queue of a thread.
+static void _frex_push(struct frex_worker * worker, char * path, const int is_directory,
+                       const struct ignore_rules * rules) {
+  struct frex_pool * pool = worker->pool;
+  struct frex_queue * queue = pool->queues + worker->id;
+  pthread_mutex_lock(&(queue->lock));
+  if (queue->tail == queue->size) {
+    // Move the items to the front, grow the queue if it is over half full.
+    const int n = queue->tail - queue->head;
+    if (2*n >= queue->size) {
+      queue->size = 2*queue->size;
+      queue->items = realloc(queue->items, queue->size * sizeof(struct frex_item));
+    }
+    for (int k = 0; k < n; k++) queue->items[k] = queue->items[queue->head+k];
+    queue->head = 0;
+    queue->tail = n;
+  }
+  queue->items[queue->tail].path = path;
+  queue->items[queue->tail].is_directory = is_directory;
+  queue->items[queue->tail].fd = -1;
+  queue->items[queue->tail].rules = rules;
+  queue->tail++;
+  pthread_mutex_unlock(&(queue->lock));
+  // Count the item and wake a thread that is waiting for work.
+  pthread_mutex_lock(&(pool->lock));
+  pool->queued++;
+  pool->pending++;
+  pthread_cond_signal(&(pool->wake));
+  pthread_mutex_unlock(&(pool->lock));
+}
+
+
+// Take the next item for a thread, from the back of its own queue or
+// else from the front of another queue. Returns 0 if none was found.
+static int _frex_take(struct frex_worker * worker, struct frex_item * item) {
+  struct frex_pool * pool = worker->pool;
+  int found = 0;
+  for (int k = 0; (k < pool->n_threads) && (! found); k++) {
+    struct frex_queue * queue = pool->queues + ((worker->id + k) % pool->n_threads);
+    pthread_mutex_lock(&(queue->lock));
+    if (queue->tail > queue->head) {
+      if (k == 0) (*item) = queue->items[--(queue->tail)];
+      else        (*item) = queue->items[(queue->head)++];
+      found = 1;
+    }
+    pthread_mutex_unlock(&(queue->lock));
+  }
+  if (found) {
+    pthread_mutex_lock(&(pool->lock));
+    pool->queued--;
+    pthread_mutex_unlock(&(pool->lock));
+  }
+  return found;
+}
+
+
+// Take up to "n" files from the back of the queue of a thread (the
+// ones it would search next, stops at a directory), open them, and
+// start reading them in the background. Returns the number taken.
+static int _frex_take_ahead(struct frex_worker * worker, struct frex_item * items, const int n) {
+  struct frex_pool * pool = worker->pool;
+  struct frex_queue * queue = pool->queues + worker->id;
+  int taken = 0;
+  pthread_mutex_lock(&(queue->lock));
+  while ((taken < n) && (queue->tail > queue->head) &&
+         (! queue->items[queue->tail-1].is_directory))
+    items[taken++] = queue->items[--(queue->tail)];
+  pthread_mutex_unlock(&(queue->lock));
+  if (taken > 0) {
+    pthread_mutex_lock(&(pool->lock));
+    pool->queued -= taken;
+    pthread_mutex_unlock(&(pool->lock));
+  }
+  for (int k = 0; k < taken; k++) {
+    items[k].fd = open(items[k].path, O_RDONLY);
+    #ifdef POSIX_FADV_WILLNEED
+    if (items[k].fd >= 0) posix_fadvise(items[k].fd, 0, 0, POSIX_FADV_WILLNEED);
+    #endif
+  }
+  return taken;
+}
+
+
+// Add bytes to the output buffer of a thread.
+static void _frex_write(struct frex_worker * worker, const char * bytes, const size_t n) {
+  if (worker->n_out + n > worker->s_out) {
+    while (worker->n_out + n > worker->s_out) worker->s_out = 2*worker->s_out;
+    worker->out = realloc(worker->out, worker->s_out);
+  }
+  memcpy(worker->out + worker->n_out, bytes, n);
+  worker->n_out += n;
+}
+
+
+// List a directory, queueing every subdirectory (when searching
+// recursively) and every file whose path matches a path pattern, and
+// that is not passed over by the walk (see `_walk_kind`). The ignore
+// files of the directory add to the "rules" of the ones above it.
+static void _frex_directory(struct frex_worker * worker, const char * path,
+                            const struct ignore_rules * rules) {
+  struct frex_pool * pool = worker->pool;
+  DIR * directory = opendir(path);
+  if (directory == NULL) return;
+  const size_t length = strlen(path);
+  if (pool->walk & WALK_IGNORE) {
+    struct ignore_rules * read = _ignore_read(path, length, rules);
+    if (read != NULL) {
+      pthread_mutex_lock(&(pool->lock));
+      read->next = pool->made;
+      pool->made = read;
+      pthread_mutex_unlock(&(pool->lock));
+      rules = read;
+    }
+  }
+  struct dirent * entry;
+  while ((entry = readdir(directory)) != NULL) {
+    char * child = _walk_join(path, length, entry->d_name);
+    if (child == NULL) continue;
+    const int kind = _walk_kind(child, entry, pool->walk, pool->max_bytes, rules);
+    int is_file = (kind == 1);
+    if (is_file && (pool->n_paths > 0)) {
+      int start, end;
+      match_compiled(worker->paths, child, &start, &end);
+      is_file = (start >= 0);
+    }
+    if ((kind == 2) || is_file) _frex_push(worker, child, (kind == 2), rules);
+    else free(child);
+  }
+  closedir(directory);
+}
+
+
+// Search one file (the open "fd", or opened here when it is -1),
+// print every line that holds a match (once) as "<path>:<line>: <text>"
+// in a single write. A file that can not be opened is reported.
+static void _frex_file(struct frex_worker * worker, const char * path, int fd) {
+  if (fd < 0) fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: could not open '%s', %s.\n", path, strerror(errno));
+    return;
+  }
+  size_t length;
+  int mapped;
+  char * contents = _file_contents(fd, &length, &mapped);
+  if (contents == NULL) return;
+  if (length >= INT_MAX) {
+    fprintf(stderr, "ERROR: '%s' is too large to search (%zu bytes).\n", path, length);
+    _free_contents(contents, length, mapped);
+    return;
+  }
+  worker->files++;
+  struct found_matches found = {0};
+  const struct frex_pool * pool = worker->pool;
+  // Only skipped binary files are checked by the search itself.
+  const float ascii_ratio = (pool->binary == FREX_BINARY_SKIP) ? FREX_ASCII_RATIO : 0.0;
+  const int binary = ((pool->binary == FREX_BINARY_REPORT) &&
+                      _is_binary(contents, (int) length, FREX_ASCII_RATIO));
+  const int max_matches = (pool->files_with_matches || binary) ? 1 : pool->max_matches;
+  if (_search_contents(worker->search, contents, (int) length, ascii_ratio,
+                       pool->n_threads, max_matches, &found) == 0) {
+    worker->matches += found.n;
+    worker->n_out = 0;
+    const size_t path_length = strlen(path);
+    // Only print the path of a matching (binary) file, or else every matching line.
+    const int n_lines = (pool->files_with_matches || binary) ? 0 : found.n;
+    if (found.n > n_lines) {
+      if (binary && ! pool->files_with_matches) _frex_write(worker, "binary file ", 12);
+      _frex_write(worker, path, path_length);
+      if (binary && ! pool->files_with_matches) _frex_write(worker, " matches", 8);
+      _frex_write(worker, "\n", 1);
+    }
+    int printed = 0; // index after the last printed line
+    for (int k = 0; k < n_lines; k++) {
+      // Take the lines that hold the match, skip them if already printed.
+      int first = found.line_starts[k];
+      int last = found.line_ends[k]; // (the index of the newline of its last line)
+      if (last < printed) continue;
+      if (first < printed) first = printed;
+      printed = last + 1;
+      int at = (found.ends[k] > found.starts[k]) ? found.ends[k]-1 : found.starts[k];
+      if (at > last) at = last;
+      // (The line of the character at "at", counted back to the first printed line.)
+      const int line = found.lines[k] - ((at > first) ? _newline_count(contents + first, at - first) : 0);
+      // Only print the part of long lines around the start of the match.
+      if (last - first > FREX_PRINT_WIDTH) {
+        if (found.starts[k] - FREX_PRINT_WIDTH/2 > first) first = found.starts[k] - FREX_PRINT_WIDTH/2;
+        if (last - first > FREX_PRINT_WIDTH) last = first + FREX_PRINT_WIDTH;
+      }
+      // Write "<path>:<line>: <text>".
+      char number[32];
+      _frex_write(worker, path, path_length);
+      _frex_write(worker, number, snprintf(number, sizeof(number), ":%d: ", line));
+      _frex_write(worker, contents + first, last - first);
+      _frex_write(worker, "\n", 1);
+    }
+    // Write all lines of this file at once (so files do not interleave).
+    if (worker->n_out > 0) fwrite(worker->out, 1, worker->n_out, stdout);
+  }
+  free(found.starts);
+  _free_contents(contents, length, mapped);
+}
+
+
+// Run one thread of a search until there are no items left.
+static void * _frex_run(void * argument) {
+  struct frex_worker * worker = (struct frex_worker *) argument;
+  struct frex_pool * pool = worker->pool;
+  struct frex_item item = {NULL, 0, -1, NULL};
+  // Files taken from this queue (in order) that are already being read.
+  struct frex_item ahead[FREX_READAHEAD];
+  int n_ahead = 0;
+  while (1) {
+    // Keep the window of files read ahead full.
+    n_ahead += _frex_take_ahead(worker, ahead + n_ahead, pool->readahead - n_ahead);
+    int taken = (n_ahead > 0);
+    if (taken) {
+      item = ahead[0];
+      n_ahead--;
+      for (int k = 0; k < n_ahead; k++) ahead[k] = ahead[k+1];
+    } else taken = _frex_take(worker, &item);
+    if (taken) {
+      if (item.is_directory) _frex_directory(worker, item.path, item.rules);
+      else                   _frex_file(worker, item.path, item.fd);
+      free(item.path);
+      // Mark this item as done, wake everyone when all items are done.
+      pthread_mutex_lock(&(pool->lock));
+      pool->pending--;
+      if (pool->pending == 0) pthread_cond_broadcast(&(pool->wake));
+      pthread_mutex_unlock(&(pool->lock));
+    } else {
+      // Wait for more items, or exit when no items are left anywhere.
+      pthread_mutex_lock(&(pool->lock));
+      while ((pool->queued == 0) && (pool->pending > 0))
+        pthread_cond_wait(&(pool->wake), &(pool->lock));
+      const int done = (pool->pending == 0);
+      pthread_mutex_unlock(&(pool->lock));
+      if (done) return NULL;
+    }
+  }
+}
+
+
+// Compile a set of (translated) regular expressions, printing an
+// error message and returning NULL if any of them is invalid.
+static struct compiled_regex * _frex_compile(const char ** regexes, const int n,
+                                             const int flags) {
+  struct compiled_regex * program = compile_set_flags(regexes, n, flags);
+  if ((program != NULL) && (program->n_tokens < 0)) {
+    const char * regex = regexes[program->n_patterns];
+    fprintf(stderr, "ERROR: invalid regular expression, code %d,", -program->n_groups);
+    fprintf(stderr, " error at position %d.\n  %s\n", -program->n_tokens-1, regex);
+    fprintf(stderr, "  %*c\n", -program->n_tokens, '^');
+    free_compiled(program);
+    return NULL;
+  }
+  return program;
+}
+
+
+int main(int argc, char * argv[]) {
+  // Read the optional flags and the search and path patterns.
+  int recursive = 1;
+  int unrestricted = 0;
+  long long max_bytes = 0;
+  int case_sensitive = 0;
+  int serial = 0;
+  int statistics = 0;
+  int files_with_matches = 0;
+  int line_mode = 0;
+  int max_matches = 0;
+  int binary = FREX_BINARY_SKIP;
+  int bad_flag = 0; // whether a flag was given an unknown value
+  int n_threads = 0;
+  const char ** search = malloc(argc * sizeof(char *));
+  const char ** paths = malloc(argc * sizeof(char *));
+  int n_search = 0;
+  int n_paths = 0;
+  int given = 0; // whether or not "-e" was given
+  for (int i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "-e") == 0) && (i+1 < argc)) {
+      search[n_search++] = argv[++i];
+      given = 1;
+    }
+    else if (strcmp(argv[i], "-n") == 0) recursive = 0;
+    else if (strcmp(argv[i], "-c") == 0) case_sensitive = 1;
+    else if (strcmp(argv[i], "-s") == 0) serial = 1;
+    else if (strcmp(argv[i], "-S") == 0) statistics = 1;
+    else if (strcmp(argv[i], "-l") == 0) files_with_matches = 1;
+    else if (strcmp(argv[i], "-L") == 0) line_mode = 1;
+    else if (strcmp(argv[i], "-u") == 0) unrestricted = 1;
+    else if ((strcmp(argv[i], "-M") == 0) && (i+1 < argc)) max_bytes = atoll(argv[++i]);
+    else if ((strcmp(argv[i], "-m") == 0) && (i+1 < argc)) max_matches = atoi(argv[++i]);
+    else if ((strcmp(argv[i], "-b") == 0) && (i+1 < argc)) {
+      i++;
+      if (strcmp(argv[i], "skip") == 0) binary = FREX_BINARY_SKIP;
+      else if (strcmp(argv[i], "scan") == 0) binary = FREX_BINARY_SCAN;
+      else if (strcmp(argv[i], "report") == 0) binary = FREX_BINARY_REPORT;
+      else bad_flag = 1;
+    }
+    else if ((strcmp(argv[i], "-j") == 0) && (i+1 < argc)) n_threads = atoi(argv[++i]);
+    else paths[n_paths++] = argv[i];
+  }
+  // Without "-e", the first pattern is the search pattern.
+  if ((! given) && (n_paths > 0)) {
+    search[n_search++] = paths[0];
+    n_paths--;
+    for (int i = 0; i < n_paths; i++) paths[i] = paths[i+1];
+  }
+  if ((n_search == 0) || bad_flag) {
+    printf("\n");
+    printf("Expected call to look like:\n");
+    printf("  %s [-n] [-c] [-s] [-S] [-l] [-L] [-u] [-m <count>] [-M <bytes>] [-b <binary>] [-j <threads>] \"<search-pattern>\" [\"<path-pattern-1>\"] [...]\n", argv[0]);
+    printf("  %s [-n] [-c] [-s] [-S] [-l] [-L] [-u] [-m <count>] [-M <bytes>] [-b <binary>] [-j <threads>] -e \"<search-pattern-1>\" [-e ...] [\"<path-pattern-1>\"] [...]\n", argv[0]);
+    printf("\n");
+    printf("\"-n\" do not recurse into subdirectories\n");
+    printf("\"-c\" the search (and path) patterns are case sensitive\n");
+    printf("\"-s\" search serially (with one thread)\n");
+    printf("\"-S\" print the statistics of the search (when compiled with -DREGEX_STATS)\n");
+    printf("\"-l\" only print the path of each file with a match (stop at its first match)\n");
+    printf("\"-m\" the most matches to find in each file (the search of a file stops there)\n");
+    printf("\"-b\" how to search binary files: \"skip\" (the default), \"scan\" them like\n");
+    printf("     other files, or \"report\" the path of each one with a match\n");
+    printf("\"-j\" the number of threads to use (default is one per processor)\n");
+    printf("\"-e\" precedes each search pattern when there are several\n");
+    printf("\"-L\" search each line on its own (no match holds a newline)\n");
+    printf("\"-u\" search every file, also the ones in \".git\" and the ones matched\n");
+    printf("     by the rules of \".gitignore\" and \".ignore\" files (passed over by default)\n");
+    printf("\"-M\" the largest file to search, in bytes (larger files are passed over)\n");
+    printf("\n");
+    return 2;
+  }
+  // Translate and check all of the patterns. An empty path pattern
+  // matches every path. Match starts are found backwards (only the
+  // lines that hold them are printed, so one start per end is enough).
+  const int n_translated = n_paths;
+  const int flags = (case_sensitive ? 0 : COMPILE_IGNORE_CASE) | COMPILE_REVERSE_START
+    | COMPILE_EXTENDED | COMPILE_MULTILINE | (line_mode ? COMPILE_LINES : 0);
+  for (int i = 0; i < n_search; i++) search[i] = _translate(search[i]);
+  for (int i = 0; i < n_paths; i++) paths[i] = _translate(paths[i]);
+  for (int i = 0; i < n_translated; i++) if (paths[i][0] == '\0') n_paths = 0;
+  struct compiled_regex * program = _frex_compile(search, n_search, flags);
+  if (program == NULL) return 2;
+  free_compiled(program);
+  if (n_paths > 0) {
+    program = _frex_compile(paths, n_paths, flags);
+    if (program == NULL) return 2;
+    free_compiled(program);
+  }
+
+  // Create the pool, with one queue and worker per thread.
+  struct frex_pool pool;
+  pool.n_threads = (n_threads > 0) ? n_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  if (serial) pool.n_threads = 1;
+  if (pool.n_threads < 1) pool.n_threads = 1;
+  if (pool.n_threads > FREX_MAX_THREADS) pool.n_threads = FREX_MAX_THREADS;
+  pthread_mutex_init(&(pool.lock), NULL);
+  pthread_cond_init(&(pool.wake), NULL);
+  pool.queued = 0;
+  pool.pending = 0;
+  pool.walk = (recursive ? WALK_RECURSIVE : 0) | (unrestricted ? 0 : WALK_IGNORE);
+  pool.max_bytes = (max_bytes > 0) ? max_bytes : 0;
+  pool.made = NULL;
+  pool.search = search;
+  pool.n_search = n_search;
+  pool.paths = paths;
+  pool.n_paths = n_paths;
+  pool.max_matches = (max_matches > 0) ? max_matches : 0;
+  pool.files_with_matches = files_with_matches;
+  pool.binary = binary;
+  // Read ahead only as many files as the limit of open files allows.
+  pool.readahead = FREX_READAHEAD;
+  struct rlimit open_files;
+  if ((getrlimit(RLIMIT_NOFILE, &open_files) == 0) && (open_files.rlim_cur != RLIM_INFINITY)) {
+    const long long spare = (long long) open_files.rlim_cur - FREX_RESERVED_FILES - 2*pool.n_threads;
+    const long long each = (spare > 0) ? spare / pool.n_threads : 0;
+    if (each < pool.readahead) pool.readahead = (int) each;
+  }
+  pool.queues = malloc(pool.n_threads * sizeof(struct frex_queue));
+  struct frex_worker * workers = malloc(pool.n_threads * sizeof(struct frex_worker));
+  pthread_t * threads = malloc(pool.n_threads * sizeof(pthread_t));
+  for (int t = 0; t < pool.n_threads; t++) {
+    pthread_mutex_init(&(pool.queues[t].lock), NULL);
+    pool.queues[t].size = FREX_QUEUE_SIZE;
+    pool.queues[t].items = malloc(FREX_QUEUE_SIZE * sizeof(struct frex_item));
+    pool.queues[t].head = 0;
+    pool.queues[t].tail = 0;
+    workers[t].pool = &pool;
+    workers[t].id = t;
+    workers[t].search = compile_set_flags(search, n_search, flags);
+    workers[t].paths = (n_paths > 0) ? compile_set_flags(paths, n_paths, flags) : NULL;
+    workers[t].s_out = READ_BUFFER_SIZE;
+    workers[t].out = malloc(workers[t].s_out);
+    workers[t].n_out = 0;
+    workers[t].matches = 0;
+    workers[t].files = 0;
+  }
+
+  // Search from the current directory, then wait for all threads.
+  _frex_push(workers, strdup("."), 1, NULL);
+  for (int t = 0; t < pool.n_threads; t++)
+    pthread_create(threads+t, NULL, _frex_run, workers+t);
+  long matches = 0;
+  long files = 0;
+  for (int t = 0; t < pool.n_threads; t++) pthread_join(threads[t], NULL);
+  for (int t = 0; t < pool.n_threads; t++) {
+    matches += workers[t].matches;
+    files += workers[t].files;
+    free_compiled(workers[t].search);
+    free_compiled(workers[t].paths);
+    free(workers[t].out);
+    free(pool.queues[t].items);
+    pthread_mutex_destroy(&(pool.queues[t].lock));
+  }
+  if (matches > 0)
+    printf("\n found %ld match%s across %ld files\n", matches, (matches > 1) ? "es" : "", files);
+  else
+    printf("\n no matches found across %ld files\n", files);
+  if (statistics) {
+    struct regex_stats stats;
+    if (read_stats(&stats, 0)) {
+      fprintf(stderr, " searches %lld, files %lld (%lld skipped as binary), bytes %lld,\n",
+              stats.searches, stats.files, stats.ascii_skips, stats.bytes);
+      fprintf(stderr, " steps %lld, pushes %lld, peak active tokens %lld, compiling %.3fms\n",
+              stats.steps, stats.pushes, stats.peak_active, stats.compile_ns / 1e6);
+    } else {
+      fprintf(stderr, " no statistics, compile with -DREGEX_STATS to keep them\n");
+    }
+  }
+
+  // Release all memory.
+  _ignore_free(pool.made);
+  pthread_cond_destroy(&(pool.wake));
+  pthread_mutex_destroy(&(pool.lock));
+  for (int i = 0; i < n_search; i++) free((char *) search[i]);
+  for (int i = 0; i < n_translated; i++) free((char *) paths[i]);
+  free(search);
+  free(paths);
+  free(pool.queues);
+  free(workers);
+  free(threads);
+  return (matches > 0) ? 0 : 1;
+}
+
+#endif
+
 
 //2020-10-21 23:13:29
 //
@@ -6,6 +6,30 @@
 
    match(regex, string) -> (start, end) or None or RegexError,
 
+ Regular expressions that are used repeatedly can be compiled once:
+
+   compile(regex) -> Pattern, with methods `match`, `matcha`, `fmatcha`,
+                     `fmatchs`, and `stream` (for input that arrives in pieces)
+
+ Many regular expressions can be searched for in one pass:
+
+   compile_set(regexes) -> PatternSet, with the same methods
+
+ The matches in many files can be given back as each file is searched
+ (as arrays viewing the memory the search filled, without copies):
+
+   frexs(regex, *path_patterns) -> yields (path, starts, ends, lines)
+   fmatchs(paths, regex) -> the same for the files at "paths"
+
+ Repeated searches of the same tree can read only the files that may
+ hold a match, from an index of the trigrams of every file:
+
+   index(curdir) -> (files indexed, files read), used by `frex`
+
+ Searches go through the CPython extension in 'regex_ext.c' (built on
+ import, when the Python headers are available), which reads buffers
+ in place and releases the GIL, or through ctypes otherwise.
+
  Documentation for 'regex.c' follows.
 
 ''' 
@@ -26,14 +50,6 @@
 #   write a C function for translating from classic regular
 #   expressions into fast regular expressions
 # 
-#   default regex library has a `finditer` command that iterates over
-#   matches and streams bytes to the regular experssion library from
-#   a buffer, can that be done here?
-#   ^^ write a smatch and sfmatch that do 'stream' style matching,
-#      being given a start index and number of bytes to parse,
-#      maintaining a global state that is used for repeated calls to
-#      the same C function
-# 
 #   create a Python test case that would reveal any memory leak in the
 #   returned allocatable arrays from the C library
 # 
@@ -133,26 +149,226 @@ with open(os.path.join(ABOUT_DIR,"version.txt")) as f:
 
 # Import ctypes for loading the underlying C regex library.
 import ctypes
+import array, contextlib, functools
 
 # --------------------------------------------------------------------
 #                 Darwin (macOS) / Linux (Ubuntu) import
-clib_bin = os.path.join(os.path.dirname(os.path.abspath(__file__)), "regex.so")
+# With "REGEX_STATS" set in the environment, a separate library that
+# keeps the counts read by `stats` is built and used.
+clib_stats = bool(os.environ.get("REGEX_STATS"))
+clib_bin = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        "regex_stats.so" if clib_stats else "regex.so")
 clib_source = os.path.join(os.path.dirname(os.path.abspath(__file__)), "regex.c")
-# Import or compile the C file.
+# Import or compile the C file (recompile when the source is newer).
 try:
+    if (os.path.exists(clib_source) and os.path.exists(clib_bin) and
+        (os.path.getmtime(clib_source) > os.path.getmtime(clib_bin))):
+        raise(OSError("Shared object is older than its source."))
     clib = ctypes.CDLL(clib_bin)
 except:
     # Configure for the compilation for the C code.
     c_compiler = "cc"
-    compile_command = f"{c_compiler} -O3 -fPIC -shared -o '{clib_bin}' '{clib_source}'"
+    c_flags = "-DREGEX_STATS" if clib_stats else ""
+    compile_command = f"{c_compiler} -O3 -pthread -fPIC -shared {c_flags} -o '{clib_bin}' '{clib_source}'"
     # Compile and import.
     os.system(compile_command)
     clib = ctypes.CDLL(clib_bin)
     # Clean up "global" variables.
-    del(c_compiler, compile_command)
+    del(c_compiler, c_flags, compile_command)
+# Declare the pointer-returning and pointer-taking functions, so that
+# compiled regular expression handles are not truncated to integers.
+clib.compile.restype = ctypes.c_void_p
+clib.compile_flags.restype = ctypes.c_void_p
+clib.compile_flags.argtypes = [ctypes.c_char_p, ctypes.c_int]
+clib.free_compiled.argtypes = [ctypes.c_void_p]
+clib.copy_compiled.restype = ctypes.c_void_p
+clib.copy_compiled.argtypes = [ctypes.c_void_p]
+clib.match_compiled.argtypes = [ctypes.c_void_p, ctypes.c_char_p,
+                                ctypes.c_void_p, ctypes.c_void_p]
+clib.matcha_compiled.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p,
+                                 ctypes.c_void_p, ctypes.c_void_p]
+clib.fmatcha_compiled.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p,
+                                  ctypes.c_void_p, ctypes.c_void_p,
+                                  ctypes.c_void_p, ctypes.c_float]
+clib.compile_set.restype = ctypes.c_void_p
+clib.compile_set.argtypes = [ctypes.c_void_p, ctypes.c_int]
+clib.compile_set_flags.restype = ctypes.c_void_p
+clib.compile_set_flags.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
+clib.match_set.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p,
+                           ctypes.c_void_p, ctypes.c_void_p]
+clib.matcha_set.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p,
+                            ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+clib.fmatcha_set.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p,
+                             ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p,
+                             ctypes.c_void_p, ctypes.c_float]
+clib.match_batch_threads.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p,
+                                     ctypes.c_int, ctypes.c_int, ctypes.c_void_p,
+                                     ctypes.c_void_p, ctypes.c_void_p]
+clib.matchn.argtypes = [ctypes.c_char_p, ctypes.c_void_p, ctypes.c_size_t,
+                        ctypes.c_void_p, ctypes.c_void_p]
+clib.matchan.argtypes = [ctypes.c_char_p, ctypes.c_void_p, ctypes.c_size_t,
+                         ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+clib.match_compiledn.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t,
+                                 ctypes.c_void_p, ctypes.c_void_p]
+clib.matcha_compiledn.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t,
+                                  ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+clib.match_setn.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t,
+                            ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+clib.matcha_setn.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t,
+                             ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p,
+                             ctypes.c_void_p]
+stream_callback = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_int,
+                                   ctypes.c_longlong, ctypes.c_longlong)
+clib.stream_init.restype = ctypes.c_void_p
+clib.stream_init.argtypes = [ctypes.c_void_p]
+clib.stream_feed.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int,
+                             stream_callback, ctypes.c_void_p]
+clib.stream_finish.argtypes = [ctypes.c_void_p, stream_callback, ctypes.c_void_p]
+clib.index_build.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int, ctypes.c_void_p,
+                             ctypes.c_void_p, ctypes.c_void_p]
+clib.index_search.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]
+clib.walk_files.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_longlong,
+                            ctypes.c_void_p, ctypes.c_void_p]
+clib.free_paths.argtypes = [ctypes.c_void_p]
+
+# The C view of a Python buffer (the C-API "Py_buffer"), it lets bytes,
+# bytearray, and memoryview objects be searched without a copy.
+class _Py_buffer(ctypes.Structure):
+    _fields_ = [("buf", ctypes.c_void_p), ("obj", ctypes.c_void_p),
+                ("len", ctypes.c_ssize_t), ("itemsize", ctypes.c_ssize_t),
+                ("readonly", ctypes.c_int), ("ndim", ctypes.c_int),
+                ("format", ctypes.c_char_p), ("shape", ctypes.c_void_p),
+                ("strides", ctypes.c_void_p), ("suboffsets", ctypes.c_void_p),
+                ("internal", ctypes.c_void_p)]
+ctypes.pythonapi.PyObject_GetBuffer.argtypes = [ctypes.py_object,
+                                                ctypes.POINTER(_Py_buffer), ctypes.c_int]
+ctypes.pythonapi.PyBuffer_Release.argtypes = [ctypes.POINTER(_Py_buffer)]
+
+# The arena of results filled by `matcha_into` and `fmatcha_into` (the
+# C "struct found_matches"), its arrays are released when a "with"
+# block ends.
+class _Results(ctypes.Structure):
+    _fields_ = [("n", ctypes.c_int), ("size", ctypes.c_int),
+                ("starts", ctypes.POINTER(ctypes.c_int)), ("ends", ctypes.POINTER(ctypes.c_int)),
+                ("lines", ctypes.POINTER(ctypes.c_int)), ("patterns", ctypes.POINTER(ctypes.c_int)),
+                ("n_captures", ctypes.c_int), ("captures", ctypes.POINTER(ctypes.c_int)),
+                ("line_starts", ctypes.POINTER(ctypes.c_int)), ("line_ends", ctypes.POINTER(ctypes.c_int))]
+
+    def __enter__(self): return self
+
+    def __exit__(self, *args): clib.free_results(ctypes.byref(self))
+clib.matcha_into.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t,
+                             ctypes.POINTER(_Results)]
+clib.fmatcha_into.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_float,
+                              ctypes.POINTER(_Results)]
+clib.matcha_limit.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_size_t,
+                              ctypes.c_int, ctypes.POINTER(_Results)]
+clib.fmatcha_limit.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_float,
+                               ctypes.c_int, ctypes.POINTER(_Results)]
+clib.free_results.argtypes = [ctypes.POINTER(_Results)]
+
+# The counts of work done by all searches (the C "struct regex_stats").
+class _Stats(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_longlong) for name in (
+        "searches", "files", "ascii_skips", "bytes", "steps",
+        "pushes", "peak_active", "compile_ns")]
+clib.read_stats.argtypes = [ctypes.POINTER(_Stats), ctypes.c_int]
+
+# Import or compile the CPython extension for the searches (see
+# 'regex_ext.c'), it takes buffers directly and releases the GIL while
+# scanning. Without the Python headers, the searches go through ctypes.
+ext_bin = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                       "regex_ext_stats.so" if clib_stats else "regex_ext.so")
+ext_source = os.path.join(os.path.dirname(os.path.abspath(__file__)), "regex_ext.c")
+def _load_ext():
+    import importlib.machinery, importlib.util
+    loader = importlib.machinery.ExtensionFileLoader("regex_ext", ext_bin)
+    spec = importlib.util.spec_from_file_location("regex_ext", ext_bin, loader=loader)
+    module = importlib.util.module_from_spec(spec)
+    loader.exec_module(module)
+    return module
+try:
+    if (os.path.exists(ext_source) and os.path.exists(ext_bin) and
+        (max(os.path.getmtime(ext_source), os.path.getmtime(clib_source)) >
+         os.path.getmtime(ext_bin))):
+        raise(OSError("Extension is older than its source."))
+    ext = _load_ext()
+except:
+    try:
+        import sys, sysconfig
+        c_flags = "-DREGEX_STATS" if clib_stats else ""
+        if (sys.platform == "darwin"): c_flags += " -undefined dynamic_lookup"
+        include = sysconfig.get_paths()["include"]
+        compile_command = (f"cc -O3 -pthread -fPIC -shared {c_flags} -I'{include}'"
+                           f" -o '{ext_bin}' '{ext_source}' 2> /dev/null")
+        os.system(compile_command)
+        ext = _load_ext()
+        del(c_flags, include, compile_command)
+    except: ext = None
 # --------------------------------------------------------------------
 
 
+# Get the (pointer, length) of the bytes in "data" while in a "with"
+# block, strings are encoded as UTF-8 and anything else must support
+# the (contiguous) buffer protocol.
+class _buffer:
+    def __init__(self, data):
+        if (type(data) == str): data = data.encode("utf-8")
+        self.view = _Py_buffer()
+        ctypes.pythonapi.PyObject_GetBuffer(data, ctypes.byref(self.view), 0)
+
+    def __enter__(self): return self.view.buf, self.view.len
+
+    def __exit__(self, *args): ctypes.pythonapi.PyBuffer_Release(ctypes.byref(self.view))
+
+
+# Take one compiled program of a `Pattern` (or `PatternSet`) for a
+# search in a "with" block. A program builds its DFA while searching,
+# so each thread searches its own (copies of the first are made as
+# more threads search at once, then reused).
+@contextlib.contextmanager
+def _program(owner):
+    try: handle = owner._idle.pop()
+    except IndexError:
+        handle = (ext.copy(owner._handle) if (ext is not None) else
+                  clib.copy_compiled(owner._handle))
+        if (not handle): raise(MemoryError("Failed to copy compiled program."))
+        owner._copies.append(handle)
+    try: yield handle
+    finally: owner._idle.append(handle)
+
+
+# The results of a search by the extension (`array('i')` objects).
+class _Found:
+    def __init__(self, starts, ends, lines=None, patterns=None, captures=None, n=0,
+                 line_starts=None, line_ends=None):
+        self.starts, self.ends, self.lines, self.patterns = starts, ends, lines, patterns
+        self.line_starts, self.line_ends = line_starts, line_ends
+        self.captures = captures
+        self.n_captures = (len(captures) // (2*n)) if ((captures is not None) and (n > 0)) else 0
+
+
+# Get "n" values of a result in a list, or in an `array('i')` when
+# "arrays" is True (from either the extension or ctypes).
+def _values(values, n, arrays=False):
+    if (type(values) == array.array): return values if arrays else values.tolist()
+    values = values[:n]
+    return array.array("i", values) if arrays else values
+
+
+# Get the groups of the first "n" matches of a search from their
+# captures (see `COMPILE_CAPTURE`), for each match a tuple with the
+# (start, end) of each "()" group, or None for a group that is not
+# part of the match.
+def _groups(results, n):
+    width = 2 * results.n_captures
+    if (width == 0): return [()] * max(n, 0)
+    values = results.captures[:n*width]
+    pairs = [((values[k], values[k+1]) if (values[k] >= 0) else None)
+             for k in range(0, n*width, 2)]
+    return [tuple(pairs[m*width//2:(m+1)*width//2]) for m in range(n)]
+
+
 # Exception to raise when errors are reported by the regex library.
 class RegexError(Exception): pass
 
@@ -161,19 +377,21 @@ class RegexError(Exception): pass
 
 # Given a regular expression in a Unix-like format, translate it to a
 # regular experssion that is (roughly) equivalent in the language of
-# the `regex.c` library.
-def translate_regex(regex, case_sensitive=True):
+# the `regex.c` library (its extended syntax unless "extended=False",
+# with "^" and "$" for lines when "multiline=True").
+def translate_regex(regex, case_sensitive=True, extended=True, multiline=False):
     # Do substitutions that make the underlying regex implementation
     # behave more like common existing regex packages.
     if (len(regex) > 0):
         # Add a ".*" to the front of the regex if the beginning of the
-        # string was not explicitly desired in the match pattern.
-        if (regex[0] == "^"): regex = regex[1:]
+        # string was not explicitly desired in the match pattern (a
+        # "^" for lines stays, it is an anchor after the ".*").
+        if ((regex[0] == "^") and (not multiline)): regex = regex[1:]
         elif ((len(regex) < 2) or (regex[0] != ".") or (regex[1] != '*')): 
             regex = ".*" + regex
         # Add a "{.}" to the end of the regex if the end of the string
-        # was explicitly requested in the pattern.
-        if (regex[-1] == "$"): regex = regex[:-1] + "{.}"
+        # was explicitly requested in the pattern (without anchors).
+        if ((regex[-1] == "$") and (not extended)): regex = regex[:-1] + "{.}"
     # Replace all alphebetical characters with token sets that include
     # all cases of that character.
     if (not case_sensitive):
@@ -216,6 +434,39 @@ def translate_regex(regex, case_sensitive=True):
     return regex
 
 
+# Flags for the C `compile_flags` function, letters match in either
+# case, match starts are found backwards from each end, the extended
+# syntax ("+", counts, and anchors), anchors for lines, the match
+# modes (matches that do not overlap), and the "()" groups of matches.
+COMPILE_IGNORE_CASE = 1
+COMPILE_REVERSE_START = 2
+COMPILE_EXTENDED = 4
+COMPILE_MULTILINE = 8
+COMPILE_FIRST_END = 16
+COMPILE_LONGEST = 32
+COMPILE_CAPTURE = 64
+COMPILE_LINES = 128
+MATCH_MODES = {"all": 0, "first": COMPILE_FIRST_END, "longest": COMPILE_LONGEST}
+
+# Remove "case_sensitive", "reverse_start", "mode", and "captures" from
+# the keyword arguments for `translate_regex` and return the C compile
+# flags for them instead (with those for "extended" and "multiline",
+# which it also uses).
+def _compile_flags(translate_kwargs):
+    flags = 0
+    if (not translate_kwargs.pop("case_sensitive", True)): flags |= COMPILE_IGNORE_CASE
+    if (translate_kwargs.pop("reverse_start", False)): flags |= COMPILE_REVERSE_START
+    mode = translate_kwargs.pop("mode", "all")
+    if (mode not in MATCH_MODES):
+        raise(ValueError(f"Unknown match mode {repr(mode)}, expected 'all', 'first', or 'longest'."))
+    flags |= MATCH_MODES[mode]
+    if (translate_kwargs.pop("captures", False)): flags |= COMPILE_CAPTURE
+    if (translate_kwargs.pop("lines", False)): flags |= COMPILE_LINES
+    if (translate_kwargs.get("extended", True)): flags |= COMPILE_EXTENDED
+    if (translate_kwargs.get("multiline", False)): flags |= COMPILE_MULTILINE
+    return flags
+
+
 # Translate 'start' and 'end' values that are returned by the `regex.c`
 # library, raising appropriate errors as defined by the library.
 def translate_return_values(regex, start, end):
@@ -225,8 +476,11 @@ def translate_return_values(regex, start, end):
         if (end == 0): return None # no match found
         elif (end == -1): return (0, 0) # empty regular expression
         elif ((start == -1) and (end == -5)): return None  # empty string
+        elif ((start == -1) and (end == -7)): # string too long
+            raise(ValueError("Only strings shorter than 2GB (INT_MAX bytes) can be searched."))
         elif (end < -1): # error code provided by C
             err = f"Invalid regular expression (code {-end})"
+            if (end == -6): err = "Regular expression too large, its counts write out too many tokens (code 6)"
             if (start < -1):
                 start -= sum(1 for c in str(regex,"utf-8") if c in "\n\t\r\0")
                 err += f", error at position {-start-1}.\n"
@@ -241,109 +495,161 @@ def translate_return_values(regex, start, end):
 #   match(regex, string) -> (start, end) or None or RegexError,
 # 
 # where "regex" is a string defining a regular expression and "string"
-# is a string to be searched against. The function will return None
+# is a string to be searched against (or bytes, bytearray, memoryview,
+# mmap, or a numpy array, anything with a contiguous buffer, which is
+# searched in place, null characters are ordinary bytes in all of
+# them). The function will return None
 # if there is no match found. If a match is found, a tuple with
 # integers "start" (inclusive index) and "end" (exclusive index) will
 # be returned. If there is a problem with the regular expression,
-# a RegexError will be raised.
+# a RegexError will be raised. Match locations are C integers, so a
+# string of 2GB (INT_MAX bytes) or more raises a ValueError.
 #
 # Some substitutions are made before passing the regular expressions
 # "regex" to the "match" function in 'regex.c'. These substitutions
 # include:
 #
 #  - If "^" is at the beginning of "regex", it will be removed (because
-#    the underlying library implicitly assumes beginning-of-string.
+#    the underlying library implicitly assumes beginning-of-string,
+#    with "multiline=True" it stays as the anchor for a line start).
 #  - If no "^" is placed at the beginning of "regex", then ".*" will
 #    be appened to the beginning of "regex" to behave like other 
 #    regular expression libraries.
-#  - If "$" is the last character of "regex", it will be substituted
-#    with "{.}", the appropriate pattern for end-of-string matches.
+#  - "+", counts like "{2,5}", and the anchors "^" and "$" are those of
+#    the extended syntax of 'regex.c' (`COMPILE_EXTENDED`), unless
+#    "extended=False" is given, then "$" is only special as the last
+#    character of "regex" (substituted with "{.}", the end of string).
+#  - If "multiline=True" is given, "^" and "$" match at the start and
+#    end of every line (with `COMPILE_MULTILINE`).
+#  - If "case_sensitive=False" is given, letters match in either case
+#    (with the `COMPILE_IGNORE_CASE` flag of 'regex.c').
+#  - If "reverse_start=True" is given, the start of each match is found
+#    by scanning backwards from its end (with `COMPILE_REVERSE_START`),
+#    which is faster for regexes like "a.*b" and gives each end once.
+#  - If "mode='first'" is given, `matcha` finds matches that do not
+#    overlap, each the first to end after the last one (with
+#    `COMPILE_FIRST_END`), and with "mode='longest'" each the
+#    leftmost-longest one (with `COMPILE_LONGEST`, like POSIX tools).
+#    The default "mode='all'" finds every end of a match.
+#  - If "captures=True" is given, the (start, end) of every "()" group
+#    (None for a group that is not part of the match) is found in the
+#    same pass (with `COMPILE_CAPTURE`). Then `match` returns (start,
+#    end, groups), `matcha` returns (starts, ends, groups) with the
+#    groups of each match, and `fmatcha` adds those to its results.
+#  - If "lines=True" is given, each line (without its newline) is
+#    searched on its own, like grep (with `COMPILE_LINES`), so no match
+#    holds a newline and '^' holds at the start of every line. Then
+#    `fmatcha` shows the whole line of each match.
 # 
 def match(regex, string, **translate_kwargs):
-    # Translate the regular expression to expected syntax.
-    regex = translate_regex(regex, **translate_kwargs)
-    # Call the C utillity.
-    #   initialize memory storage for the start and end of a match
-    start = ctypes.c_int()
-    end = ctypes.c_int()
-    #   convert strings into character arrays
-    if (type(regex) == str): regex = regex.encode("utf-8")
-    if (type(string) == str): string = string.encode("utf-8")
-    c_regex = ctypes.c_char_p(regex);
-    c_string = ctypes.c_char_p(string);
-    #   execute the C function
-    clib.match(c_regex, c_string, ctypes.byref(start), ctypes.byref(end))
-    del(c_regex, c_string, string)
-    # Return the values from the C library (translating them appropriately)
-    return translate_return_values(regex, start.value, end.value)
-
-# Get all matches for a regex.
-def matcha(regex, string, **translate_kwargs):
-    # Use a C utility to scal the file for all matches.
-    import ctypes
-    # Translate the regular expression to expected syntax.
-    regex = translate_regex(regex, **translate_kwargs)
-    # Call the C utillity.
-    #   initialize memory storage for the start and end of a match
-    n = ctypes.c_int()
-    starts = ctypes.c_void_p()
-    ends = ctypes.c_void_p()
-    #   convert strings into character arrays
-    if (type(regex) == str): regex = regex.encode("utf-8")
-    if (type(string) == str): string = string.encode("utf-8")
-    c_regex = ctypes.c_char_p(regex);
-    c_string = ctypes.c_char_p(string);
-    #   execute the C function
-    clib.matcha(c_regex, c_string, ctypes.byref(n),
-                ctypes.byref(starts), ctypes.byref(ends))
-    # Get the number of matches.
-    n = n.value
-    # Return the values from the C library (translating them appropriately)
-    if (n == 0): return [], []
-    elif (n < 0):
-        if (n == -2): raise(TypeError("`matcha` must be provided with a nonempty string."))
-        elif (n == -1):
-            starts = (ctypes.c_int*1).from_address(starts.value)
-            ends = (ctypes.c_int*1).from_address(ends.value)
-            result = translate_return_values(regex, starts[0], ends[0])
-            # ^^ this might raise an error, otherwise it's a no match
-            if (result == None):    return [], []
-            elif (result == (0,0)): raise(RegexError("`matcha` requires nonempty regular expression."))
-            else:                   raise(NotImplementedError)
-    else:
-        starts = (ctypes.c_int*n).from_address(starts.value)
-        ends = (ctypes.c_int*n).from_address(ends.value)
-    return list(starts), list(ends)
+    return _cached_pattern(regex, translate_kwargs).match(string)
+
+# Get all matches for a regex (only the first "max_matches" when that
+# is nonzero, the search stops there). With "arrays" the starts and ends
+# are `array('i')` objects instead of lists (no Python integer is made
+# for each match, and `numpy.frombuffer` can view them without a copy).
+def matcha(regex, string, max_matches=0, arrays=False, **translate_kwargs):
+    return _cached_pattern(regex, translate_kwargs).matcha(string, max_matches, arrays)
+
+# Find the first match of a regex in each of many "rows" in one call
+# (the regex is compiled once and the rows are spread over "n_threads"
+# threads, one per processor when 0). The rows are a sequence of
+# strings (or bytes-like objects), or with "offsets" one buffer where
+# row k is rows[offsets[k]:offsets[k+1]] (the layout of an Arrow array
+# of strings, "offsets" holds 4 or 8 byte integers). Returns lists
+# (starts, ends) with a start of -1 for rows without a match (see
+# `matcha` for "arrays").
+def match_batch(regex, rows, offsets=None, n_threads=0, arrays=False, **translate_kwargs):
+    return _cached_pattern(regex, translate_kwargs).match_batch(rows, offsets, n_threads, arrays)
+
+
+# Find the first match in each row with a program of "owner" (a
+# `Pattern` or `PatternSet`, see `match_batch`), return the patterns,
+# starts, and ends.
+def _match_batch(owner, rows, offsets, n_threads, arrays):
+    with _program(owner) as handle:
+        if (ext is not None):
+            if (offsets is None): found = ext.match_batch(handle, rows, n_threads)
+            else: found = ext.match_batch_offsets(handle, offsets, rows, n_threads)
+            return tuple(_values(values, len(values), arrays) for values in found)
+        if (offsets is not None):
+            offsets, data = list(offsets), memoryview(rows).cast("B")
+            rows = [data[offsets[k]:offsets[k+1]] for k in range(len(offsets)-1)]
+        rows = [(r.encode("utf-8") if (type(r) == str) else bytes(r)) for r in rows]
+        n = len(rows)
+        found = [(ctypes.c_int * n)() for _ in range(3)]
+        clib.match_batch_threads(handle, (ctypes.c_char_p * n)(*rows),
+                                 (ctypes.c_size_t * n)(*map(len, rows)), n, n_threads, *found)
+        return tuple(_values(values, n, arrays) for values in found)
+
+
+# Translate the outputs of the C `matcha_into` function into Python
+# lists of starts and ends (and the groups of each match when
+# "captures" is True), raising appropriate errors.
+def _matcha_results(n, results, arrays=False, captures=False):
+    if (n == -2): raise(TypeError("`matcha` must be provided with a nonempty string."))
+    elif (n == -1): raise(RegexError("`matcha` requires nonempty regular expression."))
+    elif (n == -3): raise(ValueError("`matcha` only searches strings shorter than 2GB (INT_MAX bytes)."))
+    if captures:
+        return _values(results.starts, n, arrays), _values(results.ends, n, arrays), _groups(results, n)
+    return _values(results.starts, n, arrays), _values(results.ends, n, arrays)
 
 
 # Given a path to a file, search for all nonoverlapping matches in the
 # file and return the count of number of matches and a summary string.
-def fmatcha(path, regex, ascii_ratio=0.7, **translate_kwargs):
+# With "max_matches" (nonzero) only that many matches are found, and
+# with "files_with_matches" only the first one (the summary is then
+# just the path), the rest of the file is not read. Files with fewer
+# than "ascii_ratio" ASCII characters at the start are binary, and
+# "binary" is "skip" (not searched), "scan" (searched like others), or
+# "report" (searched for one match, the summary only names the file,
+# and is just the path with "files_with_matches" as for other files).
+def fmatcha(path, regex, ascii_ratio=0.7, max_matches=0,
+            files_with_matches=False, binary="skip", **translate_kwargs):
     # Make sure the file exists.
-    if (not os.path.exists(path)): return path, 0, ""
-    # Use a C utility to scal the file for all matches.
-    import ctypes
-    # Translate the regular expression to expected syntax.
-    regex = translate_regex(regex, **translate_kwargs)
-    # Call the C utillity.
-    #   initialize memory storage for the start and end of a match
-    n = ctypes.c_int()
-    starts = ctypes.c_void_p()
-    ends = ctypes.c_void_p()
-    lines = ctypes.c_void_p()
-    min_ascii_ratio = ctypes.c_float(ascii_ratio)
-    #   convert strings into character arrays
-    if (type(regex) == str): regex = regex.encode("utf-8")
+    if (not os.path.exists(path)):
+        return (path, 0, "") + (([],) if translate_kwargs.get("captures", False) else ())
+    return _cached_pattern(regex, translate_kwargs).fmatcha(path, ascii_ratio, max_matches,
+                                                            files_with_matches, binary)
+
+
+# Search the file at "path" with a program of "owner" (a `Pattern` or
+# `PatternSet`, see `fmatcha`), return the path, number of matches, and
+# summary string.
+def _fmatcha_file(owner, path, ascii_ratio, max_matches, files_with_matches, binary):
+    if (not os.path.exists(path)): return (path, 0, "") + (([],) if owner.captures else ())
+    if (binary not in {"skip", "scan", "report"}):
+        raise(ValueError(f"Unknown binary mode {repr(binary)}, expected 'skip', 'scan', or 'report'."))
     if (type(path) == str): path = path.encode("utf-8")
-    c_regex = ctypes.c_char_p(regex);
-    c_path = ctypes.c_char_p(path);
-    #   execute the C function
-    clib.fmatcha(c_regex, c_path, ctypes.byref(n),
-                 ctypes.byref(starts), ctypes.byref(ends),
-                 ctypes.byref(lines), min_ascii_ratio)
-    n = n.value
-    path = str(path, 'utf-8')
-    # Return the values from the C library (translating them appropriately)
+    if files_with_matches: max_matches = 1
+    if (binary == "scan"): ascii_ratio = 0.0
+    with _program(owner) as handle, _Results() as results:
+        def search(ascii_ratio, max_matches):
+            if (ext is not None):
+                n, starts, ends, lines, patterns, captures, line_starts, line_ends = \
+                    ext.fmatcha(handle, path, ascii_ratio, max_matches)
+                return n, _Found(starts, ends, lines, patterns, captures, n, line_starts, line_ends)
+            n = clib.fmatcha_limit(handle, ctypes.c_char_p(path), ctypes.c_float(ascii_ratio),
+                                   max_matches, ctypes.byref(results))
+            return n, results
+        n, found = search(ascii_ratio, max_matches)
+        # Search a binary file again (without the check) for one match.
+        if ((n == -3) and (binary == "report")):
+            n, found = search(0.0, 1)
+            path = str(path, 'utf-8')
+            if (n <= 0): summary = _fmatcha_summary(path, n, found)
+            elif files_with_matches: summary = (path, n, f"{PRINT_PREFIX}{path}")
+            else: summary = (path, n, f"{PRINT_PREFIX}binary file {path} matches")
+        else: summary = _fmatcha_summary(str(path, 'utf-8'), n, found, files_with_matches, owner.lines)
+        # With captures, the groups of each match follow the summary.
+        if owner.captures: summary += (_groups(found, n),)
+        return summary
+
+
+# Translate the outputs of the C `fmatcha_limit` function into the number
+# of matches and a printable summary string, raising appropriate errors.
+# With "by_lines" the preview of each match is its line (see `COMPILE_LINES`).
+def _fmatcha_summary(path, n, results, files_with_matches=False, by_lines=False):
     if (n == 0):
         return path, 0, f"  no matches in '{path}'"
     elif (n < 0):
@@ -351,27 +657,34 @@ def fmatcha(path, regex, ascii_ratio=0.7, **translate_kwargs):
             return path, 0, f"  binary file skipped at '{path}'"
         if (n == -2):
             raise(OSError(f"Failed to open file '{path}'."))
+        if (n == -4):
+            raise(OSError(f"File '{path}' is too large to search (2GB or more)."))
         elif (n == -1):
-            starts = (ctypes.c_int*1).from_address(starts.value)[0]
-            ends = (ctypes.c_int*1).from_address(ends.value)[0]
-            result = translate_return_values(regex, starts, ends)
-            # ^^ this might raise an error, otherwise it's a no match
-            if (result == None): return path, 0, f"  no matches in '{path}'"
-            elif (result == (0,0)):
-                raise(RegexError("`fmatcha` requires nonempty regular expression."))
-            else:
-                raise(NotImplementedError)
+            raise(RegexError("`fmatcha` requires nonempty regular expression."))
+    elif files_with_matches:
+        return path, n, f"{PRINT_PREFIX}{path}"
     else:
         # cd ~/Git/Old/VarSys/ ; frex "poetry"
         # cd ~/Git/regex ; frex -s "he" "[.]py"
 
         if PRINT_FILE_SEPARATORS: summary = f"{'-'*70}\n{' '*(32-len(path)//2)}{path}"
         else: summary = ""
-        starts = (ctypes.c_int*n).from_address(starts.value)
-        ends = (ctypes.c_int*n).from_address(ends.value)
-        lines = (ctypes.c_int*n).from_address(lines.value)
+        starts = results.starts[:n]
+        ends = results.ends[:n]
+        lines = results.lines[:n]
+        if by_lines:
+            line_starts = results.line_starts[:n]
+            line_ends = results.line_ends[:n]
         with open(path, "rb") as f:
             for i in range(n):
+                if by_lines:
+                    # Show the line, from around the start of the match when it is long.
+                    first = max(line_starts[i], min(starts[i], line_ends[i]) - HALF_MAX_PREVIEW_WIDTH)
+                    f.seek(first, 0)
+                    match_line_string = str(f.read(min(line_ends[i] - first, 2*HALF_MAX_PREVIEW_WIDTH)))[1:]
+                    if PRINT_FILE_SEPARATORS: summary += f"\n{lines[i]}: {match_line_string}"
+                    else: summary += f"\n{PRINT_PREFIX}{path}:{lines[i]:<5d} {match_line_string}"
+                    continue
                 f.seek(max(0,starts[i]-HALF_MAX_PREVIEW_WIDTH), 0)
                 bytes_to_read = (ends[i] - starts[i]) + 2*HALF_MAX_PREVIEW_WIDTH
                 if (bytes_to_read < 1):
@@ -388,38 +701,560 @@ def fmatcha(path, regex, ascii_ratio=0.7, **translate_kwargs):
         return path, n, summary
 
 
-# Do a fast regular expression search over files that match a given
-# pattern. Find all nonoverlapping matches in the files and print
-# all matching patterns, their files, and their locations.
-def frex(regex, *path_patterns, curdir=".", recursive=True, 
-         parallel=True, **translate_kwargs):
+# The arena of results of one search whose arrays are viewed in place
+# (see `_fmatcha_views`), they are released with the last view.
+class _OwnedResults(_Results):
+    def __del__(self): clib.free_results(ctypes.byref(self))
+
+
+# Get a `memoryview` (format "i") of "n" integers at the C pointer
+# "values" that holds "owner" (the memory is released with it).
+def _view(values, n, owner):
+    array = (ctypes.c_int * n).from_address(ctypes.cast(values, ctypes.c_void_p).value)
+    array._owner = owner
+    return memoryview(array).cast("B").cast("i")
+
+
+# Search the file at "path" with a program of "owner" (a `Pattern` or
+# `PatternSet`) and return (path, starts, ends, lines), and the
+# patterns for a `PatternSet`, or None when the file has no match (or
+# could not be read, or is binary by "ascii_ratio", see `fmatcha`).
+# The arrays are `memoryview` objects (format "i") of the memory the
+# search filled, no values are copied.
+def _fmatcha_views(owner, path, ascii_ratio, max_matches):
+    c_path = path.encode("utf-8") if (type(path) == str) else path
+    with _program(owner) as handle:
+        if (ext is not None):
+            n, starts, ends, lines, patterns = ext.fmatcha_views(handle, c_path, ascii_ratio,
+                                                                 max_matches)
+        else:
+            results = _OwnedResults()
+            n = clib.fmatcha_limit(handle, ctypes.c_char_p(c_path), ctypes.c_float(ascii_ratio),
+                                   max_matches, ctypes.byref(results))
+            if (n > 0):
+                starts, ends, lines, patterns = (_view(values, n, results) for values in
+                    (results.starts, results.ends, results.lines, results.patterns))
+    if (n == -1): raise(RegexError("`fmatchs` requires nonempty regular expression."))
+    if (n <= 0): return None
+    return (path, starts, ends, lines) + ((patterns,) if isinstance(owner, PatternSet) else ())
+
+
+# The number of files searched ahead of the ones given back by
+# `fmatchs`, for each thread.
+FMATCHS_AHEAD = 4
+
+# Search every file of "paths" with "owner" (see `_fmatcha_views`) on
+# "n_threads" threads (one per processor when 0), giving back the
+# results of each file with a match as soon as it is searched. Only a
+# few files per thread are searched ahead of the ones given back.
+def _fmatchs(owner, paths, ascii_ratio, max_matches, n_threads):
+    from concurrent.futures import ThreadPoolExecutor, wait, FIRST_COMPLETED
+    if (n_threads <= 0): n_threads = os.cpu_count()
+    paths = iter(paths)
+    with ThreadPoolExecutor(n_threads) as pool:
+        pending = set()
+        while True:
+            for path in paths:
+                pending.add(pool.submit(_fmatcha_views, owner, path, ascii_ratio, max_matches))
+                if (len(pending) >= FMATCHS_AHEAD * n_threads): break
+            if (len(pending) == 0): return
+            done, pending = wait(pending, return_when=FIRST_COMPLETED)
+            for future in done:
+                found = future.result()
+                if (found is not None): yield found
+
+
+# Given paths to files, search each file for all nonoverlapping
+# matches (in parallel) and yield (path, starts, ends, lines) for each
+# file with a match as soon as it is searched (not in the order of
+# "paths"). The arrays are `memoryview` objects (format "i") of the
+# memory filled by the search (no values are copied, `numpy.frombuffer`
+# views them too), it is released with the last view. With
+# "max_matches" (nonzero) only that many matches are found in each
+# file. Files with fewer than "ascii_ratio" ASCII characters at the
+# start (binary), and files that can not be read, are passed over.
+def fmatchs(paths, regex, ascii_ratio=0.7, max_matches=0, n_threads=0, **translate_kwargs):
+    return _cached_pattern(regex, translate_kwargs).fmatchs(paths, ascii_ratio, max_matches,
+                                                            n_threads)
+
+
+# A compiled regular expression. The translated regular expression
+# and the token / jump tables built by the C library are kept for the
+# lifetime of this object, so repeated searches only pay for the
+# translation and compilation once.
+# 
+#   Pattern(regex, **translate_kwargs) -> Pattern or RegexError,
+# 
+# where "regex" and "translate_kwargs" are the same as for `match`.
+# The methods `match`, `matcha`, and `fmatcha` behave like the module
+# level functions of the same name, without the "regex" argument.
+class Pattern:
+    _handle = None
+
+    def __init__(self, regex, **translate_kwargs):
+        self.regex = regex
+        flags = _compile_flags(translate_kwargs)
+        self.captures = bool(flags & COMPILE_CAPTURE)
+        self.lines = bool(flags & COMPILE_LINES)
+        self.translated = translate_regex(regex, **translate_kwargs)
+        if (type(self.translated) == str): self.translated = self.translated.encode("utf-8")
+        self._handle = clib.compile_flags(ctypes.c_char_p(self.translated), flags)
+        if (not self._handle): raise(MemoryError("Failed to compile regular expression."))
+        # Raise an error now if the regular expression was not valid.
+        n_tokens, n_groups = (ctypes.c_int*2).from_address(self._handle)
+        if (n_tokens < 0): translate_return_values(self.translated, n_tokens, n_groups)
+        self._idle, self._copies = [self._handle], [] # (see `_program`)
+
+    def __del__(self):
+        for handle in getattr(self, "_copies", ()): clib.free_compiled(handle)
+        if (self._handle): clib.free_compiled(self._handle)
+        self._handle = None
+
+    def __repr__(self): return f"Pattern({repr(self.regex)})"
+
+    # Find the first match in "string", see `match`.
+    def match(self, string):
+        if (ext is not None):
+            if (type(string) == str): string = string.encode("utf-8")
+            with _program(self) as handle:
+                _, start, end, captures = ext.match(handle, string)
+            result = translate_return_values(self.translated, start, end)
+            if (result is None) or (not self.captures): return result
+            return result + (_groups(_Found(None, None, captures=captures, n=1), 1)[0],)
+        # (With captures, the first match is found with its groups.)
+        if self.captures:
+            with _program(self) as handle, _Results() as results, _buffer(string) as (buffer, length):
+                n = clib.matcha_limit(handle, buffer, length, 1, ctypes.byref(results))
+                if (n <= 0): return None
+                return (results.starts[0], results.ends[0]) + (_groups(results, 1)[0],)
+        start = ctypes.c_int()
+        end = ctypes.c_int()
+        with _program(self) as handle, _buffer(string) as (buffer, length):
+            clib.match_compiledn(handle, buffer, length,
+                                 ctypes.byref(start), ctypes.byref(end))
+        return translate_return_values(self.translated, start.value, end.value)
+
+    # Find all matches in "string", see `matcha`.
+    def matcha(self, string, max_matches=0, arrays=False):
+        if (ext is not None):
+            if (type(string) == str): string = string.encode("utf-8")
+            with _program(self) as handle:
+                n, starts, ends, _, captures = ext.matcha(handle, string, max_matches)
+            return _matcha_results(n, _Found(starts, ends, captures=captures, n=n),
+                                   arrays, self.captures)
+        with _program(self) as handle, _Results() as results, _buffer(string) as (buffer, length):
+            n = clib.matcha_limit(handle, buffer, length, max_matches,
+                                  ctypes.byref(results))
+            return _matcha_results(n, results, arrays, self.captures)
+
+    # Find the first match in each of many rows, see `match_batch`.
+    def match_batch(self, rows, offsets=None, n_threads=0, arrays=False):
+        return _match_batch(self, rows, offsets, n_threads, arrays)[1:]
+
+    # Find all matches in the file at "path", see `fmatcha`.
+    def fmatcha(self, path, ascii_ratio=0.7, max_matches=0,
+                files_with_matches=False, binary="skip"):
+        return _fmatcha_file(self, path, ascii_ratio, max_matches,
+                             files_with_matches, binary)
+
+    # Search many files, yielding the results of each, see `fmatchs`.
+    def fmatchs(self, paths, ascii_ratio=0.7, max_matches=0, n_threads=0):
+        return _fmatchs(self, paths, ascii_ratio, max_matches, n_threads)
+
+    # Start searching input that arrives in pieces, see `Stream`.
+    def stream(self): return Stream(self)
+
+
+# Compile a regular expression for repeated use, see `Pattern`.
+def compile(regex, **translate_kwargs):
+    return Pattern(regex, **translate_kwargs)
+
+
+# A compiled set of regular expressions, all searched for in a single
+# pass over each string or file (each file is only read once).
+# 
+#   PatternSet(regexes, **translate_kwargs) -> PatternSet or RegexError,
+# 
+# where "regexes" is a sequence of regular expressions and
+# "translate_kwargs" are the same as for `match`. The methods `match`,
+# `matcha`, and `fmatcha` behave like those of `Pattern`, and also
+# give the index (into "regexes") of the regular expression that
+# produced each match.
+class PatternSet:
+    _handle = None
+
+    def __init__(self, regexes, **translate_kwargs):
+        self.regexes = list(regexes)
+        flags = _compile_flags(translate_kwargs)
+        self.captures = bool(flags & COMPILE_CAPTURE)
+        self.lines = bool(flags & COMPILE_LINES)
+        self.translated = [translate_regex(r, **translate_kwargs) for r in self.regexes]
+        self.translated = [(t.encode("utf-8") if (type(t) == str) else t)
+                           for t in self.translated]
+        c_regexes = (ctypes.c_char_p * len(self.translated))(*self.translated)
+        self._handle = clib.compile_set_flags(c_regexes, len(self.translated), flags)
+        if (not self._handle): raise(MemoryError("Failed to compile regular expressions."))
+        # Raise an error now if any of the regular expressions was not valid.
+        n_tokens, n_groups, bad = (ctypes.c_int*3).from_address(self._handle)
+        if (n_tokens < 0): translate_return_values(self.translated[bad], n_tokens, n_groups)
+        self._idle, self._copies = [self._handle], [] # (see `_program`)
+
+    def __del__(self):
+        for handle in getattr(self, "_copies", ()): clib.free_compiled(handle)
+        if (self._handle): clib.free_compiled(self._handle)
+        self._handle = None
+
+    def __repr__(self): return f"PatternSet({repr(self.regexes)})"
+
+    # Find the first match in "string", return (index, start, end) or None.
+    def match(self, string):
+        if (ext is not None):
+            if (type(string) == str): string = string.encode("utf-8")
+            with _program(self) as handle:
+                pattern, start, end, captures = ext.match(handle, string)
+            groups = _Found(None, None, captures=captures, n=1)
+        elif self.captures:
+            with _program(self) as handle, _Results() as results, _buffer(string) as (buffer, length):
+                n = clib.matcha_limit(handle, buffer, length, 1, ctypes.byref(results))
+                if (n <= 0): return None
+                return (results.patterns[0], results.starts[0], results.ends[0]) + (_groups(results, 1)[0],)
+        else:
+            pattern, start, end = ctypes.c_int(), ctypes.c_int(), ctypes.c_int()
+            with _program(self) as handle, _buffer(string) as (buffer, length):
+                clib.match_setn(handle, buffer, length, ctypes.byref(pattern),
+                                ctypes.byref(start), ctypes.byref(end))
+            pattern, start, end = pattern.value, start.value, end.value
+        result = translate_return_values(self.translated[0], start, end)
+        if (result is None): return None
+        if self.captures: result += (_groups(groups, 1)[0],)
+        return (pattern,) + result
+
+    # Find all matches in "string", return lists (indices, starts, ends),
+    # or `array('i')` objects with "arrays" (see `matcha`).
+    def matcha(self, string, max_matches=0, arrays=False):
+        if (ext is not None):
+            if (type(string) == str): string = string.encode("utf-8")
+            with _program(self) as handle:
+                n, starts, ends, patterns, captures = ext.matcha(handle, string, max_matches)
+            found = _matcha_results(n, _Found(starts, ends, captures=captures, n=n),
+                                    arrays, self.captures)
+            return (_values(patterns, n, arrays),) + found
+        with _program(self) as handle, _Results() as results, _buffer(string) as (buffer, length):
+            n = clib.matcha_limit(handle, buffer, length, max_matches,
+                                  ctypes.byref(results))
+            found = _matcha_results(n, results, arrays, self.captures)
+            return (_values(results.patterns, n, arrays),) + found
+
+    # Find the first match in each of many rows, return (indices, starts,
+    # ends) where the index is "len(regexes)" for rows without a match
+    # (see `match_batch`).
+    def match_batch(self, rows, offsets=None, n_threads=0, arrays=False):
+        return _match_batch(self, rows, offsets, n_threads, arrays)
+
+    # Find all matches in the file at "path", see `fmatcha`.
+    def fmatcha(self, path, ascii_ratio=0.7, max_matches=0,
+                files_with_matches=False, binary="skip"):
+        return _fmatcha_file(self, path, ascii_ratio, max_matches,
+                             files_with_matches, binary)
+
+    # Search many files, yielding (path, starts, ends, lines, patterns)
+    # for each (see `fmatchs`).
+    def fmatchs(self, paths, ascii_ratio=0.7, max_matches=0, n_threads=0):
+        return _fmatchs(self, paths, ascii_ratio, max_matches, n_threads)
+
+    # Start searching input that arrives in pieces, see `Stream`.
+    def stream(self): return Stream(self)
+
+
+# Compile a set of regular expressions for searching in one pass, see `PatternSet`.
+def compile_set(regexes, **translate_kwargs):
+    return PatternSet(regexes, **translate_kwargs)
+
+
+# The most recently used compiled patterns of the module level
+# functions (`match`, `matcha`, `fmatcha`, ...), kept by the regex (or
+# tuple of regexes) and keyword arguments, so a regex that is given
+# again (like a path pattern for every file of a walk) is translated
+# and compiled once. Invalid regexes are not kept (the error is raised
+# again on each call).
+PATTERN_CACHE_SIZE = 256
+@functools.lru_cache(maxsize=PATTERN_CACHE_SIZE)
+def _cached(kind, regex, translate_items):
+    return kind(regex, **dict(translate_items))
+
+# Get the (cached) `Pattern` for "regex" with "translate_kwargs".
+def _cached_pattern(regex, translate_kwargs):
+    return _cached(Pattern, regex, tuple(sorted(translate_kwargs.items())))
+
+# Get the (cached) `PatternSet` for "regexes" with "translate_kwargs".
+def _cached_set(regexes, translate_kwargs):
+    return _cached(PatternSet, tuple(regexes), tuple(sorted(translate_kwargs.items())))
+
+
+# Get the counts of the work done by all searches in this process
+# (since the last reset) as a dictionary, or None when the library is
+# not built to keep them (set "REGEX_STATS" in the environment before
+# importing to build one that does). The counts are the "searches",
+# "files" read, files skipped by the "ascii_skips" check, "bytes"
+# scanned, simulation "steps" and stack "pushes", most tokens active
+# at once ("peak_active"), and nanoseconds spent compiling ("compile_ns").
+def stats(reset=False):
+    counts = _Stats()
+    if (not clib.read_stats(ctypes.byref(counts), int(bool(reset)))): return None
+    counts = {name:getattr(counts, name) for (name,_) in _Stats._fields_}
+    # Add the counts of the searches done by the extension.
+    ext_counts = None if (ext is None) else ext.read_stats(bool(reset))
+    if (ext_counts is not None):
+        for (name,_), value in zip(_Stats._fields_, ext_counts):
+            if (name == "peak_active"): counts[name] = max(counts[name], value)
+            else: counts[name] += value
+    return counts
+
+
+# A search over input that arrives in pieces (from a pipe or a
+# socket), made by `Pattern.stream` or `PatternSet.stream`. Memory use
+# does not grow with the input.
+# 
+#   Stream.feed(data) -> list of matches that ended within "data",
+#   Stream.finish() -> list of matches that end with the stream,
+# 
+# where "data" is bytes (or a str, encoded as UTF-8) and matches are
+# (start, end) offsets from the start of the stream for a `Pattern`,
+# or (index, start, end) for a `PatternSet`.
+class Stream:
+    _handle = None
+
+    def __init__(self, pattern):
+        self.pattern = pattern # (keeps the compiled program alive)
+        self._with_index = isinstance(pattern, PatternSet)
+        self._found = []
+        def found(data, index, start, end):
+            self._found.append((index, start, end) if self._with_index else (start, end))
+        self._callback = stream_callback(found)
+        self._handle = clib.stream_init(pattern._handle)
+        if (not self._handle): raise(MemoryError("Failed to start stream."))
+
+    def __del__(self):
+        if (self._handle): clib.stream_finish(self._handle, stream_callback(), None)
+        self._handle = None
+
+    def __repr__(self): return f"Stream({repr(self.pattern)})"
+
+    # Search the next piece of the stream, return the matches that ended.
+    def feed(self, data):
+        self._found = []
+        with _buffer(data) as (buffer, length):
+            clib.stream_feed(self._handle, buffer, length, self._callback, None)
+        return self._found
+
+    # End the stream, return the matches that end with it.
+    def finish(self):
+        self._found = []
+        if (self._handle): clib.stream_finish(self._handle, self._callback, None)
+        self._handle = None
+        return self._found
+
+
+# Flags for the C `walk_files` function, list the files of every
+# subdirectory, and pass over ".git" and the paths matched by the rules
+# of ".gitignore" and ".ignore" files.
+WALK_RECURSIVE = 1
+WALK_IGNORE = 2
+
+# Get the paths of the files below "curdir" (each starting with it),
+# listed by the C `walk_files` with "flags", passing over files over
+# "max_bytes" (unless it is 0). The types of entries come from the
+# directory listings, so most files are never checked with "stat".
+def _walk(curdir, flags, max_bytes=0):
+    paths = ctypes.c_void_p()
+    n_bytes = ctypes.c_longlong()
+    n = clib.walk_files(os.fsencode(curdir), flags, max_bytes,
+                        ctypes.byref(paths), ctypes.byref(n_bytes))
+    if (n < 0): raise(MemoryError("Failed to allocate memory for the paths of a walk."))
+    listed = ctypes.string_at(paths, n_bytes.value)
+    clib.free_paths(paths)
+    return [os.fsdecode(p) for p in listed.split(b"\0")[:-1]]
+
+
+# The name of the trigram index file of a directory tree (see `index`).
+INDEX_FILE = ".regex-index"
+
+# Get the files of the index at "index_path" as a dictionary from
+# their paths (relative to its directory) to their number in the index,
+# modification time (ns), and size, or None when there is no (valid)
+# index. The index is memory mapped, only its file table is read.
+def _index_files(index_path):
+    import mmap, struct
+    try:
+        with open(index_path, "rb") as f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as view:
+            magic, version, n_files, n_trigrams, n_postings, n_path_bytes = struct.unpack_from("4s5i", view)
+            if ((magic != b"RXTI") or (version != 1)): return None
+            stamps = array.array("q", view[24:24+16*n_files])
+            paths = view[len(view)-n_path_bytes:].split(b"\0")[:-1]
+    except (OSError, ValueError, struct.error): return None
+    if (len(paths) != n_files): return None
+    return {os.fsdecode(p): (k, stamps[2*k], stamps[2*k+1]) for (k,p) in enumerate(paths)}
+
+
+# Build (or refresh) the trigram index of every file below "curdir",
+# kept in the file INDEX_FILE there, so that `frex` only searches the
+# files that hold every trigram of the literal factors of a regex.
+# Files with the same modification time and size as in the last build
+# are not read again (their trigrams are kept). Binary files and files
+# over 64MB are listed but not indexed, they are always searched. With
+# "ignore" the files passed over by ignore files are not indexed (see
+# `frex`). Returns the number of files indexed and the number read.
+def index(curdir=".", ignore=True):
+    root = os.path.abspath(curdir)
+    prefix = os.path.join(root, "")
+    index_path = os.path.join(root, INDEX_FILE)
+    old = _index_files(index_path) or {}
+    paths, stamps, reuse = [], array.array("q"), array.array("i")
+    for path in _walk(root, WALK_RECURSIVE | (WALK_IGNORE if ignore else 0)):
+        name = path[len(prefix):]
+        if (name in (INDEX_FILE, INDEX_FILE+".tmp")): continue
+        try: info = os.stat(path)
+        except OSError: continue
+        stamp = (info.st_mtime_ns, info.st_size)
+        paths.append(os.fsencode(name))
+        stamps.extend(stamp)
+        file = old.get(name)
+        reuse.append(file[0] if ((file is not None) and (file[1:] == stamp)) else -1)
+    c_paths = (ctypes.c_char_p * len(paths))(*paths)
+    with _buffer(stamps) as (c_stamps, _), _buffer(reuse) as (c_reuse, _):
+        read = clib.index_build(os.fsencode(index_path), os.fsencode(root),
+                                len(paths), c_paths, c_stamps, c_reuse)
+    if (read == -1): raise(MemoryError("Failed to allocate memory for the index."))
+    if (read < 0): raise(OSError(f"Failed to write the index '{index_path}'."))
+    return (len(paths), read)
+
+
+# Get the paths (below "curdir") that can hold a match of the compiled
+# "owner" (a `Pattern` or `PatternSet`) by the index of "curdir", every
+# path that is not in the index or has changed since it was built,
+# and the rest only when the index keeps them. Without an index (or
+# when it can not be read) all paths are given back.
+def _index_paths(owner, curdir, paths):
+    index_path = os.path.join(curdir, INDEX_FILE)
+    files = _index_files(index_path)
+    if (files is None): return paths
+    keep = bytearray(len(files))
+    if (clib.index_search(owner._handle, os.fsencode(index_path),
+                          (ctypes.c_char * len(keep)).from_buffer(keep)) < 0): return paths
+    prefix = os.path.join(curdir, "")
+    kept = []
+    for path in paths:
+        name = path[len(prefix):]
+        if (name in (INDEX_FILE, INDEX_FILE+".tmp")): continue
+        file = files.get(name)
+        # (Only the files that would be passed over are checked for changes.)
+        if ((file is not None) and (not keep[file[0]])):
+            try: info = os.stat(path)
+            except OSError: info = None
+            if ((info is not None) and ((info.st_mtime_ns, info.st_size) == file[1:])): continue
+        kept.append(path)
+    return kept
+
+
+# Given a path to a file, search for all nonoverlapping matches of any
+# of the regular expressions in "regexes", see `fmatcha`.
+def fmatcha_set(path, regexes, ascii_ratio=0.7, max_matches=0,
+                files_with_matches=False, binary="skip", **translate_kwargs):
+    return _cached_set(regexes, translate_kwargs).fmatcha(path, ascii_ratio, max_matches,
+                                                          files_with_matches, binary)
+
+
+# Get the paths of the files below "curdir" that `frex` searches for
+# "regex", those that match a path pattern (see `frex` for the rest).
+def _frex_paths(regex, path_patterns, curdir, recursive, use_index, ignore,
+                max_bytes, translate_kwargs):
     # Get all candidate paths that *might* be searched.
-    if recursive:
-        candidate_paths = os.walk(curdir)
-    else:
-        candidate_paths = ((curdir,None,[p]) for p in os.listdir(curdir)
-                           if os.path.isfile(os.path.join(curdir,p)))
-    # Determine searchable paths from candidate paths.
+    candidate_paths = _walk(curdir, (WALK_RECURSIVE if recursive else 0) |
+                            (WALK_IGNORE if ignore else 0), max_bytes)
+    # Determine searchable paths from candidate paths. The path patterns
+    # are compiled once into a set, so each path is checked by one
+    # search (an empty path pattern matches every path).
+    every_path = ("" in path_patterns)
+    path_set = None
+    if ((len(path_patterns) > 0) and (not every_path)):
+        path_set = _cached_set(path_patterns, translate_kwargs)
     paths = []
-    for (dirname, _, file_paths) in candidate_paths:
-        for fname in file_paths:
-            path = os.path.join(dirname, fname)
-            for pattern in path_patterns:
-                if (match(pattern, path, **translate_kwargs) is not None): break
-            else: continue
-            paths.append(path)
+    for path in candidate_paths:
+        if ((not every_path) and ((path_set is None) or (path_set.match(path) is None))):
+            continue
+        paths.append(path)
+    # Pass over the files that the index shows can not hold a match.
+    if (use_index and os.path.exists(os.path.join(curdir, INDEX_FILE))):
+        many = (type(regex) in {list, tuple})
+        owner = (_cached_set if many else _cached_pattern)(regex, translate_kwargs)
+        paths = _index_paths(owner, curdir, paths)
+    return paths
+
+
+# Search the same files as `frex` does (with the same path patterns
+# and keyword arguments) and yield (path, starts, ends, lines) for
+# each file with a match as soon as it is searched, instead of printing
+# (see `fmatchs`, for a list of regexes the patterns of the matches
+# follow). Nothing is printed, and the consumer of the results runs
+# while the next files are searched.
+def frexs(regex, *path_patterns, curdir=".", recursive=True, max_matches=0,
+          ascii_ratio=0.7, n_threads=0, use_index=True, ignore=True, max_bytes=0,
+          **translate_kwargs):
+    many = (type(regex) in {list, tuple})
+    paths = _frex_paths(regex, path_patterns, curdir, recursive, use_index,
+                        ignore, max_bytes, translate_kwargs)
+    owner = (_cached_set if many else _cached_pattern)(regex, translate_kwargs)
+    return owner.fmatchs(paths, ascii_ratio, max_matches, n_threads)
+
+
+# Do a fast regular expression search over files that match a given
+# pattern. Find all nonoverlapping matches in the files and print
+# all matching patterns, their files, and their locations. If "regex"
+# is a list (or tuple) of regular expressions, matches of any of them
+# are found in one pass over each file. With "max_matches" (nonzero)
+# at most that many matches are found in each file, and with
+# "files_with_matches" only the paths of matching files are printed
+# (the search of each file stops at its first match). Binary files are
+# searched as given by "binary" (see `fmatcha`). With "ignore", ".git"
+# and the paths matched by the rules of ".gitignore" and ".ignore"
+# files are passed over (ignored directories are not walked), and
+# files over "max_bytes" are passed over unless it is 0. When "curdir"
+# has a trigram index (see `index`) and "use_index" is True, only the
+# files that it keeps (and the ones changed since it was built) are
+# searched.
+def frex(regex, *path_patterns, curdir=".", recursive=True, parallel=True,
+         max_matches=0, files_with_matches=False, binary="skip", use_index=True,
+         ignore=True, max_bytes=0, **translate_kwargs):
+    many = (type(regex) in {list, tuple})
+    paths = _frex_paths(regex, path_patterns, curdir, recursive, use_index,
+                        ignore, max_bytes, translate_kwargs)
     # Perform the search over all the candidate paths (in parallel).
-    if parallel:
-        from regex import fmatcha as p_fmatcha
+    limits = dict(max_matches=max_matches, files_with_matches=files_with_matches,
+                  binary=binary)
+    # With the extension, threads share one compiled pattern (the GIL
+    # is released while each file is searched).
+    if (parallel and (ext is not None)):
+        from concurrent.futures import ThreadPoolExecutor
+        patterns = (compile_set if many else compile)(regex, **translate_kwargs)
+        pool = ThreadPoolExecutor(os.cpu_count())
+        match_iterator = pool.map(lambda p: patterns.fmatcha(p, **limits), paths)
+    elif parallel:
+        if many: from regex import fmatcha_set as p_fmatcha
+        else:    from regex import fmatcha as p_fmatcha
         from regex.parallel import map as p_map
-        match_iterator = p_map(p_fmatcha, paths, args=(regex,), kwargs=translate_kwargs)
+        match_iterator = p_map(p_fmatcha, paths, args=(regex,),
+                               kwargs=dict(translate_kwargs, **limits))
+    elif many:
+        patterns = compile_set(regex, **translate_kwargs)
+        match_iterator = (patterns.fmatcha(p, **limits) for p in paths)
     else:
-        match_iterator = (fmatcha(p, regex, **translate_kwargs) for p in paths)
+        match_iterator = (fmatcha(p, regex, **limits, **translate_kwargs) for p in paths)
     # Cycle over all matches and print the summaries.
     matches = {}
     for p,n,s in match_iterator:
         matches[p] = n
         if (n > 0): print(s)
+    if (parallel and (ext is not None)): pool.shutdown()
     # Return the dictionary containing all paths and matches.
     return matches
 
@@ -436,6 +1271,19 @@ del(f)
 # Main for when this is executed as a program.
 def main():
     import sys
+    # Extract all "-e <search-pattern>" options (before other flags,
+    # so that a search pattern can look like a flag).
+    regexes = []
+    while ("-e" in sys.argv[1:-1]):
+        i = sys.argv.index("-e", 1)
+        regexes.append(sys.argv[i+1])
+        sys.argv = sys.argv[:i] + sys.argv[i+2:]
+    # Build (or refresh) the index of the current directory for the
+    # "index" command (a search for "index" is written "-e index").
+    if ((len(regexes) == 0) and (sys.argv[1:] == ["index"])):
+        n_files, n_read = index(os.path.curdir)
+        print(f" indexed {n_files} files ({n_read} read) in '{os.path.abspath(INDEX_FILE)}'")
+        return
     # Extract the "not recursive" optional flag if it exists.
     if ("-n" in sys.argv):
         recursive = False
@@ -451,13 +1299,58 @@ def main():
         serial = True
         sys.argv.remove("-s")
     else: serial = False
+    # Extract the "files with matches" optional flag if it exists.
+    if ("-l" in sys.argv):
+        files_with_matches = True
+        sys.argv.remove("-l")
+    else: files_with_matches = False
+    # Extract the "-m <count>" most matches per file if it exists.
+    max_matches = 0
+    if ("-m" in sys.argv[1:-1]):
+        i = sys.argv.index("-m", 1)
+        max_matches = int(sys.argv[i+1])
+        sys.argv = sys.argv[:i] + sys.argv[i+2:]
+    # Extract the "-b <binary>" mode for binary files if it exists.
+    binary = "skip"
+    if ("-b" in sys.argv[1:-1]):
+        i = sys.argv.index("-b", 1)
+        binary = sys.argv[i+1]
+        sys.argv = sys.argv[:i] + sys.argv[i+2:]
+    # Extract the "line mode" optional flag if it exists.
+    if ("-L" in sys.argv):
+        lines = True
+        sys.argv.remove("-L")
+    else: lines = False
+    # Extract the "unrestricted" optional flag if it exists.
+    if ("-u" in sys.argv):
+        ignore = False
+        sys.argv.remove("-u")
+    else: ignore = True
+    # Extract the "-M <bytes>" largest file to search if it exists.
+    max_bytes = 0
+    if ("-M" in sys.argv[1:-1]):
+        i = sys.argv.index("-M", 1)
+        max_bytes = int(sys.argv[i+1])
+        sys.argv = sys.argv[:i] + sys.argv[i+2:]
+    # Extract the "ignore the index" optional flag if it exists.
+    if ("-I" in sys.argv):
+        use_index = False
+        sys.argv.remove("-I")
+    else: use_index = True
+    # Extract the "statistics" optional flag if it exists.
+    if ("-S" in sys.argv):
+        statistics = True
+        sys.argv.remove("-S")
+    else: statistics = False
     # Check for proper usage.
-    if (len(sys.argv) < 2):
+    if ((len(sys.argv) < 2) and (len(regexes) == 0)):
         print(f'''
 ERROR: Only {len(sys.argv)} command line argument{'s' if len(sys.argv) > 1 else ''} provided.
 
 Expected call to look like:
-  python3 -m regex [-n] [-c] [-s] "<search-pattern>" ["<path-pattern-1>"] ["<path-pattern-2>"] [...]
+  python3 -m regex [-n] [-c] [-s] [-S] [-l] [-L] [-I] [-u] [-m <count>] [-M <bytes>] [-b <binary>] "<search-pattern>" ["<path-pattern-1>"] ["<path-pattern-2>"] [...]
+  python3 -m regex [-n] [-c] [-s] [-S] [-l] [-L] [-I] [-u] [-m <count>] [-M <bytes>] [-b <binary>] -e "<search-pattern-1>" [-e "<search-pattern-2>"] [...] ["<path-pattern-1>"] [...]
+  python3 -m regex index
 
 "-n" is provided if the call to `frex` should NOT recursively
 search all files in the directory tree from the current directory.
@@ -469,29 +1362,78 @@ meaning the letters should be matched with the exact same case.
 
 "-s" is provided if the search should be run serially (not in parallel).
 
+"-l" is provided to only print the paths of files with a match (the
+search of each file stops at its first match).
+
+"-m <count>" is provided to find at most "count" matches in each file
+(the search of each file stops there).
+
+"-b <binary>" is how to search binary files, "skip" (the default),
+"scan" them like other files, or "report" the path of each one with
+a match.
+
+"-L" is provided to search each line on its own (no match holds a
+newline, and the whole line of each match is shown).
+
+"-u" is provided to search every file, also the ones in ".git" and
+the ones matched by the rules of ".gitignore" and ".ignore" files
+(which are passed over by default, ignored directories are not walked).
+
+"-M <bytes>" is provided to pass over the files larger than "bytes".
+
+"-I" is provided to search every file, ignoring the trigram index of
+the current directory (when there is one, only the files that can
+hold a match are searched, build or refresh it with
+"python3 -m regex index").
+
+"index" alone builds (or refreshes) the trigram index of every file
+below the current directory, reading only the files that changed
+since the last build (search for "index" itself with "-e index").
+
+"-S" is provided to print the statistics of the search (of this
+process, so best with "-s"), when "REGEX_STATS" is set in the environment.
+
+"-e" is provided before each search pattern when there are several,
+all of them are searched for in one pass over each file (and then
+every other argument is a path pattern).
+
 See `python -c "import regex; help(regex)"` for more detailed 
 documentation including the regular expression language specification.
 ''')
         exit()
-    regex = sys.argv[1]
-    print("Given regex:",str([regex])[1:-1])
-    print("Using regex:",str([translate_regex(regex,case_sensitive)])[1:-1])
-    path_patterns = sys.argv[2:]
+    if (len(regexes) == 0):
+        regex = sys.argv[1]
+        print("Given regex:",str([regex])[1:-1])
+        print("Using regex:",str([translate_regex(regex)])[1:-1])
+        path_patterns = sys.argv[2:]
+    else:
+        regex = regexes
+        for r in regexes:
+            print("Given regex:",str([r])[1:-1])
+            print("Using regex:",str([translate_regex(r)])[1:-1])
+        path_patterns = sys.argv[1:]
     # Set the default path pattern to match all paths.
     if (len(path_patterns) == 0): path_patterns = [""]
     curdir = os.path.abspath(os.path.curdir)
     # Do a fast regular expression search.
     matches = frex(regex, *path_patterns, curdir, recursive=recursive,
-                   case_sensitive=case_sensitive, parallel=(not serial))
+                   case_sensitive=case_sensitive, reverse_start=True,
+                   parallel=(not serial), max_matches=max_matches,
+                   files_with_matches=files_with_matches, binary=binary,
+                   use_index=use_index, ignore=ignore, max_bytes=max_bytes, lines=lines)
     total_matches = sum(matches.values())
     if (total_matches > 0):
         print(f"\n found {total_matches} match{'es' if total_matches > 0 else ''} across {len(matches)} files")
     else:
         print(f"\n no matches found across {len(matches)} files")
+    if statistics:
+        counts = stats()
+        if (counts is None): print(" no statistics, set REGEX_STATS in the environment to keep them")
+        else: print(" " + ", ".join(f"{name} {value}" for (name,value) in counts.items()))
 
 
 # When using "from regex import *", only get these variables:
-__all__ = [RegexError, match, frex, match, matcha, main]
+__all__ = [RegexError, Pattern, PatternSet, Stream, compile, compile_set, match, frex, frexs, fmatchs, index, match, matcha, match_batch, stats, main]
 
 # cd ~/Git/Old/VarSys/3-Dissertation ; python3 -m regex "poetry"
 if __name__ == "__main__":
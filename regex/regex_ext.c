@@ -0,0 +1,388 @@
+// cc -O3 -pthread -fPIC -shared -I<python include> -o regex_ext.so regex_ext.c
+//
+// A CPython extension module ("regex_ext") built on 'regex.c', used
+// by 'regex.py' (which builds it) when the Python headers are found.
+// Each search takes any contiguous buffer (bytes, bytearray, mmap,
+// memoryview, numpy arrays) without a copy, releases the global
+// interpreter lock while scanning, and returns the results as
+// `array('i')` objects (which numpy can view with `numpy.frombuffer`).
+//
+// Programs are compiled by 'regex.so' and passed in by address (the
+// structures are the same, both come from 'regex.c'). A program holds
+// the DFA it builds lazily, so it must only be searched by one thread
+// at a time, `copy` makes another program for another thread.
+//
+//   copy(program) -> program
+//   match(program, buffer) -> (pattern, start, end, captures)
+//   matcha(program, buffer, max_matches) -> (n, starts, ends, patterns, captures)
+//   fmatcha(program, path, min_ascii_ratio, max_matches)
+//     -> (n, starts, ends, lines, patterns, captures, line_starts, line_ends)
+//   fmatcha_views(program, path, min_ascii_ratio, max_matches)
+//     -> (n, starts, ends, lines, patterns)
+//   match_batch(program, rows, n_threads) -> (patterns, starts, ends)
+//   match_batch_offsets(program, offsets, data, n_threads)
+//     -> (patterns, starts, ends)
+//   read_stats(reset) -> tuple of counts, or None
+//
+// The "start", "end", and "n" values are those of `match_setn`,
+// `matcha_limit`, and `fmatcha_limit` (negative for errors), the
+// "captures" hold the start and end of each "()" group of each match
+// one after the other (empty without COMPILE_CAPTURE), and a match
+// in a file is in the lines from "line_starts" to "line_ends". The rows
+// of `match_batch` are a sequence of str (searched as UTF-8) or
+// buffers, those of `match_batch_offsets` are the bytes of "data"
+// between consecutive "offsets" (a buffer of 4 or 8 byte integers,
+// one more than the rows, the way Arrow stores arrays of strings).
+// The results of `fmatcha_views` are not copied, they are `memoryview`
+// objects (format "i") of the arrays filled by the search, which are
+// released once the last view of them is.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define REGEX_EXTENSION
+
+// Include the source code for regex here in the extension.
+#include "regex.c"
+
+
+// The `array.array` type (set when the module is created).
+static PyObject * _array_type = NULL;
+
+
+// Make an `array('i')` holding a copy of "n" integers.
+static PyObject * _ext_array(const int * values, const int n) {
+  PyObject * array = PyObject_CallFunction(_array_type, "s", "i");
+  if ((array == NULL) || (n <= 0)) return array;
+  PyObject * view = PyMemoryView_FromMemory((char *) values, n * sizeof(int), PyBUF_READ);
+  PyObject * added = (view == NULL) ? NULL : PyObject_CallMethod(array, "frombytes", "O", view);
+  Py_XDECREF(view);
+  if (added == NULL) {
+    Py_DECREF(array);
+    return NULL;
+  }
+  Py_DECREF(added);
+  return array;
+}
+
+
+// The results of one search, held for the views of their arrays
+// (exported as one buffer of bytes, see `fmatcha_views`).
+typedef struct {
+  PyObject_HEAD
+  struct found_matches results;
+} _ext_results;
+
+static void _ext_results_dealloc(PyObject * self) {
+  free_results(&(((_ext_results *) self)->results));
+  Py_TYPE(self)->tp_free(self);
+}
+
+static int _ext_results_buffer(PyObject * self, Py_buffer * view, int flags) {
+  const struct found_matches * results = &(((_ext_results *) self)->results);
+  const Py_ssize_t n = (Py_ssize_t) results->size * (6 + 2*results->n_captures);
+  return PyBuffer_FillInfo(view, self, results->starts, n * sizeof(int), 1, flags);
+}
+
+static PyBufferProcs _ext_results_procs = {_ext_results_buffer, NULL};
+
+static PyTypeObject _ext_results_type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "regex_ext.results",
+  .tp_basicsize = sizeof(_ext_results),
+  .tp_dealloc = _ext_results_dealloc,
+  .tp_as_buffer = &_ext_results_procs,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "The arrays of the results of one search (viewed by `fmatcha_views`).",
+};
+
+
+// Make a `memoryview` of "n" integers of a results buffer "values"
+// ("i" format), starting at "values[first]".
+static PyObject * _ext_view(PyObject * values, const Py_ssize_t first, const Py_ssize_t n) {
+  return PySequence_GetSlice(values, first, first + n);
+}
+
+
+// copy(program) -> program
+static PyObject * _ext_copy(PyObject * self, PyObject * args) {
+  Py_ssize_t address;
+  if (! PyArg_ParseTuple(args, "n", &address)) return NULL;
+  struct compiled_regex * copy = _copy_program((struct compiled_regex *) address);
+  if (copy == NULL) return PyErr_NoMemory();
+  return PyLong_FromVoidPtr(copy);
+}
+
+
+// match(program, buffer) -> (pattern, start, end, captures)
+static PyObject * _ext_match(PyObject * self, PyObject * args) {
+  Py_ssize_t address;
+  Py_buffer buffer;
+  if (! PyArg_ParseTuple(args, "ny*", &address, &buffer)) return NULL;
+  struct compiled_regex * program = (struct compiled_regex *) address;
+  const int width = (program->n_tokens > 0) ? 2 * program->n_captures : 0;
+  int * captures = (width > 0) ? malloc(width * sizeof(int)) : NULL;
+  if ((width > 0) && (captures == NULL)) {
+    PyBuffer_Release(&buffer);
+    return PyErr_NoMemory();
+  }
+  int pattern = 0, start, end;
+  Py_BEGIN_ALLOW_THREADS
+  _match(program, buffer.buf, _buffer_length((size_t) buffer.len),
+         &pattern, &start, &end, NULL, captures);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&buffer);
+  PyObject * value = Py_BuildValue("(iiiN)", pattern, start, end, _ext_array(captures, width));
+  free(captures);
+  return value;
+}
+
+
+// matcha(program, buffer, max_matches) -> (n, starts, ends, patterns, captures)
+static PyObject * _ext_matcha(PyObject * self, PyObject * args) {
+  Py_ssize_t address;
+  Py_buffer buffer;
+  int max_matches = 0;
+  if (! PyArg_ParseTuple(args, "ny*|i", &address, &buffer, &max_matches)) return NULL;
+  struct found_matches results = {0};
+  int n;
+  Py_BEGIN_ALLOW_THREADS
+  n = matcha_limit((struct compiled_regex *) address, buffer.buf, (size_t) buffer.len,
+                   max_matches, &results);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&buffer);
+  const int kept = (n > 0) ? n : 0;
+  PyObject * value = Py_BuildValue("(iNNNN)", n, _ext_array(results.starts, kept),
+                                   _ext_array(results.ends, kept),
+                                   _ext_array(results.patterns, kept),
+                                   _ext_array(results.captures, 2 * results.n_captures * kept));
+  free_results(&results);
+  return value;
+}
+
+
+// fmatcha(program, path, min_ascii_ratio, max_matches)
+//   -> (n, starts, ends, lines, patterns, captures, line_starts, line_ends)
+static PyObject * _ext_fmatcha(PyObject * self, PyObject * args) {
+  Py_ssize_t address;
+  const char * path;
+  float min_ascii_ratio = 0.7;
+  int max_matches = 0;
+  if (! PyArg_ParseTuple(args, "ny|fi", &address, &path, &min_ascii_ratio, &max_matches))
+    return NULL;
+  struct found_matches results = {0};
+  int n;
+  Py_BEGIN_ALLOW_THREADS
+  n = fmatcha_limit((struct compiled_regex *) address, path, min_ascii_ratio,
+                    max_matches, &results);
+  Py_END_ALLOW_THREADS
+  const int kept = (n > 0) ? n : 0;
+  PyObject * value = Py_BuildValue("(iNNNNNNN)", n, _ext_array(results.starts, kept),
+                                   _ext_array(results.ends, kept),
+                                   _ext_array(results.lines, kept),
+                                   _ext_array(results.patterns, kept),
+                                   _ext_array(results.captures, 2 * results.n_captures * kept),
+                                   _ext_array(results.line_starts, kept),
+                                   _ext_array(results.line_ends, kept));
+  free_results(&results);
+  return value;
+}
+
+
+// fmatcha_views(program, path, min_ascii_ratio, max_matches)
+//   -> (n, starts, ends, lines, patterns)
+static PyObject * _ext_fmatcha_views(PyObject * self, PyObject * args) {
+  Py_ssize_t address;
+  const char * path;
+  float min_ascii_ratio = 0.7;
+  int max_matches = 0;
+  if (! PyArg_ParseTuple(args, "ny|fi", &address, &path, &min_ascii_ratio, &max_matches))
+    return NULL;
+  _ext_results * owner = PyObject_New(_ext_results, &_ext_results_type);
+  if (owner == NULL) return NULL;
+  owner->results = (struct found_matches) {0};
+  struct found_matches * results = &(owner->results);
+  int n;
+  Py_BEGIN_ALLOW_THREADS
+  n = fmatcha_limit((struct compiled_regex *) address, path, min_ascii_ratio,
+                    max_matches, results);
+  Py_END_ALLOW_THREADS
+  if (n <= 0) {
+    Py_DECREF(owner);
+    return Py_BuildValue("(iOOOO)", n, Py_None, Py_None, Py_None, Py_None);
+  }
+  // View the whole buffer as integers, then each array within it.
+  PyObject * bytes = PyMemoryView_FromObject((PyObject *) owner);
+  Py_DECREF(owner); // (the views hold it)
+  PyObject * values = (bytes == NULL) ? NULL : PyObject_CallMethod(bytes, "cast", "s", "i");
+  Py_XDECREF(bytes);
+  if (values == NULL) return NULL;
+  PyObject * value = Py_BuildValue("(iNNNN)", n,
+                                   _ext_view(values, results->starts - results->starts, n),
+                                   _ext_view(values, results->ends - results->starts, n),
+                                   _ext_view(values, results->lines - results->starts, n),
+                                   _ext_view(values, results->patterns - results->starts, n));
+  Py_DECREF(values);
+  return value;
+}
+
+
+// Search "n" rows with `match_batch_threads` (without the GIL), and
+// return the results as (patterns, starts, ends).
+static PyObject * _ext_batch(const Py_ssize_t address, const char ** strings,
+                             const size_t * lengths, const int n, const int n_threads) {
+  int * results = malloc((3*(size_t)n + 1) * sizeof(int));
+  if (results == NULL) return PyErr_NoMemory();
+  Py_BEGIN_ALLOW_THREADS
+  match_batch_threads((struct compiled_regex *) address, strings, lengths, n, n_threads,
+                      results, results + n, results + 2*n);
+  Py_END_ALLOW_THREADS
+  PyObject * value = Py_BuildValue("(NNN)", _ext_array(results, n),
+                                   _ext_array(results + n, n),
+                                   _ext_array(results + 2*n, n));
+  free(results);
+  return value;
+}
+
+
+// match_batch(program, rows, n_threads) -> (patterns, starts, ends)
+static PyObject * _ext_match_batch(PyObject * self, PyObject * args) {
+  Py_ssize_t address;
+  PyObject * rows;
+  int n_threads = 0;
+  if (! PyArg_ParseTuple(args, "nO|i", &address, &rows, &n_threads)) return NULL;
+  PyObject * sequence = PySequence_Fast(rows, "rows must be a sequence");
+  if (sequence == NULL) return NULL;
+  const Py_ssize_t n = PySequence_Fast_GET_SIZE(sequence);
+  if (n > INT_MAX) {
+    Py_DECREF(sequence);
+    return PyErr_Format(PyExc_OverflowError, "too many rows (%zd)", n);
+  }
+  const char ** strings = malloc((n + 1) * sizeof(char *));
+  size_t * lengths = malloc((n + 1) * sizeof(size_t));
+  Py_buffer * views = malloc((n + 1) * sizeof(Py_buffer));
+  PyObject * value = NULL;
+  Py_ssize_t n_views = 0; // (views held until the search is done)
+  if ((strings == NULL) || (lengths == NULL) || (views == NULL)) {
+    PyErr_NoMemory();
+  } else {
+    Py_ssize_t k = 0;
+    for (; k < n; k++) {
+      PyObject * row = PySequence_Fast_GET_ITEM(sequence, k);
+      if (PyUnicode_Check(row)) {
+        Py_ssize_t length;
+        strings[k] = PyUnicode_AsUTF8AndSize(row, &length);
+        if (strings[k] == NULL) break;
+        lengths[k] = (size_t) length;
+      } else {
+        if (PyObject_GetBuffer(row, views + n_views, PyBUF_SIMPLE) < 0) break;
+        strings[k] = views[n_views].buf;
+        lengths[k] = (size_t) views[n_views].len;
+        n_views++;
+      }
+    }
+    if (k == n) value = _ext_batch(address, strings, lengths, (int) n, n_threads);
+  }
+  for (Py_ssize_t v = 0; v < n_views; v++) PyBuffer_Release(views + v);
+  free(views);
+  free(lengths);
+  free(strings);
+  Py_DECREF(sequence);
+  return value;
+}
+
+
+// match_batch_offsets(program, offsets, data, n_threads)
+//   -> (patterns, starts, ends)
+static PyObject * _ext_match_batch_offsets(PyObject * self, PyObject * args) {
+  Py_ssize_t address;
+  PyObject * offsets_object;
+  Py_buffer offsets, data;
+  int n_threads = 0;
+  if (! PyArg_ParseTuple(args, "nOy*|i", &address, &offsets_object, &data, &n_threads))
+    return NULL;
+  if (PyObject_GetBuffer(offsets_object, &offsets, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+  PyObject * value = NULL;
+  const Py_ssize_t n = (offsets.itemsize > 0) ? offsets.len / offsets.itemsize - 1 : -1;
+  const char ** strings = NULL;
+  size_t * lengths = NULL;
+  const char * format = (offsets.format == NULL) ? "B" : offsets.format;
+  if (((offsets.itemsize != 4) && (offsets.itemsize != 8)) ||
+      (strchr("iIlLqQ", format[strlen(format)-1]) == NULL)) {
+    PyErr_SetString(PyExc_TypeError, "offsets must hold 4 or 8 byte integers");
+  } else if ((n < 0) || (n > INT_MAX)) {
+    PyErr_SetString(PyExc_ValueError, "offsets must hold one more integer than the rows");
+  } else if (((strings = malloc((n + 1) * sizeof(char *))) == NULL) ||
+             ((lengths = malloc((n + 1) * sizeof(size_t))) == NULL)) {
+    PyErr_NoMemory();
+  } else {
+    Py_ssize_t k = 0;
+    for (; k < n; k++) {
+      long long first, last;
+      if (offsets.itemsize == 4) {
+        first = ((const int *) offsets.buf)[k];
+        last = ((const int *) offsets.buf)[k+1];
+      } else {
+        first = ((const long long *) offsets.buf)[k];
+        last = ((const long long *) offsets.buf)[k+1];
+      }
+      if ((first < 0) || (last < first) || (last > data.len)) break;
+      strings[k] = (const char *) data.buf + first;
+      lengths[k] = (size_t) (last - first);
+    }
+    if (k == n) value = _ext_batch(address, strings, lengths, (int) n, n_threads);
+    else PyErr_Format(PyExc_ValueError, "offsets of row %zd are outside of the data", k);
+  }
+  free(lengths);
+  free(strings);
+  PyBuffer_Release(&offsets);
+  PyBuffer_Release(&data);
+  return value;
+}
+
+
+// read_stats(reset) -> tuple of counts, or None
+static PyObject * _ext_read_stats(PyObject * self, PyObject * args) {
+  int reset = 0;
+  if (! PyArg_ParseTuple(args, "|p", &reset)) return NULL;
+  struct regex_stats stats;
+  if (! read_stats(&stats, reset)) Py_RETURN_NONE;
+  return Py_BuildValue("(LLLLLLLL)", stats.searches, stats.files, stats.ascii_skips,
+                       stats.bytes, stats.steps, stats.pushes, stats.peak_active,
+                       stats.compile_ns);
+}
+
+
+static PyMethodDef _ext_methods[] = {
+  {"copy", _ext_copy, METH_VARARGS, "Copy a compiled program (for another thread)."},
+  {"match", _ext_match, METH_VARARGS, "Find the first match in a buffer."},
+  {"matcha", _ext_matcha, METH_VARARGS, "Find all matches in a buffer."},
+  {"fmatcha", _ext_fmatcha, METH_VARARGS, "Find all matches in a file."},
+  {"fmatcha_views", _ext_fmatcha_views, METH_VARARGS,
+   "Find all matches in a file, viewing the arrays of the results in place."},
+  {"match_batch", _ext_match_batch, METH_VARARGS, "Find the first match in each of many rows."},
+  {"match_batch_offsets", _ext_match_batch_offsets, METH_VARARGS,
+   "Find the first match in each row of an offsets and data buffer."},
+  {"read_stats", _ext_read_stats, METH_VARARGS, "Read the counts of work done by searches."},
+  {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef _ext_module = {
+  PyModuleDef_HEAD_INIT, "regex_ext",
+  "Searches of 'regex.c' over buffers, without the global interpreter lock.",
+  -1, _ext_methods
+};
+
+
+PyMODINIT_FUNC PyInit_regex_ext(void) {
+  PyObject * array = PyImport_ImportModule("array");
+  if (array == NULL) return NULL;
+  _array_type = PyObject_GetAttrString(array, "array");
+  Py_DECREF(array);
+  if (_array_type == NULL) return NULL;
+  if (PyType_Ready(&_ext_results_type) < 0) return NULL;
+  return PyModule_Create(&_ext_module);
+}
@@ -0,0 +1,451 @@
+// cc -O3 -pthread -o regex_gen regex_gen.c
+// ./regex_gen <name> <regex> [<name> <regex> ...] > patterns.c && cc -O3 -c patterns.c
+//
+// Generate C code with one specialized matcher for each regular
+// expression known ahead of time, to be compiled into a linkable
+// object (with no other dependency than the C library):
+//
+//   void <name>(const char * buffer, size_t length, int * start, int * end)
+//     Sets "start" and "end" the same way as `match_compiledn` does
+//     with a program compiled with COMPILE_REVERSE_START.
+//
+// The DFA of each regex is built in full (instead of lazily), and
+// every state becomes a block of code that jumps straight to the next
+// one, so there are no table lookups beyond the class of each byte,
+// no state that is computed at search time, and no allocation. States
+// that loop on all but one byte skip ahead with `memchr`, states that
+// loop on most bytes skip ahead through a table. Once a match ends,
+// its start is found with a second DFA that walks backwards (see
+// `_reverse_start`). Only regexes that start with ".*" (as unanchored
+// searches do) can be generated. With "-h" the prototypes are printed
+// instead (for a header). Nothing is printed (and the exit status is
+// 1) when any of the regexes can not be generated.
+//
+// With "-t" the matchers are printed in a program that checks them
+// against the engine (`match_compiledn`) on random strings, with
+// "regex.c" on the include path:
+//
+//   ./regex_gen -t [<name> <regex> ...] > check.c && cc -I. -o check check.c && ./check
+//
+// (without any regexes, a fixed set of them is checked).
+
+#define BENCHMARK
+
+// Include the source code for regex here in the generator.
+#include "regex.c"
+
+
+#define GEN_MAX_STATES 4096
+//      ^^ most states of either DFA of one regex
+#define GEN_SKIP_BYTES 192
+//      ^^ fewest bytes a state must loop on to skip ahead through a table
+#define GEN_CHECK_STRINGS 20000
+//      ^^ random strings each matcher is checked on (with "-t")
+#define GEN_CHECK_LENGTH 48
+//      ^^ longest random string (its bytes are mostly those of the regex)
+
+
+// The DFA that finds match starts backwards, each state is a sorted
+// set of the tokens (and the end of the pattern, "n_tokens") that lead
+// to the end of the match from one index.
+struct gen_reverse {
+  int n_states;
+  int * set_at; // start of the set of each state within "sets"
+  int * sets;   // all sets, concatenated in state order
+  int n_sets;   // number of integers used in "sets"
+  int * trans;  // next state, per state and byte class
+};
+
+
+// Add the set in "list" ("n" nodes, one flag each in "in_list") to the
+// reverse DFA after adding every split that leads to one of its nodes,
+// return the index of its state (or -1 if there are too many).
+static int _gen_reverse_state(const struct compiled_regex * program,
+                              struct regex_dfa * dfa, struct gen_reverse * reverse,
+                              int * list, int n, char * in_list) {
+  const int n_nodes = program->n_tokens + program->n_patterns;
+  for (int a = 0; a < n; a++) {
+    for (int r = dfa->rev_at[list[a]]; r < dfa->rev_at[list[a]+1]; r++) {
+      const int u = dfa->rev[r];
+      if ((program->code[u].op == TOKEN_SPLIT) && (! in_list[u])) {
+        list[n++] = u;
+        in_list[u] = 1;
+      }
+    }
+  }
+  n = 0;
+  for (int v = 0; v < n_nodes; v++) {
+    if (in_list[v]) list[n++] = v;
+    in_list[v] = 0;
+  }
+  for (int s = 0; s < reverse->n_states; s++) {
+    const int * other = reverse->sets + reverse->set_at[s];
+    if (reverse->set_at[s+1] - reverse->set_at[s] != n) continue;
+    int k = 0;
+    while ((k < n) && (other[k] == list[k])) k++;
+    if (k == n) return s;
+  }
+  if (reverse->n_states >= GEN_MAX_STATES) return -1;
+  memcpy(reverse->sets + reverse->n_sets, list, n * sizeof(int));
+  reverse->n_sets += n;
+  reverse->n_states++;
+  reverse->set_at[reverse->n_states] = reverse->n_sets;
+  return reverse->n_states - 1;
+}
+
+
+// Get the state of the reverse DFA one index before "state", when the
+// character there is "c" (the tokens that jump into the set on "c").
+static int _gen_reverse_step(const struct compiled_regex * program,
+                             struct regex_dfa * dfa, struct gen_reverse * reverse,
+                             const int state, const int c, int * list, char * in_list) {
+  int n = 0;
+  for (int k = reverse->set_at[state]; k < reverse->set_at[state+1]; k++) {
+    const int t = reverse->sets[k];
+    for (int r = dfa->rev_at[t]; r < dfa->rev_at[t+1]; r++) {
+      const int u = dfa->rev[r];
+      if ((program->code[u].op != TOKEN_SPLIT) && (! in_list[u]) &&
+          ((_token_match(program, u, c) ? program->code[u].jumps : program->code[u].jumpf) == t)) {
+        list[n++] = u;
+        in_list[u] = 1;
+      }
+    }
+  }
+  return _gen_reverse_state(program, dfa, reverse, list, n, in_list);
+}
+
+
+// Return 1 if the reverse DFA stops at "state" (the set either holds
+// the first token or is empty), otherwise 0.
+static int _gen_reverse_final(const struct compiled_regex * program,
+                              const struct gen_reverse * reverse, const int state) {
+  if (reverse->set_at[state+1] == reverse->set_at[state]) return 1;
+  for (int k = reverse->set_at[state]; k < reverse->set_at[state+1]; k++)
+    if (reverse->sets[k] == program->entries[0]) return 1;
+  return 0;
+}
+
+
+// Write the bytes (or a range of them) of a class as "case" labels.
+static void _gen_cases(FILE * out, const struct regex_dfa * dfa, const int cls) {
+  int b = 0;
+  while (b < 256) {
+    if (dfa->byte_classes[b] != cls) {
+      b++;
+      continue;
+    }
+    int last = b;
+    while ((last+1 < 256) && (dfa->byte_classes[last+1] == cls)) last++;
+    if (last > b) fprintf(out, "    case %d ... %d:\n", b, last);
+    else fprintf(out, "    case %d:\n", b);
+    b = last + 1;
+  }
+}
+
+
+// Generate the matcher "name" for "regex", return 0 or an error message.
+static const char * _gen_matcher(FILE * out, const char * name, const char * regex) {
+  struct compiled_regex * program = compile_flags(regex, COMPILE_REVERSE_START);
+  if (program == NULL) return "out of memory";
+  if (program->n_tokens <= 0) {
+    free_compiled(program);
+    return "invalid regular expression";
+  }
+  if (! program->reverse) {
+    free_compiled(program);
+    return "only regular expressions that start with \".*\" can be generated";
+  }
+  struct regex_dfa * dfa = _dfa_init(program);
+  program->dfa = dfa;
+  if (dfa == NULL) {
+    free_compiled(program);
+    return "out of memory";
+  }
+  const int n_classes = dfa->n_classes;
+  const int end_class = n_classes - 1;
+  const int n_tokens = program->n_tokens;
+  const char * error = NULL;
+  // Build every state of the forward DFA (they are numbered in the
+  // order they are created, so a loop over them reaches them all).
+  for (int s = 0; (s < dfa->n_states) && (error == NULL); s++) {
+    if (s == DFA_DEAD) continue;
+    for (int cls = 0; cls < n_classes; cls++) {
+      if ((dfa->trans[s*n_classes + cls] == DFA_UNKNOWN) &&
+          (_dfa_transition(program, dfa, s, cls) == DFA_FULL)) {
+        error = "the DFA is too large";
+        break;
+      }
+    }
+    if (dfa->n_states > GEN_MAX_STATES) error = "the DFA has too many states";
+  }
+  // Build the reverse DFA from the end of the pattern (on the index
+  // where it ends, or on the index after for matches that end after
+  // consuming the character at the index of the transition).
+  const int n_nodes = n_tokens + program->n_patterns;
+  struct gen_reverse reverse = {0, NULL, NULL, 0, NULL};
+  reverse.set_at = calloc(GEN_MAX_STATES + 1, sizeof(int));
+  reverse.sets = malloc((size_t) GEN_MAX_STATES * n_nodes * sizeof(int));
+  reverse.trans = malloc((size_t) GEN_MAX_STATES * n_classes * sizeof(int));
+  int * list = malloc(n_nodes * sizeof(int));
+  char * in_list = calloc(n_nodes, 1);
+  if ((reverse.set_at == NULL) || (reverse.sets == NULL) || (reverse.trans == NULL) ||
+      (list == NULL) || (in_list == NULL)) error = "out of memory";
+  int done_state = -1; // the end of the pattern, with the splits that lead to it
+  if (error == NULL) {
+    // (state 0 is the end of the pattern alone, entered only by a step)
+    reverse.sets[0] = n_tokens;
+    reverse.n_sets = 1;
+    reverse.n_states = 1;
+    reverse.set_at[1] = 1;
+    list[0] = n_tokens;
+    in_list[n_tokens] = 1;
+    done_state = _gen_reverse_state(program, dfa, &reverse, list, 1, in_list);
+  }
+  for (int s = 0; (s < reverse.n_states) && (error == NULL); s++) {
+    for (int cls = 0; cls < n_classes; cls++) {
+      const int c = (cls == end_class) ? EOF : (unsigned char) dfa->class_bytes[cls];
+      reverse.trans[s*n_classes + cls] = _gen_reverse_step(program, dfa, &reverse, s, c, list, in_list);
+      if (reverse.trans[s*n_classes + cls] < 0) {
+        error = "the reverse DFA has too many states";
+        break;
+      }
+    }
+  }
+  if (error == NULL) {
+    // The bytes each state skips with a table.
+    fprintf(out, "\n\n// %s\n", regex);
+    int * skip = malloc(dfa->n_states * sizeof(int)); // byte to find (-1 table, -2 none)
+    int n_tables = 0;
+    for (int s = 0; s < dfa->n_states; s++) {
+      int n_loop = 0, exit = -1;
+      for (int b = 0; b < 256; b++) {
+        if (dfa->trans[s*n_classes + dfa->byte_classes[b]] == ((s*n_classes) << 2)) n_loop++;
+        else exit = b;
+      }
+      skip[s] = (s == DFA_DEAD) ? -2 : (n_loop == 255) ? exit : (n_loop >= GEN_SKIP_BYTES) ? -1 : -2;
+      if (skip[s] != -1) continue;
+      fprintf(out, "static const unsigned char %s_stay%d[256] = {", name, s);
+      for (int b = 0; b < 256; b++)
+        fprintf(out, "%s%d", (b == 0) ? "\n  " : (b % 32) ? "," : ",\n  ",
+                dfa->trans[s*n_classes + dfa->byte_classes[b]] == ((s*n_classes) << 2));
+      fprintf(out, "\n};\n");
+      n_tables++;
+    }
+    // The forward states, each ends with the jump for the class of its
+    // byte (the end of the buffer is checked first).
+    fprintf(out, "\nvoid %s(const char * buffer, size_t length, int * start, int * end) {\n", name);
+    fprintf(out, "  const unsigned char * s = (const unsigned char *) buffer;\n");
+    fprintf(out, "  const size_t n = length;\n");
+    fprintf(out, "  size_t i = 0;\n");
+    fprintf(out, "  if (n == 0) {\n    (*start) = %d;\n    (*end) = %d;\n    return;\n  }\n",
+            EXIT_TOKEN, STRING_EMPTY_ERROR);
+    fprintf(out, "  if (n >= INT_MAX) {\n    (*start) = %d;\n    (*end) = %d;\n    return;\n  }\n",
+            EXIT_TOKEN, STRING_TOO_LONG_ERROR);
+    unsigned char ends[2*1];
+    char * reached = calloc(reverse.n_states, 1); // reverse states that are jumped to
+    // Only states that are jumped to get a label (the start state is
+    // entered first, without one), and likewise the end with no match.
+    char * jumped = calloc(dfa->n_states, 1);
+    int stops = 0;
+    for (int s = 0; s < dfa->n_states; s++) {
+      if (s == DFA_DEAD) continue;
+      for (int cls = 0; cls < n_classes; cls++) {
+        const int next = dfa->trans[s*n_classes + cls];
+        if (next & DFA_ENDED) continue;
+        else if (next & DFA_STOP) stops = 1;
+        else jumped[(next >> 2) / n_classes] = 1;
+      }
+    }
+    for (int s = 0; s < dfa->n_states; s++) {
+      if (s == DFA_DEAD) continue;
+      if (jumped[s]) fprintf(out, " f%d:\n", s);
+      if (skip[s] >= 0) {
+        fprintf(out, "  {\n    const unsigned char * hit = memchr(s + i, %d, n - i);\n", skip[s]);
+        fprintf(out, "    i = (hit == NULL) ? n : (size_t) (hit - s);\n  }\n");
+      } else if (skip[s] == -1) {
+        fprintf(out, "  while ((i < n) && %s_stay%d[s[i]]) i++;\n", name, s);
+      }
+      // Write the jump of one class (the end of the buffer when "cls" is the last).
+      for (int cls = (n_classes-1); cls >= 0; cls--) {
+        const int next = dfa->trans[s*n_classes + cls];
+        const int c = (cls == end_class) ? EOF : (unsigned char) dfa->class_bytes[cls];
+        const int to = (next >> 2) / n_classes;
+        if (cls == end_class) fprintf(out, "  if (i >= n) {\n");
+        else _gen_cases(out, dfa, cls);
+        const char * indent = (cls == end_class) ? "    " : "      ";
+        if (next & DFA_ENDED) {
+          ends[0] = ends[1] = 0;
+          _dfa_ends(program, dfa, s, c, ends);
+          // A match that ends here is found first (see `_search_from`).
+          const int r = ends[0] ? done_state : reverse.trans[0*n_classes + cls];
+          fprintf(out, "%s(*end) = (int) i%s;\n%sgoto r%d;\n", indent, ends[0] ? "" : " + 1", indent, r);
+          reached[r] = 1;
+        } else if (next & DFA_STOP) {
+          fprintf(out, "%sgoto none;\n", indent);
+        } else {
+          fprintf(out, "%si++;\n%sgoto f%d;\n", indent, indent, to);
+        }
+        if (cls == end_class) fprintf(out, "  }\n  switch (s[i]) {\n");
+      }
+      fprintf(out, "  }\n");
+    }
+    // The reverse states, each either holds the first token (the match
+    // starts at "i") or steps back over the byte before "i".
+    for (int changed = 1; changed; ) {
+      changed = 0;
+      for (int s = 0; s < reverse.n_states; s++) {
+        if ((! reached[s]) || _gen_reverse_final(program, &reverse, s)) continue;
+        for (int cls = 0; cls < end_class; cls++) {
+          changed |= ! reached[reverse.trans[s*n_classes + cls]];
+          reached[reverse.trans[s*n_classes + cls]] = 1;
+        }
+      }
+    }
+    for (int s = 0; s < reverse.n_states; s++) {
+      if (! reached[s]) continue;
+      fprintf(out, " r%d:\n", s);
+      if (_gen_reverse_final(program, &reverse, s)) {
+        const int empty = (reverse.set_at[s+1] == reverse.set_at[s]);
+        fprintf(out, "  (*start) = %s;\n  return;\n", empty ? "0" : "(int) i");
+        continue;
+      }
+      fprintf(out, "  if (i == 0) {\n    (*start) = 0;\n    return;\n  }\n");
+      fprintf(out, "  i--;\n  switch (s[i]) {\n");
+      for (int cls = 0; cls < end_class; cls++) {
+        _gen_cases(out, dfa, cls);
+        fprintf(out, "      goto r%d;\n", reverse.trans[s*n_classes + cls]);
+      }
+      fprintf(out, "  }\n");
+    }
+    if (stops) fprintf(out, " none:\n  (*start) = %d;\n  (*end) = 0;\n", EXIT_TOKEN);
+    fprintf(out, "}\n");
+    free(jumped);
+    free(reached);
+    free(skip);
+  }
+  free(in_list);
+  free(list);
+  free(reverse.trans);
+  free(reverse.sets);
+  free(reverse.set_at);
+  free_compiled(program);
+  return error;
+}
+
+
+// The matchers checked by "-t" when none are given, names alternate
+// with regexes (that cover skips by `memchr` and tables, counts,
+// groups, sets, anchors, and matches that end with the buffer).
+#define GEN_CHECK_PAIRS 12
+static char * gen_check_pairs[2*GEN_CHECK_PAIRS] = {
+  "check_any", ".*a", "check_hidden", ".*{a}b", "check_star", ".*a*",
+  "check_group", ".*(ab)*c", "check_not", ".*[^a]b", "check_gaps", ".*x.*y.*z",
+  "check_pairs", ".*(a|b)(c|d)", "check_skip", ".*...a", "check_end", ".*$",
+  "check_count", ".*a{2,3}b", "check_plus", ".*(a|bc)+d", "check_number", ".*[0-9]+\\.[0-9]"
+};
+
+
+// Write "string" as a C string literal.
+static void _gen_string(FILE * out, const char * string) {
+  fputc('"', out);
+  for (const unsigned char * c = (const unsigned char *) string; (*c) != '\0'; c++) {
+    if (((*c) == '"') || ((*c) == '\\')) fprintf(out, "\\%c", *c);
+    else if (((*c) < ' ') || ((*c) > '~')) fprintf(out, "\\%03o", *c);
+    else fputc(*c, out);
+  }
+  fputc('"', out);
+}
+
+
+// Write the "main" of a program that checks the "n" matchers named in
+// "pairs" (alternating with their regexes) against `match_compiledn`
+// on random strings, made mostly of the bytes of each regex.
+static void _gen_check(FILE * out, char ** pairs, const int n) {
+  fprintf(out, "\n\nint main(void) {\n  const char * regexes[%d] = {", n);
+  for (int m = 0; m < n; m++) {
+    if (m > 0) fprintf(out, ", ");
+    _gen_string(out, pairs[2*m+1]);
+  }
+  fprintf(out, "};\n  void (* matchers[%d])(const char *, size_t, int *, int *) = {", n);
+  for (int m = 0; m < n; m++) fprintf(out, "%s%s", (m > 0) ? ", " : "", pairs[2*m]);
+  fprintf(out, "};\n");
+  fprintf(out,
+          "  unsigned long long state = 88172645463325252ULL;\n"
+          "  char buffer[%d];\n"
+          "  for (int m = 0; m < %d; m++) {\n"
+          "    struct compiled_regex * program = compile_flags(regexes[m], COMPILE_REVERSE_START);\n"
+          "    const int n_bytes = (int) strlen(regexes[m]);\n"
+          "    for (int t = 0; t < %d; t++) {\n"
+          "      // (xorshift, one in eight bytes is any byte, the rest are from the regex)\n"
+          "      state ^= state << 13; state ^= state >> 7; state ^= state << 17;\n"
+          "      const int length = (int) (state %% %d);\n"
+          "      for (int k = 0; k < length; k++) {\n"
+          "        state ^= state << 13; state ^= state >> 7; state ^= state << 17;\n"
+          "        buffer[k] = ((state >> 8) %% 8) ? regexes[m][(state >> 16) %% n_bytes] : (char) (state >> 24);\n"
+          "      }\n"
+          "      int start, end, gen_start, gen_end;\n"
+          "      match_compiledn(program, buffer, length, &start, &end);\n"
+          "      matchers[m](buffer, length, &gen_start, &gen_end);\n"
+          "      if ((start != gen_start) || (end != gen_end)) {\n"
+          "        printf(\"ERROR: the matcher of '%%s' disagrees with the engine on '\", regexes[m]);\n"
+          "        for (int k = 0; k < length; k++)\n"
+          "          printf(isprint((unsigned char) buffer[k]) ? \"%%c\" : \"\\\\x%%02x\", (unsigned char) buffer[k]);\n"
+          "        printf(\"'.\\n expected (%%d, %%d)\\n received (%%d, %%d)\\n\", start, end, gen_start, gen_end);\n"
+          "        return 1;\n"
+          "      }\n"
+          "    }\n"
+          "    free_compiled(program);\n"
+          "  }\n"
+          "  printf(\"All %d matchers agree with the engine on %d random strings.\\n\");\n"
+          "  return 0;\n"
+          "}\n",
+          GEN_CHECK_LENGTH, n, GEN_CHECK_STRINGS, GEN_CHECK_LENGTH + 1, n, GEN_CHECK_STRINGS);
+}
+
+
+int main(int argc, char * argv[]) {
+  const int header = (argc > 1) && (strcmp(argv[1], "-h") == 0);
+  const int check = (argc > 1) && (strcmp(argv[1], "-t") == 0);
+  const int first = (header || check) ? 2 : 1;
+  // (names alternate with regexes, "-t" alone checks the regexes above)
+  char ** pairs = ((argc == first) && check) ? gen_check_pairs : argv + first;
+  const int n_pairs = ((argc == first) && check) ? GEN_CHECK_PAIRS : (argc - first) / 2;
+  if ((n_pairs == 0) || ((argc - first) % 2 != 0)) {
+    fprintf(stderr, "usage: %s [-h | -t] <name> <regex> [<name> <regex> ...]\n", argv[0]);
+    return 2;
+  }
+  // Generate every matcher before writing anything, so that an invalid
+  // regex leaves no (partial) output behind.
+  FILE * matchers = tmpfile();
+  if (matchers == NULL) {
+    fprintf(stderr, "ERROR: could not create a temporary file.\n");
+    return 1;
+  }
+  for (int a = 0; a < 2*n_pairs; a += 2) {
+    const char * error = _gen_matcher(matchers, pairs[a], pairs[a+1]);
+    if (error != NULL) {
+      fprintf(stderr, "ERROR: could not generate '%s' for '%s', %s.\n", pairs[a], pairs[a+1], error);
+      fclose(matchers);
+      return 1;
+    }
+  }
+  printf("// Generated by regex_gen, do not edit.\n");
+  if (check) printf("\n#define BENCHMARK\n#include \"regex.c\"\n");
+  else if (! header) printf("\n#include <limits.h> // INT_MAX\n#include <stddef.h> // size_t\n"
+                       "#include <string.h> // memchr\n");
+  else printf("\n#include <stddef.h> // size_t\n\n");
+  if (header) {
+    for (int a = 0; a < 2*n_pairs; a += 2) {
+      printf("// %s\n", pairs[a+1]);
+      printf("void %s(const char * buffer, size_t length, int * start, int * end);\n", pairs[a]);
+    }
+  } else {
+    char copy[4096];
+    size_t n;
+    rewind(matchers);
+    while ((n = fread(copy, 1, sizeof(copy), matchers)) > 0) fwrite(copy, 1, n, stdout);
+    if (check) _gen_check(stdout, pairs, n_pairs);
+  }
+  fclose(matchers);
+  return 0;
+}
@@ -34,6 +34,32 @@ char* SAFE_CHAR(const char c) {
 
 #ifdef DEBUG
 int run_tests(); // <- actually declared later
+
+// Collect the matches given by a stream into "found_matches".
+void _stream_append(void * data, int pattern, long long start, long long end) {
+  _found_append((struct found_matches *) data, pattern, (int) start, (int) end, 0);
+}
+
+// Search a string many times with one program (run by each thread of
+// the test of `copy_compiled`), the last number of matches found goes
+// in "found.n" (and -1 if any search found a different number).
+struct copy_search {
+  struct compiled_regex * program;
+  const char * string;
+  int expected;
+  struct found_matches found;
+};
+void * _copy_search(void * data) {
+  struct copy_search * search = (struct copy_search *) data;
+  int n = 0;
+  for (int i = 0; (n >= 0) && (i < 50); i++) {
+    n = matcha_limit(search->program, search->string, strlen(search->string), 0, &(search->found));
+    if (n != search->expected) n = -1;
+  }
+  search->found.n = n;
+  return NULL;
+}
+
 // For testing purposes.
 int main(int argc, char * argv[]) {
   // =================================================================
@@ -853,7 +879,7 @@ int run_tests() {
     1,
     4,
     2,
-       2,
+    7,
     18,
     1,
     //
@@ -1018,10 +1044,1054 @@ int run_tests() {
 
     // -------------------------------------------------------------
 
+
+    // =============================================================
+    //                       match_compiled
+    //
+    // A compiled program must give the same result as `match`, and
+    // must be reusable for more than one search.
+    struct compiled_regex * program = compile(regexes[i]);
+    for (int k = 0; k < 2; k++) {
+      match_compiled(program, strings[i], &start, &end);
+      if ((start != match_starts[i]) || (end != match_ends[i])) {
+        printf("\nRegex: '");
+        for (int j = 0; regexes[i][j] != '\0'; j++) {
+          printf("%s", SAFE_CHAR(regexes[i][j]));
+        }
+        printf("'\n\n");
+        printf("ERROR: Bad match returned by match_compiled (call %d).\n", k);
+        printf(" expected (%d -> %d)\n", match_starts[i], match_ends[i]);
+        printf(" received (%d -> %d)\n", start, end);
+        return(9);
+      }
+    }
+    free_compiled(program);
+
+    // -------------------------------------------------------------
+
     // Exit once the empty regex has been verified.
     if (regexes[i][0] == '\0') done++;
   }
-  
+
+  // =================================================================
+  //                      _search  vs  _simulate
+  //
+  // Searches that use the lazy DFA (with and without memory to grow
+  // it) must find exactly the matches of the plain token simulation.
+  char text[4096];
+  int length = 0;
+  for (int k = 0; k < 3; k++) {
+    for (int j = 0; strings[j][0] != '\0'; j++) {
+      for (int l = 0; strings[j][l] != '\0'; l++) text[length++] = strings[j][l];
+      text[length++] = (j % 3 == 0) ? '\n' : ' ';
+    }
+  }
+  text[length] = '\0';
+  // Also check some regexes that start with a literal prefix (skipped
+  // to by the search) that overlaps itself or is followed by more.
+  char * prefixed[] = {".*a", ".*aa", ".*ab", ".*ab*c", ".*a(b|c)", ".*abc.*",
+                       ".*ab{c}", ".*bc[ ]", ".*e\n", ""};
+  char ** lists[2] = {regexes, prefixed};
+  for (int list = 0; list < 2; list++) {
+    char ** regexes = lists[list];
+    for (int t = 0; regexes[t][0] != '\0'; t++) {
+      struct compiled_regex * program = compile(regexes[t]);
+      if (program->n_tokens <= 0) { free_compiled(program); continue; }
+      void * memory = malloc(SIMULATE_BYTES(program->n_tokens));
+      for (int full = 0; full < 2; full++) {
+        // Leave no room for new DFA states on the second pass.
+        if (full) {
+          _dfa_free(program->dfa);
+          program->dfa = _dfa_init(program);
+          program->dfa->bytes = DFA_MEMORY_LIMIT;
+        }
+        for (int first = 0; first < 2; first++) {
+          struct found_matches expected = {0};
+          struct found_matches received = {0};
+          _simulate(program, text, -1, 0, first, 0, &expected, memory);
+          _search(program, text, -1, first, &received, memory);
+          int same = (expected.n == received.n);
+          for (int k = 0; same && (k < expected.n); k++)
+            same = ((expected.starts[k] == received.starts[k]) &&
+                    (expected.ends[k] == received.ends[k]));
+          if (! same) {
+            printf("\nRegex: '");
+            for (int j = 0; regexes[t][j] != '\0'; j++) {
+              printf("%s", SAFE_CHAR(regexes[t][j]));
+            }
+            printf("'\n\n");
+            printf("ERROR: DFA search (full = %d, first = %d) disagrees with simulation.\n", full, first);
+            printf(" expected %d matches\n", expected.n);
+            printf(" received %d matches\n", received.n);
+            return(10);
+          }
+          free(expected.starts);
+          free(received.starts);
+        }
+      }
+      free(memory);
+      free_compiled(program);
+    }
+  }
+
+  // =================================================================
+  //                      fmatcha  vs  matcha
+  //
+  // Searching a (memory mapped) file must find the same matches as
+  // searching its contents as a string, with the line of each match.
+  // Searching into a reused arena of results must find them too.
+  char * path = "test_regex_fmatcha.txt";
+  struct found_matches arena = {0};
+  struct found_matches file_arena = {0};
+  FILE * file = fopen(path, "w");
+  fputs(text, file);
+  fclose(file);
+  for (int list = 0; list < 2; list++) {
+    char ** regexes = lists[list];
+    for (int t = 0; regexes[t][0] != '\0'; t++) {
+      int n, n_file;
+      int * starts, * ends;
+      int * file_starts, * file_ends, * file_lines;
+      matcha(regexes[t], text, &n, &starts, &ends);
+      fmatcha(regexes[t], path, &n_file, &file_starts, &file_ends, &file_lines, 0.0);
+      struct compiled_regex * program = compile(regexes[t]);
+      const int n_arena = matcha_into(program, text, length, &arena);
+      const int n_file_arena = fmatcha_into(program, path, 0.0, &file_arena);
+      free_compiled(program);
+      int same = ((n == n_file) && (n == n_arena) && (n == n_file_arena));
+      for (int k = 0; same && (k < n); k++) {
+        // Count the lines up to the last character of the match.
+        int line = 1;
+        int last = (file_ends[k] > file_starts[k]) ? file_ends[k]-1 : file_starts[k];
+        for (int l = 0; l < last; l++) line += (text[l] == '\n');
+        same = ((starts[k] == file_starts[k]) && (ends[k] == file_ends[k]) &&
+                (line == file_lines[k]) && (starts[k] == arena.starts[k]) &&
+                (ends[k] == arena.ends[k]) && (starts[k] == file_arena.starts[k]) &&
+                (ends[k] == file_arena.ends[k]) && (line == file_arena.lines[k]));
+      }
+      if (! same) {
+        printf("\nRegex: '");
+        for (int j = 0; regexes[t][j] != '\0'; j++) {
+          printf("%s", SAFE_CHAR(regexes[t][j]));
+        }
+        printf("'\n\n");
+        printf("ERROR: fmatcha disagrees with matcha.\n");
+        printf(" expected %d matches\n", n);
+        printf(" received %d matches\n", n_file);
+        remove(path);
+        return(11);
+      }
+      if (n != 0) free(starts);
+      if (n_file != 0) free(file_starts);
+    }
+  }
+  free_results(&arena);
+  free_results(&file_arena);
+
+  // =================================================================
+  //                    matcha_set  vs  matcha
+  //
+  // A set of regexes searched in one pass must find exactly the
+  // matches of each regex searched on its own (in the same order).
+  for (int list = 0; list < 2; list++) {
+    char ** regexes = lists[list];
+    for (int t = 0; (regexes[t][0] != '\0') && (regexes[t+1][0] != '\0'); t++) {
+      const char * pair[2] = {regexes[t], regexes[t+1]};
+      struct compiled_regex * program = compile_set(pair, 2);
+      // Invalid regexes are reported with the index of the first one.
+      if (program->n_tokens <= 0) {
+        int n_tokens, n_groups;
+        _count(pair[0], &n_tokens, &n_groups);
+        const int bad = (n_tokens <= 0) ? 0 : 1;
+        _count(pair[bad], &n_tokens, &n_groups);
+        if ((program->n_patterns != bad) || (program->n_tokens != n_tokens) ||
+            (program->n_groups != n_groups)) {
+          printf("\nERROR: compile_set reported the wrong invalid regex.\n");
+          return(12);
+        }
+        free_compiled(program);
+        continue;
+      }
+      int n_set, n_file;
+      int * set_patterns, * set_starts, * set_ends;
+      int * file_patterns, * file_starts, * file_ends, * file_lines;
+      matcha_set(program, text, &n_set, &set_patterns, &set_starts, &set_ends);
+      fmatcha_set(program, path, &n_file, &file_patterns, &file_starts, &file_ends,
+                  &file_lines, 0.0);
+      int same = (n_set == n_file);
+      for (int k = 0; same && (k < n_set); k++)
+        same = ((set_patterns[k] == file_patterns[k]) && (set_starts[k] == file_starts[k]) &&
+                (set_ends[k] == file_ends[k]));
+      // Check the matches of each pattern against searching for it alone.
+      for (int p = 0; same && (p < 2); p++) {
+        int n;
+        int * starts, * ends;
+        matcha(pair[p], text, &n, &starts, &ends);
+        int m = 0; // matches of this pattern in the set
+        for (int k = 0; same && (k < n_set); k++) {
+          if (set_patterns[k] != p) continue;
+          same = ((m < n) && (starts[m] == set_starts[k]) && (ends[m] == set_ends[k]));
+          m++;
+        }
+        same = same && (m == n);
+        if (n > 0) free(starts);
+      }
+      // The first match is the first one found by the full search.
+      int pattern, start, end;
+      match_set(program, text, &pattern, &start, &end);
+      if (n_set > 0) same = same && ((pattern == set_patterns[0]) &&
+                                     (start == set_starts[0]) && (end == set_ends[0]));
+      else same = same && (start == EXIT_TOKEN);
+      if (! same) {
+        printf("\nRegexes: '");
+        for (int j = 0; pair[0][j] != '\0'; j++) printf("%s", SAFE_CHAR(pair[0][j]));
+        printf("' and '");
+        for (int j = 0; pair[1][j] != '\0'; j++) printf("%s", SAFE_CHAR(pair[1][j]));
+        printf("'\n\n");
+        printf("ERROR: matcha_set disagrees with matcha (or fmatcha_set, match_set).\n");
+        remove(path);
+        return(12);
+      }
+      if (n_set > 0) free(set_starts);
+      if (n_file > 0) free(file_starts);
+      free_compiled(program);
+    }
+  }
+  // A file too large for integer match locations is an error (a
+  // sparse file, so its contents are never written or read).
+  file = fopen(path, "w");
+  fclose(file);
+  if (truncate(path, (off_t) INT_MAX + 1) == 0) {
+    struct compiled_regex * program = compile("a");
+    const int n_large = fmatcha_into(program, path, 0.0, &file_arena);
+    free_compiled(program);
+    if (n_large != -4) {
+      printf("\nERROR: a file of INT_MAX bytes or more was searched.\n");
+      printf(" expected -4\n");
+      printf(" received %d\n", n_large);
+      remove(path);
+      return(12);
+    }
+  }
+  remove(path);
+
+  // =================================================================
+  //                _search_chunks  vs  _search_contents
+  //
+  // Searching a file in chunks (with one thread each) must find
+  // exactly the matches of one search, including matches that cross
+  // from one chunk into the next, with the same line numbers. With a
+  // limit, both must find the first matches of the search without one
+  // (unless the chunks report that too few were kept). The same holds
+  // when match starts are found backwards (COMPILE_REVERSE_START), and
+  // when each line is searched on its own (COMPILE_LINES).
+  char * spanning[] = {".*a.*e", ".*e\n.*a", ".*(a|b)*c", ".*..", ".*[ \n]", ""};
+  char ** all_lists[3] = {regexes, prefixed, spanning};
+  for (int list = 0; list < 3*3; list++) {
+    char ** regexes = all_lists[list % 3];
+    const int list_flags = (list < 3) ? 0 : ((list < 6) ? COMPILE_REVERSE_START : COMPILE_LINES);
+    for (int t = 0; regexes[t][0] != '\0'; t++) {
+      struct compiled_regex * program = compile_flags(regexes[t], list_flags);
+      if (program->n_tokens <= 0) { free_compiled(program); continue; }
+      struct found_matches expected = {0};
+      _search_contents(program, text, length, 0.0, 1, 0, &expected);
+      const int limits[3] = {0, 1, 3};
+      for (int n_chunks = 1; n_chunks < 9*3; n_chunks++) {
+        const int max_matches = limits[n_chunks % 3];
+        const int n_expected = (max_matches && (max_matches < expected.n)) ? max_matches : expected.n;
+        struct found_matches received = {0};
+        if (n_chunks < 3) {
+          _search_contents(program, text, length, 0.0, 1, max_matches, &received);
+        } else if (_search_chunks(program, text, length, n_chunks / 3, max_matches, &received)) {
+          free(received.starts);
+          continue;
+        }
+        int same = (n_expected == received.n);
+        for (int k = 0; same && (k < n_expected); k++)
+          same = ((expected.starts[k] == received.starts[k]) &&
+                  (expected.ends[k] == received.ends[k]) &&
+                  (expected.lines[k] == received.lines[k]));
+        if (! same) {
+          printf("\nRegex: '");
+          for (int j = 0; regexes[t][j] != '\0'; j++) {
+            printf("%s", SAFE_CHAR(regexes[t][j]));
+          }
+          printf("'\n\n");
+          printf("ERROR: search in %d chunks (at most %d matches, reverse %d) disagrees with one search.\n",
+                 n_chunks / 3, max_matches, program->reverse);
+          printf(" expected %d matches\n", n_expected);
+          printf(" received %d matches\n", received.n);
+          return(13);
+        }
+        free(received.starts);
+      }
+      free(expected.starts);
+      free_compiled(program);
+    }
+  }
+
+  // =================================================================
+  //                     stream_feed  vs  _simulate
+  //
+  // Feeding the text to a stream in pieces of any size must give
+  // exactly the matches of one simulation over all of it (also when
+  // its indices are shifted back after every piece, keeping only the
+  // last 2 characters in the window, see `_stream_rebase`).
+  struct found_matches streamed;
+  for (int list = 0; list < 3; list++) {
+    char ** regexes = all_lists[list];
+    for (int t = 0; regexes[t][0] != '\0'; t++) {
+      struct compiled_regex * program = compile(regexes[t]);
+      if (program->n_tokens <= 0) { free_compiled(program); continue; }
+      struct found_matches expected = {0};
+      void * memory = malloc(SIMULATE_BYTES(program->n_tokens));
+      _simulate(program, text, length, 0, 0, 0, &expected, memory);
+      free(memory);
+      int sizes[] = {1, 2, 3, 7, 64, length, 1, 3};
+      for (int s = 0; s < 8; s++) {
+        streamed = (struct found_matches) {0};
+        struct regex_stream * stream = stream_init(program);
+        for (int k = 0; k < length; k += sizes[s]) {
+          stream_feed(stream, text + k, (k + sizes[s] < length) ? sizes[s] : length - k,
+                      _stream_append, &streamed);
+          stream_feed(stream, text + k, 0, _stream_append, &streamed);
+          if (s >= 6) _stream_rebase(stream, 2);
+        }
+        stream_finish(stream, _stream_append, &streamed);
+        int same = (expected.n == streamed.n);
+        for (int k = 0; same && (k < expected.n); k++)
+          same = ((expected.starts[k] == streamed.starts[k]) &&
+                  (expected.ends[k] == streamed.ends[k]) &&
+                  (expected.patterns[k] == streamed.patterns[k]));
+        if (! same) {
+          printf("\nRegex: '");
+          for (int j = 0; regexes[t][j] != '\0'; j++) {
+            printf("%s", SAFE_CHAR(regexes[t][j]));
+          }
+          printf("'\n\n");
+          printf("ERROR: stream fed %d bytes at a time%s disagrees with simulation.\n",
+                 sizes[s], (s >= 6) ? " (shifted back after each)" : "");
+          printf(" expected %d matches\n", expected.n);
+          printf(" received %d matches\n", streamed.n);
+          return(14);
+        }
+        free(streamed.starts);
+      }
+      free(expected.starts);
+      free_compiled(program);
+    }
+  }
+
+  // =================================================================
+  //                 matcha_compiledn  (binary buffers)
+  //
+  // Buffers with a length are searched to the end, null characters
+  // and 0xFF bytes are ordinary bytes (matched by '.').
+  const char binary[] = "a\0b" "ab\xff" "a\xff" "b\0";
+  const size_t binary_length = sizeof(binary) - 1;
+  const char * binary_regexes[3] = {".*ab", ".*a.b", ".*b."};
+  const int binary_expected[3][7] = {{1, 3, 5}, {2, 0, 3, 6, 9}, {3, 2, 4, 4, 6, 8, 10}};
+  for (int t = 0; t < 3; t++) {
+    struct compiled_regex * program = compile(binary_regexes[t]);
+    int n, * starts, * ends, start, end;
+    matcha_compiledn(program, binary, binary_length, &n, &starts, &ends);
+    int same = (n == binary_expected[t][0]);
+    for (int k = 0; same && (k < n); k++)
+      same = ((starts[k] == binary_expected[t][1+2*k]) &&
+              (ends[k] == binary_expected[t][2+2*k]));
+    if (n > 0) free(starts);
+    match_compiledn(program, binary, binary_length, &start, &end);
+    same = same && (start == binary_expected[t][1]) && (end == binary_expected[t][2]);
+    match_compiledn(program, binary, 0, &start, &end);
+    same = same && (start == EXIT_TOKEN) && (end == STRING_EMPTY_ERROR);
+    // (A buffer too long for integer locations is an error, not read.)
+    const size_t too_long = (size_t) INT_MAX;
+    match_compiledn(program, binary, too_long, &start, &end);
+    same = same && (start == EXIT_TOKEN) && (end == STRING_TOO_LONG_ERROR);
+    matcha_compiledn(program, binary, too_long, &n, &starts, &ends);
+    same = same && (n == -3);
+    struct found_matches too_long_found = {0};
+    same = same && (matcha_limit(program, binary, too_long, 1, &too_long_found) == -3);
+    free_results(&too_long_found);
+    if (! same) {
+      printf("\nRegex: '%s'\n\n", binary_regexes[t]);
+      printf("ERROR: search of a binary buffer did not find the expected matches.\n");
+      printf(" expected %d matches\n", binary_expected[t][0]);
+      printf(" received %d matches\n", n);
+      return(15);
+    }
+    free_compiled(program);
+  }
+
+  // =================================================================
+  //                 compile_flags  (token sets and case)
+  //
+  // Every token set is one token (checked by its members), and with
+  // COMPILE_IGNORE_CASE letters (also in token sets) match either case.
+  const char * case_string = "Fox a1XyAc bC";
+  const char * case_regexes[3] = {".*fox", ".*[aB]c", ".*[1x]y"};
+  const int case_tokens[3] = {5, 4, 4};
+  const int case_expected[3][2][5] = {{{0}, {1, 0, 3}},
+                                      {{0}, {2, 8, 10, 11, 13}},
+                                      {{0}, {1, 6, 8}}};
+  for (int t = 0; t < 3; t++) {
+    for (int f = 0; f < 2; f++) {
+      struct compiled_regex * program = compile_flags(case_regexes[t], f ? COMPILE_IGNORE_CASE : 0);
+      int n, * starts, * ends;
+      matcha_compiled(program, case_string, &n, &starts, &ends);
+      int same = ((program->n_tokens == case_tokens[t]) && (n == case_expected[t][f][0]));
+      for (int k = 0; same && (k < n); k++)
+        same = ((starts[k] == case_expected[t][f][1+2*k]) &&
+                (ends[k] == case_expected[t][f][2+2*k]));
+      if (n > 0) free(starts);
+      if (! same) {
+        printf("\nRegex: '%s'  flags: %d\n\n", case_regexes[t], f);
+        printf("ERROR: compiled token sets (or cases) did not find the expected matches.\n");
+        printf(" expected %d tokens and %d matches\n", case_tokens[t], case_expected[t][f][0]);
+        printf(" received %d tokens and %d matches\n", program->n_tokens, n);
+        return(16);
+      }
+      free_compiled(program);
+    }
+  }
+
+  // =================================================================
+  //                      read_stats  (REGEX_STATS)
+  //
+  // Searches are counted when compiled with -DREGEX_STATS, otherwise
+  // the counts are always zero.
+  {
+    struct regex_stats stats;
+    read_stats(&stats, 1);
+    struct compiled_regex * program = compile(".*fox");
+    int start, end;
+    match_compiled(program, "the quick brown fox", &start, &end);
+    free_compiled(program);
+    const int kept = read_stats(&stats, 1);
+    #ifdef REGEX_STATS
+    int same = (kept && (stats.searches == 1) && (stats.bytes > 0) && (stats.steps > 0) &&
+                (stats.pushes > 0) && (stats.peak_active > 0) && (stats.compile_ns > 0));
+    #else
+    int same = ((! kept) && (stats.searches == 0) && (stats.bytes == 0) && (stats.steps == 0));
+    #endif
+    if (! same) {
+      printf("\nRegex: '.*fox'\n\n");
+      printf("ERROR: the statistics of a search were not the expected counts.\n");
+      printf(" received %d searches, %lld bytes, %lld steps, %lld pushes, %lld peak, %lld ns\n",
+             (int) stats.searches, stats.bytes, stats.steps, stats.pushes,
+             stats.peak_active, stats.compile_ns);
+      return(17);
+    }
+  }
+
+  // =================================================================
+  //                 _ascii_count  vs  one byte at a time
+  //
+  // Counting ASCII characters eight bytes at a time must count the
+  // same bytes as checking each one (at every length and offset).
+  {
+    char bytes[300];
+    for (int i = 0; i < 300; i++) bytes[i] = (char) ((i * 37) % 256);
+    for (int i = 0; i < 300; i += 7) bytes[i] = '\0';
+    for (int offset = 0; offset < 8; offset++) {
+      for (int n = 0; offset + n <= 300; n++) {
+        int expected = 0;
+        for (int i = 0; i < n; i++)
+          expected += ((bytes[offset+i] != '\0') && ((unsigned char) bytes[offset+i] < 128));
+        const int received = _ascii_count(bytes + offset, n);
+        if (expected != received) {
+          printf("\nERROR: counted %d ASCII characters in %d bytes, expected %d.\n",
+                 received, n, expected);
+          return(18);
+        }
+      }
+    }
+  }
+
+  // =================================================================
+  //           COMPILE_REVERSE_START  vs  the token simulation
+  //
+  // Walking back from each end must find the same matches as the
+  // simulation, except that an end reached by many paths is only
+  // given once (with the newest start).
+  {
+    const char * reverse_string = "xxqaqzbzaqbcbdzabd";
+    const char * reverse_regexes[] = {".*q.*z", ".*a(b|c)*d", ".*(ab|b)", ".*b{d}", "q.*z"};
+    const int reverse_expected[5][2][7] = {
+      {{3, 4,6, 4,8, 9,15}, {3, 4,6, 4,8, 9,15}},
+      {{1, 15,18}, {1, 15,18}},
+      {{2, 15,17, 15,17}, {1, 15,17}},
+      {{2, 6,8, 10,12}, {2, 6,8, 10,12}},
+      {{0}, {0}}
+    };
+    const int reverse_used[5] = {1, 1, 1, 1, 0};
+    for (int t = 0; t < 5; t++) {
+      for (int f = 0; f < 2; f++) {
+        struct compiled_regex * program = compile_flags(reverse_regexes[t], f ? COMPILE_REVERSE_START : 0);
+        int n, * starts, * ends;
+        matcha_compiled(program, reverse_string, &n, &starts, &ends);
+        int same = ((program->reverse == (f && reverse_used[t])) && (n == reverse_expected[t][f][0]));
+        for (int k = 0; same && (k < n); k++)
+          same = ((starts[k] == reverse_expected[t][f][1+2*k]) &&
+                  (ends[k] == reverse_expected[t][f][2+2*k]));
+        if (n > 0) free(starts);
+        if (! same) {
+          printf("\nRegex: '%s'  flags: %d\n\n", reverse_regexes[t], f ? COMPILE_REVERSE_START : 0);
+          printf("ERROR: finding match starts backwards did not find the expected matches.\n");
+          printf(" expected %d matches\n", reverse_expected[t][f][0]);
+          printf(" received %d matches\n", n);
+          return(19);
+        }
+        free_compiled(program);
+      }
+    }
+  }
+
+  // =================================================================
+  //               match_batch_threads  vs  match_setn
+  //
+  // Searching many rows at once (with any number of threads, with or
+  // without lengths) must give each row the match of its own search.
+  {
+    const int n_rows = 5000;
+    const char * batch_regexes[2] = {".*ab*c", ".*{[abc\n]}"};
+    struct compiled_regex * program = compile_set(batch_regexes, 2);
+    char * text = malloc(n_rows * 8);
+    const char ** strings = malloc(n_rows * sizeof(char *));
+    size_t * lengths = malloc(n_rows * sizeof(size_t));
+    int * received = malloc(3 * n_rows * sizeof(int));
+    unsigned int state = 7;
+    for (int k = 0; k < n_rows; k++) {
+      lengths[k] = k % 8;
+      strings[k] = text + 8*k;
+      for (int i = 0; i < 7; i++) {
+        state = state * 1103515245 + 12345;
+        text[8*k+i] = "abc\nx"[(state >> 16) % 5];
+      }
+      text[8*k+lengths[k]] = '\0';
+    }
+    const int thread_counts[3] = {1, 3, 0};
+    for (int test = 0; test < 2*3; test++) {
+      const size_t * row_lengths = (test < 3) ? lengths : NULL;
+      match_batch_threads(program, strings, row_lengths, n_rows, thread_counts[test % 3],
+                          received, received + n_rows, received + 2*n_rows);
+      for (int k = 0; k < n_rows; k++) {
+        int pattern, start, end;
+        match_setn(program, strings[k], lengths[k], &pattern, &start, &end);
+        if ((received[k] != pattern) || (received[n_rows+k] != start) ||
+            (received[2*n_rows+k] != end)) {
+          printf("\nERROR: row %d of a batch (%d threads, lengths %d) did not match on its own.\n",
+                 k, thread_counts[test % 3], row_lengths != NULL);
+          printf(" expected %d %d %d\n", pattern, start, end);
+          printf(" received %d %d %d\n", received[k], received[n_rows+k], received[2*n_rows+k]);
+          return(20);
+        }
+      }
+    }
+    free(received);
+    free(lengths);
+    free(strings);
+    free(text);
+    free_compiled(program);
+  }
+
+  // =================================================================
+  //          COMPILE_EXTENDED  ('+', counts, and anchors)
+  //
+  // A '+' and a count must match the same as their written out forms,
+  // an invalid count is an error at its position, and the anchors
+  // hold at the start and end of the string (of each line with
+  // COMPILE_MULTILINE), with or without COMPILE_REVERSE_START.
+  {
+    const char * extended_string = "ab\nxaab\naab";
+    const char * extended_regexes[][2] = {
+      {".*(ab)+c", ".*ab(ab)*c"}, {".*a+b", ".*aa*b"},
+      {".*a{2}b", ".*aab"}, {".*x(a{1,2})b", ".*xa(a)?b"}
+    };
+    const char * extended_strings[3] = {"ababc xabc", "caab aab", "xab xaab xaaab"};
+    for (int t = 0; t < 4; t++) {
+      for (int k = 0; k < 3; k++) {
+        int start, end, expected_start, expected_end;
+        struct compiled_regex * program = compile_flags(extended_regexes[t][0], COMPILE_EXTENDED);
+        match_compiled(program, extended_strings[k], &start, &end);
+        free_compiled(program);
+        program = compile(extended_regexes[t][1]);
+        match_compiled(program, extended_strings[k], &expected_start, &expected_end);
+        free_compiled(program);
+        if ((start != expected_start) || (end != expected_end)) {
+          printf("\nRegex: '%s'  string: '%s'\n\n", extended_regexes[t][0], extended_strings[k]);
+          printf("ERROR: an extended regex did not match the same as '%s'.\n", extended_regexes[t][1]);
+          printf(" expected %d %d\n", expected_start, expected_end);
+          printf(" received %d %d\n", start, end);
+          return(21);
+        }
+      }
+    }
+    // Every match of a '+' (or "{n,}") on a group that holds a '|'
+    // is a match of the group followed by copies of it with '*'.
+    const char * group_regexes[][2] = {
+      {".*((b((.)|(b)))|(..))+", ".*((b((.)|(b)))|(..))((b((.)|(b)))|(..))*"},
+      {".*(((b((.)|(b)))|((.){2})))+", ".*(((b((.)|(b)))|((.)(.))))(((b((.)|(b)))|((.)(.))))*"},
+      {".*((b((.)|(b)))|(..)){2,}",
+       ".*((b((.)|(b)))|(..))((b((.)|(b)))|(..))((b((.)|(b)))|(..))*"},
+      {".*(a|bc)+d", ".*(a|bc)(a|bc)*d"},
+      {"((b((.)|(b)))|(..))+$", "((b((.)|(b)))|(..))((b((.)|(b)))|(..))*$"},
+      {"((b((.)|(b)))|(..)){1,}$", "((b((.)|(b)))|(..))((b((.)|(b)))|(..))*$"}
+    };
+    const char * group_strings[4] = {"b", "ab", "abcbca", "bbab bcad abcbcad"};
+    for (int t = 0; t < 6; t++) {
+      for (int k = 0; k < 4; k++) {
+        struct found_matches found = {0};
+        struct found_matches expected = {0};
+        struct compiled_regex * program = compile_flags(group_regexes[t][0], COMPILE_EXTENDED);
+        matcha_into(program, group_strings[k], strlen(group_strings[k]), &found);
+        free_compiled(program);
+        program = compile_flags(group_regexes[t][1], COMPILE_EXTENDED);
+        matcha_into(program, group_strings[k], strlen(group_strings[k]), &expected);
+        free_compiled(program);
+        int same = (found.n == expected.n);
+        for (int m = 0; same && (m < found.n); m++)
+          same = ((found.starts[m] == expected.starts[m]) && (found.ends[m] == expected.ends[m]));
+        if (! same) {
+          printf("\nRegex: '%s'  string: '%s'\n\n", group_regexes[t][0], group_strings[k]);
+          printf("ERROR: a repeated group did not find the same matches as '%s'.\n", group_regexes[t][1]);
+          printf(" expected %d matches\n", expected.n);
+          printf(" received %d matches\n", found.n);
+          return(21);
+        }
+        free_results(&found);
+        free_results(&expected);
+      }
+    }
+    // (Counts that write out more than MAX_EXPANDED characters past
+    // twice the regex are too large, the same counts within it are not.)
+    const char * invalid_regexes[6] = {"a{0}", "a{3,2}", "a+{", "(a{1,50}){1,50}",
+                                       "((a{1,20}){1,20}){1,20}", "x{5000}"};
+    const int invalid_tokens[6] = {-2, -2, -4, -10, -18, -2};
+    const int invalid_codes[6] = {REGEX_SYNTAX_ERROR, REGEX_SYNTAX_ERROR,
+                                  REGEX_UNCLOSED_GROUP_ERROR, REGEX_TOO_LARGE_ERROR,
+                                  REGEX_TOO_LARGE_ERROR, REGEX_TOO_LARGE_ERROR};
+    for (int t = 0; t < 6; t++) {
+      struct compiled_regex * program = compile_flags(invalid_regexes[t], COMPILE_EXTENDED);
+      const int n_tokens = program->n_tokens;
+      const int code = program->n_groups;
+      free_compiled(program);
+      if ((n_tokens != invalid_tokens[t]) || (code != invalid_codes[t])) {
+        printf("\nRegex: '%s'\n\n", invalid_regexes[t]);
+        printf("ERROR: an invalid count was not an error at the expected position.\n");
+        printf(" expected %d (code %d)\n", invalid_tokens[t], invalid_codes[t]);
+        printf(" received %d (code %d)\n", n_tokens, code);
+        return(21);
+      }
+    }
+    const char * counted_regexes[2] = {"x{4000}", "(a{1,20}){1,20}"};
+    const int counted_tokens[2] = {4000, 799};
+    for (int t = 0; t < 2; t++) {
+      struct compiled_regex * program = compile_flags(counted_regexes[t], COMPILE_EXTENDED);
+      const int n_tokens = program->n_tokens;
+      free_compiled(program);
+      if (n_tokens != counted_tokens[t]) {
+        printf("\nRegex: '%s'\n\n", counted_regexes[t]);
+        printf("ERROR: counts within the limit did not compile to the expected tokens.\n");
+        printf(" expected %d\n", counted_tokens[t]);
+        printf(" received %d\n", n_tokens);
+        return(21);
+      }
+    }
+    const char * anchor_regexes[4] = {".*^a+b", ".*b$", ".*a{1,2}b$", "^a"};
+    const int anchor_expected[4][2][7] = {
+      {{1, 0,2}, {2, 0,2, 8,11}},
+      {{1, 10,11}, {3, 1,2, 6,7, 10,11}},
+      {{1, 9,11}, {3, 0,2, 5,7, 9,11}},
+      {{1, 0,1}, {1, 0,1}}
+    };
+    for (int t = 0; t < 4; t++) {
+      for (int f = 0; f < 4; f++) {
+        const int flags = COMPILE_EXTENDED | ((f % 2) ? COMPILE_MULTILINE : 0)
+          | ((f / 2) ? COMPILE_REVERSE_START : 0);
+        struct compiled_regex * program = compile_flags(anchor_regexes[t], flags);
+        int n, * starts, * ends;
+        matcha_compiled(program, extended_string, &n, &starts, &ends);
+        const int * expected = anchor_expected[t][f % 2];
+        int same = (n == expected[0]);
+        for (int k = 0; same && (k < n); k++)
+          same = ((starts[k] == expected[1+2*k]) && (ends[k] == expected[2+2*k]));
+        if (n > 0) free(starts);
+        if (! same) {
+          printf("\nRegex: '%s'  flags: %d\n\n", anchor_regexes[t], flags);
+          printf("ERROR: an anchored regex did not find the expected matches.\n");
+          printf(" expected %d matches\n", expected[0]);
+          printf(" received %d matches\n", n);
+          return(21);
+        }
+        free_compiled(program);
+      }
+    }
+  }
+
+  // =================================================================
+  //           COMPILE_FIRST_END  and  COMPILE_LONGEST  (modes)
+  //
+  // A match mode gives only matches that do not overlap, the same
+  // ones from `matcha_compiled` and from a stream fed one byte at a
+  // time (also when shifted back after each byte, see `_stream_rebase`),
+  // and `matcha_limit` gives the first of them.
+  {
+    const char * mode_string = "abbcabacaab";
+    const char * mode_regexes[4] = {".*ab*", ".*a+", ".*a.*b", ".*b(ab)*"};
+    const int mode_expected[4][2][11] = {
+      {{5, 0,1, 4,5, 6,7, 8,9, 9,10}, {5, 0,3, 4,6, 6,7, 8,9, 9,11}},
+      {{5, 0,1, 4,5, 6,7, 8,9, 9,10}, {4, 0,1, 4,5, 6,7, 8,10}},
+      {{3, 0,2, 4,6, 9,11}, {1, 0,11}},
+      {{4, 1,2, 2,3, 5,6, 10,11}, {4, 1,2, 2,3, 5,6, 10,11}}
+    };
+    for (int t = 0; t < 4; t++) {
+      for (int m = 0; m < 2; m++) {
+        const int flags = COMPILE_EXTENDED | (m ? COMPILE_LONGEST : COMPILE_FIRST_END);
+        struct compiled_regex * program = compile_flags(mode_regexes[t], flags);
+        const int * expected = mode_expected[t][m];
+        struct found_matches found = {0};
+        struct found_matches first = {0};
+        streamed = (struct found_matches) {0};
+        matcha_into(program, mode_string, strlen(mode_string), &found);
+        matcha_limit(program, mode_string, strlen(mode_string), 1, &first);
+        struct found_matches rebased = {0};
+        struct regex_stream * stream = stream_init(program);
+        struct regex_stream * shifted = stream_init(program);
+        for (int k = 0; mode_string[k] != '\0'; k++) {
+          stream_feed(stream, mode_string + k, 1, _stream_append, &streamed);
+          stream_feed(shifted, mode_string + k, 1, _stream_append, &rebased);
+          _stream_rebase(shifted, 1);
+        }
+        stream_finish(stream, _stream_append, &streamed);
+        stream_finish(shifted, _stream_append, &rebased);
+        int same = ((found.n == expected[0]) && (streamed.n == expected[0]) && (first.n == 1) &&
+                    (rebased.n == expected[0]) &&
+                    (first.starts[0] == expected[1]) && (first.ends[0] == expected[2]));
+        for (int k = 0; same && (k < found.n); k++)
+          same = ((found.starts[k] == expected[1+2*k]) && (found.ends[k] == expected[2+2*k]) &&
+                  (streamed.starts[k] == expected[1+2*k]) && (streamed.ends[k] == expected[2+2*k]) &&
+                  (rebased.starts[k] == expected[1+2*k]) && (rebased.ends[k] == expected[2+2*k]));
+        if (! same) {
+          printf("\nRegex: '%s'  flags: %d\n\n", mode_regexes[t], flags);
+          printf("ERROR: a match mode did not find the expected matches.\n");
+          printf(" expected %d matches\n", expected[0]);
+          printf(" received %d matches (%d streamed)\n", found.n, streamed.n);
+          return(22);
+        }
+        free_results(&found);
+        free_results(&first);
+        free(streamed.starts);
+        free(rebased.starts);
+        free_compiled(program);
+      }
+    }
+  }
+
+  // =================================================================
+  //                   COMPILE_CAPTURE  (groups)
+  //
+  // With captures every match holds where each "()" group of it is
+  // (the last repetition of a group in a loop, -1 for a group that is
+  // not part of the match), the same from `matcha_into` and from
+  // `match_captures` for the first match.
+  {
+    const char * capture_strings[4] = {"x foo=12 b=3", "ac bc", "xaab", "xb ab"};
+    const char * capture_regexes[4] = {".*([abcfo]+)=([0123]+)", ".*(a|b)c", ".*(a){2}b", ".*(a)*b"};
+    const int capture_expected[4][13] = {
+      {2, 2,8, 2,5, 6,8, 9,12, 9,10, 11,12},
+      {2, 0,2, 0,1, 3,5, 3,4},
+      {1, 1,4, 2,3},
+      {2, 1,2, -1,-1, 3,5, 3,4}
+    };
+    for (int t = 0; t < 4; t++) {
+      const int flags = COMPILE_EXTENDED | COMPILE_LONGEST | COMPILE_CAPTURE;
+      struct compiled_regex * program = compile_flags(capture_regexes[t], flags);
+      const int * expected = capture_expected[t];
+      const int c = program->n_captures;
+      struct found_matches found = {0};
+      matcha_into(program, capture_strings[t], strlen(capture_strings[t]), &found);
+      int start, end, captures[4];
+      match_captures(program, capture_strings[t], &start, &end, captures);
+      int same = ((found.n == expected[0]) && (found.n_captures == c) &&
+                  (start == expected[1]) && (end == expected[2]));
+      for (int k = 0; same && (k < found.n); k++) {
+        const int * match = expected + 1 + k*(2+2*c);
+        same = ((found.starts[k] == match[0]) && (found.ends[k] == match[1]));
+        for (int g = 0; same && (g < 2*c); g++)
+          same = ((found.captures[k*2*c+g] == match[2+g]) && ((k > 0) || (captures[g] == match[2+g])));
+      }
+      if (! same) {
+        printf("\nRegex: '%s'  string: '%s'\n\n", capture_regexes[t], capture_strings[t]);
+        printf("ERROR: a match did not capture the expected groups.\n");
+        printf(" expected %d matches\n", expected[0]);
+        printf(" received %d matches (%d groups each)\n", found.n, found.n_captures);
+        return(23);
+      }
+      free_results(&found);
+      free_compiled(program);
+    }
+  }
+
+  // =================================================================
+  //                 SMALL_TOKENS  (stack and scratch memory)
+  //
+  // Regexes on either side of SMALL_TOKENS (searched with stack memory
+  // or the scratch memory of the thread, which grows for a longer one)
+  // find the same matches, from `match_compiled` and `matcha_limit`.
+  {
+    char long_string[4*SMALL_TOKENS+2];
+    for (int k = 0; k <= 4*SMALL_TOKENS; k++) long_string[k] = 'a' + (k % 3);
+    long_string[4*SMALL_TOKENS+1] = '\0';
+    const int lengths[4] = {SMALL_TOKENS/2, 3*SMALL_TOKENS, SMALL_TOKENS, 4*SMALL_TOKENS};
+    for (int t = 0; t < 4; t++) {
+      // The regex ".*b" followed by the next characters of the string.
+      char long_regex[4*SMALL_TOKENS+4] = {'.', '*'};
+      memcpy(long_regex+2, long_string+1, lengths[t]);
+      long_regex[lengths[t]+2] = '\0';
+      struct compiled_regex * program = compile(long_regex);
+      struct found_matches found = {0};
+      int start, end;
+      match_compiled(program, long_string, &start, &end);
+      matcha_limit(program, long_string, strlen(long_string), 0, &found);
+      if ((start != 1) || (end != lengths[t]+1) || (found.n < 1) ||
+          (found.ends[0] != lengths[t]+1)) {
+        printf("\nRegex: '%s'\n\n", long_regex);
+        printf("ERROR: a long regex did not match where expected.\n");
+        printf(" expected end %d\n", lengths[t]+1);
+        printf(" received start %d end %d\n", start, end);
+        return(24);
+      }
+      free_results(&found);
+      free_compiled(program);
+    }
+  }
+
+  // =================================================================
+  //                  COMPILE_LINES  (line mode)
+  //
+  // With COMPILE_LINES every line is searched on its own (no match
+  // holds a newline, a regex without ".*" and '^' hold at the start of
+  // each line), the same from `matcha_into` and `fmatcha_into`, which
+  // also gives the line and the range of lines that holds each match
+  // (with or without the line mode).
+  {
+    const char * line_strings[5] = {"ab\nb a\nxab b\n\na", "ab\nab\nxab", "a\nba\na",
+                                    "aa\nxaaa\na", "ab\nb a\nxab b\n\na"};
+    const char * line_regexes[5] = {".*a.*b", "ab", "^a", ".*a+", ".*a.*b"};
+    const int line_flags[5] = {COMPILE_LINES, COMPILE_LINES, COMPILE_LINES | COMPILE_EXTENDED,
+                               COMPILE_LINES | COMPILE_EXTENDED | COMPILE_LONGEST, 0};
+    // The number of matches, then the start, end, line, and line range of each.
+    const int line_expected[5][21] = {
+      {3, 0,2,1,0,2, 8,10,3,7,12, 8,12,3,7,12},
+      {2, 0,2,1,0,2, 3,5,2,3,5},
+      {2, 0,1,1,0,1, 5,6,3,5,6},
+      {3, 0,2,1,0,2, 4,7,2,3,7, 8,9,3,8,9},
+      {4, 0,2,1,0,2, 0,4,2,0,6, 8,10,3,7,12, 8,12,3,7,12}
+    };
+    for (int t = 0; t < 5; t++) {
+      struct compiled_regex * program = compile_flags(line_regexes[t], line_flags[t]);
+      const int * expected = line_expected[t];
+      struct found_matches found = {0};
+      struct found_matches file_found = {0};
+      matcha_into(program, line_strings[t], strlen(line_strings[t]), &found);
+      file = fopen(path, "w");
+      fputs(line_strings[t], file);
+      fclose(file);
+      fmatcha_into(program, path, 0.0, &file_found);
+      int same = ((found.n == expected[0]) && (file_found.n == expected[0]));
+      for (int k = 0; same && (k < found.n); k++) {
+        const int * match = expected + 1 + 5*k;
+        same = ((found.starts[k] == match[0]) && (found.ends[k] == match[1]) &&
+                (file_found.starts[k] == match[0]) && (file_found.ends[k] == match[1]) &&
+                (file_found.lines[k] == match[2]) && (file_found.line_starts[k] == match[3]) &&
+                (file_found.line_ends[k] == match[4]));
+      }
+      if (! same) {
+        printf("\nRegex: '%s'  flags: %d\n\n", line_regexes[t], line_flags[t]);
+        printf("ERROR: a search by lines did not find the expected matches.\n");
+        printf(" expected %d matches\n", expected[0]);
+        printf(" received %d matches (%d from the file)\n", found.n, file_found.n);
+        remove(path);
+        return(25);
+      }
+      free_results(&found);
+      free_results(&file_found);
+      free_compiled(program);
+    }
+    remove(path);
+  }
+
+  // =================================================================
+  //                  Trigram index  (index_build, index_search)
+  //
+  // An index of the trigrams of a few files keeps only the files that
+  // hold every trigram of the literal factors of a pattern (with
+  // letters in either case), and every file that was not indexed (a
+  // binary one). A rebuild that reuses unchanged files only reads the
+  // changed one, and an invalid index is not read.
+  {
+    const char * index_paths[3] = {"test_index_a.txt", "test_index_b.txt", "test_index_c.txt"};
+    const char * index_contents[3] = {"a foo bar\n", "FOOBAZ\n", "bar\0foo"};
+    const int index_sizes[3] = {10, 7, 7};
+    const char * index_regexes[8] = {".*foo", ".*bar", ".*b[aA]z", ".*qux", ".*(foo|qux)",
+                                     ".*ba{r}", ".*[fF][oO][oO]", ".*baz"};
+    // The kept files after the first build (and after the rebuild).
+    const char index_expected[2][8][3] = {
+      {{1,1,1}, {1,0,1}, {0,1,1}, {0,0,1}, {1,1,1}, {1,1,1}, {1,1,1}, {0,1,1}},
+      {{1,0,1}, {1,0,1}, {0,0,1}, {0,1,1}, {1,1,1}, {1,1,1}, {1,0,1}, {0,0,1}}
+    };
+    const char * index_file = "test_index.rxti";
+    long long stamps[6] = {0, 0, 0, 0, 0, 0};
+    int reuse[3] = {-1, -1, -1};
+    for (int build = 0; build < 2; build++) {
+      for (int f = 0; f < 3; f++) {
+        if ((build == 1) && (f != 1)) continue;
+        file = fopen(index_paths[f], "w");
+        if (build == 0) fwrite(index_contents[f], 1, index_sizes[f], file);
+        else fputs("a qux\n", file);
+        fclose(file);
+      }
+      const int read = index_build(index_file, ".", 3, index_paths, stamps, reuse);
+      int failed = (read != ((build == 0) ? 3 : 1));
+      for (int t = 0; (! failed) && (t < 8); t++) {
+        struct compiled_regex * program = compile(index_regexes[t]);
+        char keep[3] = {-1, -1, -1};
+        const int kept = index_search(program, index_file, keep);
+        const char * expected = index_expected[build][t];
+        failed = (kept != expected[0] + expected[1] + expected[2]);
+        for (int f = 0; f < 3; f++) failed |= (keep[f] != expected[f]);
+        if (failed) {
+          printf("\nRegex: '%s'  build: %d\n\n", index_regexes[t], build);
+          printf("ERROR: the index did not keep the expected files.\n");
+          printf(" expected %d %d %d\n", expected[0], expected[1], expected[2]);
+          printf(" received %d %d %d (%d kept)\n", keep[0], keep[1], keep[2], kept);
+        }
+        free_compiled(program);
+      }
+      if (failed) {
+        printf(" (the build read %d files)\n", read);
+        for (int f = 0; f < 3; f++) remove(index_paths[f]);
+        remove(index_file);
+        return(26);
+      }
+      reuse[0] = 0;
+      reuse[2] = 2;
+    }
+    // A file that is not an index is not read.
+    struct compiled_regex * program = compile(".*foo");
+    char keep[3];
+    const int status = index_search(program, index_paths[0], keep);
+    free_compiled(program);
+    for (int f = 0; f < 3; f++) remove(index_paths[f]);
+    remove(index_file);
+    if (status != -2) {
+      printf("\nERROR: a file that is not an index was read as one (%d).\n", status);
+      return(26);
+    }
+  }
+
+  // =================================================================
+  //                  Directory walk  (walk_files, ignore rules)
+  //
+  // Globs of ignore rules match as git does ('*' stays within a name,
+  // "**/" is any directories), and a walk with WALK_IGNORE passes over
+  // ".git", ignored directories (without opening them), and ignored
+  // files, with later and deeper rules first ('!' keeps a path).
+  {
+    const char * globs[12] = {"*.o", "*.o", "a/**/b", "a/**/b", "**/b", "a/**",
+                              "?.c", "[a-c]x", "[!a-c]x", "\\*x", "\\*x", "a[/]b"};
+    const char * texts[12] = {"a.o", "a/b.o", "a/b", "a/x/y/b", "b", "a/x/y",
+                              "ab.c", "bx", "bx", "*x", "ax", "a/b"};
+    const int glob_expected[12] = {1, 0, 1, 1, 1, 1, 0, 1, 0, 1, 0, 0};
+    for (int t = 0; t < 12; t++) {
+      if (_glob_match(globs[t], texts[t]) != glob_expected[t]) {
+        printf("\nGlob: '%s'  text: '%s'\n\n", globs[t], texts[t]);
+        printf("ERROR: the glob did not match as expected.\n");
+        printf(" expected %d\n", glob_expected[t]);
+        return(27);
+      }
+    }
+    const char * directories[5] = {"test_walk", "test_walk/.git", "test_walk/build",
+                                   "test_walk/src", "test_walk/src/gen"};
+    const char * files[9] = {"test_walk/.gitignore", "test_walk/.git/x", "test_walk/build/b",
+                             "test_walk/a.o", "test_walk/src/.ignore", "test_walk/src/a.c",
+                             "test_walk/src/gen/g.c", "test_walk/src/keep.log", "test_walk/src/drop.log"};
+    const char * file_contents[9] = {"build/\n*.o\n*.log\n", "", "", "", "gen/\n!keep.log\n",
+                                     "", "", "", ""};
+    // Whether each file is listed with WALK_IGNORE (and all are without it).
+    const int listed[9] = {1, 0, 0, 0, 1, 1, 0, 1, 0};
+    for (int d = 0; d < 5; d++) mkdir(directories[d], 0755);
+    for (int f = 0; f < 9; f++) {
+      file = fopen(files[f], "w");
+      fputs(file_contents[f], file);
+      fclose(file);
+    }
+    int failed = 0;
+    for (int ignore = 0; (! failed) && (ignore < 2); ignore++) {
+      char * paths = NULL;
+      long long n_bytes = 0;
+      const int n = walk_files("test_walk", WALK_RECURSIVE | (ignore ? WALK_IGNORE : 0), 0,
+                               &paths, &n_bytes);
+      int expected = 0;
+      for (int f = 0; f < 9; f++) {
+        int found = 0;
+        for (long long i = 0; (! found) && (i < n_bytes); i += strlen(paths + i) + 1)
+          found = (strcmp(paths + i, files[f]) == 0);
+        expected += ((! ignore) || listed[f]);
+        if (found != ((! ignore) || listed[f])) {
+          printf("\nPath: '%s'  ignore: %d\n\n", files[f], ignore);
+          printf("ERROR: a walk did not list the expected files.\n");
+          printf(" expected it %s\n", found ? "passed over" : "listed");
+          failed = 1;
+        }
+      }
+      if ((! failed) && (n != expected)) {
+        printf("\nERROR: a walk (ignore: %d) listed %d files, expected %d.\n", ignore, n, expected);
+        failed = 1;
+      }
+      free_paths(paths);
+    }
+    for (int f = 8; f >= 0; f--) remove(files[f]);
+    for (int d = 4; d >= 0; d--) rmdir(directories[d]);
+    if (failed) return(27);
+  }
+
+  // =================================================================
+  //                  Copies for threads  (copy_compiled)
+  //
+  // A program builds its DFA while searching, so threads that search
+  // at once each take a copy, and every copy finds the same matches.
+  {
+    char string[4096];
+    for (int i = 0; i < 4095; i++) string[i] = "abcab\nxyz"[(i*7) % 9];
+    string[4095] = '\0';
+    struct compiled_regex * program = compile("[ab].*x");
+    struct compiled_regex * copy = copy_compiled(program);
+    struct found_matches found = {0};
+    const int expected = matcha_limit(copy, string, strlen(string), 0, &found);
+    free_results(&found);
+    free_compiled(copy);
+    struct copy_search searches[4];
+    pthread_t threads[4];
+    for (int t = 0; t < 4; t++) {
+      searches[t] = (struct copy_search) {copy_compiled(program), string, expected, {0}};
+      pthread_create(threads+t, NULL, _copy_search, searches+t);
+    }
+    int failed = (expected <= 0);
+    for (int t = 0; t < 4; t++) {
+      pthread_join(threads[t], NULL);
+      if (searches[t].found.n != expected) failed = 1;
+      free_results(&(searches[t].found));
+      free_compiled(searches[t].program);
+    }
+    free_compiled(program);
+    if (failed) {
+      printf("\nERROR: copies of a program searched by threads did not find %d matches.\n", expected);
+      return(28);
+    }
+  }
+
   printf("\n All tests PASSED.\n");
   // Successful return.
   return(0);